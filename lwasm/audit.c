@@ -56,7 +56,7 @@ void do_audit(asmstate_t* as)
 
 	if (!of)
 	{
-		fprintf(stderr, "Cannot open audit file; feature list not generated\n");
+		fprintf(as -> errfile, "Cannot open audit file; feature list not generated\n");
 		return;
 	}
 
@@ -0,0 +1,579 @@
+/*
+batch.c
+
+Copyright © 2026 William Astle
+
+This file is part of LWTOOLS.
+
+LWTOOLS is free software: you can redistribute it and/or modify it under the
+terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <http://www.gnu.org/licenses/>.
+
+Batch mode (--batch): assemble every job in a manifest in one process
+
+The manifest has one job per line. Each line holds the command line
+arguments for that job (input file, -o output, other options) separated by
+white space; arguments may be quoted with " or '. Blank lines and lines
+starting with # are ignored. Options given on the real command line are
+applied to every job before the job's own arguments.
+
+Each job gets a fresh assembler state. Diagnostics are collected per job
+and reported in manifest order once all jobs have finished.
+*/
+
+#include <errno.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+#include <lw_alloc.h>
+#include <lw_error.h>
+#include <lw_expr.h>
+#include <lw_string.h>
+#include <lw_stringlist.h>
+
+#include "lwasm.h"
+#include "input.h"
+
+typedef struct batchjob_s
+{
+	asmstate_t as;						// assembler state for the job
+	int lineno;							// manifest line the job came from
+	int argc;							// job arguments (argv[0] is the program name)
+	char **argv;
+	char *line;							// manifest line the arguments point into
+	int status;							// exit status of the job
+	int started;						// set if the job was actually assembled
+	char *input;						// first input file, for the report
+} batchjob_t;
+
+typedef struct
+{
+	jmp_buf bail;						// where lw_error() returns to
+	FILE *errfile;						// where the error message goes
+} batchguard_t;
+
+typedef struct
+{
+	batchjob_t *jobs;
+	int njobs;
+	int next;							// next job to hand out
+#if !defined(_WIN32)
+	pthread_mutex_t mutex;
+#endif
+} batchpool_t;
+
+/* the assembly running on the current thread, for the lw_error() hook */
+#if !defined(_WIN32)
+static pthread_key_t batch_key;
+#define batch_current()		((batchguard_t *)pthread_getspecific(batch_key))
+#define batch_setcurrent(g)	pthread_setspecific(batch_key, (g))
+#else
+static batchguard_t *batch_curguard;
+#define batch_current()		(batch_curguard)
+#define batch_setcurrent(g)	(batch_curguard = (g))
+#endif
+
+/* fatal errors inside a job fail that job rather than the whole batch */
+static void batch_error(const char *fmt, va_list args)
+{
+	batchguard_t *g = batch_current();
+
+	if (!g)
+	{
+		vfprintf(stderr, fmt, args);
+		return;
+	}
+	vfprintf(g -> errfile, fmt, args);
+	longjmp(g -> bail, 1);
+}
+
+/* must be called once before using batch_assemble() */
+void batch_init(void)
+{
+#if !defined(_WIN32)
+	pthread_key_create(&batch_key, NULL);
+#endif
+	lw_error_setfunc(batch_error);
+}
+
+/*
+run lwasm_assemble() such that a fatal error only fails this assembly;
+used by --batch and --server, which outlive the assemblies they run
+*/
+int batch_assemble(asmstate_t *as)
+{
+	batchguard_t g;
+	int status;
+
+	g.errfile = as -> errfile;
+	batch_setcurrent(&g);
+	if (setjmp(g.bail) == 0)
+		status = lwasm_assemble(as);
+	else
+		status = 1;
+	batch_setcurrent(NULL);
+	return status;
+}
+
+/* read a line of arbitrary length; returns NULL at end of file */
+static char *batch_readline(FILE *fp)
+{
+	char *buf = NULL;
+	int len = 0, size = 0;
+	int c;
+
+	while ((c = fgetc(fp)) != EOF)
+	{
+		if (len + 1 >= size)
+		{
+			size += 128;
+			buf = lw_realloc(buf, size);
+		}
+		if (c == '\n')
+			break;
+		buf[len++] = c;
+	}
+	if (!buf)
+		return NULL;
+	if (len > 0 && buf[len - 1] == '\r')
+		len--;
+	buf[len] = '\0';
+	return buf;
+}
+
+/* split a manifest line into arguments; argv[0] is left for the caller */
+static char **batch_split(char *line, int *argc)
+{
+	char **argv = lw_alloc(sizeof(char *));
+	int n = 1;
+	char *p = line, *o;
+	int q;
+
+	for (;;)
+	{
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (!*p)
+			break;
+		// unquote in place; the result is never longer than the input
+		o = p;
+		argv = lw_realloc(argv, sizeof(char *) * (n + 2));
+		argv[n++] = o;
+		q = 0;
+		while (*p && (q || (*p != ' ' && *p != '\t')))
+		{
+			if (q && *p == q)
+				q = 0;
+			else if (!q && (*p == '"' || *p == '\''))
+				q = *p;
+			else if (*p == '\\' && q != '\'' && p[1])
+				*o++ = *++p;
+			else
+				*o++ = *p;
+			p++;
+		}
+		if (*p)
+			p++;
+		*o = '\0';
+	}
+	argv[n] = NULL;
+	*argc = n;
+	return argv;
+}
+
+/* release the bulk of a finished job's memory */
+static void batch_free_symbols(struct symtabe *s)
+{
+	struct symtabe *v, *nv, *r;
+
+	for (; s; s = r)
+	{
+		r = s -> right;
+		batch_free_symbols(s -> left);
+		for (v = s; v; v = nv)
+		{
+			nv = v -> nextver;
+			lw_expr_destroy(v -> value);
+			lw_free(v -> symbol);
+			lw_free(v);
+		}
+	}
+}
+
+void batch_free_state(asmstate_t *as)
+{
+	line_t *cl, *nl;
+	struct line_expr_s *le, *nle;
+	lwasm_error_t *e, *ne;
+	macrotab_t *m, *nm;
+	structtab_t *st, *nst;
+	structtab_field_t *sf, *nsf;
+	sectiontab_t *sc, *nsc;
+	reloctab_t *re, *nre;
+	exportlist_t *ex, *nex;
+	importlist_t *im, *nim;
+	char **opts[] = {
+		&(as -> list_file), &(as -> symbol_dump_file), &(as -> audit_file),
+		&(as -> cmt_file), &(as -> cmt_system), &(as -> map_file),
+		&(as -> output_file), &(as -> depend_target), &(as -> depend_file),
+		&(as -> stats_file), &(as -> batch_file), &(as -> server_socket),
+		&(as -> cache_dir), &(as -> snapshot_file)
+	};
+	int i;
+
+	for (cl = as -> line_head; cl; cl = nl)
+	{
+		nl = cl -> next;
+		for (le = cl -> exprs; le; le = nle)
+		{
+			nle = le -> next;
+			lw_expr_destroy(le -> expr);
+			lw_free(le);
+		}
+		for (e = cl -> err; e; e = ne)
+		{
+			ne = e -> next;
+			lw_free(e -> mess);
+			lw_free(e);
+		}
+		for (e = cl -> warn; e; e = ne)
+		{
+			ne = e -> next;
+			lw_free(e -> mess);
+			lw_free(e);
+		}
+		// "org" points both addresses at the same expression
+		if (cl -> daddr != cl -> addr)
+			lw_expr_destroy(cl -> daddr);
+		lw_expr_destroy(cl -> addr);
+		lw_free(cl -> sym);
+		lw_free(cl -> output);
+		lw_free(cl -> lstr);
+		lw_free(cl -> ltext);
+		lw_free(cl -> linespec);
+		lw_free(cl);
+	}
+	as -> line_head = as -> line_tail = NULL;
+	batch_free_symbols(as -> symtab.head);
+	as -> symtab.head = NULL;
+
+	for (m = as -> macros; m; m = nm)
+	{
+		nm = m -> next;
+		for (i = 0; i < m -> numlines; i++)
+			lw_free(m -> lines[i]);
+		lw_free(m -> lines);
+		lw_free(m -> name);
+		lw_free(m);
+	}
+	as -> macros = NULL;
+	for (st = as -> structs; st; st = nst)
+	{
+		nst = st -> next;
+		// substructures are other entries in the list
+		for (sf = st -> fields; sf; sf = nsf)
+		{
+			nsf = sf -> next;
+			lw_free(sf -> name);
+			lw_free(sf);
+		}
+		lw_free(st -> name);
+		lw_free(st);
+	}
+	as -> structs = as -> cstruct = NULL;
+	for (sc = as -> sections; sc; sc = nsc)
+	{
+		nsc = sc -> next;
+		for (re = sc -> reloctab; re; re = nre)
+		{
+			nre = re -> next;
+			lw_expr_destroy(re -> offset);
+			lw_expr_destroy(re -> expr);
+			lw_free(re);
+		}
+		lw_expr_destroy(sc -> offset);
+		lw_free(sc -> obytes);
+		lw_free(sc -> name);
+		lw_free(sc);
+	}
+	as -> sections = as -> csect = NULL;
+	for (ex = as -> exportlist; ex; ex = nex)
+	{
+		nex = ex -> next;
+		lw_free(ex -> symbol);
+		lw_free(ex);
+	}
+	as -> exportlist = NULL;
+	for (im = as -> importlist; im; im = nim)
+	{
+		nim = im -> next;
+		lw_free(im -> symbol);
+		lw_free(im);
+	}
+	as -> importlist = NULL;
+	lw_expr_destroy(as -> execaddr_expr);
+	as -> execaddr_expr = NULL;
+	lw_expr_destroy(as -> savedaddr);
+	as -> savedaddr = NULL;
+	if (as -> stats)
+	{
+		lw_free(as -> stats -> passes);
+		lw_free(as -> stats -> pass3unres);
+		lw_free(as -> stats -> pass4unres);
+		lw_free(as -> stats);
+		as -> stats = NULL;
+	}
+
+	// open and cached input files, the include stack and dependency list
+	input_finish(as);
+	lw_stringlist_destroy(as -> input_files);
+	as -> input_files = NULL;
+	lw_stringlist_destroy(as -> include_list);
+	as -> include_list = NULL;
+
+	// the file cache belongs to the server and errfile to the caller
+	for (i = 0; i < sizeof(opts) / sizeof(opts[0]); i++)
+	{
+		lw_free(*(opts[i]));
+		*(opts[i]) = NULL;
+	}
+
+	lw_expr_ctx_destroy(as -> exprctx);
+	as -> exprctx = NULL;
+}
+
+static void batch_run(batchjob_t *job)
+{
+	FILE *diag;
+
+	// collect the job's diagnostics so they can be reported together
+	if (job -> as.errfile == stderr)
+	{
+		diag = tmpfile();
+		if (diag)
+			job -> as.errfile = diag;
+	}
+	job -> started = 1;
+
+	job -> status = batch_assemble(&(job -> as));
+	fflush(job -> as.errfile);
+	batch_free_state(&(job -> as));
+}
+
+#if !defined(_WIN32)
+static void *batch_worker(void *arg)
+{
+	batchpool_t *pool = arg;
+	int i;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&(pool -> mutex));
+		i = pool -> next++;
+		pthread_mutex_unlock(&(pool -> mutex));
+		if (i >= pool -> njobs)
+			break;
+		if (pool -> jobs[i].status == 0)
+			batch_run(&(pool -> jobs[i]));
+	}
+	return NULL;
+}
+#endif
+
+static void batch_runall(batchpool_t *pool, int nthreads)
+{
+	int i;
+
+#if !defined(_WIN32)
+	if (nthreads > 1)
+	{
+		pthread_t *threads;
+		pthread_attr_t attr;
+		char *started;
+		int nstarted = 0;
+
+		pthread_mutex_init(&(pool -> mutex), NULL);
+		pthread_attr_init(&attr);
+		// the expression simplifier and symbol table recurse; don't rely on
+		// small default thread stacks
+		pthread_attr_setstacksize(&attr, 8 * 1024 * 1024);
+		threads = lw_alloc(nthreads * sizeof(pthread_t));
+		started = lw_alloc(nthreads);
+		for (i = 0; i < nthreads; i++)
+		{
+			started[i] = (pthread_create(&threads[i], &attr, batch_worker, pool) == 0);
+			nstarted += started[i];
+		}
+		for (i = 0; i < nthreads; i++)
+		{
+			if (started[i])
+				pthread_join(threads[i], NULL);
+		}
+		pthread_attr_destroy(&attr);
+		lw_free(threads);
+		lw_free(started);
+		pthread_mutex_destroy(&(pool -> mutex));
+		if (nstarted > 0)
+			return;
+		// no threads could be started; run everything here instead
+		pool -> next = 0;
+	}
+#endif
+	for (i = 0; i < pool -> njobs; i++)
+	{
+		if (pool -> jobs[i].status == 0 && !pool -> jobs[i].started)
+			batch_run(&(pool -> jobs[i]));
+	}
+}
+
+/* copy a job's collected diagnostics to stderr */
+static void batch_report(asmstate_t *as, batchjob_t *job)
+{
+	FILE *diag = job -> as.errfile;
+	char buf[1024];
+	size_t n;
+	long len = 0;
+
+	if (diag != stderr)
+	{
+		fseek(diag, 0, SEEK_END);
+		len = ftell(diag);
+		rewind(diag);
+	}
+	if (job -> status == 0 && len <= 0)
+	{
+		if (diag != stderr)
+			fclose(diag);
+		return;
+	}
+
+	fprintf(stderr, "%s:%d: %s: %s\n", as -> batch_file, job -> lineno,
+		job -> input ? job -> input : "(no input)", job -> status ? "failed" : "ok");
+	if (len > 0)
+	{
+		while ((n = fread(buf, 1, sizeof(buf), diag)) > 0)
+			fwrite(buf, 1, n, stderr);
+	}
+	if (diag != stderr)
+		fclose(diag);
+}
+
+/*
+run a batch; "as" holds the options from the command line which are
+reapplied to each job from argc/argv
+*/
+int do_batch(asmstate_t *as, int argc, char **argv)
+{
+	FILE *fp;
+	batchpool_t pool = { 0 };
+	batchjob_t *job;
+	char *line, *p;
+	FILE *diag;
+	int lineno = 0, nfailed = 0, nthreads, i;
+
+	if (lw_stringlist_nstrings(as -> input_files) > 0)
+	{
+		fprintf(stderr, "Input files cannot be given with --batch; list them in the batch file\n");
+		return 1;
+	}
+
+	if (!strcmp(as -> batch_file, "-"))
+		fp = stdin;
+	else
+		fp = fopen(as -> batch_file, "r");
+	if (!fp)
+	{
+		fprintf(stderr, "Cannot open batch file %s: %s\n", as -> batch_file, strerror(errno));
+		return 1;
+	}
+
+	while ((line = batch_readline(fp)))
+	{
+		lineno++;
+		for (p = line; *p == ' ' || *p == '\t'; p++)
+			/* do nothing */ ;
+		if (!*p || *p == '#')
+		{
+			lw_free(line);
+			continue;
+		}
+
+		pool.jobs = lw_realloc(pool.jobs, sizeof(batchjob_t) * (pool.njobs + 1));
+		job = &(pool.jobs[pool.njobs++]);
+		memset(job, 0, sizeof(batchjob_t));
+		job -> lineno = lineno;
+		job -> line = line;
+		job -> argv = batch_split(p, &(job -> argc));
+		job -> argv[0] = argv[0];
+
+		// the command line options first, then the job's own; complaints
+		// about the job's options are reported with the job
+		lwasm_init_state(&(job -> as));
+		lwasm_parse_cmdline(&(job -> as), argc, argv);
+		lw_free(job -> as.batch_file);
+		job -> as.batch_file = NULL;
+		if ((diag = tmpfile()))
+			job -> as.errfile = diag;
+		if (lwasm_parse_cmdline(&(job -> as), job -> argc, job -> argv) != 0)
+		{
+			job -> status = 1;
+		}
+		else if (job -> as.batch_file)
+		{
+			fprintf(job -> as.errfile, "--batch cannot be used inside a batch file\n");
+			job -> status = 1;
+		}
+		// the job's state is gone by the time it is reported
+		lw_stringlist_reset(job -> as.input_files);
+		if ((p = lw_stringlist_current(job -> as.input_files)))
+			job -> input = lw_strdup(p);
+	}
+	if (fp != stdin)
+		fclose(fp);
+
+	nthreads = as -> batch_jobs;
+#if !defined(_WIN32)
+	if (nthreads < 1)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if (nthreads > pool.njobs)
+		nthreads = pool.njobs;
+
+	batch_init();
+	pool.next = 0;
+	batch_runall(&pool, nthreads);
+	lw_error_setfunc(NULL);
+
+	for (i = 0; i < pool.njobs; i++)
+	{
+		batch_report(as, &(pool.jobs[i]));
+		if (pool.jobs[i].status)
+			nfailed++;
+		if (!pool.jobs[i].started)
+			batch_free_state(&(pool.jobs[i].as));
+		lw_free(pool.jobs[i].input);
+		lw_free(pool.jobs[i].argv);
+		lw_free(pool.jobs[i].line);
+	}
+	lw_free(pool.jobs);
+	if (nfailed > 0)
+		fprintf(stderr, "%d of %d batch jobs failed\n", nfailed, pool.njobs);
+	return nfailed > 0 ? 1 : 0;
+}
@@ -0,0 +1,576 @@
+/*
+cache.c
+
+Copyright © 2026 William Astle
+
+This file is part of LWTOOLS.
+
+LWTOOLS is free software: you can redistribute it and/or modify it under the
+terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <http://www.gnu.org/licenses/>.
+
+Assembly result cache (--cache)
+
+Each cache entry is a directory named by the SHA-1 of the lwasm version,
+the working directory and the command line. It holds a manifest with the
+SHA-1 of every file the assembly read (sources, includes and includebin
+data) and copies of the output, listing, map and symbol dump. A lookup
+hashes the files named in the manifest; if they all still match, the
+results are copied into place and no passes are run.
+
+Entries are evicted least recently used first, by directory modification
+time, once the cache grows past its size limit. Hit, miss and store counts
+are kept in a "stats" file in the cache directory.
+*/
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <utime.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#else
+#include <direct.h>
+#endif
+
+#include <lw_alloc.h>
+#include <lw_sha1.h>
+#include <lw_string.h>
+
+#include "lwasm.h"
+#include "input.h"
+#include "instab.h"
+
+#define CACHE_MAGIC		"lwasm-cache 1"
+
+#if defined(_WIN32)
+#define cache_mkdir(d)	_mkdir(d)
+#else
+#define cache_mkdir(d)	mkdir((d), 0777)
+#endif
+
+// the names results are stored under in an entry
+static const char *cache_results[] = { "output", "list", "map", "symdump" };
+#define CACHE_NRESULTS	4
+
+#if !defined(_WIN32)
+// serializes stats updates between --batch jobs
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static char *cache_path(const char *dir, const char *a, const char *b)
+{
+	char *r;
+
+	r = lw_alloc(strlen(dir) + strlen(a) + (b ? strlen(b) : 0) + 3);
+	if (b)
+		sprintf(r, "%s/%s/%s", dir, a, b);
+	else
+		sprintf(r, "%s/%s", dir, a);
+	return r;
+}
+
+/* destination of each result for this assembly, or NULL if not wanted */
+static char *cache_dest(asmstate_t *as, int i)
+{
+	switch (i)
+	{
+	case 0:
+		return (as -> flags & FLAG_NOOUT) ? NULL : as -> output_file;
+	case 1:
+		return (as -> flags & FLAG_LIST) ? as -> list_file : NULL;
+	case 2:
+		return (as -> flags & FLAG_MAP) ? as -> map_file : NULL;
+	default:
+		return (as -> flags & FLAG_SYMDUMP) ? as -> symbol_dump_file : NULL;
+	}
+}
+
+/* results can be cached when everything goes to files we can copy */
+static int cache_eligible(asmstate_t *as)
+{
+	int i;
+	char *d;
+
+	if (!as -> cache_dir)
+		return 0;
+	if (as -> preprocess || as -> debug_level > 0)
+		return 0;
+	if (as -> flags & (FLAG_DEPEND | FLAG_UNICORNS | FLAG_AUDIT | FLAG_CMT | FLAG_STATS))
+		return 0;
+	for (i = 0; i < CACHE_NRESULTS; i++)
+	{
+		d = cache_dest(as, i);
+		if (d && !strcmp(d, "-"))
+			return 0;
+	}
+	return 1;
+}
+
+static void cache_key(asmstate_t *as, char *hex)
+{
+	lw_sha1_t c = as -> cmdhash;
+	char cwd[4096];
+
+	lw_sha1_update(&c, PACKAGE_STRING, strlen(PACKAGE_STRING) + 1);
+	if (getcwd(cwd, sizeof(cwd)))
+		lw_sha1_update(&c, cwd, strlen(cwd) + 1);
+	lw_sha1_finalhex(&c, hex);
+}
+
+static int cache_hashfile(const char *fn, char *hex)
+{
+	lw_sha1_t c;
+	FILE *fp;
+	int r;
+
+	fp = fopen(fn, "rb");
+	if (!fp)
+		return -1;
+	lw_sha1_init(&c);
+	r = lw_sha1_file(&c, fp);
+	fclose(fp);
+	if (r)
+		return -1;
+	lw_sha1_finalhex(&c, hex);
+	return 0;
+}
+
+static int cache_copy(const char *from, const char *to)
+{
+	FILE *in, *out;
+	char buf[16384];
+	size_t n;
+	int r = 0;
+
+	in = fopen(from, "rb");
+	if (!in)
+		return -1;
+	out = fopen(to, "wb");
+	if (!out)
+	{
+		fclose(in);
+		return -1;
+	}
+	while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+	{
+		if (fwrite(buf, 1, n, out) != n)
+		{
+			r = -1;
+			break;
+		}
+	}
+	if (ferror(in))
+		r = -1;
+	fclose(in);
+	if (fclose(out) != 0)
+		r = -1;
+	return r;
+}
+
+/* remove an entry directory and everything in it */
+static void cache_rmentry(const char *path)
+{
+	DIR *d;
+	struct dirent *de;
+	char *fn;
+
+	d = opendir(path);
+	if (d)
+	{
+		while ((de = readdir(d)))
+		{
+			if (de -> d_name[0] == '.')
+				continue;
+			fn = cache_path(path, de -> d_name, NULL);
+			remove(fn);
+			lw_free(fn);
+		}
+		closedir(d);
+	}
+	rmdir(path);
+}
+
+static const char *cache_statnames[] = { "hits", "misses", "stores", "evictions" };
+#define CACHE_NSTATS	4
+
+static void cache_readstats(const char *dir, long *v)
+{
+	char *fn;
+	FILE *fp;
+	char name[32];
+	long n;
+	int i;
+
+	for (i = 0; i < CACHE_NSTATS; i++)
+		v[i] = 0;
+	fn = cache_path(dir, "stats", NULL);
+	fp = fopen(fn, "r");
+	lw_free(fn);
+	if (!fp)
+		return;
+	while (fscanf(fp, "%31s %ld", name, &n) == 2)
+	{
+		for (i = 0; i < CACHE_NSTATS; i++)
+			if (!strcmp(name, cache_statnames[i]))
+				v[i] = n;
+	}
+	fclose(fp);
+}
+
+/*
+add to one of the counters in the stats file
+
+Other lwasm processes may share the cache, so the update is done under a
+lock on "stats.lock" (a file that is never replaced) and the new counts go
+to a temporary that is renamed over the old file; readers only ever see a
+complete stats file.
+*/
+static void cache_count(asmstate_t *as, int which, int n)
+{
+	long v[CACHE_NSTATS];
+	char *fn, *tfn;
+	FILE *fp;
+	int i;
+#if !defined(_WIN32)
+	int lockfd;
+#endif
+
+	// the first miss comes before anything has created the cache
+	cache_mkdir(as -> cache_dir);
+#if !defined(_WIN32)
+	pthread_mutex_lock(&cache_mutex);
+	fn = cache_path(as -> cache_dir, "stats.lock", NULL);
+	lockfd = open(fn, O_RDWR | O_CREAT, 0666);
+	lw_free(fn);
+	if (lockfd >= 0 && lockf(lockfd, F_LOCK, 0) != 0)
+	{
+		close(lockfd);
+		lockfd = -1;
+	}
+#endif
+	cache_readstats(as -> cache_dir, v);
+	v[which] += n;
+	fn = cache_path(as -> cache_dir, "stats", NULL);
+	tfn = cache_path(as -> cache_dir, "stats.new", NULL);
+	fp = fopen(tfn, "w");
+	if (fp)
+	{
+		for (i = 0; i < CACHE_NSTATS; i++)
+			fprintf(fp, "%s %ld\n", cache_statnames[i], v[i]);
+		if (fclose(fp) == 0)
+		{
+#if defined(_WIN32)
+			// rename() won't replace an existing file here
+			remove(fn);
+#endif
+			rename(tfn, fn);
+		}
+		remove(tfn);
+	}
+	lw_free(tfn);
+	lw_free(fn);
+#if !defined(_WIN32)
+	// closing the descriptor drops the lock
+	if (lockfd >= 0)
+		close(lockfd);
+	pthread_mutex_unlock(&cache_mutex);
+#endif
+}
+
+/*
+look the assembly up in the cache; returns nonzero if the results were
+restored and the assembly doesn't need to run
+*/
+int cache_lookup(asmstate_t *as)
+{
+	char key[LW_SHA1_HEXSIZE], hex[LW_SHA1_HEXSIZE];
+	char line[4096 + LW_SHA1_HEXSIZE + 2];
+	char *entry, *fn, *d;
+	FILE *fp;
+	int i, ok = 0;
+	size_t l;
+
+	if (!cache_eligible(as))
+		return 0;
+
+	cache_key(as, key);
+	entry = cache_path(as -> cache_dir, key, NULL);
+	fn = cache_path(entry, "manifest", NULL);
+	fp = fopen(fn, "r");
+	lw_free(fn);
+	if (!fp)
+		goto done;
+
+	// every file the assembly read has to be unchanged
+	if (!fgets(line, sizeof(line), fp) || strncmp(line, CACHE_MAGIC, strlen(CACHE_MAGIC)))
+		goto donefp;
+	while (fgets(line, sizeof(line), fp))
+	{
+		l = strlen(line);
+		if (l > 0 && line[l - 1] == '\n')
+			line[--l] = '\0';
+		if (l < LW_SHA1_HEXSIZE + 1 || line[LW_SHA1_HEXSIZE - 1] != ' ')
+			goto donefp;
+		line[LW_SHA1_HEXSIZE - 1] = '\0';
+		if (cache_hashfile(line + LW_SHA1_HEXSIZE, hex) || strcmp(hex, line))
+			goto donefp;
+	}
+
+	for (i = 0; i < CACHE_NRESULTS; i++)
+	{
+		d = cache_dest(as, i);
+		if (!d)
+			continue;
+		fn = cache_path(entry, cache_results[i], NULL);
+		if (cache_copy(fn, d))
+		{
+			lw_free(fn);
+			goto donefp;
+		}
+		lw_free(fn);
+	}
+	ok = 1;
+	// most recently used entries are kept longest
+	utime(entry, NULL);
+
+donefp:
+	fclose(fp);
+done:
+	lw_free(entry);
+	cache_count(as, ok ? 0 : 1, 1);
+	debug_message(as, 50, "Cache %s for %s", ok ? "hit" : "miss", key);
+	return ok;
+}
+
+typedef struct
+{
+	char *path;
+	long size;
+	time_t mtime;
+} cache_ent_t;
+
+static int cache_entcmp(const void *a, const void *b)
+{
+	const cache_ent_t *ea = a, *eb = b;
+
+	if (ea -> mtime < eb -> mtime)
+		return -1;
+	return ea -> mtime > eb -> mtime;
+}
+
+/* drop least recently used entries until the cache fits its size limit */
+static void cache_evict(asmstate_t *as, const char *keep)
+{
+	DIR *d, *d2;
+	struct dirent *de, *de2;
+	struct stat st;
+	cache_ent_t *ents = NULL;
+	int nents = 0, i, nevict = 0;
+	long total = 0;
+	char *fn;
+
+	d = opendir(as -> cache_dir);
+	if (!d)
+		return;
+	while ((de = readdir(d)))
+	{
+		// entries are named by 40 hex digits; skip stats and temporaries
+		if (strlen(de -> d_name) != LW_SHA1_HEXSIZE - 1)
+			continue;
+		ents = lw_realloc(ents, sizeof(cache_ent_t) * (nents + 1));
+		ents[nents].path = cache_path(as -> cache_dir, de -> d_name, NULL);
+		ents[nents].size = 0;
+		ents[nents].mtime = 0;
+		if (stat(ents[nents].path, &st) == 0)
+			ents[nents].mtime = st.st_mtime;
+		d2 = opendir(ents[nents].path);
+		if (d2)
+		{
+			while ((de2 = readdir(d2)))
+			{
+				fn = cache_path(ents[nents].path, de2 -> d_name, NULL);
+				if (de2 -> d_name[0] != '.' && stat(fn, &st) == 0)
+					ents[nents].size += st.st_size;
+				lw_free(fn);
+			}
+			closedir(d2);
+		}
+		total += ents[nents].size;
+		nents++;
+	}
+	closedir(d);
+
+	if (total > as -> cache_max)
+	{
+		// leave some room so the next few stores don't evict again
+		qsort(ents, nents, sizeof(cache_ent_t), cache_entcmp);
+		for (i = 0; i < nents && total > as -> cache_max - as -> cache_max / 10; i++)
+		{
+			if (strstr(ents[i].path, keep))
+				continue;
+			cache_rmentry(ents[i].path);
+			total -= ents[i].size;
+			nevict++;
+		}
+		if (nevict)
+			cache_count(as, 3, nevict);
+	}
+	for (i = 0; i < nents; i++)
+		lw_free(ents[i].path);
+	lw_free(ents);
+}
+
+/* store the results of a successful assembly */
+void cache_store(asmstate_t *as)
+{
+	char key[LW_SHA1_HEXSIZE], hex[LW_SHA1_HEXSIZE], tname[64];
+	char *tmp, *entry, *fn, *d;
+	struct ifl *ifl;
+	line_t *cl;
+	FILE *fp;
+	int i, ok = 1;
+
+	if (!cache_eligible(as))
+		return;
+	// warnings wouldn't be repeated on a hit
+	if (as -> errorcount || as -> warningcount || as -> testmode_errorcount)
+		return;
+	// the date pseudo ops make the output depend on when it was assembled
+	for (cl = as -> line_head; cl; cl = cl -> next)
+	{
+		if (cl -> insn >= 0 && (!strcmp(instab[cl -> insn].opcode, "dts") || !strcmp(instab[cl -> insn].opcode, "dtb")))
+			return;
+	}
+
+	cache_mkdir(as -> cache_dir);
+	cache_key(as, key);
+#if !defined(_WIN32)
+	sprintf(tname, "tmp-%ld-%p", (long)getpid(), (void *)as);
+#else
+	sprintf(tname, "tmp-%p", (void *)as);
+#endif
+	tmp = cache_path(as -> cache_dir, tname, NULL);
+	if (cache_mkdir(tmp) != 0)
+	{
+		lw_free(tmp);
+		return;
+	}
+
+	fn = cache_path(tmp, "manifest", NULL);
+	fp = fopen(fn, "w");
+	lw_free(fn);
+	if (!fp)
+	{
+		cache_rmentry(tmp);
+		lw_free(tmp);
+		return;
+	}
+	fprintf(fp, "%s\n", CACHE_MAGIC);
+	for (ifl = as -> ifl_head; ifl; ifl = ifl -> next)
+	{
+		if (cache_hashfile(ifl -> fn, hex))
+		{
+			ok = 0;
+			break;
+		}
+		fprintf(fp, "%s %s\n", hex, ifl -> fn);
+	}
+	if (fclose(fp) != 0)
+		ok = 0;
+
+	for (i = 0; ok && i < CACHE_NRESULTS; i++)
+	{
+		d = cache_dest(as, i);
+		if (!d)
+			continue;
+		fn = cache_path(tmp, cache_results[i], NULL);
+		if (cache_copy(d, fn))
+			ok = 0;
+		lw_free(fn);
+	}
+
+	entry = cache_path(as -> cache_dir, key, NULL);
+	if (ok)
+	{
+		cache_rmentry(entry);
+		if (rename(tmp, entry) != 0)
+			ok = 0;
+	}
+	if (!ok)
+		cache_rmentry(tmp);
+	else
+		cache_count(as, 2, 1);
+	lw_free(tmp);
+	lw_free(entry);
+
+	if (ok)
+		cache_evict(as, key);
+}
+
+/* report the cache statistics for --cache-stats */
+int do_cache_stats(asmstate_t *as)
+{
+	long v[CACHE_NSTATS];
+	DIR *d, *d2;
+	struct dirent *de, *de2;
+	struct stat st;
+	long total = 0;
+	int nents = 0, i;
+	char *p, *fn;
+
+	if (!as -> cache_dir)
+	{
+		fprintf(stderr, "--cache-stats needs --cache=DIR\n");
+		return 1;
+	}
+	cache_readstats(as -> cache_dir, v);
+	d = opendir(as -> cache_dir);
+	if (d)
+	{
+		while ((de = readdir(d)))
+		{
+			if (strlen(de -> d_name) != LW_SHA1_HEXSIZE - 1)
+				continue;
+			nents++;
+			p = cache_path(as -> cache_dir, de -> d_name, NULL);
+			d2 = opendir(p);
+			if (d2)
+			{
+				while ((de2 = readdir(d2)))
+				{
+					fn = cache_path(p, de2 -> d_name, NULL);
+					if (de2 -> d_name[0] != '.' && stat(fn, &st) == 0)
+						total += st.st_size;
+					lw_free(fn);
+				}
+				closedir(d2);
+			}
+			lw_free(p);
+		}
+		closedir(d);
+	}
+
+	printf("%-16s %s\n", "Cache directory", as -> cache_dir);
+	for (i = 0; i < CACHE_NSTATS; i++)
+		printf("%-16s %ld\n", cache_statnames[i], v[i]);
+	printf("%-16s %d\n", "entries", nents);
+	printf("%-16s %ld KiB of %ld KiB\n", "size", total / 1024, as -> cache_max / 1024);
+	return 0;
+}
@@ -59,7 +59,7 @@ void do_cmt(asmstate_t *as)
 
 	if (!of)
 	{
-		fprintf(stderr, "Cannot open cmt file; not generated\n");
+		fprintf(as -> errfile, "Cannot open cmt file; not generated\n");
 		return;
 	}
 
@@ -73,7 +73,7 @@ void do_cmt(asmstate_t *as)
 	line_t* line = as -> line_head;
 	if (line)
 	{
-		int comment_address;
+		int comment_address = 0;
 		int comment_tag_open = 0;
 		int addr = get_addr(as, line);
 
@@ -122,8 +122,9 @@ static line_t* cmt_one_line(asmstate_t *as, FILE *of, line_t *line)
 	char* result = fgets(buf, 1024, of);
 	if (!result)
 	{
-		fprintf(stderr, "error processing cmt file");
-		exit(1);
+		fprintf(as -> errfile, "Error processing cmt file\n");
+		as -> errorcount++;
+		return NULL;
 	}
 
 	fsetpos(of, &pos);
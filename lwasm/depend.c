@@ -0,0 +1,1026 @@
+/*
+depend.c
+
+Copyright © 2026 William Astle
+
+This file is part of LWTOOLS.
+
+LWTOOLS is free software: you can redistribute it and/or modify it under the
+terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <http://www.gnu.org/licenses/>.
+
+Dependency scanning. Rather than running a full pass 1, this walks the
+source looking only at the things that can change which files get read:
+include and includebin, the conditionals that guard them, the equ/set
+definitions those conditionals test, and macro definitions (whose bodies
+are only checked for includes). No line_t structures, symbol table
+entries, or macro expansions are created.
+
+A condition that cannot be decided here (forward references, expressions
+involving addresses, symbols a macro might define, etc.) is treated as
+"maybe": both branches are scanned and files included from them are
+listed if they exist. This may list a file the real assembly would not
+read, but never misses one it would. A condition that doesn't parse (an
+operator lwasm doesn't have, like ==) is a "maybe" too; the assembly itself
+would stop on it with "Bad expression".
+*/
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lw_alloc.h>
+#include <lw_string.h>
+#include <lw_error.h>
+
+#include "lwasm.h"
+#include "input.h"
+
+lw_expr_t lwasm_parse_term(char **p, void *priv);
+int parse_pragma_string(asmstate_t *as, char *str, int ignoreerr);
+
+#define DEPEND_HASHSIZE	1024
+
+enum
+{
+	dep_op_none = 0,
+	dep_op_include,
+	dep_op_includebin,
+	dep_op_ifne,
+	dep_op_ifeq,
+	dep_op_ifgt,
+	dep_op_ifge,
+	dep_op_iflt,
+	dep_op_ifle,
+	dep_op_ifdef,
+	dep_op_ifndef,
+	dep_op_ifpragma,
+	dep_op_ifmaybe,
+	dep_op_ifp,
+	dep_op_else,
+	dep_op_endc,
+	dep_op_macro,
+	dep_op_endm,
+	dep_op_equ,
+	dep_op_set,
+	dep_op_pragma,
+	dep_op_end
+};
+
+static struct
+{
+	char *opcode;
+	int op;
+} depend_ops[] =
+{
+	{ "include",	dep_op_include },
+	{ "incl",		dep_op_include },
+	{ "use",		dep_op_include },
+	{ "includebin",	dep_op_includebin },
+	{ "if",			dep_op_ifne },
+	{ "ifne",		dep_op_ifne },
+	{ "ifeq",		dep_op_ifeq },
+	{ "ifgt",		dep_op_ifgt },
+	{ "ifge",		dep_op_ifge },
+	{ "iflt",		dep_op_iflt },
+	{ "ifle",		dep_op_ifle },
+	{ "ifdef",		dep_op_ifdef },
+	{ "ifndef",		dep_op_ifndef },
+	{ "ifpragma",	dep_op_ifpragma },
+	{ "ifopt",		dep_op_ifpragma },
+	{ "ifstr",		dep_op_ifmaybe },
+	{ "ifp1",		dep_op_ifp },
+	{ "ifp2",		dep_op_ifp },
+	{ "else",		dep_op_else },
+	{ "endc",		dep_op_endc },
+	{ "endif",		dep_op_endc },
+	{ "macro",		dep_op_macro },
+	{ "macr",		dep_op_macro },
+	{ "endm",		dep_op_endm },
+	{ "equ",		dep_op_equ },
+	{ "=",			dep_op_equ },
+	{ "set",		dep_op_set },
+	{ "pragma",		dep_op_pragma },
+	{ "*pragma",	dep_op_pragma },
+	{ "opt",		dep_op_pragma },
+	{ "end",		dep_op_end },
+	{ NULL,			dep_op_none }
+};
+
+// state of one level of conditional nesting
+enum
+{
+	dep_cond_true,				// branch is being taken
+	dep_cond_false,				// branch is skipped; "else" takes the other one
+	dep_cond_done,				// a branch has already been taken
+	dep_cond_skip,				// nested inside a skipped branch
+	dep_cond_maybe				// undecidable; scan both branches
+};
+
+typedef struct depend_sym_s depend_sym_t;
+struct depend_sym_s
+{
+	char *name;					// symbol or macro name
+	int value;					// value if known
+	int known;					// nonzero if value is known
+	int defined;				// zero if only defined in a speculative branch
+	depend_sym_t *next;			// next in the hash chain
+};
+
+typedef struct
+{
+	asmstate_t *as;
+	line_t l;					// stand-in line for the expression term parser
+	int *conds;					// conditional nesting stack
+	int ncond;
+	int condsize;
+	int nskip;					// levels on the stack not taking their branch
+	int nmaybe;					// levels on the stack in the "maybe" state
+	int inmacro;				// inside a macro definition
+	int specmacro;				// the macro definition is in a scanned region
+	int uncertain;				// a macro was invoked; symbols may exist we don't know about
+	int pragmaunknown;			// a pragma was changed speculatively
+	depend_sym_t *syms[DEPEND_HASHSIZE];
+	depend_sym_t *macros[DEPEND_HASHSIZE];
+} depstate_t;
+
+static unsigned int depend_hash(const char *s, int nocase)
+{
+	unsigned int h = 5381;
+
+	for (; *s; s++)
+		h = h * 33 + (nocase ? tolower((unsigned char)*s) : (unsigned char)*s);
+	return h % DEPEND_HASHSIZE;
+}
+
+static depend_sym_t *depend_lookup(depend_sym_t **tab, const char *name, int nocase)
+{
+	depend_sym_t *s;
+
+	for (s = tab[depend_hash(name, nocase)]; s; s = s -> next)
+	{
+		if (nocase ? !strcasecmp(s -> name, name) : !strcmp(s -> name, name))
+			return s;
+	}
+	return NULL;
+}
+
+static depend_sym_t *depend_define(depend_sym_t **tab, const char *name, int nocase, int defined)
+{
+	depend_sym_t *s;
+	unsigned int h;
+
+	s = depend_lookup(tab, name, nocase);
+	if (s)
+	{
+		s -> defined |= defined;
+		return s;
+	}
+	h = depend_hash(name, nocase);
+	s = lw_alloc(sizeof(depend_sym_t));
+	s -> name = lw_strdup(name);
+	s -> value = 0;
+	s -> known = 0;
+	s -> defined = defined;
+	s -> next = tab[h];
+	tab[h] = s;
+	return s;
+}
+
+static void depend_free_tab(depend_sym_t **tab)
+{
+	depend_sym_t *s, *n;
+	int i;
+
+	for (i = 0; i < DEPEND_HASHSIZE; i++)
+	{
+		for (s = tab[i]; s; s = n)
+		{
+			n = s -> next;
+			lw_free(s -> name);
+			lw_free(s);
+		}
+		tab[i] = NULL;
+	}
+}
+
+// scanning is speculative if any enclosing condition is undecided
+#define DEP_SPECULATIVE(ds)	((ds) -> nmaybe > 0 || (ds) -> specmacro)
+
+static int depend_islocal(depstate_t *ds, char *name)
+{
+	// local symbols depend on context tracking we don't do
+	if (strchr(name, '@') || strchr(name, '?'))
+		return 1;
+	if (!(ds -> l.pragmas & PRAGMA_DOLLARNOTLOCAL) && strchr(name, '$'))
+		return 1;
+	return 0;
+}
+
+/*
+Look up a symbol. Returns 1 if it is defined with a known value, 0 if it
+is known to be undefined, and -1 if we can't tell.
+*/
+static int depend_symval(depstate_t *ds, char *name, int *val)
+{
+	depend_sym_t *s;
+	struct symtabe *se;
+
+	if (depend_islocal(ds, name))
+		return -1;
+
+	s = depend_lookup(ds -> syms, name, 0);
+	if (s)
+	{
+		if (!s -> known || !s -> defined)
+			return -1;
+		*val = s -> value;
+		return 1;
+	}
+
+	// symbols defined on the command line
+	se = lookup_symbol(ds -> as, NULL, name);
+	if (se)
+	{
+		if (!lw_expr_istype(se -> value, lw_expr_type_int))
+			return -1;
+		*val = lw_expr_intval(se -> value);
+		return 1;
+	}
+	if (ds -> uncertain)
+		return -1;
+	return 0;
+}
+
+/* like depend_symval() but only asks whether the symbol exists */
+static int depend_isdefined(depstate_t *ds, char *name)
+{
+	depend_sym_t *s;
+
+	if (depend_islocal(ds, name))
+		return -1;
+	s = depend_lookup(ds -> syms, name, 0);
+	if (s)
+		return s -> defined ? 1 : -1;
+	if (lookup_symbol(ds -> as, NULL, name))
+		return 1;
+	if (ds -> uncertain)
+		return -1;
+	return 0;
+}
+
+/*
+A minimal integer evaluator following the same operators and precedence
+as lw_expr_parse_expr(). Terms are parsed by the regular term parser so
+numeric constants behave identically; anything that isn't a plain integer
+or a symbol with a known value makes the result unknown. Returns 1 if
+the result is known, 0 if not, and -1 on a syntax error.
+*/
+static int depend_eval(depstate_t *ds, char **p, int prec, int *val);
+
+/* operands may contain spaces under "pragma newsource" */
+static void depend_skipspace(depstate_t *ds, char **p)
+{
+	if (!CURPRAGMA(&(ds -> l), PRAGMA_NEWSOURCE))
+		return;
+	for (; **p && isspace(**p); (*p)++)
+		/* do nothing */ ;
+}
+
+static int depend_eval_term(depstate_t *ds, char **p, int *val)
+{
+	lw_expr_t e;
+	int r;
+
+	depend_skipspace(ds, p);
+	if (!**p || isspace(**p) || **p == ')' || **p == ']')
+		return -1;
+
+	if (**p == '(')
+	{
+		(*p)++;
+		r = depend_eval(ds, p, 0, val);
+		depend_skipspace(ds, p);
+		if (r < 0 || **p != ')')
+			return -1;
+		(*p)++;
+		return r;
+	}
+
+	if (**p == '+')
+	{
+		(*p)++;
+		return depend_eval_term(ds, p, val);
+	}
+
+	if (**p == '-' || **p == '^' || **p == '~')
+	{
+		int op = **p;
+
+		(*p)++;
+		r = depend_eval(ds, p, 200, val);
+		if (op == '-')
+			*val = -*val;
+		else if (ds -> as -> exprwidth == 8)
+			*val = ~*val & 0xff;
+		else
+			*val = ~*val;
+		return r;
+	}
+
+	e = lwasm_parse_term(p, ds -> as);
+	if (!e)
+		return -1;
+
+	r = 0;
+	if (lw_expr_istype(e, lw_expr_type_int))
+	{
+		*val = lw_expr_intval(e);
+		r = 1;
+	}
+	else if (lw_expr_istype(e, lw_expr_type_var))
+	{
+		r = depend_symval(ds, lw_expr_specptr(e), val);
+		if (r == 0)
+		{
+			if (CURPRAGMA(&(ds -> l), PRAGMA_CONDUNDEFZERO))
+			{
+				*val = 0;
+				r = 1;
+			}
+		}
+		else if (r < 0)
+			r = 0;
+	}
+	lw_expr_destroy(e);
+	return r;
+}
+
+static int depend_eval(depstate_t *ds, char **p, int prec, int *val)
+{
+	// the same operators and precedences as lw_expr_parse_expr(); keep
+	// them in step so the scan agrees with the assembly about conditions
+	static const struct
+	{
+		char *operstr;
+		int operprec;
+	} operators[] =
+	{
+		{ "+", 100 },
+		{ "-", 100 },
+		{ "*", 150 },
+		{ "/", 150 },
+		{ "%", 150 },
+		{ "\\", 150 },
+		{ "&&", 25 },
+		{ "||", 25 },
+		{ "&", 50 },
+		{ "|", 50 },
+		{ "!", 50 },
+		{ "^", 50 },
+		{ NULL, 0 }
+	};
+	int opern, i;
+	int known, known2;
+	int v2;
+
+	known = depend_eval_term(ds, p, val);
+	if (known < 0)
+		return -1;
+
+	for (;;)
+	{
+		depend_skipspace(ds, p);
+		if (!**p || isspace(**p) || **p == ')' || **p == ',' || **p == ']' || **p == ';')
+			return known;
+
+		for (opern = 0; operators[opern].operstr; opern++)
+		{
+			for (i = 0; (*p)[i] && operators[opern].operstr[i] && ((*p)[i] == operators[opern].operstr[i]); i++)
+				/* do nothing */ ;
+			if (operators[opern].operstr[i] == '\0')
+				break;
+		}
+		if (!operators[opern].operstr)
+			return -1;
+		if (operators[opern].operprec <= prec)
+			return known;
+		(*p) += i;
+
+		known2 = depend_eval(ds, p, operators[opern].operprec, &v2);
+		if (known2 < 0)
+			return -1;
+		known = known && known2;
+		if (!known)
+			continue;
+
+		switch (operators[opern].operstr[0])
+		{
+		case '+':
+			*val += v2;
+			break;
+
+		case '-':
+			*val -= v2;
+			break;
+
+		case '*':
+			*val *= v2;
+			break;
+
+		case '/':
+		case '\\':
+			if (v2 == 0)
+				known = 0;
+			else
+				*val /= v2;
+			break;
+
+		case '%':
+			if (v2 == 0)
+				known = 0;
+			else
+				*val %= v2;
+			break;
+
+		case '&':
+			if (operators[opern].operstr[1])
+				*val = *val && v2;
+			else
+				*val &= v2;
+			break;
+
+		case '|':
+			if (operators[opern].operstr[1])
+				*val = *val || v2;
+			else
+				*val |= v2;
+			break;
+
+		case '!':
+			*val |= v2;
+			break;
+
+		case '^':
+			*val ^= v2;
+			break;
+		}
+	}
+}
+
+static void depend_pushcond(depstate_t *ds, int state)
+{
+	if (ds -> ncond >= ds -> condsize)
+	{
+		ds -> condsize += 32;
+		ds -> conds = lw_realloc(ds -> conds, sizeof(int) * ds -> condsize);
+	}
+	ds -> conds[ds -> ncond++] = state;
+	if (state == dep_cond_maybe)
+		ds -> nmaybe++;
+	else if (state != dep_cond_true)
+		ds -> nskip++;
+}
+
+static void depend_setcond(depstate_t *ds, int state)
+{
+	int *c = &(ds -> conds[ds -> ncond - 1]);
+
+	if (*c != dep_cond_true && *c != dep_cond_maybe)
+		ds -> nskip--;
+	*c = state;
+	if (*c != dep_cond_true && *c != dep_cond_maybe)
+		ds -> nskip++;
+}
+
+static void depend_popcond(depstate_t *ds)
+{
+	int state;
+
+	if (ds -> ncond == 0)
+		return;
+	state = ds -> conds[--(ds -> ncond)];
+	if (state == dep_cond_maybe)
+		ds -> nmaybe--;
+	else if (state != dep_cond_true)
+		ds -> nskip--;
+}
+
+/* evaluate a conditional; returns 1 for true, 0 for false, -1 for unknown */
+static int depend_cond(depstate_t *ds, int op, char *p)
+{
+	char *sym;
+	int i, val, r;
+
+	switch (op)
+	{
+	case dep_op_ifp:
+		// IFP1/IFP2 are not supported and never skip
+		return 1;
+
+	case dep_op_ifmaybe:
+		return -1;
+
+	case dep_op_ifpragma:
+		if (ds -> pragmaunknown)
+			return -1;
+		r = 0;
+		for (;;)
+		{
+			int pragma;
+
+			for (i = 0; p[i] && !isspace(p[i]) && p[i] != '|' && p[i] != '&'; i++)
+				/* do nothing */ ;
+			sym = lw_strndup(p, i);
+			pragma = parse_pragma_helper(sym);
+			lw_free(sym);
+			p += i;
+			if (pragma & PRAGMA_CLEARBIT)
+				r = (ds -> as -> pragmas & (pragma & ~PRAGMA_CLEARBIT)) ? 0 : 1;
+			else
+				r = (ds -> as -> pragmas & pragma) ? 1 : 0;
+			if (r || *p != '|')
+				return r;
+			p++;
+		}
+
+	case dep_op_ifdef:
+	case dep_op_ifndef:
+		r = 0;
+		for (;;)
+		{
+			for (i = 0; p[i] && !isspace(p[i]) && p[i] != '|' && p[i] != '&'; i++)
+				/* do nothing */ ;
+			sym = lw_strndup(p, i);
+			p += i;
+			r = depend_isdefined(ds, sym);
+			lw_free(sym);
+			// IFNDEF only looks at the first symbol
+			if (op == dep_op_ifndef)
+				return (r < 0) ? -1 : !r;
+			if (r != 0 || *p != '|')
+				return r;
+			p++;
+		}
+	}
+
+	r = depend_eval(ds, &p, 0, &val);
+	if (r <= 0)
+		return -1;
+
+	switch (op)
+	{
+	case dep_op_ifne:
+		return val != 0;
+	case dep_op_ifeq:
+		return val == 0;
+	case dep_op_ifgt:
+		return val > 0;
+	case dep_op_ifge:
+		return val >= 0;
+	case dep_op_iflt:
+		return val < 0;
+	case dep_op_ifle:
+		return val <= 0;
+	}
+	return -1;
+}
+
+/* extract a possibly quoted file name operand */
+static char *depend_filename(char *p)
+{
+	char *p2;
+	int delim;
+
+	if (*p == '"' || *p == '\'')
+	{
+		delim = *p++;
+		for (p2 = p; *p2 && *p2 != delim; p2++)
+			/* do nothing */ ;
+	}
+	else
+	{
+		for (p2 = p; *p2 && !isspace(*p2); p2++)
+			/* do nothing */ ;
+	}
+	return lw_strndup(p, p2 - p);
+}
+
+static void depend_include(depstate_t *ds, char *p)
+{
+	asmstate_t *as = ds -> as;
+	char *fn, *spec;
+	int oflags = as -> flags;
+
+	if (!*p)
+		return;
+	fn = depend_filename(p);
+	spec = lw_alloc(strlen(fn) + 9);
+	sprintf(spec, "include:%s", fn);
+	lw_free(fn);
+
+	// a file that might not be read doesn't have to exist
+	if (DEP_SPECULATIVE(ds))
+		as -> flags |= FLAG_DEPENDNOERR;
+	as -> fileerr = 0;
+	input_open(as, spec);
+	as -> flags = oflags;
+	lw_free(spec);
+
+	if (DEP_SPECULATIVE(ds) && !input_isopen(as))
+		lw_free(lw_stack_pop(as -> includelist));
+}
+
+static void depend_includebin(depstate_t *ds, char *p)
+{
+	asmstate_t *as = ds -> as;
+	char *fn, *rfn, *dir;
+	FILE *fp;
+
+	if (!*p)
+		return;
+	fn = depend_filename(p);
+	fp = input_open_standalone(as, fn, &rfn);
+	if (fp)
+	{
+		fclose(fp);
+		lw_stack_push(as -> includelist, rfn);
+	}
+	else if (!DEP_SPECULATIVE(ds))
+	{
+		// list where it would be expected so it can be generated
+		dir = lw_stack_top(as -> file_dir);
+		rfn = lw_alloc(strlen(dir ? dir : "") + strlen(fn) + 2);
+		sprintf(rfn, "%s/%s", dir ? dir : "", fn);
+		lw_stack_push(as -> includelist, rfn);
+	}
+	lw_free(fn);
+}
+
+static void depend_setsym(depstate_t *ds, char *sym, char *p, int isset)
+{
+	depend_sym_t *s;
+	int val, known;
+
+	known = depend_eval(ds, &p, 0, &val) > 0;
+	s = depend_lookup(ds -> syms, sym, 0);
+
+	if (s && !isset && s -> defined)
+		return;			// redefinition; the original value stands
+
+	if (!s)
+		s = depend_define(ds -> syms, sym, 0, 0);
+
+	if (DEP_SPECULATIVE(ds))
+	{
+		// the value only survives if every path agrees on it
+		if (!(s -> defined && s -> known && known && s -> value == val))
+			s -> known = 0;
+		return;
+	}
+	s -> defined = 1;
+	s -> known = known;
+	s -> value = val;
+}
+
+static int depend_findop(char *opc)
+{
+	int i;
+
+	for (i = 0; depend_ops[i].opcode; i++)
+	{
+		if (!strcasecmp(depend_ops[i].opcode, opc))
+			return depend_ops[i].op;
+	}
+	return dep_op_none;
+}
+
+/* process a single source line; returns nonzero if scanning should stop */
+static int depend_line(depstate_t *ds, char *line)
+{
+	char *p1, *tok, *sym = NULL, *opc;
+	int stspace, op, r;
+	int rv = 0;
+
+	if (!*line || *line == '*' || *line == ';' || *line == '#')
+		return 0;
+
+	p1 = line;
+	if (isdigit(*p1) && !CURPRAGMA(&(ds -> l), PRAGMA_NEWSOURCE))
+	{
+		// skip line number
+		while (*p1 && isdigit(*p1))
+			p1++;
+		if (*p1 && isspace(*p1))
+			p1++;
+		else
+			p1 = line;
+	}
+	if (!*p1 || *p1 == '*' || *p1 == ';' || *p1 == '#')
+		return 0;
+
+	stspace = 0;
+	if (isspace(*p1))
+	{
+		for (; *p1 && isspace(*p1); p1++)
+			/* do nothing */ ;
+		stspace = 1;
+	}
+	if (!*p1)
+		return 0;
+
+	for (tok = p1; *p1 && !isspace(*p1) && *p1 != ':' && *p1 != '='; p1++)
+		/* do nothing */ ;
+
+	if (*p1 == ':' || *p1 == '=' || stspace == 0)
+	{
+		if (*tok == '*' || *tok == ';' || *tok == '#')
+			return 0;
+		sym = lw_strndup(tok, p1 - tok);
+		if (*p1 == ':')
+			p1++;
+		for (; *p1 && isspace(*p1); p1++)
+			/* do nothing */ ;
+		if (*p1 == '=')
+		{
+			tok = p1++;
+		}
+		else
+		{
+			for (tok = p1; *p1 && !isspace(*p1); p1++)
+				/* do nothing */ ;
+		}
+	}
+
+	if (tok[0] == '?' && tok[1] == '?')
+		tok += 2;
+	opc = lw_strndup(tok, p1 - tok);
+	for (; *p1 && isspace(*p1); p1++)
+		/* do nothing */ ;
+	op = depend_findop(opc);
+
+	// inside a macro definition, only ENDM matters; an include in a
+	// macro body that is being defined may be read when it is expanded
+	if (ds -> inmacro)
+	{
+		if (op == dep_op_endm)
+			ds -> inmacro = ds -> specmacro = 0;
+		else if (ds -> nskip == 0 && op == dep_op_include)
+			depend_include(ds, p1);
+		else if (ds -> nskip == 0 && op == dep_op_includebin)
+			depend_includebin(ds, p1);
+		goto done;
+	}
+
+	switch (op)
+	{
+	case dep_op_ifne:
+	case dep_op_ifeq:
+	case dep_op_ifgt:
+	case dep_op_ifge:
+	case dep_op_iflt:
+	case dep_op_ifle:
+	case dep_op_ifdef:
+	case dep_op_ifndef:
+	case dep_op_ifpragma:
+	case dep_op_ifmaybe:
+	case dep_op_ifp:
+		if (ds -> nskip)
+		{
+			depend_pushcond(ds, dep_cond_skip);
+			break;
+		}
+		r = depend_cond(ds, op, p1);
+		depend_pushcond(ds, (r < 0) ? dep_cond_maybe : (r ? dep_cond_true : dep_cond_false));
+		break;
+
+	case dep_op_else:
+		if (ds -> ncond == 0)
+			break;
+		switch (ds -> conds[ds -> ncond - 1])
+		{
+		case dep_cond_true:
+			depend_setcond(ds, dep_cond_done);
+			break;
+
+		case dep_cond_false:
+			depend_setcond(ds, dep_cond_true);
+			break;
+		}
+		break;
+
+	case dep_op_endc:
+		depend_popcond(ds);
+		break;
+
+	case dep_op_macro:
+		ds -> inmacro = 1;
+		ds -> specmacro = (ds -> nskip == 0);
+		if (ds -> nskip == 0 && sym)
+			depend_define(ds -> macros, sym, 1, 1);
+		break;
+
+	default:
+		if (ds -> nskip)
+			break;
+
+		switch (op)
+		{
+		case dep_op_include:
+			depend_include(ds, p1);
+			break;
+
+		case dep_op_includebin:
+			depend_includebin(ds, p1);
+			break;
+
+		case dep_op_equ:
+		case dep_op_set:
+			if (sym)
+				depend_setsym(ds, sym, p1, op == dep_op_set);
+			break;
+
+		case dep_op_end:
+			// END stops assembly; a speculative one might not
+			if (!DEP_SPECULATIVE(ds) && !(CURPRAGMA(&(ds -> l), PRAGMA_M80EXT) && input_isinclude(ds -> as)))
+				rv = 1;
+			break;
+
+		case dep_op_pragma:
+			for (tok = p1; *tok && !isspace(*tok); tok++)
+				/* do nothing */ ;
+			*tok = '\0';
+			parse_pragma_string(ds -> as, p1, 1);
+			ds -> l.pragmas = ds -> as -> pragmas;
+			if (DEP_SPECULATIVE(ds))
+				ds -> pragmaunknown = 1;
+			break;
+
+		default:
+			// a macro invocation can define anything
+			if (*opc && depend_lookup(ds -> macros, opc, 1))
+				ds -> uncertain = 1;
+			// an ordinary label; defined but its value is an address
+			if (sym && strcmp(sym, "!"))
+				depend_define(ds -> syms, sym, 0, !DEP_SPECULATIVE(ds));
+			break;
+		}
+	}
+
+done:
+	lw_free(opc);
+	lw_free(sym);
+	return rv;
+}
+
+/* write a file name escaped for make/ninja */
+static void depend_writename(FILE *of, char *s)
+{
+	for (; *s; s++)
+	{
+		if (*s == ' ' || *s == '\\' || *s == '#')
+			fputc('\\', of);
+		else if (*s == '$')
+			fputc('$', of);
+		fputc(*s, of);
+	}
+}
+
+static void depend_output(asmstate_t *as)
+{
+	FILE *of = stdout;
+	char **deps = NULL;
+	char *n;
+	int ndeps = 0, i, j;
+
+	// the include list is a stack; unwind it into discovery order
+	while ((n = lw_stack_pop(as -> includelist)))
+	{
+		deps = lw_realloc(deps, sizeof(char *) * (ndeps + 1));
+		deps[ndeps++] = n;
+	}
+	for (i = 0; i < ndeps / 2; i++)
+	{
+		n = deps[i];
+		deps[i] = deps[ndeps - i - 1];
+		deps[ndeps - i - 1] = n;
+	}
+
+	if (as -> depend_file && strcmp(as -> depend_file, "-"))
+	{
+		of = fopen(as -> depend_file, "w");
+		if (!of)
+		{
+			// a batch job or server request fails; the process carries on
+			fprintf(as -> errfile, "Cannot open dependency file %s: %s\n", as -> depend_file, strerror(errno));
+			as -> errorcount++;
+			goto done;
+		}
+	}
+
+	if (as -> depend_format != DEPEND_LIST)
+	{
+		depend_writename(of, as -> depend_target ? as -> depend_target : as -> output_file);
+		fputc(':', of);
+	}
+
+	for (i = 0; i < ndeps; i++)
+	{
+		for (j = 0; j < i; j++)
+		{
+			if (deps[j] && !strcmp(deps[i], deps[j]))
+				break;
+		}
+		if (j < i)
+		{
+			lw_free(deps[i]);
+			deps[i] = NULL;
+			continue;
+		}
+		if (as -> depend_format == DEPEND_LIST)
+		{
+			fprintf(of, "%s\n", deps[i]);
+			continue;
+		}
+		fputs(" \\\n ", of);
+		depend_writename(of, deps[i]);
+	}
+	if (as -> depend_format != DEPEND_LIST)
+		fputc('\n', of);
+
+	// phony targets for everything but the source files themselves keep
+	// make happy when an included file is removed
+	if (as -> depend_format == DEPEND_MAKE)
+	{
+		for (i = 0; i < ndeps; i++)
+		{
+			if (!deps[i])
+				continue;
+			lw_stringlist_reset(as -> input_files);
+			while ((n = lw_stringlist_current(as -> input_files)))
+			{
+				if (!strcmp(n, deps[i]))
+					break;
+				lw_stringlist_next(as -> input_files);
+			}
+			if (n)
+				continue;
+			fputc('\n', of);
+			depend_writename(of, deps[i]);
+			fputs(":\n", of);
+		}
+	}
+
+done:
+	for (i = 0; i < ndeps; i++)
+		lw_free(deps[i]);
+	lw_free(deps);
+
+	if (of && of != stdout)
+		fclose(of);
+}
+
+void do_depend(asmstate_t *as)
+{
+	depstate_t ds = { 0 };
+	char *line;
+	int done;
+
+	ds.as = as;
+	ds.l.pragmas = as -> pragmas;
+	ds.l.as = as;
+	ds.l.insn = -1;
+	as -> cl = &(ds.l);
+
+	while ((line = input_readline(as)))
+	{
+		// skip internal directives; these only come from expansions we don't do
+		if (line[0] == 1 && line[1] == 1)
+		{
+			lw_free(line);
+			continue;
+		}
+		done = depend_line(&ds, line);
+		lw_free(line);
+		if (done)
+			break;
+	}
+
+	as -> cl = NULL;
+	depend_free_tab(ds.syms);
+	depend_free_tab(ds.macros);
+	lw_free(ds.conds);
+
+	depend_output(as);
+}
@@ -68,6 +68,16 @@ struct input_stack
 	struct input_stack_node *stack;
 };
 
+/* open an input file, going through the --server file cache if there is one */
+static FILE *input_fopen(asmstate_t *as, char *fn)
+{
+#if !defined(_WIN32)
+	if (as -> filecache)
+		return filecache_fopen(as -> filecache, fn);
+#endif
+	return fopen(fn, "rb");
+}
+
 static char *make_filename(char *p, char *f)
 {
 	int l;
@@ -80,8 +90,6 @@ static char *make_filename(char *p, char *f)
 
 #define IS	((struct input_stack *)(as -> input_data))
 
-struct ifl *ifl_head = NULL;
-
 int input_isinclude(asmstate_t *as)
 {
 	return IS->type == input_type_include;
@@ -115,7 +123,7 @@ void input_add_to_resource_list(asmstate_t *as, const char *s)
 	struct ifl *ifl;
 	
 	/* first see if the file is already referenced */
-	for (ifl = ifl_head; ifl; ifl = ifl -> next)
+	for (ifl = as -> ifl_head; ifl; ifl = ifl -> next)
 	{
 		if (strcmp(s, ifl -> fn) == 0)
 			break;
@@ -123,8 +131,8 @@ void input_add_to_resource_list(asmstate_t *as, const char *s)
 	if (!ifl)
 	{
 		ifl = lw_alloc(sizeof(struct ifl));
-		ifl -> next = ifl_head;
-		ifl_head = ifl;
+		ifl -> next = as -> ifl_head;
+		as -> ifl_head = ifl;
 		ifl -> fn = lw_strdup(s);
 	}
 }
@@ -146,6 +154,48 @@ void input_init(asmstate_t *as)
 	}
 }
 
+/*
+release everything the input system holds for an assembly: files still
+open when it stopped early, the directory and include stacks, and the list
+of files read
+*/
+void input_finish(asmstate_t *as)
+{
+	struct input_stack *t;
+	struct input_stack_node *n;
+	struct ifl *ifl;
+
+	while (IS)
+	{
+		t = IS;
+		as -> input_data = t -> next;
+		if (t -> type == input_type_string)
+			lw_free(t -> data);
+		else if (t -> data)
+			fclose(t -> data);
+		while ((n = t -> stack))
+		{
+			t -> stack = n -> next;
+			lw_free(n -> entry);
+			lw_free(n);
+		}
+		lw_free(t -> filespec);
+		lw_free(t);
+	}
+	if (as -> file_dir)
+		lw_stack_destroy(as -> file_dir);
+	as -> file_dir = NULL;
+	if (as -> includelist)
+		lw_stack_destroy(as -> includelist);
+	as -> includelist = NULL;
+	while ((ifl = as -> ifl_head))
+	{
+		as -> ifl_head = ifl -> next;
+		lw_free((char *)(ifl -> fn));
+		lw_free(ifl);
+	}
+}
+
 void input_pushpath(asmstate_t *as, char *fn)
 {
 	/* take apart fn into path and filename then push the path */
@@ -238,7 +288,7 @@ void input_open(asmstate_t *as, char *s)
 		if (input_isabsolute(s))
 		{
 			/* absolute path */
-			IS -> data = fopen(s, "rb");
+			IS -> data = input_fopen(as, s);
 			debug_message(as, 1, "Opening (abs) %s", s);
 			if (!IS -> data && !IGNOREERROR)
 			{
@@ -257,7 +307,7 @@ void input_open(asmstate_t *as, char *s)
 		p = lw_stack_top(as -> file_dir);
 		p2 = make_filename(p, s);
 		debug_message(as, 1, "Open: (cd) %s\n", p2);
-		IS -> data = fopen(p2, "rb");
+		IS -> data = input_fopen(as, p2);
 		if (IS -> data)
 		{
 			input_pushpath(as, p2);
@@ -274,7 +324,7 @@ void input_open(asmstate_t *as, char *s)
 		{
 			p2 = make_filename(p, s);
 		debug_message(as, 1, "Open (sp): %s\n", p2);
-			IS -> data = fopen(p2, "rb");
+			IS -> data = input_fopen(as, p2);
 			if (IS -> data)
 			{
 				input_pushpath(as, p2);
@@ -297,7 +347,7 @@ void input_open(asmstate_t *as, char *s)
 		
 	case input_type_file:
 		debug_message(as, 1, "Opening (reg): %s\n", s);
-		IS -> data = fopen(s, "rb");
+		IS -> data = input_fopen(as, s);
 
 		if (!IS -> data)
 		{
@@ -323,9 +373,7 @@ FILE *input_open_standalone(asmstate_t *as, char *s, char **rfn)
 	{
 		/* absolute path */
 		debug_message(as, 2, "Open file (st abs) %s", s);
-		if (as -> flags & FLAG_DEPEND)
-			printf("%s\n", s);
-		fp = fopen(s, "rb");
+		fp = input_fopen(as, s);
 		if (!fp)
 		{
 			return NULL;
@@ -340,11 +388,9 @@ FILE *input_open_standalone(asmstate_t *as, char *s, char **rfn)
 	p = lw_stack_top(as -> file_dir);
 	p2 = make_filename(p ? p : "", s);
 	debug_message(as, 2, "Open file (st cd) %s", p2);
-	fp = fopen(p2, "rb");
+	fp = input_fopen(as, p2);
 	if (fp)
 	{
-		if (as -> flags & FLAG_DEPEND)
-			printf("%s\n", p2);
 		input_add_to_resource_list(as, p2);
 		if (rfn)
 			*rfn = lw_strdup(p2);
@@ -359,11 +405,9 @@ FILE *input_open_standalone(asmstate_t *as, char *s, char **rfn)
 	{
 		p2 = make_filename(p, s);
 		debug_message(as, 2, "Open file (st ip) %s", p2);
-		fp = fopen(p2, "rb");
+		fp = input_fopen(as, p2);
 		if (fp)
 		{
-			if (as -> flags & FLAG_DEPEND)
-				printf("%s\n", p2);
 			input_add_to_resource_list(as, p2);
 			if (rfn)
 				*rfn = lw_strdup(p2);
@@ -374,18 +418,19 @@ FILE *input_open_standalone(asmstate_t *as, char *s, char **rfn)
 		lw_stringlist_next(as -> include_list);
 	}
 
-	// last ditch output for dependencies
-	if (as -> flags & FLAG_DEPEND)
-	{
-		p = lw_stack_top(as -> file_dir);
-		p2 = make_filename(p ? p : "", s);
-		printf("%s\n", p2);
-		lw_free(p2);
-	}
-	
 	return NULL;
 }
 
+/* returns nonzero if the current input source could actually be opened */
+int input_isopen(asmstate_t *as)
+{
+	if (!IS)
+		return 0;
+	if (IS -> type == input_type_string)
+		return 1;
+	return IS -> data != NULL;
+}
+
 char *input_readline(asmstate_t *as)
 {
 	char *s;
@@ -33,12 +33,15 @@ void input_stack_push(asmstate_t *as, input_stack_entry *se);
 input_stack_entry *input_stack_pop(asmstate_t *as, int magic, int (*fn)(input_stack_entry *e, void *data), void *data);
 
 void input_init(asmstate_t *as);
+void input_finish(asmstate_t *as);
 void input_openstring(asmstate_t *as, char *s, char *str);
 void input_open(asmstate_t *as, char *s);
 char *input_readline(asmstate_t *as);
 char *input_curspec(asmstate_t *as);
 FILE *input_open_standalone(asmstate_t *as, char *s, char **rfn);
 int input_isinclude(asmstate_t *as);
+int input_isopen(asmstate_t *as);
+void input_add_to_resource_list(asmstate_t *as, const char *s);
 
 struct ifl
 {
@@ -46,6 +49,4 @@ struct ifl
 	struct ifl *next;
 };
 
-extern struct ifl *ifl_head;
-
 #endif
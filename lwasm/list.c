@@ -17,11 +17,27 @@ more details.
 
 You should have received a copy of the GNU General Public License along with
 this program. If not, see <http://www.gnu.org/licenses/>.
+
+
+The listing is generated in two steps. First, each line is "prepared": this
+is a single forward pass over the lines which does everything that depends
+on assembler state (evaluating addresses, the cycle count running total,
+collecting the bytes of no-expand blocks, and reporting warnings). Then the
+prepared line is rendered into a memory buffer which is written out in large
+chunks.
+
+Rendering does not touch any shared state so the listing can optionally be
+rendered by several threads, each doing a contiguous chunk of the lines.
+The chunks are then written out in order.
 */
 
 #include <stdio.h>
 #include <string.h>
 
+#if !defined(_WIN32)
+#include <pthread.h>
+#endif
+
 #include <lw_alloc.h>
 #include <lw_string.h>
 
@@ -29,145 +45,227 @@ this program. If not, see <http://www.gnu.org/licenses/>.
 #include "instab.h"
 
 void list_symbols(asmstate_t *as, FILE *of);
-line_t *list_one_line(asmstate_t *as, FILE *of, line_t *line);
+line_t *list_one_line(asmstate_t *as, FILE *of, line_t *cl);
 
-/*
-Do listing
-*/
-void do_list(asmstate_t *as)
+// size at which the listing buffer is written out
+#define LIST_CHUNK	65536
+
+// minimum number of lines per parallel rendering job
+#define LIST_JOBMIN	1024
+
+typedef struct
 {
-	FILE *of = NULL;
-		
-	if (!(as -> flags & FLAG_LIST))
+	char *buf;							// rendered text
+	int len;							// length of rendered text
+	int size;							// size of allocated buffer
+	FILE *of;							// where to flush to; NULL to keep it all in memory
+} listbuf_t;
+
+enum
+{
+	list_addr_none = 0,					// no address field
+	list_addr_soff,						// struct offset
+	list_addr_dshow8,					// 8 bit data value
+	list_addr_dshow16,					// 16 bit data value
+	list_addr_dptr,						// symbol value
+	list_addr_dptrunk,					// unresolved symbol value
+	list_addr_line						// line address and output bytes
+};
+
+typedef struct
+{
+	line_t *cl;							// line to list
+	line_t *wend;						// stop listing warnings at this line
+	int hidden;							// only list the warnings
+	int addrmode;						// which address field to show
+	int addrval;						// value for the address field
+	int addrflag;						// marker following the address
+	unsigned char *obytes;				// output bytes to show
+	int obytelen;						// number of output bytes
+	int obytesalloc;					// set if obytes needs to be freed
+	char cycles[64];					// cycle count field
+	int showtotal;						// set to show the running total
+	int cycletotal;						// cycle count running total
+} listent_t;
+
+static void listbuf_flush(listbuf_t *lb)
+{
+	if (lb -> of && lb -> len > 0)
 	{
-		of = NULL;
+		(void)(fwrite(lb -> buf, lb -> len, 1, lb -> of) && 1);
+		lb -> len = 0;
 	}
-	else
-	{		
-		if (as -> list_file)
-		{
-			if (strcmp(as -> list_file, "-") == 0)
-			{
-				of = stdout;
-			}
-			else
-				of = fopen(as -> list_file, "w");
-		}
-		else
-			of = stdout;
+}
 
-		if (!of)
-		{
-			fprintf(stderr, "Cannot open list file; list not generated\n");
-			return;
-		}
+static char *listbuf_reserve(listbuf_t *lb, int len)
+{
+	if (lb -> len + len > lb -> size)
+	{
+		if (lb -> size == 0)
+			lb -> size = LIST_CHUNK + 1024;
+		while (lb -> len + len > lb -> size)
+			lb -> size *= 2;
+		lb -> buf = lw_realloc(lb -> buf, lb -> size);
 	}
+	return lb -> buf + lb -> len;
+}
+
+static void listbuf_add(listbuf_t *lb, const char *s, int len)
+{
+	memcpy(listbuf_reserve(lb, len), s, len);
+	lb -> len += len;
+}
+
+#define listbuf_puts(lb, s) listbuf_add((lb), (s), strlen(s))
+
+static void listbuf_putc(listbuf_t *lb, int c)
+{
+	*listbuf_reserve(lb, 1) = c;
+	lb -> len++;
+}
+
+static void listbuf_fill(listbuf_t *lb, int c, int len)
+{
+	if (len <= 0)
+		return;
+	memset(listbuf_reserve(lb, len), c, len);
+	lb -> len += len;
+}
+
+// upper case hex, exactly "digits" digits
+static void listbuf_hex(listbuf_t *lb, unsigned int v, int digits)
+{
+	static const char hexdigits[16] = "0123456789ABCDEF";
+	char *p;
 
-	line_t *line = as -> line_head;
-	while(line)
+	p = listbuf_reserve(lb, digits);
+	lb -> len += digits;
+	while (digits--)
 	{
-		line = list_one_line(as, of, line);
+		p[digits] = hexdigits[v & 0x0f];
+		v >>= 4;
 	}
+}
 
-	if ((as -> flags & FLAG_SYMBOLS) && of)
-		list_symbols(as, of);
-	if (of && of != stdout)
-		fclose(of);
+// decimal, zero padded on the left to at least "width" digits
+static void listbuf_dec(listbuf_t *lb, int v, int width)
+{
+	char tbuf[16];
+	int i = sizeof(tbuf);
+	unsigned int uv = v;
+
+	if (v < 0)
+	{
+		listbuf_putc(lb, '-');
+		uv = -uv;
+		width--;
+	}
+	do
+	{
+		tbuf[--i] = '0' + uv % 10;
+		uv /= 10;
+	} while (uv);
+	listbuf_fill(lb, '0', width - (int)(sizeof(tbuf) - i));
+	listbuf_add(lb, tbuf + i, sizeof(tbuf) - i);
 }
 
-line_t *list_one_line(asmstate_t* as, FILE *of, line_t *cl)
+/* warnings go with the rest of this assembly's diagnostics */
+static void list_warnings(asmstate_t *as, FILE *of, line_t *cl, line_t *wl)
 {
-	line_t *nl, *nl2;
-	int i;
-	unsigned char *obytes = NULL;
-	int obytelen = 0;
-	
-	char *tc;
-	char *linespec;
+	lwasm_error_t *e;
+
+	for (e = wl -> warn; e; e = e -> next)
+	{
+		if (of != stdout) fprintf(as -> errfile, "Warning (%s:%d): %s\n", cl -> linespec, cl -> lineno,  e -> mess);
+	}
+}
+
+/*
+Prepare "cl" for listing. Returns the next line to consider. If "ent" is
+NULL, only the warnings are reported.
+*/
+static line_t *list_prepare(asmstate_t *as, FILE *of, line_t *cl, listent_t *ent)
+{
+	line_t *nl, *bl;
+	int nc;
+	int obytelen;
 
 	nl = cl -> next;
+	if (ent)
+		ent -> cl = NULL;
 	if (CURPRAGMA(cl, PRAGMA_NOLIST))
 	{
 		if (cl -> outputl <= 0)
-			goto Exit;
+			return nl;
 	}
 
 	if (cl -> noexpand_start)
 	{
+		// the whole no-expand block is listed as the starting line, showing
+		// all the bytes generated by the block
 		obytelen = 0;
-		int nc = 0;
-		for (nl = cl; nl; nl = nl -> next)
+		nc = 0;
+		for (bl = cl; bl; bl = bl -> next)
 		{
-			if (nl -> noexpand_start)
-				nc += nl -> noexpand_start;
-			if (nl -> noexpand_end)
-				nc -= nl -> noexpand_end;
-				
-			if (nl -> outputl > 0)
-				obytelen += nl -> outputl;
-			if (nl -> warn)
-			{
-				lwasm_error_t *e;
-				for (e = nl -> warn; e; e = e -> next)
-				{
-					if (of != stdout) printf("Warning (%s:%d): %s\n", cl -> linespec, cl -> lineno,  e -> mess);
-					if (of) fprintf(of, "Warning: %s\n", e -> mess);
-				}
-			}
+			nc += bl -> noexpand_start;
+			nc -= bl -> noexpand_end;
+			if (bl -> outputl > 0)
+				obytelen += bl -> outputl;
+			list_warnings(as, of, cl, bl);
 			if (nc == 0)
-				goto Exit;
+				break;
 		}
-		obytes = lw_alloc(obytelen);
-		nc = 0;
-		for (nl2 = cl; ; nl2 = nl2 -> next)
+		nl = bl ? bl -> next : NULL;
+		if (!ent)
+			return nl;
+		ent -> obytes = NULL;
+		ent -> obytesalloc = 0;
+		if (obytelen > 0)
 		{
-			int i;
-			for (i = 0; i < nl2 -> outputl; i++)
+			ent -> obytes = lw_alloc(obytelen);
+			ent -> obytesalloc = 1;
+			obytelen = 0;
+			for (bl = cl; bl != nl; bl = bl -> next)
 			{
-				obytes[nc++] = nl2 -> output[i];
+				if (bl -> outputl > 0)
+				{
+					memcpy(ent -> obytes + obytelen, bl -> output, bl -> outputl);
+					obytelen += bl -> outputl;
+				}
 			}
-			if (nc >= obytelen)
-				goto Exit;
 		}
-		if (nl)
-			nl = nl -> next;
 	}
 	else
 	{
-		if (cl -> warn)
-		{
-			lwasm_error_t *e;
-			for (e = cl -> warn; e; e = e -> next)
-			{
-				if (of != stdout) printf("Warning (%s:%d): %s\n", cl -> linespec, cl -> lineno, e -> mess);
-				if (of) fprintf(of, "Warning: %s\n", e -> mess);
-			}
-		}
+		list_warnings(as, of, cl, cl);
+		if (!ent)
+			return nl;
 		obytelen = cl -> outputl;
-		if (obytelen > 0)
-		{
-			obytes = lw_alloc(obytelen);
-			memmove(obytes, cl -> output, cl -> outputl);
-		}
+		ent -> obytes = cl -> output;
+		ent -> obytesalloc = 0;
 	}
+
+	ent -> cl = cl;
+	ent -> wend = nl;
+	ent -> obytelen = obytelen;
+	ent -> hidden = 0;
 	if (cl -> hidecond && CURPRAGMA(cl, PRAGMA_NOEXPANDCOND))
-		goto Exit;
+	{
+		ent -> hidden = 1;
+		return nl;
+	}
+
 	if ((cl -> len < 1 && cl -> dlen < 1) && obytelen < 1 && (cl -> symset == 1 || cl -> sym == NULL) )
 	{
 		if (cl -> soff >= 0)
 		{
-			if (of) fprintf(of, "%04Xs                 ", cl -> soff & 0xffff);
+			ent -> addrmode = list_addr_soff;
+			ent -> addrval = cl -> soff;
 		}
 		else if (cl -> dshow >= 0)
 		{
-			if (cl -> dsize == 1)
-			{
-				if (of) fprintf(of, "     %02X               ", cl -> dshow & 0xff);
-			}
-			else
-			{
-				if (of) fprintf(of, "     %04X               ", cl -> dshow & 0xff);
-			}
+			ent -> addrmode = (cl -> dsize == 1) ? list_addr_dshow8 : list_addr_dshow16;
+			ent -> addrval = cl -> dshow;
 		}
 		else if (cl -> dptr)
 		{
@@ -179,23 +277,27 @@ line_t *list_one_line(asmstate_t* as, FILE *of, line_t *cl)
 			as -> exportcheck = 0;
 			if (lw_expr_istype(te, lw_expr_type_int))
 			{
-				if (of) fprintf(of, "     %04X             ", lw_expr_intval(te) & 0xffff);
+				ent -> addrmode = list_addr_dptr;
+				ent -> addrval = lw_expr_intval(te);
 			}
 			else
 			{
-				if (of) fprintf(of, "     ????             ");
+				ent -> addrmode = list_addr_dptrunk;
 			}
 			lw_expr_destroy(te);
 		}
 		else
 		{
-			if (of) fprintf(of, "                      ");
+			ent -> addrmode = list_addr_none;
 		}
 	}
 	else
 	{
 		lw_expr_t te;
-		if (instab[cl -> insn].flags & lwasm_insn_setdata)
+		int setdata;
+
+		setdata = (cl -> insn >= 0) && (instab[cl -> insn].flags & lwasm_insn_setdata);
+		if (setdata)
 			te = lw_expr_copy(cl -> daddr);
 		else
 			te = lw_expr_copy(cl -> addr);
@@ -203,46 +305,19 @@ line_t *list_one_line(asmstate_t* as, FILE *of, line_t *cl)
 		as -> csect = cl -> csect;
 		lwasm_reduce_expr(as, te);
 		as -> exportcheck = 0;
-//			if (of) fprintf(of, "%s\n", lw_expr_print(te));
-		if (of) fprintf(of, "%04X%c", lw_expr_intval(te) & 0xffff, ((cl -> inmod || (cl -> dlen != cl -> len)) && instab[cl -> insn].flags & lwasm_insn_setdata) ? '.' : ' ');
+		ent -> addrmode = list_addr_line;
+		ent -> addrval = lw_expr_intval(te);
+		ent -> addrflag = ((cl -> inmod || (cl -> dlen != cl -> len)) && setdata) ? '.' : ' ';
 		lw_expr_destroy(te);
-		for (i = 0; i < obytelen && i < 8; i++)
-		{
-			if (of) fprintf(of, "%02X", obytes[i]);
-		}
-		for (; i < 8; i++)
-		{
-			if (of) fprintf(of, "  ");
-		}
-		if (of) fprintf(of, " ");
-	}
-
-	/* the format specifier below is deliberately chosen so that the start of the line text is at
-	a multiple of 8 from the start of the list line */
-
-	#define max_linespec_len 17
-
-	// trim "include:" if it appears
-	if (as -> listnofile)
-	{
-		if (of) fprintf(of, "%05d ", cl->lineno);
 	}
-	else
-	{
-		linespec = cl -> linespec;
-		if ((strlen(linespec) > 8) && (linespec[7] == ':')) linespec += 8;
-		while (*linespec == ' ') linespec++;
 
-		if (of) fprintf(of, "(%*.*s):%05d ", max_linespec_len, max_linespec_len, linespec, cl->lineno);
-	}
-		
 	if (CURPRAGMA(cl, PRAGMA_CC))
 	{
-		as->cycle_total = 0;
+		as -> cycle_total = 0;
 	}
 
-	/* display cycle counts */
-	char s[64] = "";
+	/* cycle counts */
+	ent -> cycles[0] = '\0';
 	if (CURPRAGMA(cl, PRAGMA_C) || CURPRAGMA(cl, PRAGMA_CD))
 	{
 		char sch = '(', ech = ')';
@@ -251,41 +326,142 @@ line_t *list_one_line(asmstate_t* as, FILE *of, line_t *cl)
 			sch = '[';
 			ech = ']';
 		}
-		if (cl->cycle_base != 0)
+		if (cl -> cycle_base != 0)
 		{
 			int est = cl -> cycle_flags & CYCLE_ESTIMATED;
 
-			if (CURPRAGMA(cl, PRAGMA_CD) && cl->cycle_flags & CYCLE_ADJ)
+			if (CURPRAGMA(cl, PRAGMA_CD) && cl -> cycle_flags & CYCLE_ADJ)
 			{
-				sprintf(s, "%c%d+%d%s%c", sch, cl->cycle_base, cl->cycle_adj, est ? "+?" : "", ech);	/* detailed cycle count */
+				sprintf(ent -> cycles, "%c%d+%d%s%c", sch, cl -> cycle_base, cl -> cycle_adj, est ? "+?" : "", ech);	/* detailed cycle count */
 			}
 			else
 			{
-				sprintf(s, "%c%d%s%c", sch, cl->cycle_base + cl->cycle_adj, est ? "+?" : "", ech);   /* normal cycle count*/
+				sprintf(ent -> cycles, "%c%d%s%c", sch, cl -> cycle_base + cl -> cycle_adj, est ? "+?" : "", ech);   /* normal cycle count*/
 			}
-			as->cycle_total += cl->cycle_base + cl->cycle_adj;
+			as -> cycle_total += cl -> cycle_base + cl -> cycle_adj;
 		}
 	}
+	ent -> showtotal = CURPRAGMA(cl, PRAGMA_CT) ? ((cl -> cycle_base != 0) ? 1 : -1) : 0;
+	ent -> cycletotal = as -> cycle_total;
+	return nl;
+}
 
-	if (of) fprintf(of, "%-8s", s);
+/*
+Render a prepared line. This must not touch any state other than "lb" as
+it may be running in parallel with other renderers.
+*/
+static void list_render(asmstate_t *as, listbuf_t *lb, listent_t *ent)
+{
+	line_t *cl = ent -> cl;
+	line_t *wl;
+	lwasm_error_t *e;
+	char *tc;
+	char *linespec;
+	int i, l;
 
-	if (CURPRAGMA(cl, PRAGMA_CT)) 
+	for (wl = cl; wl != ent -> wend; wl = wl -> next)
 	{
-		if (cl->cycle_base != 0)
+		for (e = wl -> warn; e; e = e -> next)
 		{
-			if (of) fprintf(of, "%-8d", as->cycle_total);
-		}
-		else
-		{
-			if (of) fprintf(of, "        ");
+			listbuf_puts(lb, "Warning: ");
+			listbuf_puts(lb, e -> mess);
+			listbuf_putc(lb, '\n');
 		}
 	}
+	if (ent -> hidden)
+		return;
+
+	switch (ent -> addrmode)
+	{
+	case list_addr_soff:
+		listbuf_hex(lb, ent -> addrval & 0xffff, 4);
+		listbuf_putc(lb, 's');
+		listbuf_fill(lb, ' ', 17);
+		break;
+
+	case list_addr_dshow8:
+		listbuf_fill(lb, ' ', 5);
+		listbuf_hex(lb, ent -> addrval & 0xff, 2);
+		listbuf_fill(lb, ' ', 15);
+		break;
+
+	case list_addr_dshow16:
+		listbuf_fill(lb, ' ', 5);
+		listbuf_hex(lb, ent -> addrval & 0xff, 4);
+		listbuf_fill(lb, ' ', 15);
+		break;
+
+	case list_addr_dptr:
+		listbuf_fill(lb, ' ', 5);
+		listbuf_hex(lb, ent -> addrval & 0xffff, 4);
+		listbuf_fill(lb, ' ', 13);
+		break;
+
+	case list_addr_dptrunk:
+		listbuf_puts(lb, "     ????             ");
+		break;
+
+	case list_addr_line:
+		listbuf_hex(lb, ent -> addrval & 0xffff, 4);
+		listbuf_putc(lb, ent -> addrflag);
+		for (i = 0; i < ent -> obytelen && i < 8; i++)
+			listbuf_hex(lb, ent -> obytes[i], 2);
+		listbuf_fill(lb, ' ', (8 - i) * 2 + 1);
+		break;
+
+	default:
+		listbuf_fill(lb, ' ', 22);
+		break;
+	}
+
+	/* the format below is deliberately chosen so that the start of the line text is at
+	a multiple of 8 from the start of the list line */
+
+	#define max_linespec_len 17
+
+	// trim "include:" if it appears
+	if (as -> listnofile)
+	{
+		listbuf_dec(lb, cl -> lineno, 5);
+		listbuf_putc(lb, ' ');
+	}
+	else
+	{
+		linespec = cl -> linespec;
+		if ((strlen(linespec) > 8) && (linespec[7] == ':')) linespec += 8;
+		while (*linespec == ' ') linespec++;
+
+		l = strlen(linespec);
+		if (l > max_linespec_len)
+			l = max_linespec_len;
+		listbuf_putc(lb, '(');
+		listbuf_fill(lb, ' ', max_linespec_len - l);
+		listbuf_add(lb, linespec, l);
+		listbuf_puts(lb, "):");
+		listbuf_dec(lb, cl -> lineno, 5);
+		listbuf_putc(lb, ' ');
+	}
+
+	l = strlen(ent -> cycles);
+	listbuf_add(lb, ent -> cycles, l);
+	listbuf_fill(lb, ' ', 8 - l);
+
+	if (ent -> showtotal > 0)
+	{
+		l = lb -> len;
+		listbuf_dec(lb, ent -> cycletotal, 0);
+		listbuf_fill(lb, ' ', 8 - (lb -> len - l));
+	}
+	else if (ent -> showtotal < 0)
+	{
+		listbuf_fill(lb, ' ', 8);
+	}
 
 	if (as -> tabwidth == 0)
 	{
-		fputs(cl -> ltext, of);
+		listbuf_puts(lb, cl -> ltext);
 	}
-	else 
+	else
 	{
 		i = 0;
 		for (tc = cl -> ltext; *tc; tc++)
@@ -294,47 +470,228 @@ line_t *list_one_line(asmstate_t* as, FILE *of, line_t *cl)
 			{
 				if (i % as -> tabwidth == 0)
 				{
-					if (of) fputc(' ', of);
+					listbuf_putc(lb, ' ');
 					i++;
 				}
 				while (i % as -> tabwidth)
 				{
-					if (of) fputc(' ', of);
+					listbuf_putc(lb, ' ');
 					i++;
 				}
 			}
 			else
 			{
-				if (of) fputc(*tc, of);
+				listbuf_putc(lb, *tc);
 				i++;
 			}
 		}
 	}
 
-	if (of) fputc('\n', of);
+	listbuf_putc(lb, '\n');
 
-	if (obytelen > 8)
+	if (ent -> obytelen > 8)
 	{
-		for (i = 8; i < obytelen; i++)
+		for (i = 8; i < ent -> obytelen; i++)
 		{
 			if (i % 8 == 0)
 			{
 				if (i != 8)
-				{
-					if (of) fprintf(of, "\n     ");
-				}
-				else
-				{
-					if (of) fprintf(of, "     ");
-				}
+					listbuf_putc(lb, '\n');
+				listbuf_fill(lb, ' ', 5);
 			}
-			if (of) fprintf(of, "%02X", obytes[i]);
+			listbuf_hex(lb, ent -> obytes[i], 2);
 		}
-		if (i > 8)
-			if (of) fprintf(of, "\n");
+		listbuf_putc(lb, '\n');
 	}
 
-Exit:
-	if (obytes) lw_free(obytes);
+	if (lb -> len >= LIST_CHUNK)
+		listbuf_flush(lb);
+}
+
+static void list_entfree(listent_t *ent)
+{
+	if (ent -> obytesalloc)
+		lw_free(ent -> obytes);
+	ent -> obytesalloc = 0;
+}
+
+/*
+List a single line (or no-expand block) starting at "cl" to "of" and return
+the next line to list. This is used by the CMT generator which needs to
+post-process each listed line.
+*/
+line_t *list_one_line(asmstate_t *as, FILE *of, line_t *cl)
+{
+	listent_t ent;
+	listbuf_t lb = { 0 };
+	line_t *nl;
+
+	lb.of = of;
+	nl = list_prepare(as, of, cl, &ent);
+	if (ent.cl)
+	{
+		list_render(as, &lb, &ent);
+		list_entfree(&ent);
+	}
+	listbuf_flush(&lb);
+	lw_free(lb.buf);
 	return nl;
 }
+
+typedef struct
+{
+	asmstate_t *as;
+	listent_t *ents;					// first line of this chunk
+	int nents;							// number of lines in this chunk
+	listbuf_t lb;						// rendered text
+} listjob_t;
+
+static void *list_job(void *arg)
+{
+	listjob_t *job = arg;
+	int i;
+
+	for (i = 0; i < job -> nents; i++)
+		list_render(job -> as, &(job -> lb), &(job -> ents[i]));
+	return NULL;
+}
+
+/*
+Render the listing in "njobs" chunks. All the lines are prepared first,
+in order, then the chunks are rendered concurrently and written out in
+order.
+*/
+static void list_parallel(asmstate_t *as, FILE *of, int njobs)
+{
+	listent_t *ents = NULL;
+	listjob_t *jobs;
+	int nents = 0, sents = 0;
+	int i, per;
+	line_t *cl;
+
+	for (cl = as -> line_head; cl; )
+	{
+		if (nents >= sents)
+		{
+			sents = sents ? sents * 2 : 1024;
+			ents = lw_realloc(ents, sents * sizeof(listent_t));
+		}
+		cl = list_prepare(as, of, cl, &(ents[nents]));
+		if (ents[nents].cl)
+			nents++;
+	}
+
+	if (njobs > nents / LIST_JOBMIN)
+		njobs = nents / LIST_JOBMIN;
+	if (njobs < 1)
+		njobs = 1;
+	per = (nents + njobs - 1) / njobs;
+
+	jobs = lw_alloc(njobs * sizeof(listjob_t));
+	memset(jobs, 0, njobs * sizeof(listjob_t));
+	for (i = 0; i < njobs; i++)
+	{
+		jobs[i].as = as;
+		jobs[i].ents = ents + i * per;
+		jobs[i].nents = (i == njobs - 1) ? nents - i * per : per;
+	}
+
+#if !defined(_WIN32)
+	{
+		pthread_t *threads;
+		int *started;
+
+		threads = lw_alloc(njobs * sizeof(pthread_t));
+		started = lw_alloc(njobs * sizeof(int));
+		for (i = 1; i < njobs; i++)
+			started[i] = (pthread_create(&threads[i], NULL, list_job, &jobs[i]) == 0);
+		list_job(&jobs[0]);
+		for (i = 1; i < njobs; i++)
+		{
+			// if a thread could not be created, do its chunk here
+			if (started[i])
+				pthread_join(threads[i], NULL);
+			else
+				list_job(&jobs[i]);
+		}
+		lw_free(started);
+		lw_free(threads);
+	}
+#else
+	for (i = 0; i < njobs; i++)
+		list_job(&jobs[i]);
+#endif
+
+	for (i = 0; i < njobs; i++)
+	{
+		jobs[i].lb.of = of;
+		listbuf_flush(&(jobs[i].lb));
+		lw_free(jobs[i].lb.buf);
+	}
+	for (i = 0; i < nents; i++)
+		list_entfree(&ents[i]);
+	lw_free(jobs);
+	lw_free(ents);
+}
+
+/*
+Do listing
+*/
+void do_list(asmstate_t *as)
+{
+	FILE *of = NULL;
+	line_t *cl;
+	listent_t ent;
+	listbuf_t lb = { 0 };
+
+	if (!(as -> flags & FLAG_LIST))
+	{
+		// no listing but warnings still need to be reported
+		for (cl = as -> line_head; cl; )
+			cl = list_prepare(as, NULL, cl, NULL);
+		return;
+	}
+
+	if (as -> list_file)
+	{
+		if (strcmp(as -> list_file, "-") == 0)
+		{
+			of = stdout;
+		}
+		else
+			of = fopen(as -> list_file, "w");
+	}
+	else
+		of = stdout;
+
+	if (!of)
+	{
+		fprintf(as -> errfile, "Cannot open list file; list not generated\n");
+		return;
+	}
+
+	if (as -> list_jobs > 1)
+	{
+		list_parallel(as, of, as -> list_jobs);
+	}
+	else
+	{
+		lb.of = of;
+		for (cl = as -> line_head; cl; )
+		{
+			cl = list_prepare(as, of, cl, &ent);
+			if (ent.cl)
+			{
+				list_render(as, &lb, &ent);
+				list_entfree(&ent);
+			}
+		}
+		listbuf_flush(&lb);
+		lw_free(lb.buf);
+	}
+
+	if (as -> flags & FLAG_SYMBOLS)
+		list_symbols(as, of);
+	if (of != stdout)
+		fclose(of);
+}
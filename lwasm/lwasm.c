@@ -68,7 +68,7 @@ lw_expr_t lwasm_evaluate_var(char *var, void *priv)
 	s = lookup_symbol(as, as -> cl, var);
 	if (s)
 	{
-		debug_message(as, 225, "eval var: symbol found %s = %s (%p)", s -> symbol, lw_expr_print(s -> value), s);
+		debug_message(as, 225, "eval var: symbol found %s = %s (%p)", s -> symbol, lw_expr_print_ctx(as -> exprctx, s -> value), s);
 		e = lw_expr_build(lw_expr_type_special, lwasm_expr_syment, s);
 		return e;
 	}
@@ -297,7 +297,7 @@ const char* lwasm_lookup_error(lwasm_errorcode_t error_code)
 void lwasm_error_testmode(line_t *cl, const char* msg, int fatal)
 {
 	cl -> as -> testmode_errorcount++;
-	fprintf(stderr, "line %d: %s : %s\n", cl->lineno, msg, cl->ltext);
+	fprintf(cl -> as -> errfile, "line %d: %s : %s\n", cl->lineno, msg, cl->ltext);
 	if (fatal == 1) lw_error("aborting\n");
 }
 
@@ -892,19 +892,19 @@ lw_expr_t lwasm_parse_expr(asmstate_t *as, char **p)
 
 	if (as->exprwidth != 16)	
 	{
-		lw_expr_setwidth(as->exprwidth);
+		lw_expr_ctx_setwidth(as -> exprctx, as->exprwidth);
 		if (CURPRAGMA(as -> cl, PRAGMA_NEWSOURCE))
-			e = lw_expr_parse(p, as);
+			e = lw_expr_parse_ctx(as -> exprctx, p, as);
 		else
-			e = lw_expr_parse_compact(p, as);
-		lw_expr_setwidth(0);
+			e = lw_expr_parse_compact_ctx(as -> exprctx, p, as);
+		lw_expr_ctx_setwidth(as -> exprctx, 0);
 	}
 	else
 	{
 		if (CURPRAGMA(as -> cl, PRAGMA_NEWSOURCE))
-			e = lw_expr_parse(p, as);
+			e = lw_expr_parse_ctx(as -> exprctx, p, as);
 		else
-			e = lw_expr_parse_compact(p, as);
+			e = lw_expr_parse_compact_ctx(as -> exprctx, p, as);
 	}
 	lwasm_skip_to_next_token(as -> cl, p);
 	return e;
@@ -913,7 +913,7 @@ lw_expr_t lwasm_parse_expr(asmstate_t *as, char **p)
 int lwasm_reduce_expr(asmstate_t *as, lw_expr_t expr)
 {
 	if (expr)
-		lw_expr_simplify(expr, as);
+		lw_expr_simplify_ctx(as -> exprctx, expr, as);
 	return 0;
 }
 
@@ -1245,13 +1245,13 @@ void lwasm_show_errors(asmstate_t *as)
 
 		for (e = cl -> err; e; e = e -> next)
 		{
-			fprintf(stderr, "%s(%d) : ERROR : %s\n", s, cl->lineno, e->mess);
+			fprintf(as -> errfile, "%s(%d) : ERROR : %s\n", s, cl->lineno, e->mess);
 		}
 		for (e = cl -> warn; e; e = e -> next)
 		{
-			fprintf(stderr, "%s(%d) : WARNING : %s\n", s, cl->lineno, e->mess);
+			fprintf(as -> errfile, "%s(%d) : WARNING : %s\n", s, cl->lineno, e->mess);
 		}
-		fprintf(stderr, "%s:%05d %s\n\n", cl -> linespec, cl -> lineno, cl -> ltext);
+		fprintf(as -> errfile, "%s:%05d %s\n\n", cl -> linespec, cl -> lineno, cl -> ltext);
 	}
 }
 
@@ -1274,7 +1274,7 @@ lw_expr_t lwasm_parse_cond(asmstate_t *as, char **p)
 
 	debug_message(as, 250, "Parsing condition");
 	e = lwasm_parse_expr(as, p);
-	debug_message(as, 250, "COND EXPR: %s", lw_expr_print(e));
+	debug_message(as, 250, "COND EXPR: %s", lw_expr_print_ctx(as -> exprctx, e));
 	
 	if (!e)
 	{
@@ -1293,16 +1293,16 @@ lw_expr_t lwasm_parse_cond(asmstate_t *as, char **p)
 	/* we need to simplify the expression here */
 	debug_message(as, 250, "Doing interim reductions");
 	lwasm_interim_reduce(as);
-	debug_message(as, 250, "COND EXPR: %s", lw_expr_print(e));
+	debug_message(as, 250, "COND EXPR: %s", lw_expr_print_ctx(as -> exprctx, e));
 	debug_message(as, 250, "Reducing expression");
 	lwasm_reduce_expr(as, e);
-	debug_message(as, 250, "COND EXPR: %s", lw_expr_print(e));
+	debug_message(as, 250, "COND EXPR: %s", lw_expr_print_ctx(as -> exprctx, e));
 /*	lwasm_reduce_expr(as, e);
-	debug_message(as, 250, "COND EXPR: %s", lw_expr_print(e));
+	debug_message(as, 250, "COND EXPR: %s", lw_expr_print_ctx(as -> exprctx, e));
 	lwasm_reduce_expr(as, e);
-	debug_message(as, 250, "COND EXPR: %s", lw_expr_print(e));
+	debug_message(as, 250, "COND EXPR: %s", lw_expr_print_ctx(as -> exprctx, e));
 	lwasm_reduce_expr(as, e);
-	debug_message(as, 250, "COND EXPR: %s", lw_expr_print(e));
+	debug_message(as, 250, "COND EXPR: %s", lw_expr_print_ctx(as -> exprctx, e));
 */
 
 	lwasm_save_expr(as -> cl, 4242, e);
@@ -1428,9 +1428,9 @@ void lwasm_reduce_line_exprs(line_t *cl)
 	// simplify each expression
 	for (i = 0, le = cl -> exprs; le; le = le -> next, i++)
 	{
-		debug_message(as, 101, "Reduce expressions: (pre) exp[%d] = %s", i, lw_expr_print(le -> expr));
+		debug_message(as, 101, "Reduce expressions: (pre) exp[%d] = %s", i, lw_expr_print_ctx(as -> exprctx, le -> expr));
 		lwasm_reduce_expr(as, le -> expr);
-		debug_message(as, 100, "Reduce expressions: exp[%d] = %s", i, lw_expr_print(le -> expr));
+		debug_message(as, 100, "Reduce expressions: exp[%d] = %s", i, lw_expr_print_ctx(as -> exprctx, le -> expr));
 	}
 			
 	if (cl -> len == -1 || cl -> dlen == -1)
@@ -1451,6 +1451,6 @@ void lwasm_reduce_line_exprs(line_t *cl)
 	}
 	debug_message(as, 100, "Reduce expressions: len = %d", cl -> len);
 	debug_message(as, 100, "Reduce expressions: dlen = %d", cl -> dlen);
-	debug_message(as, 100, "Reduce expressions: addr = %s", lw_expr_print(cl -> addr));
-	debug_message(as, 100, "Reduce expressions: daddr = %s", lw_expr_print(cl -> daddr));
+	debug_message(as, 100, "Reduce expressions: addr = %s", lw_expr_print_ctx(as -> exprctx, cl -> addr));
+	debug_message(as, 100, "Reduce expressions: daddr = %s", lw_expr_print_ctx(as -> exprctx, cl -> daddr));
 }
@@ -29,6 +29,7 @@ this program. If not, see <http://www.gnu.org/licenses/>.
 #include <lw_expr.h>
 #include <lw_stringlist.h>
 #include <lw_stack.h>
+#include <lw_sha1.h>
 
 #include <version.h>
 
@@ -66,6 +67,13 @@ enum lwasm_output_e
 	OUTPUT_LWMOD        // special module format for LW
 };
 
+enum lwasm_depend_e
+{
+	DEPEND_LIST = 0,	// one dependency per line
+	DEPEND_MAKE,		// make rule with phony targets for included files
+	DEPEND_NINJA		// single make style rule as read by ninja
+};
+
 enum lwasm_flags_e
 {
 	FLAG_NONE = 0,
@@ -79,7 +87,10 @@ enum lwasm_flags_e
 	FLAG_NOOUT					= 1 << 7,
 	FLAG_SYMDUMP				= 1 << 8,
 	FLAG_AUDIT					= 1 << 9,
-	FLAG_CMT					= 1 << 10
+	FLAG_CMT					= 1 << 10,
+	FLAG_STATS					= 1 << 11,
+	FLAG_CACHESTATS				= 1 << 12,
+	FLAG_SNAPSHOT				= 1 << 13
 };
 
 enum lwasm_pragmas_e
@@ -378,6 +389,27 @@ struct structtab_s
 	line_t *definedat;					// line where structure is defined
 };
 
+// timing for one stage of the assembly
+typedef struct
+{
+	const char *name;					// name of the pass
+	double wall;						// elapsed wall clock seconds
+	double cpu;							// elapsed cpu seconds
+} lwasm_stats_pass_t;
+
+typedef struct
+{
+	lwasm_stats_pass_t *passes;			// timings of stages completed so far
+	int npasses;						// number of entries in passes
+	double wall0;						// start time of the current stage
+	double cpu0;						// start cpu time of the current stage
+	int macros;							// number of macro expansions
+	int *pass3unres;					// unresolved lines at the start of each pass 3 round
+	int pass3rounds;					// number of pass 3 rounds
+	int *pass4unres;					// unresolved lines at the start of each pass 4 round
+	int pass4rounds;					// number of pass 4 rounds
+} lwasm_stats_t;
+
 struct asmstate_s
 {
 	int output_format;					// output format
@@ -441,9 +473,48 @@ struct asmstate_s
 	int fileerr;						// flags error opening file
 	int exprwidth;						// the bit width of the expression being evaluated
 	int listnofile;						// nonzero to suppress printing file name in listings
+	int list_jobs;						// number of parallel jobs for rendering the listing
+	int depend_format;					// format of the dependency list (DEPEND_*)
+	char *depend_target;				// target name for make/ninja dependency rules
+	char *depend_file;					// file to write the dependency list to
+	char *stats_file;					// name of file to write statistics to
+	int stats_json;						// nonzero to write statistics as JSON
+	lwasm_stats_t *stats;				// statistics being collected (NULL if not)
+	lw_expr_ctx_t exprctx;				// expression parser/simplifier context
+	FILE *errfile;						// FILE * to output diagnostics to
+	struct ifl *ifl_head;				// list of files opened during assembly
+	char *batch_file;					// manifest of jobs to assemble (--batch)
+	int batch_jobs;						// number of batch jobs to run concurrently
+	char *server_socket;				// socket to listen on (--server)
+	struct filecache_s *filecache;		// cache of input file contents (--server)
+	char *cache_dir;					// assembly result cache directory (--cache)
+	long cache_max;						// size limit for the result cache
+	lw_sha1_t cmdhash;					// hash of the command line, for the cache key
+	char *snapshot_file;				// include snapshot to use (--use-snapshot)
+	int snapshot_done;					// set once the snapshot has been tried
 };
 
 struct symtabe *register_symbol(asmstate_t *as, line_t *cl, char *sym, lw_expr_t value, int flags);
+
+void lwasm_init_state(asmstate_t *as);
+int lwasm_parse_cmdline(asmstate_t *as, int argc, char **argv);
+int lwasm_assemble(asmstate_t *as);
+int do_batch(asmstate_t *as, int argc, char **argv);
+void batch_init(void);
+int batch_assemble(asmstate_t *as);
+void batch_free_state(asmstate_t *as);
+int do_server(asmstate_t *as, int argc, char **argv);
+int do_client(const char *sock, int argc, char **argv);
+FILE *filecache_fopen(struct filecache_s *fc, const char *fn);
+int cache_lookup(asmstate_t *as);
+void cache_store(asmstate_t *as);
+int do_cache_stats(asmstate_t *as);
+int do_snapshot(asmstate_t *as);
+int snapshot_include(asmstate_t *as, line_t *l, char *fn);
+
+void stats_begin(asmstate_t *as);
+void stats_end(asmstate_t *as, const char *name);
+void stats_round(asmstate_t *as, int pass, int unresolved);
 struct symtabe *lookup_symbol(asmstate_t *as, line_t *cl, char *sym);
 
 int parse_pragma_helper(char *p);
@@ -322,6 +322,8 @@ int expand_macro(asmstate_t *as, line_t *l, char **p, char *opc)
 	
 	// push the macro into the front of the stream
 	input_openstring(as, opc, linebuff);
+	if (as -> stats)
+		as -> stats -> macros++;
 	lw_free(linebuff);
 
 	// clean up
@@ -19,6 +19,7 @@ You should have received a copy of the GNU General Public License along with
 this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -47,6 +48,7 @@ static struct lw_cmdline_options options[] =
 	{ "format",		'f',	"TYPE",		0,							"Select output format: decb, basic, raw, obj, os9, ihex, srec"},
 	{ "list",		'l',	"FILE",		lw_cmdline_opt_optional,	"Generate list [to FILE]"},
 	{ "list-nofiles", 0x104, 0,			0,							"Omit file names in list output"},
+	{ "list-jobs",	0x109,	"N",		0,							"Render the listing using N parallel jobs"},
 	{ "symbols",	's',	0,			lw_cmdline_opt_optional,	"Generate symbol list in listing, no effect without --list"},
 	{ "symbols-nolocals", 0x103,	0,	lw_cmdline_opt_optional,	"Same as --symbols but with local labels ignored"},
 	{ "symbol-dump", 0x106, "FILE",		lw_cmdline_opt_optional,	"Dump global symbol table in assembly format" },
@@ -58,8 +60,22 @@ static struct lw_cmdline_options options[] =
 	{ "decb",		'b',	0,			0,							"Generate DECB .bin format output, equivalent of --format=decb"},
 	{ "raw",		'r',	0,			0,							"Generate raw binary format output, equivalent of --format=raw"},
 	{ "obj",		0x100,	0,			0,							"Generate proprietary object file format for later linking, equivalent of --format=obj" },
-	{ "depend",		0x101,	0,			0,							"Output a dependency list to stdout; do not do any actual output though assembly is completed as usual" },
-	{ "dependnoerr", 0x102,	0,			0,							"Output a dependency list to stdout; do not do any actual output though assembly is completed as usual; don't bail on missing include files" },
+	{ "depend",		0x101,	0,			0,							"Output a dependency list to stdout; only conditionals and includes are processed, nothing is assembled, and files from both branches of a conditional that cannot be decided this way are listed" },
+	{ "dependnoerr", 0x102,	0,			0,							"Same as --depend but don't bail on missing include files" },
+	{ "depend-format", 0x10A, "TYPE",	0,							"Select dependency list format: list (default), make, ninja" },
+	{ "depend-target", 0x10B, "TARGET",	0,							"Use TARGET as the target of make/ninja dependency rules (default is the output file)" },
+	{ "depend-file", 0x10C,	"FILE",		0,							"Write the dependency list to FILE instead of stdout" },
+	{ "stats",		0x10D,	"FILE",		lw_cmdline_opt_optional,	"Report pass timings and assembler statistics [to FILE]" },
+	{ "stats-format", 0x10E, "TYPE",	0,							"Select statistics format: text (default), json" },
+	{ "batch",		0x10F,	"FILE",		0,							"Assemble each job listed in FILE; other options apply to every job" },
+	{ "batch-jobs",	0x110,	"N",		0,							"Run N batch jobs concurrently (default is the number of CPUs)" },
+	{ "server",		0x111,	"SOCKET",	0,							"Run as a server assembling requests sent to SOCKET" },
+	{ "connect",	0x112,	"SOCKET",	0,							"Have the server on SOCKET do the assembly; must be given as --connect=SOCKET" },
+	{ "cache",		0x113,	"DIR",		0,							"Reuse results of identical earlier assemblies kept in DIR" },
+	{ "cache-max",	0x114,	"SIZE",		0,							"Limit the result cache to SIZE bytes (K, M or G suffix allowed; default 256M)" },
+	{ "cache-stats",	0x115,	0,			0,							"Show result cache statistics and exit" },
+	{ "snapshot",	0x116,	0,			0,							"Write the symbols, macros, structures and pragmas defined by the input to the output file as an include snapshot" },
+	{ "use-snapshot",	0x117,	"FILE",		0,							"Load the snapshot in FILE in place of the include it was made from" },
 	{ "pragma",		'p',	"PRAGMA",	0,							"Set an assembler pragma to any value understood by the \"pragma\" pseudo op"},
 	{ "6809",		'9',	0,			0,							"Set assembler to 6809 only mode" },
 	{ "6309",		'3',	0,			0,							"Set assembler to 6309 mode (default)" },
@@ -73,10 +89,25 @@ static struct lw_cmdline_options options[] =
 };
 
 
+/*
+add an option to the hash the result cache is keyed on; the cache, batch
+and server settings don't affect the result, and neither do the names of
+the listing, map and symbol dump files
+*/
+static void hash_opt(asmstate_t *as, int key, char *arg)
+{
+	if (key >= 0x10F && key <= 0x115)
+		return;
+	lw_sha1_update(&(as -> cmdhash), &key, sizeof(key));
+	if (arg && key != 'l' && key != 'm' && key != 0x106)
+		lw_sha1_update(&(as -> cmdhash), arg, strlen(arg) + 1);
+}
+
 static int parse_opts(int key, char *arg, void *state)
 {
 	asmstate_t *as = state;
 
+	hash_opt(as, key, arg);
 	switch (key)
 	{
 	case 'I':
@@ -127,7 +158,7 @@ static int parse_opts(int key, char *arg, void *state)
 
 	case 'd':
 #ifdef LWASM_NODEBUG
-		fprintf(stderr, "This binary has been built without debugging message support\n");
+		fprintf(as -> errfile, "This binary has been built without debugging message support\n");
 #else
 		if (!arg)
 			as -> debug_level = 50;
@@ -208,6 +239,10 @@ static int parse_opts(int key, char *arg, void *state)
 		as -> listnofile = 1;
 		break;
 
+	case 0x109:
+		as -> list_jobs = atoi(arg);
+		break;
+
 	case 'b':
 		as -> output_format = OUTPUT_DECB;
 		break;
@@ -227,6 +262,114 @@ static int parse_opts(int key, char *arg, void *state)
 	case 0x102:
 		as -> flags |= FLAG_DEPEND | FLAG_DEPENDNOERR;
 		break;
+
+	case 0x10A:
+		if (!strcasecmp(arg, "list"))
+			as -> depend_format = DEPEND_LIST;
+		else if (!strcasecmp(arg, "make"))
+			as -> depend_format = DEPEND_MAKE;
+		else if (!strcasecmp(arg, "ninja"))
+			as -> depend_format = DEPEND_NINJA;
+		else
+		{
+			fprintf(as -> errfile, "Invalid dependency format: %s\n", arg);
+			return EINVAL;
+		}
+		break;
+
+	case 0x10B:
+		if (as -> depend_target)
+			lw_free(as -> depend_target);
+		as -> depend_target = lw_strdup(arg);
+		break;
+
+	case 0x10C:
+		if (as -> depend_file)
+			lw_free(as -> depend_file);
+		as -> depend_file = lw_strdup(arg);
+		break;
+
+	case 0x10D:
+		if (as -> stats_file)
+			lw_free(as -> stats_file);
+		if (!arg)
+			as -> stats_file = lw_strdup("-");
+		else
+			as -> stats_file = lw_strdup(arg);
+		as -> flags |= FLAG_STATS;
+		break;
+
+	case 0x10E:
+		if (!strcasecmp(arg, "text"))
+			as -> stats_json = 0;
+		else if (!strcasecmp(arg, "json"))
+			as -> stats_json = 1;
+		else
+		{
+			fprintf(as -> errfile, "Invalid statistics format: %s\n", arg);
+			return EINVAL;
+		}
+		break;
+
+	case 0x10F:
+		if (as -> batch_file)
+			lw_free(as -> batch_file);
+		as -> batch_file = lw_strdup(arg);
+		break;
+
+	case 0x110:
+		as -> batch_jobs = atoi(arg);
+		break;
+
+	case 0x111:
+		if (as -> server_socket)
+			lw_free(as -> server_socket);
+		as -> server_socket = lw_strdup(arg);
+		break;
+
+	case 0x112:
+		// main() removes --connect=SOCKET before the command line is parsed
+		fprintf(as -> errfile, "--connect must be given as --connect=SOCKET\n");
+		return EINVAL;
+
+	case 0x113:
+		if (as -> cache_dir)
+			lw_free(as -> cache_dir);
+		as -> cache_dir = lw_strdup(arg);
+		break;
+
+	case 0x114:
+		{
+			char *e;
+			
+			as -> cache_max = strtol(arg, &e, 10);
+			if (*e == 'k' || *e == 'K')
+				as -> cache_max *= 1024L;
+			else if (*e == 'm' || *e == 'M')
+				as -> cache_max *= 1024L * 1024;
+			else if (*e == 'g' || *e == 'G')
+				as -> cache_max *= 1024L * 1024 * 1024;
+			if (as -> cache_max <= 0)
+			{
+				fprintf(as -> errfile, "Invalid cache size: %s\n", arg);
+				return EINVAL;
+			}
+		}
+		break;
+
+	case 0x115:
+		as -> flags |= FLAG_CACHESTATS;
+		break;
+
+	case 0x116:
+		as -> flags |= FLAG_SNAPSHOT;
+		break;
+
+	case 0x117:
+		if (as -> snapshot_file)
+			lw_free(as -> snapshot_file);
+		as -> snapshot_file = lw_strdup(arg);
+		break;
 	
 	case 0x142:
 		as -> flags |= FLAG_UNICORNS;
@@ -260,16 +403,16 @@ static int parse_opts(int key, char *arg, void *state)
 		}
 		else
 		{
-			fprintf(stderr, "Invalid output format: %s\n", arg);
-			exit(1);
+			fprintf(as -> errfile, "Invalid output format: %s\n", arg);
+			return EINVAL;
 		}
 		break;
 		
 	case 'p':
 		if (parse_pragma_string(as, arg, 0) == 0)
 		{
-			fprintf(stderr, "Unrecognized pragma string: %s\n", arg);
-			exit(1);
+			fprintf(as -> errfile, "Unrecognized pragma string: %s\n", arg);
+			return EINVAL;
 		}
 		break;
 
@@ -328,6 +471,9 @@ void do_list(asmstate_t *as);
 void do_map(asmstate_t *as);
 void do_audit(asmstate_t *as);
 void do_cmt(asmstate_t *as);
+void do_depend(asmstate_t *as);
+void stats_init(asmstate_t *as);
+void do_stats(asmstate_t *as);
 lw_expr_t lwasm_evaluate_special(int t, void *ptr, void *priv);
 lw_expr_t lwasm_evaluate_var(char *var, void *priv);
 lw_expr_t lwasm_parse_term(char **p, void *priv);
@@ -337,9 +483,8 @@ struct passlist_s
 {
 	char *passname;
 	void (*fn)(asmstate_t *as);
-	int fordep;
 } passlist[] = {
-	{ "parse", do_pass1, 1 },
+	{ "parse", do_pass1 },
 	{ "symcheck", do_pass2 },
 	{ "resolve1", do_pass3 },
 	{ "resolve2", do_pass4 },
@@ -350,105 +495,164 @@ struct passlist_s
 };
 
 
-int main(int argc, char **argv)
+/* set up a fresh assembler state with the default settings */
+void lwasm_init_state(asmstate_t *as)
 {
-	int passnum;
+	memset(as, 0, sizeof(asmstate_t));
+	as -> exprctx = lw_expr_ctx_create();
+	lw_expr_ctx_set_special_handler(as -> exprctx, lwasm_evaluate_special);
+	lw_expr_ctx_set_var_handler(as -> exprctx, lwasm_evaluate_var);
+	lw_expr_ctx_set_term_parser(as -> exprctx, lwasm_parse_term);
+	lw_expr_ctx_setdivzero(as -> exprctx, lwasm_dividezero);
+	as -> include_list = lw_stringlist_create();
+	as -> input_files = lw_stringlist_create();
+	as -> nextcontext = 1;
+	as -> exprwidth = 16;
+	as -> tabwidth = 8;
+	as -> errfile = stderr;
+	as -> cache_max = 256L * 1024 * 1024;
+	lw_sha1_init(&(as -> cmdhash));
 
-	/* assembler state */
-	asmstate_t asmstate = { 0 };
-	program_name = argv[0];
+	// enable the "forward reference maximum size" pragma; old available
+	// can be obtained with --pragma=noforwardrefmax
+	as -> pragmas = PRAGMA_FORWARDREFMAX;
+}
 
-	lw_expr_set_special_handler(lwasm_evaluate_special);
-	lw_expr_set_var_handler(lwasm_evaluate_var);
-	lw_expr_set_term_parser(lwasm_parse_term);
-	lw_expr_setdivzero(lwasm_dividezero);
+/* apply command line arguments to an assembler state */
+int lwasm_parse_cmdline(asmstate_t *as, int argc, char **argv)
+{
+	return lw_cmdline_parse(&cmdline_parser, argc, argv, 0, 0, as);
+}
 
-	/* initialize assembler state */
-	asmstate.include_list = lw_stringlist_create();
-	asmstate.input_files = lw_stringlist_create();
-	asmstate.nextcontext = 1;
-	asmstate.exprwidth = 16;
-	asmstate.tabwidth = 8;
+/*
+run the assembler on the state set up by lwasm_init_state() and
+lwasm_parse_cmdline(); returns the exit status for the run
+*/
+int lwasm_assemble(asmstate_t *as)
+{
+	int passnum;
 
-	// enable the "forward reference maximum size" pragma; old available
-	// can be obtained with --pragma=noforwardrefmax
-	asmstate.pragmas = PRAGMA_FORWARDREFMAX;
-	
-	/* parse command line arguments */	
-	if (lw_cmdline_parse(&cmdline_parser, argc, argv, 0, 0, &asmstate) != 0)
+	if (!as -> output_file)
 	{
-		exit(1);
+		as -> output_file = lw_strdup("a.out");
 	}
 
-	if (!asmstate.output_file)
+	if (cache_lookup(as))
+		return 0;
+
+	input_init(as);
+	stats_init(as);
+
+	if (as -> flags & FLAG_DEPEND)
 	{
-		asmstate.output_file = lw_strdup("a.out");
+		// dependency scanning doesn't need any of the assembly passes
+		debug_message(as, 50, "Scanning dependencies");
+		do_depend(as);
+		return as -> errorcount ? 1 : 0;
 	}
 
-	input_init(&asmstate);
-
 	for (passnum = 0; passlist[passnum].fn; passnum++)
 	{
-		if ((asmstate.flags & FLAG_DEPEND) && passlist[passnum].fordep == 0)
-			continue;
-		asmstate.passno = passnum;
-		debug_message(&asmstate, 50, "Doing pass %d (%s)\n", passnum, passlist[passnum].passname);
-		(passlist[passnum].fn)(&asmstate);
-		debug_message(&asmstate, 50, "After pass %d (%s)\n", passnum, passlist[passnum].passname);
-		dump_state(&asmstate);
-
-		if (asmstate.preprocess)
+		as -> passno = passnum;
+		debug_message(as, 50, "Doing pass %d (%s)\n", passnum, passlist[passnum].passname);
+		stats_begin(as);
+		(passlist[passnum].fn)(as);
+		stats_end(as, passlist[passnum].passname);
+		debug_message(as, 50, "After pass %d (%s)\n", passnum, passlist[passnum].passname);
+		dump_state(as);
+
+		if (as -> preprocess)
 		{
 			/* we're done if we were preprocessing */
-			exit(0);
+			return 0;
 		}
-		if (asmstate.errorcount > 0)
+		if (as -> errorcount > 0)
 		{
-			if (asmstate.flags & FLAG_DEPEND)
-			{
-				// don't show errors during dependency scanning but
-				// stop processing immediately
-				break;
-			}
-			if (asmstate.flags & FLAG_UNICORNS)
-				lwasm_do_unicorns(&asmstate);
+			if (as -> flags & FLAG_UNICORNS)
+				lwasm_do_unicorns(as);
 			else
-				lwasm_show_errors(&asmstate);
-			exit(1);
+				lwasm_show_errors(as);
+			do_stats(as);
+			return 1;
 		}
 	}
 
-	if (asmstate.flags & FLAG_DEPEND)
-	{
-		// output dependencies (other than "includebin")
-		char *n;
-		
-		while ((n = lw_stack_pop(asmstate.includelist)))
-		{
-			fprintf(stdout, "%s\n", n);
-			lw_free(n);
-		}
-	}	
-	else if ((asmstate.flags & FLAG_NOOUT) == 0)
+	if ((as -> flags & FLAG_NOOUT) == 0)
 	{
-		debug_message(&asmstate, 50, "Doing output");
-		do_output(&asmstate);
+		debug_message(as, 50, "Doing output");
+		stats_begin(as);
+		if (as -> flags & FLAG_SNAPSHOT)
+			do_snapshot(as);
+		else
+			do_output(as);
+		stats_end(as, "output");
 	}
 	
-	debug_message(&asmstate, 50, "Done assembly");
+	debug_message(as, 50, "Done assembly");
 
-	if (asmstate.flags & FLAG_UNICORNS)
+	if (as -> flags & FLAG_UNICORNS)
 	{	
-		debug_message(&asmstate, 50, "Invoking unicorns");
-		lwasm_do_unicorns(&asmstate);
+		debug_message(as, 50, "Invoking unicorns");
+		lwasm_do_unicorns(as);
+	}
+	stats_begin(as);
+	do_symdump(as);
+	do_list(as);
+	do_map(as);
+	do_audit(as);
+	do_cmt(as);
+	stats_end(as, "reports");
+	do_stats(as);
+
+	if (as -> testmode_errorcount > 0 || as -> errorcount > 0)
+		return 1;
+
+	cache_store(as);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	/* assembler state */
+	asmstate_t asmstate;
+	char *sock = NULL;
+	int i, j;
+	program_name = argv[0];
+
+	/* hand the job to a server if asked to; fall back to assembling here */
+	for (i = 1, j = 1; i < argc; i++)
+	{
+		if (!strncmp(argv[i], "--connect=", 10) && !sock)
+			sock = argv[i] + 10;
+		else
+			argv[j++] = argv[i];
+	}
+	if (sock)
+	{
+		argc = j;
+		argv[argc] = NULL;
+		i = do_client(sock, argc, argv);
+		if (i >= 0)
+			exit(i);
+	}
+
+	/* initialize assembler state */
+	lwasm_init_state(&asmstate);
+	
+	/* parse command line arguments */	
+	if (lwasm_parse_cmdline(&asmstate, argc, argv) != 0)
+	{
+		exit(1);
 	}
-	do_symdump(&asmstate);
-	do_list(&asmstate);
-	do_map(&asmstate);
-	do_audit(&asmstate);
-	do_cmt(&asmstate);
 
-	if (asmstate.testmode_errorcount > 0) exit(1);
+	if (asmstate.flags & FLAG_CACHESTATS)
+		exit(do_cache_stats(&asmstate));
+
+	if (asmstate.server_socket)
+		exit(do_server(&asmstate, argc, argv));
+
+	if (asmstate.batch_file)
+		exit(do_batch(&asmstate, argc, argv));
 
-	exit(0);
+	exit(lwasm_assemble(&asmstate));
 }
@@ -19,8 +19,13 @@ this program. If not, see <http://www.gnu.org/licenses/>.
 
 
 Contains the code for actually outputting the assembled code
+
+The complete output file is built in memory and then written with a single
+write. This means none of the output formats need to seek in the output
+file so output can go to a pipe or to stdout ("-o -").
 */
 #include <errno.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -30,214 +35,355 @@ Contains the code for actually outputting the assembled code
 
 #include <lw_alloc.h>
 #include <lw_expr.h>
+#include <lw_hex.h>
 
 #include "lwasm.h"
 
-void write_code_raw(asmstate_t *as, FILE *of);
-void write_code_decb(asmstate_t *as, FILE *of);
-void write_code_BASIC(asmstate_t *as, FILE *of);
-void write_code_rawrel(asmstate_t *as, FILE *of);
-void write_code_obj(asmstate_t *as, FILE *of);
-void write_code_os9(asmstate_t *as, FILE *of);
-void write_code_hex(asmstate_t *as, FILE *of);
-void write_code_srec(asmstate_t *as, FILE *of);
-void write_code_ihex(asmstate_t *as, FILE *of);
-void write_code_lwmod(asmstate_t *as, FILE *of);
-
-// this prevents warnings about not using the return value of fwrite()
-// r++ prevents the "set but not used" warnings; should be optimized out
-#define writebytes(s, l, c, f)	do { int r; r = fwrite((s), (l), (c), (f)); r++; } while (0)
+/*
+in-memory output file
+*/
+typedef struct
+{
+	unsigned char *buf;					// output bytes
+	int len;							// number of bytes in the buffer
+	int size;							// size of allocated buffer
+} outbuf_t;
+
+/*
+A run is a sequence of output bytes at contiguous addresses. The data for
+all the runs is stored back to back in a single image buffer.
+*/
+typedef struct
+{
+	line_t *line;						// first line contributing to the run
+	int addr;							// load address of the run
+	int offset;							// offset of the run in the image data
+	int len;							// number of bytes in the run
+} outrun_t;
+
+typedef struct
+{
+	unsigned char *data;				// output bytes of all runs
+	int datalen;						// total number of bytes
+	outrun_t *runs;						// list of runs
+	int nruns;							// number of runs
+} outimage_t;
+
+void write_code_raw(asmstate_t *as, outbuf_t *ob);
+void write_code_decb(asmstate_t *as, outbuf_t *ob);
+void write_code_BASIC(asmstate_t *as, outbuf_t *ob);
+void write_code_rawrel(asmstate_t *as, outbuf_t *ob);
+void write_code_obj(asmstate_t *as, outbuf_t *ob);
+void write_code_os9(asmstate_t *as, outbuf_t *ob);
+void write_code_hex(asmstate_t *as, outbuf_t *ob);
+void write_code_srec(asmstate_t *as, outbuf_t *ob);
+void write_code_ihex(asmstate_t *as, outbuf_t *ob);
+void write_code_lwmod(asmstate_t *as, outbuf_t *ob);
+
+static void outbuf_reserve(outbuf_t *ob, int len)
+{
+	if (ob -> len + len <= ob -> size)
+		return;
+	if (ob -> size == 0)
+		ob -> size = 4096;
+	while (ob -> len + len > ob -> size)
+		ob -> size *= 2;
+	ob -> buf = lw_realloc(ob -> buf, ob -> size);
+}
+
+static void outbuf_add(outbuf_t *ob, const void *data, int len)
+{
+	if (len <= 0)
+		return;
+	outbuf_reserve(ob, len);
+	memcpy(ob -> buf + ob -> len, data, len);
+	ob -> len += len;
+}
+
+static void outbuf_fill(outbuf_t *ob, int c, int len)
+{
+	if (len <= 0)
+		return;
+	outbuf_reserve(ob, len);
+	memset(ob -> buf + ob -> len, c, len);
+	ob -> len += len;
+}
+
+// place bytes at an arbitrary offset, zero filling any gap
+static void outbuf_put(outbuf_t *ob, int offset, const void *data, int len)
+{
+	if (offset > ob -> len)
+		outbuf_fill(ob, 0, offset - ob -> len);
+	if (offset + len > ob -> len)
+		outbuf_reserve(ob, offset + len - ob -> len);
+	memcpy(ob -> buf + offset, data, len);
+	if (offset + len > ob -> len)
+		ob -> len = offset + len;
+}
+
+static int outbuf_printf(outbuf_t *ob, const char *fmt, ...)
+{
+	char buf[128];
+	va_list args;
+	int l;
+
+	va_start(args, fmt);
+	l = vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	if (l >= (int)sizeof(buf))
+		l = sizeof(buf) - 1;
+	outbuf_add(ob, buf, l);
+	return l;
+}
+
+/*
+Collect the output of all lines into runs of contiguous addresses. If
+"fillrmb" is set, lines which reserve space without emitting anything
+(RMB, etc.) contribute zero bytes to the image. Those are only used by
+the formats which ignore addresses (raw and os9) so no run splitting
+happens for them.
+*/
+static void outimage_build(asmstate_t *as, outimage_t *oi, int fillrmb)
+{
+	line_t *cl;
+	int size = 0;
+	int rsize = 0;
+	int nextaddr = -1;
+	int caddr;
+	outrun_t *r = NULL;
+
+	oi -> data = NULL;
+	oi -> datalen = 0;
+	oi -> runs = NULL;
+	oi -> nruns = 0;
+
+	// first pass: work out how big the image is
+	for (cl = as -> line_head; cl; cl = cl -> next)
+	{
+		if (cl -> outputl > 0)
+			size += cl -> outputl;
+		else if (fillrmb && cl -> len > 0 && cl -> outputl == 0)
+			size += cl -> len;
+	}
+	if (size > 0)
+		oi -> data = lw_alloc(size);
+
+	// second pass: copy the bytes and split into runs
+	for (cl = as -> line_head; cl; cl = cl -> next)
+	{
+		if (fillrmb && cl -> len > 0 && cl -> outputl == 0)
+		{
+			memset(oi -> data + oi -> datalen, 0, cl -> len);
+			oi -> datalen += cl -> len;
+			if (r)
+				r -> len += cl -> len;
+			continue;
+		}
+		if (cl -> outputl <= 0)
+			continue;
+		caddr = lw_expr_intval(cl -> addr);
+		if (!r || caddr != nextaddr)
+		{
+			if (oi -> nruns >= rsize)
+			{
+				rsize += 64;
+				oi -> runs = lw_realloc(oi -> runs, sizeof(outrun_t) * rsize);
+			}
+			r = &(oi -> runs[oi -> nruns++]);
+			r -> line = cl;
+			r -> addr = caddr;
+			r -> offset = oi -> datalen;
+			r -> len = 0;
+			nextaddr = caddr;
+		}
+		memcpy(oi -> data + oi -> datalen, cl -> output, cl -> outputl);
+		oi -> datalen += cl -> outputl;
+		r -> len += cl -> outputl;
+		nextaddr += cl -> outputl;
+	}
+}
+
+static void outimage_free(outimage_t *oi)
+{
+	lw_free(oi -> data);
+	lw_free(oi -> runs);
+}
 
 void do_output(asmstate_t *as)
 {
 	FILE *of;
-	
+	outbuf_t ob = { 0 };
+
 	if (as -> errorcount > 0)
 	{
-		fprintf(stderr, "Not doing output due to assembly errors.\n");
-		return;
-	}
-	
-	of = fopen(as -> output_file, "wb");
-	if (!of)
-	{
-		fprintf(stderr, "Cannot open '%s' for output", as -> output_file);
-		perror("");
+		fprintf(as -> errfile, "Not doing output due to assembly errors.\n");
 		return;
 	}
 
 	switch (as -> output_format)
 	{
 	case OUTPUT_RAW:
-		write_code_raw(as, of);
+		write_code_raw(as, &ob);
 		break;
-		
+
 	case OUTPUT_DECB:
-		write_code_decb(as, of);
+		write_code_decb(as, &ob);
 		break;
-	
+
 	case OUTPUT_BASIC:
-		write_code_BASIC(as, of);
+		write_code_BASIC(as, &ob);
 		break;
-		
+
 	case OUTPUT_RAWREL:
-		write_code_rawrel(as, of);
+		write_code_rawrel(as, &ob);
 		break;
-	
+
 	case OUTPUT_OBJ:
-		write_code_obj(as, of);
+		write_code_obj(as, &ob);
 		break;
 
 	case OUTPUT_OS9:
-		write_code_os9(as, of);
+		write_code_os9(as, &ob);
 		break;
 
 	case OUTPUT_HEX:
-		write_code_hex(as, of);
+		write_code_hex(as, &ob);
 		break;
-		
+
 	case OUTPUT_SREC:
-		write_code_srec(as, of);
+		write_code_srec(as, &ob);
 		break;
 
 	case OUTPUT_IHEX:
-		write_code_ihex(as, of);
+		write_code_ihex(as, &ob);
 		break;
 
 	case OUTPUT_LWMOD:
-		write_code_lwmod(as, of);
+		write_code_lwmod(as, &ob);
 		break;
 
 	default:
-		fprintf(stderr, "BUG: unrecognized output format when generating output file\n");
-		fclose(of);
-		unlink(as -> output_file);
+		fprintf(as -> errfile, "BUG: unrecognized output format when generating output file\n");
+		lw_free(ob.buf);
 		return;
 	}
 
-	fclose(of);
+	if (strcmp(as -> output_file, "-") == 0)
+	{
+		of = stdout;
+	}
+	else
+	{
+		of = fopen(as -> output_file, "wb");
+		if (!of)
+		{
+			fprintf(as -> errfile, "Cannot open '%s' for output: %s\n", as -> output_file, strerror(errno));
+			as -> errorcount++;
+			lw_free(ob.buf);
+			return;
+		}
+	}
+
+	if (ob.len > 0 && fwrite(ob.buf, ob.len, 1, of) != 1)
+	{
+		fprintf(as -> errfile, "Error writing '%s': %s\n", as -> output_file, strerror(errno));
+		as -> errorcount++;
+		if (of != stdout)
+		{
+			fclose(of);
+			unlink(as -> output_file);
+			of = NULL;
+		}
+	}
+	lw_free(ob.buf);
+
+	// buffered data that can't be written only shows up here
+	if (of && (of == stdout ? fflush(of) : fclose(of)) != 0)
+	{
+		fprintf(as -> errfile, "Error writing '%s': %s\n", as -> output_file, strerror(errno));
+		as -> errorcount++;
+	}
 }
 
-int write_code_BASIC_fprintf(FILE *of, int linelength, int *linenumber, int value)
+int write_code_BASIC_fprintf(outbuf_t *ob, int linelength, int *linenumber, int value)
 {
 	if (linelength > 247)
 	{
-		fprintf(of, "\n");
-		linelength = fprintf(of, "%d DATA ", *linenumber);
+		outbuf_printf(ob, "\n");
+		linelength = outbuf_printf(ob, "%d DATA ", *linenumber);
 		*linenumber += 10;
 	}
 	else
 	{
-		linelength += fprintf(of, ",");
+		linelength += outbuf_printf(ob, ",");
 	}
-	linelength += fprintf(of, "%d", value);
+	linelength += outbuf_printf(ob, "%d", value);
 
 	return linelength;
 }
 
-void write_code_BASIC(asmstate_t *as, FILE *of)
+void write_code_BASIC(asmstate_t *as, outbuf_t *ob)
 {
-	line_t *cl;
-	line_t *startblock = as -> line_head;
-	line_t *endblock;
-	int linenumber, linelength, startaddress, lastaddress, address;
+	outimage_t oi;
+	outrun_t *r;
+	int linenumber, linelength;
 	int outidx;
-	
-	fprintf(of, "10 READ A,B\n");
-	fprintf(of, "20 IF A=-1 THEN 70\n");
-	fprintf(of, "30 FOR C = A TO B\n");
-	fprintf(of, "40 READ D:POKE C,D\n");
-	fprintf(of, "50 NEXT C\n");
-	fprintf(of, "60 GOTO 10\n");
-	
+
+	outbuf_printf(ob, "10 READ A,B\n");
+	outbuf_printf(ob, "20 IF A=-1 THEN 70\n");
+	outbuf_printf(ob, "30 FOR C = A TO B\n");
+	outbuf_printf(ob, "40 READ D:POKE C,D\n");
+	outbuf_printf(ob, "50 NEXT C\n");
+	outbuf_printf(ob, "60 GOTO 10\n");
+
 	if (as -> execaddr == 0)
 	{
-		fprintf(of, "70 END");
+		outbuf_printf(ob, "70 END");
 	}
 	else
 	{
-		fprintf(of, "70 EXEC %d", as -> execaddr);
+		outbuf_printf(ob, "70 EXEC %d", as -> execaddr);
 	}
-	
+
 	linenumber = 80;
 	linelength = 255;
-	
-	while(startblock)
+
+	outimage_build(as, &oi, 0);
+	for (r = oi.runs; r < oi.runs + oi.nruns; r++)
 	{
-		startaddress = -1;
-		endblock = NULL;
-		
-		for (cl = startblock; cl; cl = cl -> next)
+		linelength = write_code_BASIC_fprintf(ob, linelength, &linenumber, r -> addr);
+		linelength = write_code_BASIC_fprintf(ob, linelength, &linenumber, r -> addr + r -> len - 1);
+		for (outidx = 0; outidx < r -> len; outidx++)
 		{
-			if (cl -> outputl < 0)
-				continue;
-		
-			address = lw_expr_intval(cl -> addr);
-		
-			if (startaddress == -1)
-			{
-				startaddress = address;
-				lastaddress = address + cl -> outputl - 1;
-			}
-			else
-			{
-				if (lastaddress != address - 1)
-				{
-					endblock = cl;
-					break;
-				}
-				
-				lastaddress += cl -> outputl;
-			}
+			linelength = write_code_BASIC_fprintf(ob, linelength, &linenumber, oi.data[r -> offset + outidx]);
 		}
-	
-		if (startaddress != -1)
-		{
-			linelength = write_code_BASIC_fprintf(of, linelength, &linenumber, startaddress);
-			linelength = write_code_BASIC_fprintf(of, linelength, &linenumber, lastaddress);
-	
-			for (cl = startblock; cl != endblock; cl = cl -> next)
-			{
-				if (cl -> outputl < 0)
-					continue;
-		
-				for (outidx=0; outidx<cl -> outputl; outidx++)
-				{
-					linelength = write_code_BASIC_fprintf(of, linelength, &linenumber, cl -> output[outidx]);
-				}
-			}
-		}
-	
-		startblock = cl;
 	}
-	
-	linelength = write_code_BASIC_fprintf(of, linelength, &linenumber, -1);
-	linelength = write_code_BASIC_fprintf(of, linelength, &linenumber, -1);
-	
-	fprintf(of, "\n");
+	outimage_free(&oi);
+
+	linelength = write_code_BASIC_fprintf(ob, linelength, &linenumber, -1);
+	linelength = write_code_BASIC_fprintf(ob, linelength, &linenumber, -1);
+
+	outbuf_printf(ob, "\n");
 }
 
 
 /*
 rawrel output treats an ORG directive as an offset from the start of the
 file. Undefined results will occur if an ORG directive moves the output
-pointer backward. This particular implementation uses "fseek" to handle
-ORG requests and to skip over RMBs.
-
-This simple brain damanged method simply does an fseek before outputting
-each instruction.
+pointer backward. This particular implementation places each instruction
+at its address in the output buffer, zero filling any gaps left by ORG
+requests and RMBs.
 */
-void write_code_rawrel(asmstate_t *as, FILE *of)
+void write_code_rawrel(asmstate_t *as, outbuf_t *ob)
 {
 	line_t *cl;
-	
+
 	for (cl = as -> line_head; cl; cl = cl -> next)
 	{
 		if (cl -> outputl <= 0)
 			continue;
-		
-		fseek(of, lw_expr_intval(cl -> addr), SEEK_SET);
-		writebytes(cl -> output, cl -> outputl, 1, of);
+
+		outbuf_put(ob, lw_expr_intval(cl -> addr), cl -> output, cl -> outputl);
 	}
 }
 
@@ -246,22 +392,13 @@ raw merely writes all the bytes directly to the file as is. ORG is just a
 reference for the assembler to handle absolute references. Multiple ORG
 statements will produce mostly useless results
 */
-void write_code_raw(asmstate_t *as, FILE *of)
+void write_code_raw(asmstate_t *as, outbuf_t *ob)
 {
-	line_t *cl;
-	
-	for (cl = as -> line_head; cl; cl = cl -> next)
-	{
-		if (cl -> len > 0 && cl -> outputl == 0)
-		{
-			int i;
-			for (i = 0; i < cl -> len; i++)
-				writebytes("\0", 1, 1, of);
-			continue;
-		}
-		else if (cl -> outputl > 0)
-			writebytes(cl -> output, cl -> outputl, 1, of);
-	}
+	outimage_t oi;
+
+	outimage_build(as, &oi, 1);
+	outbuf_add(ob, oi.data, oi.datalen);
+	outimage_free(&oi);
 }
 
 
@@ -269,351 +406,232 @@ void write_code_raw(asmstate_t *as, FILE *of)
 OS9 target also just writes all the bytes in order. No need for anything
 else.
 */
-void write_code_os9(asmstate_t *as, FILE *of)
+void write_code_os9(asmstate_t *as, outbuf_t *ob)
 {
-	line_t *cl;
-	
-	for (cl = as -> line_head; cl; cl = cl -> next)
-	{
-//		if (cl -> inmod == 0)
-//			continue;
-		if (cl -> len > 0 && cl -> outputl == 0)
-		{
-			int i;
-			for (i = 0; i < cl -> len; i++)
-				writebytes("\0", 1, 1, of);
-			continue;
-		}
-		else if (cl -> outputl > 0)
-			writebytes(cl -> output, cl -> outputl, 1, of);
-	}
+	outimage_t oi;
+
+	outimage_build(as, &oi, 1);
+	outbuf_add(ob, oi.data, oi.datalen);
+	outimage_free(&oi);
 }
 
-void write_code_decb(asmstate_t *as, FILE *of)
+/*
+DECB output is a sequence of blocks, one per run, each with a 5 byte
+preamble giving the block length and load address, followed by a postamble
+giving the execution address.
+*/
+void write_code_decb(asmstate_t *as, outbuf_t *ob)
 {
-	long preambloc;
-	line_t *cl;
-	int blocklen = -1;
-	int nextcalc = -1;
+	outimage_t oi;
+	outrun_t *r;
 	unsigned char outbuf[5];
-	int caddr;
-	
-	for (cl = as -> line_head; cl; cl = cl -> next)
-	{
-		if (cl -> outputl < 0)
-			continue;
-		caddr = lw_expr_intval(cl -> addr);
-		if (caddr != nextcalc && cl -> outputl > 0)
-		{
-			// need preamble here
-			if (blocklen > 0)
-			{
-				// update previous preamble if needed
-				fseek(of, preambloc, SEEK_SET);
-				outbuf[0] = (blocklen >> 8) & 0xFF;
-				outbuf[1] = blocklen & 0xFF;
-				writebytes(outbuf, 2, 1, of);
-				fseek(of, 0, SEEK_END);
-			}
-			blocklen = 0;
-			nextcalc = caddr;
-			outbuf[0] = 0x00;
-			outbuf[1] = 0x00;
-			outbuf[2] = 0x00;
-			outbuf[3] = (nextcalc >> 8) & 0xFF;
-			outbuf[4] = nextcalc & 0xFF;
-			preambloc = ftell(of) + 1;
-			writebytes(outbuf, 5, 1, of);
-		}
-		nextcalc += cl -> outputl;
-		writebytes(cl -> output, cl -> outputl, 1, of);
-		blocklen += cl -> outputl;
-	}
-	if (blocklen > 0)
+
+	outimage_build(as, &oi, 0);
+	for (r = oi.runs; r < oi.runs + oi.nruns; r++)
 	{
-		fseek(of, preambloc, SEEK_SET);
-		outbuf[0] = (blocklen >> 8) & 0xFF;
-		outbuf[1] = blocklen & 0xFF;
-		writebytes(outbuf, 2, 1, of);
-		fseek(of, 0, SEEK_END);
+		outbuf[0] = 0x00;
+		outbuf[1] = (r -> len >> 8) & 0xFF;
+		outbuf[2] = r -> len & 0xFF;
+		outbuf[3] = (r -> addr >> 8) & 0xFF;
+		outbuf[4] = r -> addr & 0xFF;
+		outbuf_add(ob, outbuf, 5);
+		outbuf_add(ob, oi.data + r -> offset, r -> len);
 	}
-	
+	outimage_free(&oi);
+
 	// now write postamble
 	outbuf[0] = 0xFF;
 	outbuf[1] = 0x00;
 	outbuf[2] = 0x00;
 	outbuf[3] = (as -> execaddr >> 8) & 0xFF;
 	outbuf[4] = (as -> execaddr) & 0xFF;
-	writebytes(outbuf, 5, 1, of);
+	outbuf_add(ob, outbuf, 5);
 }
 
-int fetch_output_byte(line_t *cl, char *value, int *addr)
+
+/*
+Split a run into records of at most "reclen" bytes, breaking records at
+addresses which are a multiple of "reclen". Returns the length of the
+record starting at "i" within run "r".
+*/
+static int output_reclen(outrun_t *r, int i, int reclen)
 {
-	static int outidx = 0;
-	static int lastaddr = -2;
-	
-	// try to read next byte in current line's output field
-	if ((cl -> outputl > 0) && (outidx < cl -> outputl))
-	{
-		*addr = lw_expr_intval(cl -> addr) + outidx;
-		*value = *(cl -> output + outidx++);
-		
-		// this byte follows the previous byte (contiguous, rc = 1)
-		if (*addr == lastaddr + 1)
-		{
-			lastaddr = *addr;
-			return 1;
-		}
-		
-		// this byte does not follow prev byte (disjoint, rc = -1)
-		else 
-		{
-			lastaddr = *addr;
-			return -1;
-		}
-	}
+	int l = 1;
 
-	// no (more) output from this line (rc = 0)
-	else
-	{
-		outidx = 0;
-		return 0;
-	}
+	while (i + l < r -> len && (r -> addr + i + l) % reclen != 0 && l < reclen)
+		l++;
+	return l;
 }
 
-
 /* a simple ASCII hex file format */
 
-void write_code_hex(asmstate_t *as, FILE *of)
+void write_code_hex(asmstate_t *as, outbuf_t *ob)
 {
 	const int RECLEN = 16;
-	
-	line_t *cl;
-	char outbyte;
-	int outaddr;
-	int rc;
-	
-	for (cl = as -> line_head; cl; cl = cl -> next)
-		do
+
+	outimage_t oi;
+	outrun_t *r;
+	char rec[LW_HEX_RECMAX];
+	int i;
+	int recdlen;
+
+	outimage_build(as, &oi, 0);
+	for (r = oi.runs; r < oi.runs + oi.nruns; r++)
+	{
+		// if address jump or xxx0 address, start new line
+		for (i = 0; i < r -> len; i += recdlen)
 		{
-			rc = fetch_output_byte(cl, &outbyte, &outaddr);
-			
-			// if address jump or xxx0 address, start new line
-			if ((rc == -1) || ((rc == 1) && (outaddr % RECLEN == 0)))
-			{
-				fprintf(of, "\r\n%04X:", (unsigned int)(outaddr & 0xffff));
-				fprintf(of, "%02X", (unsigned char)outbyte);
-				rc = -1;
-			}
-			if (rc == 1)
-				fprintf(of, ",%02X", (unsigned char)outbyte);
+			recdlen = output_reclen(r, i, RECLEN);
+			outbuf_add(ob, rec, lw_hex_line(rec, r -> addr + i, oi.data + r -> offset + i, recdlen));
 		}
-		while (rc);
+	}
+	outimage_free(&oi);
 }
 
 
 /* Motorola S19 hex file format */
 
-void write_code_srec(asmstate_t *as, FILE *of)
+void write_code_srec(asmstate_t *as, outbuf_t *ob)
 {
 	#define SRECLEN 16
 	#define HDRLEN 51
-	
-	line_t *cl;
-	char outbyte;
-	int outaddr;
-	int rc;
-	unsigned int i;
-	int recaddr = 0;
-	unsigned int recdlen = 0;
-	unsigned char recdata[SRECLEN];
-	int recsum;
-	int reccnt = -1;
+
+	outimage_t oi;
+	outrun_t *r;
+	char rec[LW_HEX_RECMAX];
+	int i;
+	int recdlen;
+	int reccnt = 0;
 	char rechdr[HDRLEN];
-	
-	for (cl = as -> line_head; cl; cl = cl -> next)
-		do
-		{
-			rc = fetch_output_byte(cl, &outbyte, &outaddr);
-			
-			// if address jump or xxx0 address, start new S1 record
-			if ((rc == -1) || ((rc == 1) && (outaddr % SRECLEN == 0)))
-			{
-				// if not already done so, emit an S0 header record
-				if (reccnt < 0)
-				{
-					// build header from version and filespec
-					// e.g. "[lwtools X.Y] filename.asm"
-					strcpy(rechdr, "[");
-					strcat(rechdr, PACKAGE_STRING);
-					strcat(rechdr, "] ");
-					i = strlen(rechdr);
-					strncat(rechdr, cl -> linespec, HDRLEN - 1 - i);
-					recsum = strlen(rechdr) + 3;
-					fprintf(of, "S0%02X0000", recsum);
-					for (i = 0; i < strlen(rechdr); i++)
-					{
-						fprintf(of, "%02X", (unsigned char)rechdr[i]);
-						recsum += (unsigned char)rechdr[i];
-					}
-					fprintf(of, "%02X\r\n", (unsigned char)(~recsum));
-					reccnt = 0;
-				}
 
-				// flush any current S1 record before starting new one
-				if (recdlen > 0)
-				{
-					recsum = recdlen + 3;
-					fprintf(of, "S1%02X%04X", recdlen + 3, recaddr & 0xffff);
-					for (i = 0; i < recdlen; i++)
-					{
-						fprintf(of, "%02X", (unsigned char)recdata[i]);
-						recsum += (unsigned char)recdata[i];
-					}
-					recsum += (recaddr >> 8) & 0xFF;
-					recsum += recaddr & 0xFF;
-					fprintf(of, "%02X\r\n", (unsigned char)(~recsum));
-					reccnt += 1;
-				}
-				
-				// now start the new S1 record
-				recdlen = 0;
-				recaddr = outaddr;
-				rc = 1;
-			}
+	outimage_build(as, &oi, 0);
+	if (oi.nruns > 0)
+	{
+		// emit an S0 header record built from version and filespec
+		// e.g. "[lwtools X.Y] filename.asm"
+		strcpy(rechdr, "[");
+		strcat(rechdr, PACKAGE_STRING);
+		strcat(rechdr, "] ");
+		i = strlen(rechdr);
+		strncat(rechdr, oi.runs[0].line -> linespec, HDRLEN - 1 - i);
+		outbuf_add(ob, rec, lw_hex_srec(rec, 0, 0, (unsigned char *)rechdr, strlen(rechdr)));
+	}
 
-			// for each new byte read, add to recdata[]
-			if (rc == 1)
-				recdata[recdlen++] = outbyte;
-		}
-		while (rc);
-		
-	// done with all output lines, flush the final S1 record (if any)
-	if (recdlen > 0)
+	for (r = oi.runs; r < oi.runs + oi.nruns; r++)
 	{
-		recsum = recdlen + 3;
-		fprintf(of, "S1%02X%04X", recdlen + 3, recaddr & 0xffff);
-		for (i = 0; i < recdlen; i++)
+		for (i = 0; i < r -> len; i += recdlen)
 		{
-			fprintf(of, "%02X", (unsigned char)recdata[i]);
-			recsum += (unsigned char)recdata[i];
+			recdlen = output_reclen(r, i, SRECLEN);
+			outbuf_add(ob, rec, lw_hex_srec(rec, 1, r -> addr + i, oi.data + r -> offset + i, recdlen));
+			reccnt += 1;
 		}
-		recsum += (recaddr >> 8) & 0xFF;
-		recsum += recaddr & 0xFF;
-		fprintf(of, "%02X\r\n", (unsigned char)(~recsum));
-		reccnt += 1;
 	}
+	outimage_free(&oi);
 
 	// if any S1 records were output, close with S5 and S9 records
 	if (reccnt > 0)
 	{
 		// emit S5 count record
-		recsum = 3;
-		recsum += (reccnt >> 8) & 0xFF;
-		recsum += reccnt & 0xFF;
-		fprintf(of, "S503%04X", (unsigned int)reccnt);
-		fprintf(of, "%02X\r\n", (unsigned char)(~recsum));
-		
+		outbuf_add(ob, rec, lw_hex_srec(rec, 5, reccnt, NULL, 0));
+
 		// emit S9 end-of-file record
-		recsum = 3;
-		recsum += (as -> execaddr >> 8) & 0xFF;
-		recsum += (as -> execaddr) & 0xFF;
-		fprintf(of, "S903%04X", as -> execaddr & 0xffff);
-		fprintf(of, "%02X\r\n", (unsigned char)(~recsum));
+		outbuf_add(ob, rec, lw_hex_srec(rec, 9, as -> execaddr, NULL, 0));
 	}
 }
 
 
 /* Intel hex file format */
 
-void write_code_ihex(asmstate_t *as, FILE *of)
+void write_code_ihex(asmstate_t *as, outbuf_t *ob)
 {
 	#define IRECLEN 16
-	
-	line_t *cl;
-	char outbyte;
-	int outaddr;
-	int rc;
+
+	outimage_t oi;
+	outrun_t *r;
+	char rec[LW_HEX_RECMAX];
 	int i;
-	int recaddr = 0;
-	int recdlen = 0;
-	unsigned char recdata[IRECLEN];
-	int recsum;
+	int recdlen;
 	int reccnt = 0;
-	
-	for (cl = as -> line_head; cl; cl = cl -> next)
-		do
-		{
-			rc = fetch_output_byte(cl, &outbyte, &outaddr);
-			
-			// if address jump or xxx0 address, start new ihx record
-			if ((rc == -1) || ((rc == 1) && (outaddr % IRECLEN == 0)))
-			{
-				// flush any current ihex record before starting new one
-				if (recdlen > 0)
-				{
-					recsum = recdlen;
-					fprintf(of, ":%02X%04X00", recdlen, recaddr & 0xffff);
-					for (i = 0; i < recdlen; i++)
-					{
-						fprintf(of, "%02X", (unsigned char)recdata[i]);
-						recsum += (unsigned char)recdata[i];
-					}
-					recsum += (recaddr >> 8) & 0xFF;
-					recsum += recaddr & 0xFF;
-					fprintf(of, "%02X\r\n", (unsigned char)(256 - recsum));
-					reccnt += 1;
-				}
-				
-				// now start the new ihex record
-				recdlen = 0;
-				recaddr = outaddr;
-				rc = 1;
-			}
 
-			// for each new byte read, add to recdata[]
-			if (rc == 1)
-				recdata[recdlen++] = outbyte;
-		}
-		while (rc);
-		
-	// done with all output lines, flush the final ihex record (if any)
-	if (recdlen > 0)
+	outimage_build(as, &oi, 0);
+	for (r = oi.runs; r < oi.runs + oi.nruns; r++)
 	{
-		recsum = recdlen;
-		fprintf(of, ":%02X%04X00", recdlen, recaddr & 0xffff);
-		for (i = 0; i < recdlen; i++)
+		for (i = 0; i < r -> len; i += recdlen)
 		{
-			fprintf(of, "%02X", (unsigned char)recdata[i]);
-			recsum += (unsigned char)recdata[i];
+			recdlen = output_reclen(r, i, IRECLEN);
+			outbuf_add(ob, rec, lw_hex_ihex(rec, 0, r -> addr + i, oi.data + r -> offset + i, recdlen));
+			reccnt += 1;
 		}
-		recsum += (recaddr >> 8) & 0xFF;
-		recsum += recaddr & 0xFF;
-		fprintf(of, "%02X\r\n", (unsigned char)(256 - recsum));
-		reccnt += 1;
 	}
+	outimage_free(&oi);
 
 	// if any ihex records were output, close with a "01" record
 	if (reccnt > 0)
 	{
-		fprintf(of, ":00%04X01FF", as -> execaddr & 0xffff);
+		outbuf_printf(ob, ":00%04X01FF", as -> execaddr & 0xffff);
 	}
 }
 	    
 	    
-void write_code_obj_sbadd(sectiontab_t *s, unsigned char b)
+/*
+Build the byte streams for each section. All line lengths are resolved by
+the time output happens so the size of each section is known up front.
+Each section buffer is allocated once and the line output copied into
+place. Space reserved without any output (RMB, etc.) is simply left as
+zeros. BSS sections only need their length so no buffer is created for
+them.
+*/
+void write_code_obj_sections(asmstate_t *as)
 {
-	if (s -> oblen >= s -> obsize)
+	line_t *l;
+	sectiontab_t *s;
+	int len;
+	
+	for (s = as -> sections; s; s = s -> next)
+		s -> oblen = 0;
+	
+	for (l = as -> line_head; l; l = l -> next)
+	{
+		if (!(l -> csect))
+			continue;
+		if (l -> outputl > 0)
+			l -> csect -> oblen += l -> outputl;
+		else if ((l -> outputl == 0 || l -> outputl == -1) && l -> len > 0)
+			l -> csect -> oblen += l -> len;
+	}
+	
+	for (s = as -> sections; s; s = s -> next)
 	{
-		s -> obytes = lw_realloc(s -> obytes, s -> obsize + 128);
-		s -> obsize += 128;
+		s -> obsize = s -> oblen;
+		if ((s -> flags & section_flag_bss) || s -> oblen == 0)
+			continue;
+		s -> obytes = lw_realloc(s -> obytes, s -> obsize);
+		memset(s -> obytes, 0, s -> obsize);
+		// reset so it can be used as the fill position below
+		s -> oblen = 0;
+	}
+	
+	for (l = as -> line_head; l; l = l -> next)
+	{
+		if (!(l -> csect))
+			continue;
+		s = l -> csect;
+		if (l -> outputl > 0)
+			len = l -> outputl;
+		else if (l -> outputl == 0 || l -> outputl == -1)
+			len = l -> len;
+		else
+			len = 0;
+		if (len <= 0 || (s -> flags & section_flag_bss))
+			continue;
+		if (l -> outputl > 0)
+			memcpy(s -> obytes + s -> oblen, l -> output, len);
+		s -> oblen += len;
 	}
-	s -> obytes[s -> oblen] = b;
-	s -> oblen += 1;
 }
 
 
-int write_code_obj_expraux(lw_expr_t e, void *of)
+int write_code_obj_expraux(lw_expr_t e, void *ob)
 {
 	int tt;
 	int v;
@@ -687,7 +705,7 @@ int write_code_obj_expraux(lw_expr_t e, void *of)
 			buf[1] = 0xff;
 		}
 		while (count--)
-			writebytes(buf, 2, 1, of);
+			outbuf_add(ob, buf, 2);
 		return 0;
 
 	case lw_expr_type_int:
@@ -695,7 +713,7 @@ int write_code_obj_expraux(lw_expr_t e, void *of)
 		buf[0] = 0x01;
 		buf[1] = (v >> 8) & 0xff;
 		buf[2] = v & 0xff;
-		writebytes(buf, 3, 1, of);
+		outbuf_add(ob, buf, 3);
 		return 0;
 		
 	case lw_expr_type_special:
@@ -708,8 +726,8 @@ int write_code_obj_expraux(lw_expr_t e, void *of)
 				sectiontab_t *se;
 				se = lw_expr_specptr(e);
 				
-				writebytes("\x03\x02", 2, 1, of);
-				writebytes(se -> name, strlen(se -> name) + 1, 1, of);
+				outbuf_add(ob, "\x03\x02", 2);
+				outbuf_add(ob, se -> name, strlen(se -> name) + 1);
 				return 0;
 			}	
 		case lwasm_expr_import:
@@ -717,8 +735,8 @@ int write_code_obj_expraux(lw_expr_t e, void *of)
 				importlist_t *ie;
 				ie = lw_expr_specptr(e);
 				buf[0] = 0x02;
-				writebytes(buf, 1, 1, of);
-				writebytes(ie -> symbol, strlen(ie -> symbol) + 1, 1, of);
+				outbuf_add(ob, buf, 1);
+				outbuf_add(ob, ie -> symbol, strlen(ie -> symbol) + 1);
 				return 0;
 			}
 		case lwasm_expr_syment:
@@ -726,14 +744,14 @@ int write_code_obj_expraux(lw_expr_t e, void *of)
 				struct symtabe *se;
 				se = lw_expr_specptr(e);
 				buf[0] = 0x03;
-				writebytes(buf, 1, 1, of);
-				writebytes(se -> symbol, strlen(se -> symbol), 1, of);
+				outbuf_add(ob, buf, 1);
+				outbuf_add(ob, se -> symbol, strlen(se -> symbol));
 				if (se -> context != -1)
 				{
 					sprintf((char *)buf, "\x01%d", se -> context);
-					writebytes(buf, strlen((char *)buf), 1, of);
+					outbuf_add(ob, buf, strlen((char *)buf));
 				}
-				writebytes("", 1, 1, of);
+				outbuf_add(ob, "", 1);
 				return 0;
 			}
 		}
@@ -744,20 +762,20 @@ int write_code_obj_expraux(lw_expr_t e, void *of)
 		buf[0] = 0x01;
 		buf[1] = 0x00;
 		buf[2] = 0x00;
-		writebytes(buf, 3, 1, of);
+		outbuf_add(ob, buf, 3);
 		break;
 	}
 	return 0;
 }
 
-void write_code_obj_auxsym(asmstate_t *as, FILE *of, sectiontab_t *s, struct symtabe *se2)
+void write_code_obj_auxsym(asmstate_t *as, outbuf_t *ob, sectiontab_t *s, struct symtabe *se2)
 {
 	struct symtabe *se;
 	unsigned char buf[16];
 		
 	if (!se2)
 		return;
-	write_code_obj_auxsym(as, of, s, se2 -> left);
+	write_code_obj_auxsym(as, ob, s, se2 -> left);
 	
 	for (se = se2; se; se = se -> nextver)
 	{
@@ -777,13 +795,13 @@ void write_code_obj_auxsym(asmstate_t *as, FILE *of, sectiontab_t *s, struct sym
 		debug_message(as, 200, "  Not symbol_flag_set");
 			
 		te = lw_expr_copy(se -> value);
-		debug_message(as, 200, "  Value=%s", lw_expr_print(te));
+		debug_message(as, 200, "  Value=%s", lw_expr_print_ctx(as -> exprctx, te));
 		as -> exportcheck = 1;
 		as -> csect = s;
 		lwasm_reduce_expr(as, te);
 		as -> exportcheck = 0;
 
-		debug_message(as, 200, "  Value2=%s", lw_expr_print(te));
+		debug_message(as, 200, "  Value2=%s", lw_expr_print_ctx(as -> exprctx, te));
 			
 		// don't output non-constant symbols
 		if (!lw_expr_istype(te, lw_expr_type_int))
@@ -792,38 +810,36 @@ void write_code_obj_auxsym(asmstate_t *as, FILE *of, sectiontab_t *s, struct sym
 			continue;
 		}
 
-		writebytes(se -> symbol, strlen(se -> symbol), 1, of);
+		outbuf_add(ob, se -> symbol, strlen(se -> symbol));
 		if (se -> context >= 0)
 		{
-			writebytes("\x01", 1, 1, of);
+			outbuf_add(ob, "\x01", 1);
 			sprintf((char *)buf, "%d", se -> context);
-			writebytes(buf, strlen((char *)buf), 1, of);
+			outbuf_add(ob, buf, strlen((char *)buf));
 		}
 		// the "" is NOT an error
-		writebytes("", 1, 1, of);
+		outbuf_add(ob, "", 1);
 			
 		// write the address
 		buf[0] = (lw_expr_intval(te) >> 8) & 0xff;
 		buf[1] = lw_expr_intval(te) & 0xff;
-		writebytes(buf, 2, 1, of);
+		outbuf_add(ob, buf, 2);
 		lw_expr_destroy(te);
 	}
-	write_code_obj_auxsym(as, of, s, se2 -> right);
+	write_code_obj_auxsym(as, ob, s, se2 -> right);
 }
 
-void write_code_obj(asmstate_t *as, FILE *of)
+void write_code_obj(asmstate_t *as, outbuf_t *ob)
 {
-	line_t *l;
 	sectiontab_t *s;
 	reloctab_t *re;
 	exportlist_t *ex;
 
-	int i;
 	unsigned char buf[16];
 
 	// output the magic number and file header
 	// the 8 is NOT an error
-	writebytes("LWOBJ16", 8, 1, of);
+	outbuf_add(ob, "LWOBJ16", 8);
 	
 	// run through the entire system and build the byte streams for each
 	// section; at the same time, generate a list of "local" symbols to
@@ -846,49 +862,37 @@ void write_code_obj(asmstate_t *as, FILE *of)
 	// as continuations of previous sections so we would need to collect
 	// them together anyway.
 	
-	for (l = as -> line_head; l; l = l -> next)
-	{
-		if (l -> csect)
-		{
-			// we're in a section - need to output some bytes
-			if (l -> outputl > 0)
-				for (i = 0; i < l -> outputl; i++)
-					write_code_obj_sbadd(l -> csect, l -> output[i]);
-			else if (l -> outputl == 0 || l -> outputl == -1)
-				for (i = 0; i < l -> len; i++)
-					write_code_obj_sbadd(l -> csect, 0);
-		}
-	}
+	write_code_obj_sections(as);
 	
 	// run through the sections
 	for (s = as -> sections; s; s = s -> next)
 	{
 		// write the name
-		writebytes(s -> name, strlen(s -> name) + 1, 1, of);
+		outbuf_add(ob, s -> name, strlen(s -> name) + 1);
 		
 		// write the flags
 		if (s -> flags & section_flag_bss)
-			writebytes("\x01", 1, 1, of);
+			outbuf_add(ob, "\x01", 1);
 		if (s -> flags & section_flag_constant)
-			writebytes("\x02", 1, 1, of);
+			outbuf_add(ob, "\x02", 1);
 			
 		// indicate end of flags - the "" is NOT an error
-		writebytes("", 1, 1, of);
+		outbuf_add(ob, "", 1);
 		
 		// now the local symbols
 		
 		// a symbol for section base address
 		if ((s -> flags & section_flag_constant) == 0)
 		{
-			writebytes("\x02", 1, 1, of);
-			writebytes(s -> name, strlen(s -> name) + 1, 1, of);
+			outbuf_add(ob, "\x02", 1);
+			outbuf_add(ob, s -> name, strlen(s -> name) + 1);
 			// address 0; "\0" is not an error
-			writebytes("\0", 2, 1, of);
+			outbuf_add(ob, "\0", 2);
 		}
 		
-		write_code_obj_auxsym(as, of, s, as -> symtab.head);
+		write_code_obj_auxsym(as, ob, s, as -> symtab.head);
 		// flag end of local symbol table - "" is NOT an error
-		writebytes("", 1, 1, of);
+		outbuf_add(ob, "", 1);
 		
 		// now the exports -- FIXME
 		for (ex = as -> exportlist; ex; ex = ex -> next)
@@ -916,14 +920,14 @@ void write_code_obj(asmstate_t *as, FILE *of)
 			}
 			eval = lw_expr_intval(te);
 			lw_expr_destroy(te);
-			writebytes(ex -> symbol, strlen(ex -> symbol) + 1, 1, of);
+			outbuf_add(ob, ex -> symbol, strlen(ex -> symbol) + 1);
 			buf[0] = (eval >> 8) & 0xff;
 			buf[1] = eval & 0xff;
-			writebytes(buf, 2, 1, of);
+			outbuf_add(ob, buf, 2);
 		}
 	
 		// flag end of exported symbols - "" is NOT an error
-		writebytes("", 1, 1, of);
+		outbuf_add(ob, "", 1);
 		
 		// FIXME - relocation table
 		for (re = s -> reloctab; re; re = re -> next)
@@ -951,7 +955,7 @@ void write_code_obj(asmstate_t *as, FILE *of)
 				// flag an 8 bit relocation (low 8 bits will be used)
 				buf[0] = 0xFF;
 				buf[1] = 0x01;
-				writebytes(buf, 2, 1, of);
+				outbuf_add(ob, buf, 2);
 			}
 			
 			te = lw_expr_copy(re -> offset);
@@ -965,19 +969,19 @@ void write_code_obj(asmstate_t *as, FILE *of)
 			lw_expr_destroy(te);
 			
 			// output expression
-			lw_expr_testterms(re -> expr, write_code_obj_expraux, of);
+			lw_expr_testterms(re -> expr, write_code_obj_expraux, ob);
 			
 			// flag end of expressions
-			writebytes("", 1, 1, of);
+			outbuf_add(ob, "", 1);
 			
 			// write the offset
 			buf[0] = (offset >> 8) & 0xff;
 			buf[1] = offset & 0xff;
-			writebytes(buf, 2, 1, of);
+			outbuf_add(ob, buf, 2);
 		}
 
 		// flag end of incomplete references list
-		writebytes("", 1, 1, of);
+		outbuf_add(ob, "", 1);
 		
 		// now blast out the code
 		
@@ -992,24 +996,23 @@ void write_code_obj(asmstate_t *as, FILE *of)
 			buf[0] = s -> oblen >> 8 & 0xff;
 			buf[1] = s -> oblen & 0xff;
 		}
-		writebytes(buf, 2, 1, of);
+		outbuf_add(ob, buf, 2);
 		
 		
 		if (!(s -> flags & section_flag_bss) && !(s -> flags & section_flag_constant))
 		{
-			writebytes(s -> obytes, s -> oblen, 1, of);
+			outbuf_add(ob, s -> obytes, s -> oblen);
 		}
 	}
 	
 	// flag no more sections
 	// the "" is NOT an error
-	writebytes("", 1, 1, of);
+	outbuf_add(ob, "", 1);
 }
 
 
-void write_code_lwmod(asmstate_t *as, FILE *of)
+void write_code_lwmod(asmstate_t *as, outbuf_t *ob)
 {
-	line_t *l;
 	sectiontab_t *s;
 	reloctab_t *re;
 	int initsize, bsssize, mainsize, callsnum, namesize;
@@ -1019,7 +1022,6 @@ void write_code_lwmod(asmstate_t *as, FILE *of)
 	int tsize, bssoff;
 	int initaddr = -1;
 
-	int i;
 	unsigned char buf[16];
 
 	// the magic number
@@ -1036,19 +1038,7 @@ void write_code_lwmod(asmstate_t *as, FILE *of)
 	// We build everything in memory here because we need to calculate the
 	// sizes of everything before we can output the complete header.
 	
-	for (l = as -> line_head; l; l = l -> next)
-	{
-		if (l -> csect)
-		{
-			// we're in a section - need to output some bytes
-			if (l -> outputl > 0)
-				for (i = 0; i < l -> outputl; i++)
-					write_code_obj_sbadd(l -> csect, l -> output[i]);
-			else if (l -> outputl == 0 || l -> outputl == -1)
-				for (i = 0; i < l -> len; i++)
-					write_code_obj_sbadd(l -> csect, 0);
-		}
-	}
+	write_code_obj_sections(as);
 	
 	// now run through sections and set various parameters
 	initsize = 0;
@@ -1188,8 +1178,11 @@ void write_code_lwmod(asmstate_t *as, FILE *of)
 					lw_expr_destroy(te);
 					s -> tbase = x;
 					// offset *should* be the offset in the section
-					s -> obytes[offset] = val >> 8;
-					s -> obytes[offset + 1] = val & 0xff;
+					if (s -> obytes && offset + 1 < s -> oblen)
+					{
+						s -> obytes[offset] = val >> 8;
+						s -> obytes[offset + 1] = val & 0xff;
+					}
 					continue;
 				}
 				
@@ -1227,19 +1220,19 @@ void write_code_lwmod(asmstate_t *as, FILE *of)
 	// number of call entries
 	buf[10] = callsnum;
 	// write the header
-	writebytes(buf, 11, 1, of);
+	outbuf_add(ob, buf, 11);
 	// call data
 	if (callsnum)
-		writebytes(callscode, callsnum * 2, 1, of);
+		outbuf_add(ob, callscode, callsnum * 2);
 	// module name
-	writebytes(namecode, namesize + 1, 1, of);
+	outbuf_add(ob, namecode, namesize + 1);
 	// main code
 	if (mainsize)
-		writebytes(maincode, mainsize, 1, of);
+		outbuf_add(ob, maincode, mainsize);
 	// bss relocs
 	if (relocsize)
-		writebytes(reloccode, relocsize, 1, of);
+		outbuf_add(ob, reloccode, relocsize);
 	// init stuff
 	if (initsize)
-		writebytes(initcode, initsize, 1, of);
+		outbuf_add(ob, initcode, initsize);
 }
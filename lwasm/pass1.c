@@ -424,7 +424,7 @@ void do_pass1(asmstate_t *as)
 		{
 			if (cl -> sym && cl -> symset == 0)
 			{
-				debug_message(as, 50, "Register symbol %s: %s", cl -> sym, lw_expr_print(cl -> addr));
+				debug_message(as, 50, "Register symbol %s: %s", cl -> sym, lw_expr_print_ctx(as -> exprctx, cl -> addr));
 	
 				// register symbol at line address
 				if (instab[cl -> insn].flags & lwasm_insn_setdata)
@@ -444,7 +444,7 @@ void do_pass1(asmstate_t *as)
 					}
 				}
 			}
-			debug_message(as, 40, "Line address: %s", lw_expr_print(cl -> addr));
+			debug_message(as, 40, "Line address: %s", lw_expr_print_ctx(as -> exprctx, cl -> addr));
 		}
 		if (as -> skipcond || as -> inmacro || cl -> ltext[0] == 1)
 			cl -> hideline = 1;
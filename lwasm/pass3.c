@@ -40,10 +40,12 @@ void do_pass3(asmstate_t *as)
 	int rc;
 	line_t *cl;
 	struct line_expr_s *le;
+	int unres;
 	
 	do
 	{
 		rc = 0;
+		unres = 0;
 		for (cl = as -> line_head; cl; cl = cl -> next)
 		{
 			as -> cl = cl;
@@ -60,6 +62,7 @@ void do_pass3(asmstate_t *as)
 			
 			if (cl -> len == -1 || cl -> dlen == -1)
 			{
+				unres++;
 				// try resolving the instruction length
 				// but don't force resolution
 				if (cl -> insn >= 0 && instab[cl -> insn].resolve)
@@ -78,6 +81,9 @@ void do_pass3(asmstate_t *as)
 				}
 			}
 		}
+		// pass 1 runs this for conditionals; only count the real pass
+		if (as -> passno > 0)
+			stats_round(as, 3, unres);
 		if (as -> errorcount > 0)
 			return;
 	} while (rc > 0);
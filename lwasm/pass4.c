@@ -54,6 +54,7 @@ void do_pass4_aux(asmstate_t *as, int force)
 	{
 		trycount = cnt;
 		debug_message(as, 60, "%d unresolved instructions", cnt);
+		stats_round(as, 4, cnt);
 
 		// find an unresolved instruction
 		for ( ; sl && sl -> len != -1; sl = sl -> next)
@@ -41,12 +41,20 @@ PARSEFUNC(pseudo_parse_dts)
 {
 	time_t tp;
 	char *t;
+#if !defined(_WIN32)
+	char tbuf[32];
+#endif
 	
 	skip_operand(p);
 	l -> len = 0;
 
 	tp = time(NULL);
+	// ctime() uses a shared buffer which isn't safe with --batch jobs
+#if !defined(_WIN32)
+	t = l ->lstr = lw_strdup(ctime_r(&tp, tbuf));
+#else
 	t = l ->lstr = lw_strdup(ctime(&tp));
+#endif
 
 	while (*t)
 	{
@@ -78,9 +86,16 @@ EMITFUNC(pseudo_emit_dtb)
 {
 	time_t tp;
 	struct tm *t;
+#if !defined(_WIN32)
+	struct tm tbuf;
+#endif
 	
 	tp = time(NULL);
+#if !defined(_WIN32)
+	t = localtime_r(&tp, &tbuf);
+#else
 	t = localtime(&tp);
+#endif
 
 	lwasm_emit(l, t -> tm_year);
 	lwasm_emit(l, t -> tm_mon + 1);
@@ -1566,6 +1581,12 @@ PARSEFUNC(pseudo_parse_include)
 	if (delim && **p)
 		(*p)++;
 
+	if (snapshot_include(as, l, fn))
+	{
+		lw_free(fn);
+		return;
+	}
+
 	/* add a book-keeping entry for line numbers */
 	snprintf(buf, 100, "\001\001SETLINENO %d\n", l -> lineno + 1);
 	input_openstring(as, "INTERNAL", buf);
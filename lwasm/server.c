@@ -0,0 +1,648 @@
+/*
+server.c
+
+Copyright © 2026 William Astle
+
+This file is part of LWTOOLS.
+
+LWTOOLS is free software: you can redistribute it and/or modify it under the
+terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <http://www.gnu.org/licenses/>.
+
+Persistent assembler server (--server) and its client (--connect)
+
+The server listens on a Unix domain socket and assembles one request at a
+time in its own process, keeping the contents of input files cached between
+requests. The client sends its working directory and arguments and relays
+what the assembly writes to stdout and stderr along with the exit status.
+
+A request is the client's working directory, the number of arguments and
+the arguments, each terminated by a NUL, followed by end of file. The reply
+is a series of records: a type byte ('1' for stdout, '2' for stderr, 'x' for
+the exit status), a four byte big endian length, and that many bytes.
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#include <lw_alloc.h>
+#include <lw_string.h>
+#include <lw_stringlist.h>
+
+#include "lwasm.h"
+
+/*
+Return nonzero if the arguments ask for help, usage or version output. The
+command line parser exits the program for those so they are never sent to
+the server. Short option clusters containing ? or V are treated the same
+even when the letter is really an option argument; that only costs a local
+run.
+*/
+static int server_infoargs(int argc, char **argv)
+{
+	int i;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--"))
+			break;
+		if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "--usage") || !strcmp(argv[i], "--version"))
+			return 1;
+		if (argv[i][0] == '-' && argv[i][1] != '-' && (strchr(argv[i], '?') || strchr(argv[i], 'V')))
+			return 1;
+	}
+	return 0;
+}
+
+#if !defined(_WIN32)
+
+/* size beyond which the file cache is emptied before adding to it */
+#define FILECACHE_MAX	(64 * 1024 * 1024)
+#define FILECACHE_HASH	256
+
+typedef struct filecache_ent_s filecache_ent_t;
+struct filecache_ent_s
+{
+	char *fn;							// absolute file name
+	time_t mtime;						// modification time when read
+	long mtimens;						// nanosecond part of mtime, if known
+	off_t size;							// file size when read
+	ino_t ino;							// inode when read
+	char *data;							// file contents
+	filecache_ent_t *next;				// next in hash chain
+};
+
+struct filecache_s
+{
+	filecache_ent_t *ents[FILECACHE_HASH];
+	long total;							// bytes of file data held
+	char *cwd;							// directory of the current request
+	char **retired;						// replaced buffers still open this request
+	int nretired;
+};
+
+static unsigned int filecache_hash(const char *s)
+{
+	unsigned int h = 5381;
+
+	while (*s)
+		h = (h * 33) ^ (unsigned char)(*s++);
+	return h % FILECACHE_HASH;
+}
+
+static long filecache_mtimens(struct stat *st)
+{
+#if defined(__linux__)
+	return st -> st_mtim.tv_nsec;
+#elif defined(__APPLE__)
+	return st -> st_mtimespec.tv_nsec;
+#else
+	return 0;
+#endif
+}
+
+/* buffers can't be freed while a FILE opened on them may still be in use */
+static void filecache_retire(struct filecache_s *fc, char *data)
+{
+	fc -> retired = lw_realloc(fc -> retired, sizeof(char *) * (fc -> nretired + 1));
+	fc -> retired[fc -> nretired++] = data;
+}
+
+static void filecache_flush(struct filecache_s *fc)
+{
+	filecache_ent_t *e, *ne;
+	int i;
+
+	for (i = 0; i < FILECACHE_HASH; i++)
+	{
+		for (e = fc -> ents[i]; e; e = ne)
+		{
+			ne = e -> next;
+			filecache_retire(fc, e -> data);
+			lw_free(e -> fn);
+			lw_free(e);
+		}
+		fc -> ents[i] = NULL;
+	}
+	fc -> total = 0;
+}
+
+/* called once a request is finished with all of its files */
+static void filecache_endrequest(struct filecache_s *fc)
+{
+	int i;
+
+	for (i = 0; i < fc -> nretired; i++)
+		lw_free(fc -> retired[i]);
+	lw_free(fc -> retired);
+	fc -> retired = NULL;
+	fc -> nretired = 0;
+}
+
+/*
+Open fn for reading. The file is checked with stat() on every open and is
+only read again if its size, inode or modification time changed.
+*/
+FILE *filecache_fopen(struct filecache_s *fc, const char *fn)
+{
+	struct stat st;
+	filecache_ent_t *e;
+	char *afn;
+	FILE *fp;
+	unsigned int h;
+	size_t n;
+
+	if (stat(fn, &st) != 0)
+		return NULL;
+	// fmemopen() can't handle empty buffers everywhere
+	if (!S_ISREG(st.st_mode) || st.st_size == 0)
+		return fopen(fn, "rb");
+
+	if (fn[0] == '/')
+	{
+		afn = lw_strdup(fn);
+	}
+	else
+	{
+		afn = lw_alloc(strlen(fc -> cwd) + strlen(fn) + 2);
+		sprintf(afn, "%s/%s", fc -> cwd, fn);
+	}
+
+	h = filecache_hash(afn);
+	for (e = fc -> ents[h]; e; e = e -> next)
+	{
+		if (!strcmp(e -> fn, afn))
+			break;
+	}
+	if (e && e -> size == st.st_size && e -> ino == st.st_ino &&
+		e -> mtime == st.st_mtime && e -> mtimens == filecache_mtimens(&st))
+	{
+		lw_free(afn);
+		return fmemopen(e -> data, e -> size, "rb");
+	}
+
+	fp = fopen(fn, "rb");
+	if (!fp)
+	{
+		lw_free(afn);
+		return NULL;
+	}
+	if (!e)
+	{
+		if (fc -> total + st.st_size > FILECACHE_MAX)
+			filecache_flush(fc);
+		e = lw_alloc(sizeof(filecache_ent_t));
+		e -> fn = afn;
+		e -> data = NULL;
+		e -> size = 0;
+		e -> next = fc -> ents[h];
+		fc -> ents[h] = e;
+	}
+	else
+	{
+		lw_free(afn);
+		filecache_retire(fc, e -> data);
+		fc -> total -= e -> size;
+	}
+	e -> data = lw_alloc(st.st_size);
+	n = fread(e -> data, 1, st.st_size, fp);
+	fclose(fp);
+	e -> size = n;
+	e -> ino = st.st_ino;
+	e -> mtime = st.st_mtime;
+	e -> mtimens = filecache_mtimens(&st);
+	fc -> total += n;
+	if (n == 0)
+		return fopen(fn, "rb");
+	return fmemopen(e -> data, e -> size, "rb");
+}
+
+static const char *server_sockpath;
+
+static void server_sigexit(int sig)
+{
+	unlink(server_sockpath);
+	_exit(0);
+}
+
+// remove the socket however the server ends
+static void server_atexit(void)
+{
+	if (server_sockpath)
+		unlink(server_sockpath);
+	server_sockpath = NULL;
+}
+
+static int server_writeall(int fd, const char *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0)
+	{
+		r = write(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int server_record(int fd, int type, const char *buf, size_t len)
+{
+	unsigned char hdr[5];
+
+	hdr[0] = type;
+	hdr[1] = (len >> 24) & 0xff;
+	hdr[2] = (len >> 16) & 0xff;
+	hdr[3] = (len >> 8) & 0xff;
+	hdr[4] = len & 0xff;
+	if (server_writeall(fd, (char *)hdr, 5))
+		return -1;
+	return server_writeall(fd, buf, len);
+}
+
+/* send everything written to fp as records of the given type */
+static int server_sendfile(int fd, int type, FILE *fp)
+{
+	char buf[16384];
+	size_t n;
+
+	rewind(fp);
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+	{
+		if (server_record(fd, type, buf, n))
+			return -1;
+	}
+	return 0;
+}
+
+static int server_connect(const char *sock)
+{
+	struct sockaddr_un sa;
+	int fd;
+
+	if (strlen(sock) >= sizeof(sa.sun_path))
+		return -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, sock);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -1;
+	if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* read a whole request; returns the number of bytes or -1 */
+static int server_readreq(int fd, char **bufp)
+{
+	char *buf = NULL;
+	int len = 0, size = 0;
+	ssize_t r;
+
+	for (;;)
+	{
+		if (len == size)
+		{
+			// nobody needs a megabyte of arguments
+			if (size >= 1024 * 1024)
+				break;
+			size += 4096;
+			buf = lw_realloc(buf, size + 1);
+		}
+		r = read(fd, buf + len, size - len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0)
+			break;
+		if (r == 0)
+		{
+			buf[len] = '\0';
+			*bufp = buf;
+			return len;
+		}
+		len += r;
+	}
+	lw_free(buf);
+	return -1;
+}
+
+/* assemble one request with stdout and stderr captured; returns the status */
+static int server_assemble(struct filecache_s *fc, int argc, char **argv, int rargc, char **rargv)
+{
+	asmstate_t as;
+	int status;
+
+	lwasm_init_state(&as);
+	as.filecache = fc;
+	lwasm_parse_cmdline(&as, argc, argv);
+	lw_free(as.server_socket);
+	as.server_socket = NULL;
+	if (server_infoargs(rargc, rargv))
+	{
+		fprintf(stderr, "Help, usage and version requests are not handled by the server\n");
+		status = 1;
+	}
+	else if (lwasm_parse_cmdline(&as, rargc, rargv) != 0)
+	{
+		status = 1;
+	}
+	else if (as.server_socket || as.batch_file)
+	{
+		fprintf(stderr, "--server and --batch cannot be used with --connect\n");
+		status = 1;
+	}
+	else
+	{
+		status = batch_assemble(&as);
+	}
+	batch_free_state(&as);
+	return status;
+}
+
+static void server_request(struct filecache_s *fc, int cfd, int argc, char **argv)
+{
+	char *req, *p, *end, *cwd;
+	char **rargv;
+	int len, rargc, i, status;
+	FILE *out, *err;
+	int saveout, saveerr;
+	unsigned char st;
+
+	len = server_readreq(cfd, &req);
+	if (len < 0)
+		return;
+	end = req + len;
+
+	// working directory, argument count, arguments
+	cwd = req;
+	p = cwd + strlen(cwd) + 1;
+	if (p >= end)
+	{
+		lw_free(req);
+		return;
+	}
+	rargc = atoi(p) + 1;
+	p += strlen(p) + 1;
+	rargv = lw_alloc(sizeof(char *) * (rargc + 1));
+	rargv[0] = argv[0];
+	for (i = 1; i < rargc; i++)
+	{
+		if (p >= end)
+			break;
+		rargv[i] = p;
+		p += strlen(p) + 1;
+	}
+	rargv[i] = NULL;
+	rargc = i;
+
+	out = tmpfile();
+	err = tmpfile();
+	if (!out || !err || chdir(cwd) != 0)
+	{
+		static const char msg[] = "Server could not set up the request\n";
+
+		server_record(cfd, '2', msg, sizeof(msg) - 1);
+		st = 1;
+		server_record(cfd, 'x', (char *)&st, 1);
+		if (out)
+			fclose(out);
+		if (err)
+			fclose(err);
+		lw_free(rargv);
+		lw_free(req);
+		return;
+	}
+	lw_free(fc -> cwd);
+	fc -> cwd = lw_strdup(cwd);
+
+	// anything the assembly writes to stdout or stderr goes to the client
+	fflush(stdout);
+	fflush(stderr);
+	saveout = dup(1);
+	saveerr = dup(2);
+	dup2(fileno(out), 1);
+	dup2(fileno(err), 2);
+
+	status = server_assemble(fc, argc, argv, rargc, rargv);
+
+	fflush(stdout);
+	fflush(stderr);
+	dup2(saveout, 1);
+	dup2(saveerr, 2);
+	close(saveout);
+	close(saveerr);
+	filecache_endrequest(fc);
+
+	st = status;
+	if (server_sendfile(cfd, '1', out) == 0 && server_sendfile(cfd, '2', err) == 0)
+		server_record(cfd, 'x', (char *)&st, 1);
+	fclose(out);
+	fclose(err);
+	lw_free(rargv);
+	lw_free(req);
+}
+
+/*
+run the server; "as" holds the options from the command line, which are
+reapplied to each request from argc/argv
+*/
+int do_server(asmstate_t *as, int argc, char **argv)
+{
+	struct sockaddr_un sa;
+	struct filecache_s fc = { { 0 } };
+	int fd, cfd;
+
+	if (lw_stringlist_nstrings(as -> input_files) > 0)
+	{
+		fprintf(stderr, "Input files cannot be given with --server\n");
+		return 1;
+	}
+	if (strlen(as -> server_socket) >= sizeof(sa.sun_path))
+	{
+		fprintf(stderr, "Socket path too long: %s\n", as -> server_socket);
+		return 1;
+	}
+
+	// refuse to take over the socket of a server that is still running
+	fd = server_connect(as -> server_socket);
+	if (fd >= 0)
+	{
+		close(fd);
+		fprintf(stderr, "A server is already listening on %s\n", as -> server_socket);
+		return 1;
+	}
+	unlink(as -> server_socket);
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strcpy(sa.sun_path, as -> server_socket);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0 || listen(fd, 16) != 0)
+	{
+		fprintf(stderr, "Cannot listen on %s: %s\n", as -> server_socket, strerror(errno));
+		return 1;
+	}
+
+	server_sockpath = as -> server_socket;
+	atexit(server_atexit);
+	signal(SIGINT, server_sigexit);
+	signal(SIGQUIT, server_sigexit);
+	signal(SIGTERM, server_sigexit);
+	signal(SIGHUP, server_sigexit);
+	signal(SIGPIPE, SIG_IGN);
+	batch_init();
+
+	for (;;)
+	{
+		cfd = accept(fd, NULL, NULL);
+		if (cfd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "Accepting connection failed: %s\n", strerror(errno));
+			break;
+		}
+		server_request(&fc, cfd, argc, argv);
+		close(cfd);
+	}
+	close(fd);
+	server_atexit();
+	return 1;
+}
+
+static int client_readall(int fd, unsigned char *buf, size_t len)
+{
+	ssize_t r;
+
+	while (len > 0)
+	{
+		r = read(fd, buf, len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+/*
+send the arguments to the server on sock; returns the exit status of the
+assembly or -1 if the server couldn't be used, in which case the caller
+assembles locally
+*/
+int do_client(const char *sock, int argc, char **argv)
+{
+	char cwd[4096];
+	char nbuf[16];
+	unsigned char hdr[5];
+	char buf[16384];
+	size_t len, n;
+	int fd, i, status = -1;
+
+	if (server_infoargs(argc, argv))
+		return -1;
+	if (!getcwd(cwd, sizeof(cwd)))
+		return -1;
+	fd = server_connect(sock);
+	if (fd < 0)
+		return -1;
+	signal(SIGPIPE, SIG_IGN);
+
+	sprintf(nbuf, "%d", argc - 1);
+	if (server_writeall(fd, cwd, strlen(cwd) + 1) || server_writeall(fd, nbuf, strlen(nbuf) + 1))
+		goto done;
+	for (i = 1; i < argc; i++)
+	{
+		if (server_writeall(fd, argv[i], strlen(argv[i]) + 1))
+			goto done;
+	}
+	shutdown(fd, SHUT_WR);
+
+	for (;;)
+	{
+		if (client_readall(fd, hdr, 5))
+		{
+			// the server went away part way through
+			if (status < 0)
+			{
+				fprintf(stderr, "Lost connection to lwasm server on %s\n", sock);
+				status = 1;
+			}
+			break;
+		}
+		len = (hdr[1] << 24) | (hdr[2] << 16) | (hdr[3] << 8) | hdr[4];
+		if (hdr[0] == 'x')
+		{
+			if (len != 1 || client_readall(fd, hdr, 1))
+				status = 1;
+			else
+				status = hdr[0];
+			break;
+		}
+		while (len > 0)
+		{
+			n = len > sizeof(buf) ? sizeof(buf) : len;
+			if (client_readall(fd, (unsigned char *)buf, n))
+			{
+				len = 0;
+				break;
+			}
+			fwrite(buf, 1, n, hdr[0] == '1' ? stdout : stderr);
+			len -= n;
+		}
+	}
+
+done:
+	close(fd);
+	return status;
+}
+
+#else
+
+FILE *filecache_fopen(struct filecache_s *fc, const char *fn)
+{
+	return fopen(fn, "rb");
+}
+
+int do_server(asmstate_t *as, int argc, char **argv)
+{
+	fprintf(stderr, "--server is not supported on this platform\n");
+	return 1;
+}
+
+int do_client(const char *sock, int argc, char **argv)
+{
+	(void)server_infoargs;
+	return -1;
+}
+
+#endif
@@ -0,0 +1,637 @@
+/*
+snapshot.c
+
+Copyright © 2026 William Astle
+
+This file is part of LWTOOLS.
+
+LWTOOLS is free software: you can redistribute it and/or modify it under the
+terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <http://www.gnu.org/licenses/>.
+
+Precompiled include snapshots (--snapshot and --use-snapshot)
+
+A snapshot holds the symbol table, macros, structures and pragmas that are
+left after assembling a definitions file. When that file is later included
+as the first thing an assembly does, the snapshot is loaded instead of
+parsing the file again.
+
+A snapshot is only used when the include resolves to a file with the same
+contents as the one it was made from, every file that file included is
+also unchanged, and the state it would be loaded into matches the state it
+was made from: nothing defined yet, the same pragmas and output format, and
+the address counter still at 0. Otherwise the include is processed as
+usual.
+
+The file format is a sequence of 32 bit big endian integers and length
+prefixed strings, described by do_snapshot() below.
+*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <lw_alloc.h>
+#include <lw_error.h>
+#include <lw_expr.h>
+#include <lw_sha1.h>
+#include <lw_string.h>
+
+#include "lwasm.h"
+#include "input.h"
+
+#define SNAPSHOT_MAGIC	"LWASM-SNAPSHOT-1"
+
+static void snap_putint(FILE *fp, int v)
+{
+	fputc((v >> 24) & 0xff, fp);
+	fputc((v >> 16) & 0xff, fp);
+	fputc((v >> 8) & 0xff, fp);
+	fputc(v & 0xff, fp);
+}
+
+// NULL strings are stored with a length of -1
+static void snap_putstr(FILE *fp, const char *s)
+{
+	if (!s)
+	{
+		snap_putint(fp, -1);
+		return;
+	}
+	snap_putint(fp, strlen(s));
+	fwrite(s, 1, strlen(s), fp);
+}
+
+typedef struct
+{
+	unsigned char *p;
+	unsigned char *end;
+	int bad;							// set if we ran off the end
+} snapbuf_t;
+
+static int snap_getint(snapbuf_t *b)
+{
+	unsigned int v;
+
+	if (b -> end - b -> p < 4)
+	{
+		b -> bad = 1;
+		return 0;
+	}
+	v = (b -> p[0] << 24) | (b -> p[1] << 16) | (b -> p[2] << 8) | b -> p[3];
+	b -> p += 4;
+	return (int)v;
+}
+
+/* returns a new copy of the string */
+static char *snap_getstr(snapbuf_t *b)
+{
+	int l;
+	char *r;
+
+	l = snap_getint(b);
+	if (l < 0 || b -> bad)
+		return NULL;
+	if (b -> end - b -> p < l)
+	{
+		b -> bad = 1;
+		return NULL;
+	}
+	r = lw_strndup((char *)(b -> p), l);
+	b -> p += l;
+	return r;
+}
+
+/* compare the next string with s; returns nonzero if they match */
+static int snap_matchstr(snapbuf_t *b, const char *s)
+{
+	char *t;
+	int r;
+
+	t = snap_getstr(b);
+	r = t && !strcmp(t, s);
+	lw_free(t);
+	return r;
+}
+
+static int snap_hashfile(FILE *fp, char *hex)
+{
+	lw_sha1_t c;
+
+	lw_sha1_init(&c);
+	if (lw_sha1_file(&c, fp))
+		return -1;
+	lw_sha1_finalhex(&c, hex);
+	return 0;
+}
+
+static int snap_hashpath(const char *fn, char *hex)
+{
+	FILE *fp;
+	int r;
+
+	fp = fopen(fn, "rb");
+	if (!fp)
+		return -1;
+	r = snap_hashfile(fp, hex);
+	fclose(fp);
+	return r;
+}
+
+/* included files are recorded by absolute path so the snapshot can be used from anywhere */
+static char *snap_abspath(const char *fn)
+{
+	char *r, *p;
+
+#if defined(_WIN32)
+	p = _fullpath(NULL, fn, 0);
+#else
+	p = realpath(fn, NULL);
+#endif
+	if (!p)
+		return lw_strdup(fn);
+	r = lw_strdup(p);
+	free(p);
+	return r;
+}
+
+static int snapshot_error(asmstate_t *as, const char *fmt, ...)
+{
+	va_list args;
+
+	va_start(args, fmt);
+	fprintf(as -> errfile, "Cannot write snapshot: ");
+	vfprintf(as -> errfile, fmt, args);
+	fprintf(as -> errfile, "\n");
+	va_end(args);
+	as -> errorcount++;
+	return -1;
+}
+
+/*
+symbols are written in preorder with a mask saying which subtrees follow;
+this rebuilds exactly the same tree when loading. Only the current version
+of a "set" symbol is kept.
+*/
+static int snapshot_writesyms(asmstate_t *as, FILE *fp, struct symtabe *se)
+{
+	lw_expr_t te;
+	int v;
+
+	if (se -> section)
+		return snapshot_error(as, "symbol %s is in a section", se -> symbol);
+	te = lw_expr_copy(se -> value);
+	lwasm_reduce_expr(as, te);
+	if (!lw_expr_istype(te, lw_expr_type_int))
+	{
+		lw_expr_destroy(te);
+		return snapshot_error(as, "symbol %s is not constant", se -> symbol);
+	}
+	v = lw_expr_intval(te);
+	lw_expr_destroy(te);
+
+	snap_putstr(fp, se -> symbol);
+	snap_putint(fp, se -> context);
+	snap_putint(fp, se -> version);
+	snap_putint(fp, se -> flags);
+	snap_putint(fp, v);
+	snap_putint(fp, (se -> left ? 1 : 0) | (se -> right ? 2 : 0));
+	if (se -> left && snapshot_writesyms(as, fp, se -> left))
+		return -1;
+	if (se -> right && snapshot_writesyms(as, fp, se -> right))
+		return -1;
+	return 0;
+}
+
+static void snapshot_writemacros(FILE *fp, macrotab_t *m)
+{
+	int i;
+
+	// oldest first so loading them in order rebuilds the same list
+	if (!m)
+		return;
+	snapshot_writemacros(fp, m -> next);
+	snap_putstr(fp, m -> name);
+	snap_putint(fp, m -> flags);
+	snap_putint(fp, m -> numlines);
+	for (i = 0; i < m -> numlines; i++)
+		snap_putstr(fp, m -> lines[i]);
+}
+
+static void snapshot_writestructs(FILE *fp, structtab_t *s)
+{
+	structtab_field_t *f;
+	int n;
+
+	if (!s)
+		return;
+	snapshot_writestructs(fp, s -> next);
+	snap_putstr(fp, s -> name);
+	snap_putint(fp, s -> size);
+	for (n = 0, f = s -> fields; f; f = f -> next)
+		n++;
+	snap_putint(fp, n);
+	for (f = s -> fields; f; f = f -> next)
+	{
+		snap_putstr(fp, f -> name);
+		snap_putint(fp, f -> size);
+		snap_putstr(fp, f -> substruct ? f -> substruct -> name : NULL);
+	}
+}
+
+/*
+write the definitions made by the input file to the output file
+
+The layout is:
+
+	magic, lwasm version
+	output format, pragmas before, pragmas after
+	final address, final DP value, next free symbol context
+	SHA-1 of the input file
+	count, then path and SHA-1 of each file it included
+	symbol count, symbol tree
+	macro count, macros
+	structure count, structures
+*/
+int do_snapshot(asmstate_t *as)
+{
+	FILE *fp;
+	line_t *cl;
+	struct ifl *ifl;
+	macrotab_t *m;
+	structtab_t *s;
+	char *root, *p;
+	char hex[LW_SHA1_HEXSIZE];
+	int endaddr = 0, n, r;
+	lw_expr_t te, te2;
+
+	lw_stringlist_reset(as -> input_files);
+	root = lw_stringlist_current(as -> input_files);
+	lw_stringlist_next(as -> input_files);
+	if (!root || lw_stringlist_current(as -> input_files))
+		return snapshot_error(as, "a snapshot must be made from exactly one input file");
+
+	if (as -> sections || as -> exportlist || as -> importlist)
+		return snapshot_error(as, "sections, imports and exports cannot be included in a snapshot");
+	if (as -> endseen)
+		return snapshot_error(as, "END cannot be used in a snapshot");
+	for (cl = as -> line_head; cl; cl = cl -> next)
+	{
+		if (cl -> outputl > 0 || cl -> inmod)
+			return snapshot_error(as, "code or data is generated at %s:%d", cl -> linespec, cl -> lineno);
+	}
+	if (as -> line_tail)
+	{
+		te2 = lw_expr_build(lw_expr_type_int, as -> line_tail -> len);
+		te = lw_expr_build(lw_expr_type_oper, lw_expr_oper_plus, as -> line_tail -> addr, te2);
+		lw_expr_destroy(te2);
+		lwasm_reduce_expr(as, te);
+		if (!lw_expr_istype(te, lw_expr_type_int))
+		{
+			lw_expr_destroy(te);
+			return snapshot_error(as, "the final address is not constant");
+		}
+		endaddr = lw_expr_intval(te);
+		lw_expr_destroy(te);
+	}
+
+	if (snap_hashpath(root, hex))
+		return snapshot_error(as, "cannot read %s", root);
+
+	if (strcmp(as -> output_file, "-") == 0)
+		fp = stdout;
+	else
+		fp = fopen(as -> output_file, "wb");
+	if (!fp)
+		return snapshot_error(as, "cannot open %s", as -> output_file);
+
+	snap_putstr(fp, SNAPSHOT_MAGIC);
+	snap_putstr(fp, PACKAGE_STRING);
+	snap_putint(fp, as -> output_format);
+	snap_putint(fp, as -> line_head ? as -> line_head -> pragmas : as -> pragmas);
+	snap_putint(fp, as -> pragmas);
+	snap_putint(fp, endaddr);
+	snap_putint(fp, as -> line_tail ? as -> line_tail -> dpval : 0);
+	snap_putint(fp, as -> nextcontext);
+	snap_putstr(fp, hex);
+
+	for (n = 0, ifl = as -> ifl_head; ifl; ifl = ifl -> next)
+		if (strcmp(ifl -> fn, root))
+			n++;
+	snap_putint(fp, n);
+	for (ifl = as -> ifl_head; ifl; ifl = ifl -> next)
+	{
+		if (!strcmp(ifl -> fn, root))
+			continue;
+		if (snap_hashpath(ifl -> fn, hex))
+		{
+			r = snapshot_error(as, "cannot read %s", ifl -> fn);
+			goto done;
+		}
+		p = snap_abspath(ifl -> fn);
+		snap_putstr(fp, p);
+		lw_free(p);
+		snap_putstr(fp, hex);
+	}
+
+	snap_putint(fp, as -> symtab.head ? 1 : 0);
+	if (as -> symtab.head && (r = snapshot_writesyms(as, fp, as -> symtab.head)))
+		goto done;
+
+	for (n = 0, m = as -> macros; m; m = m -> next)
+		n++;
+	snap_putint(fp, n);
+	snapshot_writemacros(fp, as -> macros);
+
+	for (n = 0, s = as -> structs; s; s = s -> next)
+		n++;
+	snap_putint(fp, n);
+	snapshot_writestructs(fp, as -> structs);
+	r = 0;
+
+done:
+	if (ferror(fp))
+		r = snapshot_error(as, "error writing %s", as -> output_file);
+	if (fp == stdout)
+	{
+		fflush(fp);
+	}
+	else
+	{
+		fclose(fp);
+		if (r)
+			remove(as -> output_file);
+	}
+	return r;
+}
+
+static struct symtabe *snapshot_readsyms(snapbuf_t *b)
+{
+	struct symtabe *se;
+	int mask;
+
+	se = lw_alloc(sizeof(struct symtabe));
+	se -> symbol = snap_getstr(b);
+	se -> context = snap_getint(b);
+	se -> version = snap_getint(b);
+	se -> flags = snap_getint(b);
+	se -> value = lw_expr_build(lw_expr_type_int, snap_getint(b));
+	se -> section = NULL;
+	se -> nextver = NULL;
+	se -> left = NULL;
+	se -> right = NULL;
+	mask = snap_getint(b);
+	if (!se -> symbol)
+		b -> bad = 1;
+	if (b -> bad)
+		return se;
+	if (mask & 1)
+		se -> left = snapshot_readsyms(b);
+	if (!b -> bad && (mask & 2))
+		se -> right = snapshot_readsyms(b);
+	return se;
+}
+
+static void snapshot_readmacros(asmstate_t *as, line_t *l, snapbuf_t *b)
+{
+	macrotab_t *m;
+	int n, i;
+
+	for (n = snap_getint(b); n > 0 && !b -> bad; n--)
+	{
+		m = lw_alloc(sizeof(macrotab_t));
+		m -> name = snap_getstr(b);
+		m -> flags = snap_getint(b);
+		m -> numlines = snap_getint(b);
+		if (m -> numlines < 0 || m -> numlines > b -> end - b -> p)
+		{
+			b -> bad = 1;
+			m -> numlines = 0;
+		}
+		m -> lines = lw_alloc(sizeof(char *) * (m -> numlines + 1));
+		for (i = 0; i < m -> numlines; i++)
+			m -> lines[i] = snap_getstr(b);
+		m -> definedat = l;
+		m -> next = as -> macros;
+		as -> macros = m;
+	}
+}
+
+static void snapshot_readstructs(asmstate_t *as, line_t *l, snapbuf_t *b)
+{
+	structtab_t *s, *s2;
+	structtab_field_t *f, **fp;
+	char *sub;
+	int n, nf;
+
+	for (n = snap_getint(b); n > 0 && !b -> bad; n--)
+	{
+		s = lw_alloc(sizeof(structtab_t));
+		s -> name = snap_getstr(b);
+		s -> size = snap_getint(b);
+		s -> fields = NULL;
+		s -> definedat = l;
+		fp = &(s -> fields);
+		for (nf = snap_getint(b); nf > 0 && !b -> bad; nf--)
+		{
+			f = lw_alloc(sizeof(structtab_field_t));
+			f -> name = snap_getstr(b);
+			f -> size = snap_getint(b);
+			f -> substruct = NULL;
+			f -> next = NULL;
+			sub = snap_getstr(b);
+			if (sub)
+			{
+				// substructures are always defined before they're used
+				for (s2 = as -> structs; s2; s2 = s2 -> next)
+					if (!strcmp(s2 -> name, sub))
+						break;
+				if (!s2)
+					b -> bad = 1;
+				f -> substruct = s2;
+				lw_free(sub);
+			}
+			*fp = f;
+			fp = &(f -> next);
+		}
+		s -> next = as -> structs;
+		as -> structs = s;
+	}
+}
+
+/* read the whole snapshot file; it's mapped rather than read where possible */
+static unsigned char *snapshot_map(const char *fn, size_t *len)
+{
+	unsigned char *r;
+#if !defined(_WIN32)
+	struct stat st;
+	int fd;
+
+	fd = open(fn, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0 || st.st_size == 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	r = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED)
+		return NULL;
+	*len = st.st_size;
+	return r;
+#else
+	FILE *fp;
+	long l;
+
+	fp = fopen(fn, "rb");
+	if (!fp)
+		return NULL;
+	fseek(fp, 0, SEEK_END);
+	l = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if (l <= 0)
+	{
+		fclose(fp);
+		return NULL;
+	}
+	r = lw_alloc(l);
+	if (fread(r, 1, l, fp) != (size_t)l)
+	{
+		fclose(fp);
+		lw_free(r);
+		return NULL;
+	}
+	fclose(fp);
+	*len = l;
+	return r;
+#endif
+}
+
+static void snapshot_unmap(unsigned char *buf, size_t len)
+{
+#if !defined(_WIN32)
+	munmap(buf, len);
+#else
+	lw_free(buf);
+#endif
+}
+
+/*
+called for an "include" of fn on line l; loads the snapshot given with
+--use-snapshot if it was made from that file and can be used here.
+Returns nonzero if it was, in which case the include must not be opened.
+*/
+int snapshot_include(asmstate_t *as, line_t *l, char *fn)
+{
+	unsigned char *buf;
+	size_t len;
+	snapbuf_t b;
+	FILE *fp;
+	char *rfn, *p;
+	char hex[LW_SHA1_HEXSIZE];
+	int pragmas, endaddr, dpval, nextcontext, n, ok = 0;
+	struct symtabe *se = NULL;
+
+	if (!as -> snapshot_file || as -> snapshot_done || as -> preprocess)
+		return 0;
+
+	// only the very first thing done by an assembly can be replaced
+	if (as -> symtab.head || as -> macros || as -> structs || l -> csect || l -> inmod || l -> dpval)
+		return 0;
+	if (!lw_expr_istype(l -> addr, lw_expr_type_int) || lw_expr_intval(l -> addr) != 0)
+		return 0;
+
+	// the snapshot is only tried once whether or not it fits
+	as -> snapshot_done = 1;
+	buf = snapshot_map(as -> snapshot_file, &len);
+	if (!buf)
+	{
+		debug_message(as, 1, "Cannot read snapshot %s", as -> snapshot_file);
+		return 0;
+	}
+	b.p = buf;
+	b.end = buf + len;
+	b.bad = 0;
+
+	if (!snap_matchstr(&b, SNAPSHOT_MAGIC) || !snap_matchstr(&b, PACKAGE_STRING))
+		goto done;
+	if (snap_getint(&b) != as -> output_format || snap_getint(&b) != l -> pragmas)
+		goto done;
+	pragmas = snap_getint(&b);
+	endaddr = snap_getint(&b);
+	dpval = snap_getint(&b);
+	nextcontext = snap_getint(&b);
+
+	// the include has to be the file the snapshot was made from
+	fp = input_open_standalone(as, fn, &rfn);
+	if (!fp)
+		goto done;
+	n = snap_hashfile(fp, hex);
+	fclose(fp);
+	lw_free(rfn);
+	if (n || !snap_matchstr(&b, hex))
+		goto done;
+
+	// and nothing it included can have changed
+	for (n = snap_getint(&b); n > 0 && !b.bad; n--)
+	{
+		p = snap_getstr(&b);
+		if (!p || snap_hashpath(p, hex) || !snap_matchstr(&b, hex))
+		{
+			lw_free(p);
+			goto done;
+		}
+		input_add_to_resource_list(as, p);
+		lw_free(p);
+	}
+	if (b.bad)
+		goto done;
+
+	// from here on the snapshot is known to fit; anything wrong is a bad file
+	if (snap_getint(&b))
+		se = snapshot_readsyms(&b);
+	snapshot_readmacros(as, l, &b);
+	snapshot_readstructs(as, l, &b);
+	if (b.bad)
+	{
+		lw_error("Snapshot %s is corrupt\n", as -> snapshot_file);
+		goto done;
+	}
+
+	as -> symtab.head = se;
+	as -> pragmas = pragmas;
+	if (as -> nextcontext < nextcontext)
+		as -> nextcontext = nextcontext;
+	as -> context = lwasm_next_context(as);
+	input_add_to_resource_list(as, as -> snapshot_file);
+
+	// carry the address and DP the file left behind to the next line
+	l -> len = endaddr;
+	l -> dpval = dpval;
+	l -> hideline = 1;
+	ok = 1;
+	debug_message(as, 1, "Loaded snapshot %s for %s", as -> snapshot_file, fn);
+
+done:
+	snapshot_unmap(buf, len);
+	return ok;
+}
@@ -0,0 +1,253 @@
+/*
+stats.c
+
+Copyright © 2026 William Astle
+
+This file is part of LWTOOLS.
+
+LWTOOLS is free software: you can redistribute it and/or modify it under the
+terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <http://www.gnu.org/licenses/>.
+
+Collection and reporting of assembler statistics (--stats)
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined(_WIN32)
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include <lw_alloc.h>
+#include <lw_expr.h>
+
+#include "lwasm.h"
+
+static double stats_wall(void)
+{
+#if !defined(_WIN32)
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/*
+CPU time used by the calling thread where the system can say; concurrent
+--batch jobs run on their own threads and clock() would charge each of
+them with the others' work
+*/
+static double stats_cpu(void)
+{
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0)
+		return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+#endif
+	return (double)clock() / CLOCKS_PER_SEC;
+}
+
+/*
+peak resident set size of the whole process in KiB, or -1 if not
+available; under --batch this covers every job run so far
+*/
+static long stats_peakmem(void)
+{
+#if !defined(_WIN32)
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return -1;
+#if defined(__APPLE__)
+	return ru.ru_maxrss / 1024;
+#else
+	return ru.ru_maxrss;
+#endif
+#else
+	return -1;
+#endif
+}
+
+void stats_init(asmstate_t *as)
+{
+	if (!(as -> flags & FLAG_STATS))
+		return;
+	as -> stats = lw_alloc(sizeof(lwasm_stats_t));
+	memset(as -> stats, 0, sizeof(lwasm_stats_t));
+}
+
+/* mark the start of an assembly stage */
+void stats_begin(asmstate_t *as)
+{
+	if (!as -> stats)
+		return;
+	as -> stats -> wall0 = stats_wall();
+	as -> stats -> cpu0 = stats_cpu();
+}
+
+/* record the time taken by the stage started by stats_begin() */
+void stats_end(asmstate_t *as, const char *name)
+{
+	lwasm_stats_t *st = as -> stats;
+	lwasm_stats_pass_t *p;
+
+	if (!st)
+		return;
+	st -> passes = lw_realloc(st -> passes, sizeof(lwasm_stats_pass_t) * (st -> npasses + 1));
+	p = &(st -> passes[st -> npasses++]);
+	p -> name = name;
+	p -> wall = stats_wall() - st -> wall0;
+	p -> cpu = stats_cpu() - st -> cpu0;
+}
+
+/* record the number of unresolved lines at the start of a resolve round */
+void stats_round(asmstate_t *as, int pass, int unresolved)
+{
+	lwasm_stats_t *st = as -> stats;
+
+	if (!st)
+		return;
+	if (pass == 3)
+	{
+		st -> pass3unres = lw_realloc(st -> pass3unres, sizeof(int) * (st -> pass3rounds + 1));
+		st -> pass3unres[st -> pass3rounds++] = unresolved;
+	}
+	else
+	{
+		st -> pass4unres = lw_realloc(st -> pass4unres, sizeof(int) * (st -> pass4rounds + 1));
+		st -> pass4unres[st -> pass4rounds++] = unresolved;
+	}
+}
+
+static int stats_countsyms(struct symtabe *s)
+{
+	int c = 0;
+	struct symtabe *v;
+
+	for (; s; s = s -> right)
+	{
+		for (v = s; v; v = v -> nextver)
+			c++;
+		c += stats_countsyms(s -> left);
+	}
+	return c;
+}
+
+static void stats_list(FILE *of, int *v, int n, int json)
+{
+	int i;
+
+	if (json)
+		fputc('[', of);
+	for (i = 0; i < n; i++)
+		fprintf(of, "%s%d", i ? (json ? ", " : " ") : "", v[i]);
+	if (json)
+		fputc(']', of);
+}
+
+void do_stats(asmstate_t *as)
+{
+	lwasm_stats_t *st = as -> stats;
+	FILE *of;
+	line_t *cl;
+	int lines = 0, i;
+	unsigned long calls, iterations;
+	double twall = 0, tcpu = 0;
+	long peak;
+
+	if (!st)
+		return;
+
+	if (!as -> stats_file || !strcmp(as -> stats_file, "-"))
+	{
+		of = as -> errfile;
+	}
+	else
+	{
+		of = fopen(as -> stats_file, "w");
+		if (!of)
+		{
+			fprintf(as -> errfile, "Cannot open stats file %s: %s\n", as -> stats_file, strerror(errno));
+			return;
+		}
+	}
+
+	for (cl = as -> line_head; cl; cl = cl -> next)
+		lines++;
+	lw_expr_ctx_getstats(as -> exprctx, &calls, &iterations);
+	for (i = 0; i < st -> npasses; i++)
+	{
+		twall += st -> passes[i].wall;
+		tcpu += st -> passes[i].cpu;
+	}
+	peak = stats_peakmem();
+
+	if (as -> stats_json)
+	{
+		fprintf(of, "{\n");
+		fprintf(of, "  \"version\": \"%s\",\n", PACKAGE_STRING);
+		fprintf(of, "  \"passes\": [\n");
+		for (i = 0; i < st -> npasses; i++)
+		{
+			fprintf(of, "    { \"name\": \"%s\", \"wall\": %.6f, \"cpu\": %.6f }%s\n",
+				st -> passes[i].name, st -> passes[i].wall, st -> passes[i].cpu,
+				(i + 1 < st -> npasses) ? "," : "");
+		}
+		fprintf(of, "  ],\n");
+		fprintf(of, "  \"total_wall\": %.6f,\n", twall);
+		fprintf(of, "  \"total_cpu\": %.6f,\n", tcpu);
+		fprintf(of, "  \"lines\": %d,\n", lines);
+		fprintf(of, "  \"macro_expansions\": %d,\n", st -> macros);
+		fprintf(of, "  \"symbols\": %d,\n", stats_countsyms(as -> symtab.head));
+		fprintf(of, "  \"expr_simplify_calls\": %lu,\n", calls);
+		fprintf(of, "  \"expr_simplify_iterations\": %lu,\n", iterations);
+		fprintf(of, "  \"pass3_rounds\": %d,\n", st -> pass3rounds);
+		fprintf(of, "  \"pass3_unresolved\": ");
+		stats_list(of, st -> pass3unres, st -> pass3rounds, 1);
+		fprintf(of, ",\n  \"pass4_rounds\": %d,\n", st -> pass4rounds);
+		fprintf(of, "  \"pass4_unresolved\": ");
+		stats_list(of, st -> pass4unres, st -> pass4rounds, 1);
+		fprintf(of, ",\n  \"process_peak_memory_kb\": %ld\n", peak);
+		fprintf(of, "}\n");
+	}
+	else
+	{
+		fprintf(of, "%-24s %12s %12s\n", "Pass", "Wall (s)", "CPU (s)");
+		for (i = 0; i < st -> npasses; i++)
+			fprintf(of, "%-24s %12.6f %12.6f\n", st -> passes[i].name, st -> passes[i].wall, st -> passes[i].cpu);
+		fprintf(of, "%-24s %12.6f %12.6f\n\n", "total", twall, tcpu);
+		fprintf(of, "%-24s %d\n", "Lines", lines);
+		fprintf(of, "%-24s %d\n", "Macro expansions", st -> macros);
+		fprintf(of, "%-24s %d\n", "Symbols", stats_countsyms(as -> symtab.head));
+		fprintf(of, "%-24s %lu\n", "Expression simplify", calls);
+		fprintf(of, "%-24s %lu\n", "Simplify iterations", iterations);
+		fprintf(of, "%-24s %d (", "Pass 3 rounds", st -> pass3rounds);
+		stats_list(of, st -> pass3unres, st -> pass3rounds, 0);
+		fprintf(of, ")\n");
+		fprintf(of, "%-24s %d (", "Pass 4 rounds", st -> pass4rounds);
+		stats_list(of, st -> pass4unres, st -> pass4rounds, 0);
+		fprintf(of, ")\n");
+		if (peak >= 0)
+			fprintf(of, "%-24s %ld KiB\n", "Process peak memory", peak);
+	}
+
+	if (of != as -> errfile)
+		fclose(of);
+}
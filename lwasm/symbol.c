@@ -84,7 +84,7 @@ struct symtabe *register_symbol(asmstate_t *as, line_t *cl, char *sym, lw_expr_t
 	char *cp;
 	int cdir;
 	
-	debug_message(as, 200, "Register symbol %s (%02X), %s", sym, flags, lw_expr_print(val));
+	debug_message(as, 200, "Register symbol %s (%02X), %s", sym, flags, lw_expr_print_ctx(as -> exprctx, val));
 
 	if (!(flags & symbol_flag_nocheck))
 	{
@@ -286,7 +286,7 @@ struct symtabe * lookup_symbol(asmstate_t *as, line_t *cl, char *sym)
 		
 		if (!cdir)
 		{
-			debug_message(as, 100, "Found symbol %s: %s, %s", sym, s -> symbol, lw_expr_print(s -> value));
+			debug_message(as, 100, "Found symbol %s: %s, %s", sym, s -> symbol, lw_expr_print_ctx(as -> exprctx, s -> value));
 			return s;
 		}
 		
@@ -476,7 +476,7 @@ void do_map(asmstate_t *as)
 		of = stdout;
 	if (!of)
 	{
-		fprintf(stderr, "Cannot open map file '%s' for output\n", as -> map_file);
+		fprintf(as -> errfile, "Cannot open map file '%s' for output\n", as -> map_file);
 		return;
 	}
 
@@ -138,7 +138,7 @@ void do_symdump(asmstate_t *as)
 
 		if (!of)
 		{
-			fprintf(stderr, "Cannot open list file; list not generated\n");
+			fprintf(as -> errfile, "Cannot open list file; list not generated\n");
 			return;
 		}
 	}
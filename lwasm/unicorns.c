@@ -69,7 +69,7 @@ void lwasm_do_unicorns(asmstate_t *as)
 	lwasm_error_t *ee;
 			
 	/* output file list */	
-	for (ifl = ifl_head; ifl; ifl = ifl -> next)
+	for (ifl = as -> ifl_head; ifl; ifl = ifl -> next)
 	{
 		fputs("RESOURCE: type=file,filename=", stdout);
 		print_urlencoding(stdout, ifl -> fn);
@@ -38,14 +38,16 @@ char *generate_nextlabel(void)
 }
 
 void generate_code(node_t *n, FILE *output);
+static void generate_code_helper(node_t *n, FILE *output, const char *helper);
+extern void peephole_optimize(FILE *in, FILE *out);
 
 void generate_code_shift(node_t *n, FILE *output, int dir)
 {
-    generate_code(n -> children, output);
     if (n -> children -> next_child -> type == NODE_CONST_INT)
     {
         long ival;
         int i;
+        generate_code(n -> children, output);
         ival = strtol(n -> children -> next_child -> strval, NULL, 0);
         if (ival <= 0)
             return;
@@ -89,12 +91,330 @@ void generate_code_shift(node_t *n, FILE *output, int dir)
     }
     else
     {
+        generate_code_helper(n, output, dir == 1 ? "___lsh16" : "___rsh16");
+    }
+}
+
+
+/*
+Expression code generation
+
+Everything is computed in D. The 6809 can only combine D with an operand
+in memory, so a value that has to wait while the other side of an operator
+is computed goes on the stack; holding it in X, Y, or U would cost a
+transfer back through memory anyway. Pushes are avoided altogether when one
+side of an operator is a leaf (currently a constant) that can be used as an
+immediate operand. Operators whose operands may be swapped, or undone
+afterward like subtraction and comparisons, do that to put the leaf on the
+right. When both sides need D, the side needing more is done first (Sethi-
+Ullman order) where the operator allows it. Conditions are compiled into
+branches rather than computing 0 or 1 and testing it.
+*/
+
+// return nonzero if n can be used directly as an instruction operand
+static int generate_isleaf(node_t *n)
+{
+    return n -> type == NODE_CONST_INT;
+}
+
+static long generate_constval(node_t *n)
+{
+    long v;
+
+    v = strtol(n -> strval, NULL, 0) & 0xffff;
+    return (v & 0x8000) ? v - 0x10000 : v;
+}
+
+// return the number of values that must be held at once to compute n
+static int generate_need(node_t *n)
+{
+    node_t *nn;
+    int l, r;
+
+    if (generate_isleaf(n))
+        return 0;
+    switch (n -> type)
+    {
+    case NODE_OPER_PLUS:
+    case NODE_OPER_MINUS:
+    case NODE_OPER_TIMES:
+    case NODE_OPER_DIVIDE:
+    case NODE_OPER_MOD:
+    case NODE_OPER_LSH:
+    case NODE_OPER_RSH:
+    case NODE_OPER_LT:
+    case NODE_OPER_LE:
+    case NODE_OPER_GT:
+    case NODE_OPER_GE:
+    case NODE_OPER_EQ:
+    case NODE_OPER_NE:
+    case NODE_OPER_BWAND:
+    case NODE_OPER_BWXOR:
+    case NODE_OPER_BWOR:
+        l = generate_need(n -> children);
+        r = generate_need(n -> children -> next_child);
+        if (l == r)
+            return l + 1;
+        return l > r ? l : r;
+    }
+    l = 1;
+    for (nn = n -> children; nn; nn = nn -> next_child)
+    {
+        r = generate_need(nn);
+        if (r > l)
+            l = r;
+    }
+    return l;
+}
+
+// combine D with a leaf operand
+static void generate_code_leafop(int type, node_t *leaf, FILE *output)
+{
+    static const char *ops[3][2] = {
+        { "anda", "andb" },
+        { "ora", "orb" },
+        { "eora", "eorb" }
+    };
+    static const char *regs = "ab";
+    long v;
+    int i, op, b;
+
+    v = generate_constval(leaf);
+    switch (type)
+    {
+    case NODE_OPER_PLUS:
+        fprintf(output, "\taddd #%ld\n", v);
+        return;
+
+    case NODE_OPER_MINUS:
+        fprintf(output, "\tsubd #%ld\n", v);
+        return;
+
+    case NODE_OPER_BWAND:
+        op = 0;
+        break;
+
+    case NODE_OPER_BWOR:
+        op = 1;
+        break;
+
+    default:
+        op = 2;
+        break;
+    }
+
+    // bitwise operations work a byte at a time and some bytes are trivial
+    for (i = 0; i < 2; i++)
+    {
+        b = (i == 0) ? (v >> 8) & 0xff : v & 0xff;
+        if ((op == 0 && b == 0xff) || (op != 0 && b == 0))
+            continue;
+        if (op == 0 && b == 0)
+            fprintf(output, "\tclr%c\n", regs[i]);
+        else if (op == 1 && b == 0xff)
+            fprintf(output, "\tld%c #255\n", regs[i]);
+        else if (op == 2 && b == 0xff)
+            fprintf(output, "\tcom%c\n", regs[i]);
+        else
+            fprintf(output, "\t%s #%d\n", ops[op][i], b);
+    }
+}
+
+// operators done as D <op> memory
+static void generate_code_binop(node_t *n, FILE *output)
+{
+    node_t *l, *r, *first, *second;
+    int commutative;
+
+    l = n -> children;
+    r = l -> next_child;
+    commutative = (n -> type != NODE_OPER_MINUS);
+
+    if (generate_isleaf(r))
+    {
+        generate_code(l, output);
+        generate_code_leafop(n -> type, r, output);
+        return;
+    }
+    if (generate_isleaf(l))
+    {
+        generate_code(r, output);
+        if (!commutative)
+        {
+            // l - r is -r + l
+            fprintf(output, "\tnega\n\tnegb\n\tsbca #0\n");
+            generate_code_leafop(NODE_OPER_PLUS, l, output);
+            return;
+        }
+        generate_code_leafop(n -> type, l, output);
+        return;
+    }
+
+    // the right operand goes on the stack unless the operands can be swapped
+    first = r;
+    second = l;
+    if (commutative && generate_need(l) > generate_need(r))
+    {
+        first = l;
+        second = r;
+    }
+    generate_code(first, output);
+    fprintf(output, "\tpshs d\n");
+    generate_code(second, output);
+    switch (n -> type)
+    {
+    case NODE_OPER_PLUS:
+        fprintf(output, "\taddd ,s++\n");
+        break;
+
+    case NODE_OPER_MINUS:
+        fprintf(output, "\tsubd ,s++\n");
+        break;
+
+    case NODE_OPER_BWAND:
+        fprintf(output, "\tandb 1,s\n\tanda ,s++\n");
+        break;
+
+    case NODE_OPER_BWOR:
+        fprintf(output, "\torb 1,s\n\tora ,s++\n");
+        break;
+
+    case NODE_OPER_BWXOR:
+        fprintf(output, "\teorb 1,s\n\teora ,s++\n");
+        break;
+    }
+}
+
+/*
+Operators done by a runtime helper. The helpers take the left operand on
+the stack and the right one in D and leave the result in place of the left
+operand.
+*/
+static void generate_code_helper(node_t *n, FILE *output, const char *helper)
+{
+    node_t *l, *r, *t;
+
+    l = n -> children;
+    r = l -> next_child;
+    if (n -> type == NODE_OPER_TIMES && generate_need(r) > generate_need(l))
+    {
+        t = l;
+        l = r;
+        r = t;
+    }
+    if (generate_isleaf(l) && !generate_isleaf(r))
+    {
+        // X carries the leaf to the stack without disturbing D
+        generate_code(r, output);
+        fprintf(output, "\tldx #%ld\n\tpshs x\n", generate_constval(l));
+    }
+    else
+    {
+        generate_code(l, output);
         fprintf(output, "\tpshs d\n");
-        generate_code(n -> children -> next_child, output);
-        fprintf(output, "\tjsr ___%ssh16\n\tpuls d\n", dir == 1 ? "l" : "r");
+        generate_code(r, output);
+    }
+    fprintf(output, "\tjsr %s\n\tpuls d\n", helper);
+}
+
+// return the relation that holds when the operands are swapped
+static int generate_swaprel(int type)
+{
+    switch (type)
+    {
+    case NODE_OPER_LT:  return NODE_OPER_GT;
+    case NODE_OPER_LE:  return NODE_OPER_GE;
+    case NODE_OPER_GT:  return NODE_OPER_LT;
+    case NODE_OPER_GE:  return NODE_OPER_LE;
+    }
+    return type;
+}
+
+// return the branch taken when relation type does (sense) or doesn't hold
+static const char *generate_relbranch(int type, int sense)
+{
+    switch (type)
+    {
+    case NODE_OPER_LT:  return sense ? "blt" : "bge";
+    case NODE_OPER_LE:  return sense ? "ble" : "bgt";
+    case NODE_OPER_GT:  return sense ? "bgt" : "ble";
+    case NODE_OPER_GE:  return sense ? "bge" : "blt";
+    case NODE_OPER_EQ:  return sense ? "beq" : "bne";
     }
+    return sense ? "bne" : "beq";
 }
 
+// set the condition codes for a comparison; returns the relation to test
+static int generate_code_compare(node_t *n, FILE *output)
+{
+    node_t *l, *r;
+
+    l = n -> children;
+    r = l -> next_child;
+    if (generate_isleaf(r))
+    {
+        generate_code(l, output);
+        fprintf(output, "\tsubd #%ld\n", generate_constval(r));
+        return n -> type;
+    }
+    if (generate_isleaf(l))
+    {
+        generate_code(r, output);
+        fprintf(output, "\tsubd #%ld\n", generate_constval(l));
+        return generate_swaprel(n -> type);
+    }
+    generate_code(r, output);
+    fprintf(output, "\tpshs d\n");
+    generate_code(l, output);
+    fprintf(output, "\tsubd ,s++\n");
+    return n -> type;
+}
+
+// branch to label if the truth of n is sense
+static void generate_code_condjump(node_t *n, FILE *output, int sense, const char *label)
+{
+    char *skip;
+
+    switch (n -> type)
+    {
+    case NODE_CONST_INT:
+        if ((generate_constval(n) != 0) == sense)
+            fprintf(output, "\tbra %s\n", label);
+        break;
+
+    case NODE_OPER_LT:
+    case NODE_OPER_LE:
+    case NODE_OPER_GT:
+    case NODE_OPER_GE:
+    case NODE_OPER_EQ:
+    case NODE_OPER_NE:
+        fprintf(output, "\t%s %s\n", generate_relbranch(generate_code_compare(n, output), sense), label);
+        break;
+
+    case NODE_OPER_BAND:
+    case NODE_OPER_BOR:
+        // a && b is true only if both are; a || b is false only if both are
+        if (sense == (n -> type == NODE_OPER_BOR))
+        {
+            generate_code_condjump(n -> children, output, sense, label);
+            generate_code_condjump(n -> children -> next_child, output, sense, label);
+        }
+        else
+        {
+            skip = generate_nextlabel();
+            generate_code_condjump(n -> children, output, !sense, skip);
+            generate_code_condjump(n -> children -> next_child, output, sense, label);
+            fprintf(output, "%s\n", skip);
+            lw_free(skip);
+        }
+        break;
+
+    default:
+        generate_code(n, output);
+        fprintf(output, "\tsubd #0\n\t%s %s\n", sense ? "bne" : "beq", label);
+        break;
+    }
+}
 
 void generate_code(node_t *n, FILE *output)
 {
@@ -111,42 +431,27 @@ void generate_code(node_t *n, FILE *output)
         break;
     
     case NODE_CONST_INT:
-        fprintf(output, "\tldd #%s\n", n->strval);
+        fprintf(output, "\tldd #%ld\n", generate_constval(n));
         break;
 
     case NODE_OPER_PLUS:
-        generate_code(n->children, output);
-        fprintf(output, "\tpshs d\n");
-        generate_code(n->children->next_child, output);
-        fprintf(output, "\taddd ,s++\n");
-        break;
-    
     case NODE_OPER_MINUS:
-        generate_code(n->children, output);
-        fprintf(output, "\tpshs d,x\n");
-        generate_code(n->children->next_child, output);
-        fprintf(output, "\tstd 2,s\n\tpuls d\n\tsubd ,s++\n");
+    case NODE_OPER_BWAND:
+    case NODE_OPER_BWOR:
+    case NODE_OPER_BWXOR:
+        generate_code_binop(n, output);
         break;
 
     case NODE_OPER_TIMES:
-        generate_code(n -> children, output);
-        fprintf(output, "\tpshs d\n");
-        generate_code(n->children->next_child, output);
-        fprintf(output, "\tjsr ___mul16i\n\tpuls d\n");
+        generate_code_helper(n, output, "___mul16i");
         break;
 
     case NODE_OPER_DIVIDE:
-        generate_code(n -> children, output);
-        fprintf(output, "\tpshs d\n");
-        generate_code(n->children->next_child, output);
-        fprintf(output, "\tjsr ___div16i\n\tpuls d\n");
+        generate_code_helper(n, output, "___div16i");
         break;
     
     case NODE_OPER_MOD:
-        generate_code(n -> children, output);
-        fprintf(output, "\tpshs d\n");
-        generate_code(n -> children -> next_child, output);
-        fprintf(output, "\tjsr ___mod16i\n\tpuls d\n");
+        generate_code_helper(n, output, "___mod16i");
         break;
 
     case NODE_OPER_LSH:
@@ -160,8 +465,7 @@ void generate_code(node_t *n, FILE *output)
     case NODE_OPER_COND:
         label1 = generate_nextlabel();
         label2 = generate_nextlabel();
-        generate_code(n -> children, output);
-        fprintf(output, "\tsubd #0\n\tbeq %s\n", label1);
+        generate_code_condjump(n -> children, output, 0, label1);
         generate_code(n -> children -> next_child, output);
         fprintf(output, "\tbra %s\n%s\n", label2, label1);
         generate_code(n -> children -> next_child -> next_child, output);
@@ -175,69 +479,18 @@ void generate_code(node_t *n, FILE *output)
         generate_code(n -> children -> next_child, output);
         break;
     
-    case NODE_OPER_BWAND:
-        generate_code(n -> children, output);
-        fprintf(output, "\tpshs d\n");
-        generate_code(n -> children -> next_child, output);
-        fprintf(output, "\tandb 1,s\n\tanda ,s++\n");
-        break;
-
-    case NODE_OPER_BWOR:
-        generate_code(n -> children, output);
-        fprintf(output, "\tpshs d\n");
-        generate_code(n -> children -> next_child, output);
-        fprintf(output, "\torb 1,s\n\tora ,s++\n");
-        break;
-
-    case NODE_OPER_BWXOR:
-        generate_code(n -> children, output);
-        fprintf(output, "\tpshs d\n");
-        generate_code(n -> children -> next_child, output);
-        fprintf(output, "\teorb 1,s\n\teora ,s++\n");
-        break;
-
     case NODE_OPER_BAND:
-        label1 = generate_nextlabel();
-        generate_code(n -> children, output);
-        fprintf(output, "\tsubd #0\n\tbeq %s\n", label1);
-        generate_code(n -> children -> next_child, output);
-        fprintf(output, "\tsubd #0\n\tbeq %s\n\tldd #1\n%s\n", label1, label1);
-        lw_free(label1);
-        break;
-
     case NODE_OPER_BOR:
-        label1 = generate_nextlabel();
-        label2 = generate_nextlabel();
-        generate_code(n -> children, output);
-        fprintf(output, "\tsubd #0\n\tbne %s\n", label1);
-        generate_code(n -> children -> next_child, output);
-        fprintf(output, "\tsubd #0\n\tbeq %s\n%s\tldd #1\n%s\n", label2, label1, label2);
-        lw_free(label1);
-        lw_free(label2);
-        break; 
-
     case NODE_OPER_NE:
     case NODE_OPER_EQ:
     case NODE_OPER_LT:
     case NODE_OPER_GT:
     case NODE_OPER_LE:
     case NODE_OPER_GE:
-        generate_code(n -> children, output);
-        fprintf(output, "\tpshs d\n");
-        generate_code(n -> children -> next_child, output);
-        fprintf(output, "\tsubd ,s++\n");
         label1 = generate_nextlabel();
         label2 = generate_nextlabel();
-        fprintf(output, "\t%s %s\n", (
-            (n -> type == NODE_OPER_NE ? "bne" :
-            (n -> type == NODE_OPER_EQ ? "beq" :
-            (n -> type == NODE_OPER_LT ? "bge" :
-            (n -> type == NODE_OPER_GT ? "ble" :
-            (n -> type == NODE_OPER_LE ? "bgt" :
-            (n -> type == NODE_OPER_GE ? "blt" :
-            "foobar"))))))
-        ), label1);
-        fprintf(output, "\tldd #0\n\tbra %s\n%s\tldd #1\n%s\n", label2, label1, label2);
+        generate_code_condjump(n, output, 0, label1);
+        fprintf(output, "\tldd #1\n\tbra %s\n%s\tldd #0\n%s\n", label2, label1, label2);
         lw_free(label1);
         lw_free(label2);
         break;
@@ -248,3 +501,23 @@ void generate_code(node_t *n, FILE *output)
         break;
     }
 }
+
+/*
+Generate code for a whole program. The code goes through the peephole
+optimizer on the way to output.
+*/
+void generate_program(node_t *n, FILE *output)
+{
+    FILE *tmp;
+
+    tmp = tmpfile();
+    if (!tmp)
+    {
+        generate_code(n, output);
+        return;
+    }
+    generate_code(n, tmp);
+    rewind(tmp);
+    peephole_optimize(tmp, output);
+    fclose(tmp);
+}
@@ -37,7 +37,10 @@ this program. If not, see <http://www.gnu.org/licenses/>.
 node_t *process_file(const char *);
 static void do_error(const char *f, ...);
 extern node_t *parse_program(struct preproc_info *pp);
-extern void generate_code(node_t *n, FILE *of);
+extern void optimize_tree(node_t *n);
+extern void generate_program(node_t *n, FILE *of);
+extern int peephole_disable(const char *name);
+extern void peephole_list(FILE *fp);
 
 node_t *program_tree = NULL;
 
@@ -53,6 +56,7 @@ lw_stringlist_t macrolist;
 
 /* various flags */
 int trigraphs = 0;
+int nofold = 0;
 char *output_file = NULL;
 FILE *output_fp = NULL;
 
@@ -64,6 +68,9 @@ static struct lw_cmdline_options options[] =
 	{ "sincludedir", 'S',	"PATH",		0,							"Add entry to the system include path" },
 	{ "define", 	'D',	"SYM[=VAL]",0, 							"Automatically define SYM to be VAL (or 1)"},
 	{ "trigraphs",	0x100,	NULL,		0,							"Enable interpretation of trigraphs" },
+	{ "no-fold",	0x101,	NULL,		0,							"Do not simplify expressions before generating code" },
+	{ "peephole-disable", 0x102, "RULE", 0,							"Do not apply peephole rule RULE (\"all\" for every rule)" },
+	{ "peephole-list", 0x103, NULL,		0,							"List the peephole rules and exit" },
 	{ 0 }
 };
 
@@ -81,6 +88,19 @@ static int parse_opts(int key, char *arg, void *state)
 		trigraphs = 1;
 		break;
 
+	case 0x101:
+		nofold = 1;
+		break;
+
+	case 0x102:
+		if (peephole_disable(arg))
+			do_error("Unknown peephole rule %s", arg);
+		break;
+
+	case 0x103:
+		peephole_list(stdout);
+		exit(0);
+
 	case 'I':
 		lw_stringlist_addstring(includedirs, arg);
 		break;
@@ -173,10 +193,12 @@ int main(int argc, char **argv)
 	lw_stringlist_destroy(sysincludedirs);
 	lw_stringlist_destroy(macrolist);
 	
+	if (!nofold)
+		optimize_tree(program_tree);
 	node_display(program_tree, stdout);
 	
 	// generate output
-	generate_code(program_tree, output_fp);
+	generate_program(program_tree, output_fp);
 	
 	node_destroy(program_tree);
 	exit(retval);
@@ -191,6 +213,7 @@ node_t *process_file(const char *fn)
 	pp = preproc_init(fn);
 	if (!pp)
 		return NULL;
+	pp -> trigraphs = trigraphs;
 
 	/* set up the include paths */
 	lw_stringlist_reset(includedirs);
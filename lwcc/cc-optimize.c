@@ -0,0 +1,444 @@
+/*
+lwcc/cc-optimize.c
+
+Copyright © 2026 William Astle
+
+This file is part of LWTOOLS.
+
+LWTOOLS is free software: you can redistribute it and/or modify it under the
+terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+Tree level optimizations done between parsing and code generation:
+
+* constant subexpressions are folded
+* identities like x+0, x*1, x<<0 are removed and x*0, x&0 become 0
+* multiplication, division, and modulus by a power of two become shifts
+  and masks
+
+All arithmetic is done the way the code generator does it: as 16 bit two's
+complement ints with right shifts being arithmetic. Anything whose result is
+undefined (division by zero, out of range shift counts) is left alone so it
+happens at run time as written.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lw_alloc.h>
+#include <lw_string.h>
+
+#include "tree.h"
+
+// reduce a value to the range of a 16 bit int
+static long wrap16(long v)
+{
+    v &= 0xffff;
+    if (v & 0x8000)
+        v -= 0x10000;
+    return v;
+}
+
+static int is_const(node_t *n)
+{
+    return n -> type == NODE_CONST_INT;
+}
+
+static long const_value(node_t *n)
+{
+    return wrap16(strtol(n -> strval, NULL, 0));
+}
+
+static void set_const(node_t *n, long v)
+{
+    char buf[16];
+
+    sprintf(buf, "%ld", wrap16(v));
+    lw_free(n -> strval);
+    n -> strval = lw_strdup(buf);
+}
+
+static node_t *make_const(long v)
+{
+    char buf[16];
+
+    sprintf(buf, "%ld", wrap16(v));
+    return node_create(NODE_CONST_INT, buf);
+}
+
+// return the shift count if v is a power of two greater than 1, else -1
+static int log2_exact(long v)
+{
+    int k;
+
+    if (v < 2 || (v & (v - 1)))
+        return -1;
+    for (k = 0; v > 1; k++)
+        v >>= 1;
+    return k;
+}
+
+// return nonzero if evaluating n cannot change anything
+static int is_pure(node_t *n)
+{
+    node_t *c;
+
+    switch (n -> type)
+    {
+    case NODE_OPER_FNCALL:
+    case NODE_OPER_POSTINC:
+    case NODE_OPER_POSTDEC:
+    case NODE_OPER_ASS:
+    case NODE_OPER_ADDASS:
+    case NODE_OPER_SUBASS:
+    case NODE_OPER_MULASS:
+    case NODE_OPER_DIVASS:
+    case NODE_OPER_MODASS:
+    case NODE_OPER_LSHASS:
+    case NODE_OPER_RSHASS:
+    case NODE_OPER_BWANDASS:
+    case NODE_OPER_BWXORASS:
+    case NODE_OPER_BWORASS:
+        return 0;
+    }
+    for (c = n -> children; c; c = c -> next_child)
+    {
+        if (!is_pure(c))
+            return 0;
+    }
+    return 1;
+}
+
+// replace n in place with c, which must already be detached from n
+static void become(node_t *n, node_t *c)
+{
+    node_t *nn;
+
+    lw_free(n -> strval);
+    n -> type = c -> type;
+    n -> strval = c -> strval;
+    memcpy(n -> ival, c -> ival, sizeof(n -> ival));
+    n -> children = c -> children;
+    for (nn = n -> children; nn; nn = nn -> next_child)
+        nn -> parent = n;
+    lw_free(c);
+}
+
+static void set_children(node_t *n, node_t *l, node_t *r)
+{
+    n -> children = NULL;
+    node_addchild(n, l);
+    node_addchild(n, r);
+}
+
+/*
+Evaluate a binary operator on constants. Returns 0 if the result is
+undefined and should be left for run time.
+*/
+static int fold_binary(int type, long a, long b, long *r)
+{
+    switch (type)
+    {
+    case NODE_OPER_PLUS:    *r = a + b; break;
+    case NODE_OPER_MINUS:   *r = a - b; break;
+    case NODE_OPER_TIMES:   *r = a * b; break;
+    case NODE_OPER_BWAND:   *r = a & b; break;
+    case NODE_OPER_BWXOR:   *r = a ^ b; break;
+    case NODE_OPER_BWOR:    *r = a | b; break;
+    case NODE_OPER_LT:      *r = a < b; break;
+    case NODE_OPER_LE:      *r = a <= b; break;
+    case NODE_OPER_GT:      *r = a > b; break;
+    case NODE_OPER_GE:      *r = a >= b; break;
+    case NODE_OPER_EQ:      *r = a == b; break;
+    case NODE_OPER_NE:      *r = a != b; break;
+    case NODE_OPER_BAND:    *r = a && b; break;
+    case NODE_OPER_BOR:     *r = a || b; break;
+    case NODE_OPER_COMMA:   *r = b; break;
+
+    case NODE_OPER_DIVIDE:
+    case NODE_OPER_MOD:
+        if (b == 0 || (a == -32768 && b == -1))
+            return 0;
+        *r = (type == NODE_OPER_DIVIDE) ? a / b : a % b;
+        break;
+
+    case NODE_OPER_LSH:
+        if (b < 0 || b > 15)
+            return 0;
+        *r = (unsigned long)a << b;
+        break;
+
+    case NODE_OPER_RSH:
+        if (b < 0 || b > 15)
+            return 0;
+        *r = (a < 0) ? ~(~a >> b) : a >> b;
+        break;
+
+    default:
+        return 0;
+    }
+    *r = wrap16(*r);
+    return 1;
+}
+
+/*
+Simplify a binary operator node whose operands have already been
+optimized. Returns nonzero if n was changed into something else.
+*/
+static int optimize_binary(node_t *n)
+{
+    node_t *l, *r;
+    long lv, rv, v;
+    int k;
+
+    l = n -> children;
+    r = l -> next_child;
+
+    if (is_const(l) && is_const(r))
+    {
+        if (!fold_binary(n -> type, const_value(l), const_value(r), &v))
+            return 0;
+        node_destroy(l);
+        node_destroy(r);
+        n -> children = NULL;
+        n -> type = NODE_CONST_INT;
+        n -> strval = NULL;
+        set_const(n, v);
+        return 1;
+    }
+
+    // a few operators only need to look at the left operand
+    if (is_const(l))
+    {
+        lv = const_value(l);
+        if ((n -> type == NODE_OPER_BAND && lv == 0) || (n -> type == NODE_OPER_BOR && lv != 0))
+        {
+            // the right operand is never evaluated
+            node_destroy(r);
+            n -> children = NULL;
+            become(n, l);
+            set_const(n, lv != 0);
+            return 1;
+        }
+    }
+    if (n -> type == NODE_OPER_COMMA && is_pure(l))
+    {
+        node_destroy(l);
+        n -> children = NULL;
+        r -> next_child = NULL;
+        become(n, r);
+        return 1;
+    }
+
+    // put a constant on the right of commutative operators
+    switch (n -> type)
+    {
+    case NODE_OPER_PLUS:
+    case NODE_OPER_TIMES:
+    case NODE_OPER_BWAND:
+    case NODE_OPER_BWOR:
+    case NODE_OPER_BWXOR:
+        if (is_const(l))
+        {
+            set_children(n, r, l);
+            l = n -> children;
+            r = l -> next_child;
+        }
+        break;
+    }
+    if (!is_const(r))
+        return 0;
+    rv = const_value(r);
+
+    // identities: the result is the left operand
+    if ((rv == 0 && (n -> type == NODE_OPER_PLUS || n -> type == NODE_OPER_MINUS ||
+            n -> type == NODE_OPER_LSH || n -> type == NODE_OPER_RSH ||
+            n -> type == NODE_OPER_BWOR || n -> type == NODE_OPER_BWXOR)) ||
+        (rv == 1 && (n -> type == NODE_OPER_TIMES || n -> type == NODE_OPER_DIVIDE)) ||
+        (rv == -1 && n -> type == NODE_OPER_BWAND))
+    {
+        node_destroy(r);
+        n -> children = NULL;
+        l -> next_child = NULL;
+        become(n, l);
+        return 1;
+    }
+
+    // the result is a constant no matter what the left operand is
+    if (is_pure(l) && ((rv == 0 && (n -> type == NODE_OPER_TIMES || n -> type == NODE_OPER_BWAND)) ||
+        (rv == 1 && n -> type == NODE_OPER_MOD) || (rv == -1 && n -> type == NODE_OPER_BWOR)))
+    {
+        node_destroy(l);
+        n -> children = NULL;
+        become(n, r);
+        set_const(n, (rv == -1) ? -1 : 0);
+        return 1;
+    }
+
+    k = log2_exact(rv);
+    if (k < 0 || k > 14)
+        return 0;
+    switch (n -> type)
+    {
+    case NODE_OPER_TIMES:
+        // x * 2^k is x << k
+        n -> type = NODE_OPER_LSH;
+        set_const(r, k);
+        return 1;
+
+    case NODE_OPER_DIVIDE:
+        // a signed divide rounds toward zero so negative values need
+        // 2^k - 1 added before the arithmetic shift:
+        // (x + ((x >> 15) & (2^k - 1))) >> k
+        if (!is_pure(l))
+            return 0;
+        set_children(n, node_create(NODE_OPER_PLUS, l,
+            node_create(NODE_OPER_BWAND,
+                node_create(NODE_OPER_RSH, node_dup(l), make_const(15)),
+                make_const(rv - 1))), r);
+        n -> type = NODE_OPER_RSH;
+        set_const(r, k);
+        return 1;
+
+    case NODE_OPER_MOD:
+        // the remainder takes the sign of x so round x toward zero to a
+        // multiple of 2^k the same way and take the difference:
+        // x - ((x + ((x >> 15) & (2^k - 1))) & -2^k)
+        if (!is_pure(l))
+            return 0;
+        set_children(n, l, node_create(NODE_OPER_BWAND,
+            node_create(NODE_OPER_PLUS, node_dup(l),
+                node_create(NODE_OPER_BWAND,
+                    node_create(NODE_OPER_RSH, node_dup(l), make_const(15)),
+                    make_const(rv - 1))),
+            make_const(-rv)));
+        node_destroy(r);
+        n -> type = NODE_OPER_MINUS;
+        return 1;
+    }
+    return 0;
+}
+
+static void optimize_cond(node_t *n)
+{
+    node_t *c, *t, *f;
+
+    c = n -> children;
+    t = c -> next_child;
+    f = t -> next_child;
+    if (!is_const(c))
+        return;
+    n -> children = NULL;
+    t -> next_child = NULL;
+    if (const_value(c))
+    {
+        node_destroy(f);
+        become(n, t);
+    }
+    else
+    {
+        node_destroy(t);
+        become(n, f);
+    }
+    node_destroy(c);
+}
+
+static void optimize_typecast(node_t *n)
+{
+    node_t *t, *e;
+    long v;
+
+    t = n -> children;
+    e = t -> next_child;
+    if (!is_const(e))
+        return;
+    v = const_value(e);
+    switch (t -> type)
+    {
+    // only conversions whose result is still an int are folded
+    case NODE_TYPE_SHORT:
+    case NODE_TYPE_INT:
+        break;
+
+    // the parser uses TYPE_CHAR for "signed char"; plain char is unsigned
+    case NODE_TYPE_CHAR:
+    case NODE_TYPE_SCHAR:
+        v = (v & 0x80) ? (v | ~0xffL) : (v & 0xff);
+        break;
+
+    case NODE_TYPE_UCHAR:
+        v &= 0xff;
+        break;
+
+    default:
+        return;
+    }
+    node_destroy(t);
+    n -> children = NULL;
+    e -> next_child = NULL;
+    become(n, e);
+    set_const(n, v);
+}
+
+static int is_binary(node_t *n)
+{
+    switch (n -> type)
+    {
+    case NODE_OPER_PLUS:
+    case NODE_OPER_MINUS:
+    case NODE_OPER_TIMES:
+    case NODE_OPER_DIVIDE:
+    case NODE_OPER_MOD:
+    case NODE_OPER_LSH:
+    case NODE_OPER_RSH:
+    case NODE_OPER_LT:
+    case NODE_OPER_LE:
+    case NODE_OPER_GT:
+    case NODE_OPER_GE:
+    case NODE_OPER_EQ:
+    case NODE_OPER_NE:
+    case NODE_OPER_BWAND:
+    case NODE_OPER_BWXOR:
+    case NODE_OPER_BWOR:
+    case NODE_OPER_BAND:
+    case NODE_OPER_BOR:
+    case NODE_OPER_COMMA:
+        return n -> children && n -> children -> next_child;
+    }
+    return 0;
+}
+
+void optimize_tree(node_t *n)
+{
+    node_t *c;
+
+    for (c = n -> children; c; c = c -> next_child)
+        optimize_tree(c);
+
+    // anything a rewrite exposes gets another look
+    while (is_binary(n) && optimize_binary(n))
+        /* do nothing */ ;
+
+    switch (n -> type)
+    {
+    case NODE_OPER_COND:
+        optimize_cond(n);
+        break;
+
+    case NODE_TYPECAST:
+        optimize_typecast(n);
+        break;
+    }
+}
@@ -0,0 +1,544 @@
+/*
+lwcc/cc-peephole.c
+
+Copyright © 2026 William Astle
+
+This file is part of LWTOOLS.
+
+LWTOOLS is free software: you can redistribute it and/or modify it under the
+terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+Peephole optimizer for the generated assembly
+
+The code generator works from simple templates; this pass reads its output
+back as a list of lines and rewrites wasteful sequences before the code is
+written out. Labels are kept as lines of their own with a trailing ":" and
+instructions as "opcode operand".
+
+Most rules are patterns. A rule lists up to PEEPHOLE_MAXLINES consecutive
+lines to match and the lines to put in their place. In a pattern, %1
+through %9 match any nonempty text; a later use of the same number must
+match the same text and the replacement may use them too. The "where"
+string restricts what the captures may be, as space separated terms:
+
+    N=a|b|c     capture N is one of the words listed
+    N:simple    capture N is an operand that can be read again without
+                side effects (no auto increment or decrement)
+
+Rules that have to look beyond adjacent lines are functions instead.
+
+Rules are applied over and over until none of them changes anything. Each
+has a name so it can be turned off with --peephole-disable; test/runcycles
+uses that to measure what every rule is worth.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lw_alloc.h>
+#include <lw_string.h>
+
+#define PEEPHOLE_MAXLINES 4
+#define PEEPHOLE_MAXPASSES 100
+
+struct peephole_code
+{
+    char **lines;
+    int nlines;
+    int nalloc;
+};
+
+struct peephole_capture
+{
+    const char *s;
+    int len;
+};
+
+struct peephole_rule
+{
+    const char *name;
+    const char *match[PEEPHOLE_MAXLINES + 1];
+    const char *replace[PEEPHOLE_MAXLINES + 1];
+    const char *where;
+    int (*func)(struct peephole_code *code);
+    int disabled;
+};
+
+static int peephole_thread(struct peephole_code *code);
+static int peephole_branchrts(struct peephole_code *code);
+static int peephole_deadlabel(struct peephole_code *code);
+
+#define PEEPHOLE_CONDBRANCHES "beq|bne|blt|ble|bgt|bge|bhi|bls|bhs|blo|bcc|bcs|bmi|bpl|bvc|bvs"
+
+static struct peephole_rule peephole_rules[] =
+{
+    // a value pushed and popped straight back
+    { "push-pop",           { "pshs d", "puls d" },     { NULL },           NULL },
+    // a helper result popped only to be pushed for the next helper
+    { "pop-push",           { "puls d", "pshs d" },     { "ldd ,s" },       NULL },
+    // reloading what was just stored
+    { "store-load",         { "std %1", "ldd %1" },     { "std %1" },       "1:simple" },
+    // the first of two loads is dead
+    { "load-load",          { "ldd %1", "ldd %2" },     { "ldd %2" },       "1:simple" },
+    // Z already reflects D after these
+    { "test-zero",          { "%1 %2", "subd #0", "%3 %4" },
+                            { "%1 %2", "%3 %4" },       "1=ldd|addd|subd 3=beq|bne" },
+    // branches to the next line
+    { "branch-next",        { "bra %1", "%1:" },        { "%1:" },          NULL },
+    { "cond-branch-next",   { "%2 %1", "%1:" },         { "%1:" },          "2=" PEEPHOLE_CONDBRANCHES },
+    // branches to branches go straight to the final target
+    { "thread-branch",      { NULL },                   { NULL },           NULL,   peephole_thread },
+    // a branch to a return is a return
+    { "branch-rts",         { NULL },                   { NULL },           NULL,   peephole_branchrts },
+    // labels nothing refers to any more
+    { "dead-label",         { NULL },                   { NULL },           NULL,   peephole_deadlabel },
+    { NULL }
+};
+
+/*
+Turn off the rule called name, or every rule if name is "all". Returns
+nonzero if there is no such rule.
+*/
+int peephole_disable(const char *name)
+{
+    struct peephole_rule *r;
+    int found = 0;
+
+    for (r = peephole_rules; r -> name; r++)
+    {
+        if (strcmp(name, "all") == 0 || strcmp(name, r -> name) == 0)
+        {
+            r -> disabled = 1;
+            found = 1;
+        }
+    }
+    return !found;
+}
+
+void peephole_list(FILE *fp)
+{
+    struct peephole_rule *r;
+
+    for (r = peephole_rules; r -> name; r++)
+        fprintf(fp, "%s\n", r -> name);
+}
+
+static void peephole_addline(struct peephole_code *code, char *text)
+{
+    if (code -> nlines == code -> nalloc)
+    {
+        code -> nalloc = code -> nalloc ? code -> nalloc * 2 : 256;
+        code -> lines = lw_realloc(code -> lines, sizeof(char *) * code -> nalloc);
+    }
+    code -> lines[code -> nlines++] = text;
+}
+
+// read the generator output, splitting "label<tab>instruction" lines in two
+static void peephole_read(struct peephole_code *code, FILE *fp)
+{
+    char *buf = NULL;
+    char *p, *label;
+    int len = 0, alloc = 0;
+    int c;
+
+    for (;;)
+    {
+        c = fgetc(fp);
+        if (c != '\n' && c != EOF)
+        {
+            if (len + 1 >= alloc)
+            {
+                alloc += 128;
+                buf = lw_realloc(buf, alloc);
+            }
+            buf[len++] = c;
+            continue;
+        }
+        if (len > 0)
+        {
+            buf[len] = 0;
+            p = buf;
+            if (*p != ' ' && *p != '\t')
+            {
+                while (*p && *p != ' ' && *p != '\t')
+                    p++;
+                label = lw_alloc(p - buf + 2);
+                memcpy(label, buf, p - buf);
+                label[p - buf] = ':';
+                label[p - buf + 1] = 0;
+                peephole_addline(code, label);
+            }
+            while (*p == ' ' || *p == '\t')
+                p++;
+            if (*p)
+                peephole_addline(code, lw_strdup(p));
+        }
+        len = 0;
+        if (c == EOF)
+            break;
+    }
+    lw_free(buf);
+}
+
+static void peephole_write(struct peephole_code *code, FILE *fp)
+{
+    char *s;
+    int i, l;
+
+    for (i = 0; i < code -> nlines; i++)
+    {
+        s = code -> lines[i];
+        l = strlen(s);
+        if (s[l - 1] == ':')
+            fprintf(fp, "%.*s\n", l - 1, s);
+        else
+            fprintf(fp, "\t%s\n", s);
+    }
+}
+
+static int peephole_islabel(const char *s)
+{
+    return s[strlen(s) - 1] == ':';
+}
+
+// replace count lines starting at index i with the nnew lines in newlines
+static void peephole_splice(struct peephole_code *code, int i, int count, char **newlines, int nnew)
+{
+    int j;
+
+    for (j = 0; j < count; j++)
+        lw_free(code -> lines[i + j]);
+    while (code -> nlines - count + nnew > code -> nalloc)
+    {
+        code -> nalloc *= 2;
+        code -> lines = lw_realloc(code -> lines, sizeof(char *) * code -> nalloc);
+    }
+    memmove(code -> lines + i + nnew, code -> lines + i + count, sizeof(char *) * (code -> nlines - i - count));
+    for (j = 0; j < nnew; j++)
+        code -> lines[i + j] = newlines[j];
+    code -> nlines += nnew - count;
+}
+
+static int peephole_matchtext(const char *p, const char *t, struct peephole_capture *caps)
+{
+    int n, len;
+
+    for (;;)
+    {
+        if (*p == '%' && p[1] >= '1' && p[1] <= '9')
+            break;
+        if (*p != *t)
+            return 0;
+        if (*p == 0)
+            return 1;
+        p++;
+        t++;
+    }
+
+    n = p[1] - '0';
+    if (caps[n].s)
+    {
+        if (strncmp(t, caps[n].s, caps[n].len) != 0)
+            return 0;
+        return peephole_matchtext(p + 2, t + caps[n].len, caps);
+    }
+    for (len = 1; t[len - 1]; len++)
+    {
+        caps[n].s = t;
+        caps[n].len = len;
+        if (peephole_matchtext(p + 2, t + len, caps))
+            return 1;
+    }
+    caps[n].s = NULL;
+    return 0;
+}
+
+// an operand that does not change a register when used
+static int peephole_simple(const char *s, int len)
+{
+    const char *comma;
+
+    comma = memchr(s, ',', len);
+    if (!comma)
+        return 1;
+    return !memchr(comma, '+', len - (comma - s)) && !memchr(comma, '-', len - (comma - s));
+}
+
+static int peephole_where(const char *w, struct peephole_capture *caps)
+{
+    struct peephole_capture *c;
+    const char *e;
+    int ok;
+
+    while (w && *w)
+    {
+        while (*w == ' ')
+            w++;
+        if (!*w)
+            break;
+        c = &caps[w[0] - '0'];
+        if (w[1] == ':')
+        {
+            // only one predicate so far
+            if (!peephole_simple(c -> s, c -> len))
+                return 0;
+            w = strchr(w, ' ');
+            continue;
+        }
+        ok = 0;
+        w += 2;
+        for (;;)
+        {
+            for (e = w; *e && *e != '|' && *e != ' '; e++)
+                /* do nothing */ ;
+            if (e - w == c -> len && strncmp(w, c -> s, c -> len) == 0)
+                ok = 1;
+            w = e;
+            if (*w != '|')
+                break;
+            w++;
+        }
+        if (!ok)
+            return 0;
+    }
+    return 1;
+}
+
+// fill in the captures in a replacement line
+static char *peephole_subst(const char *p, struct peephole_capture *caps)
+{
+    char *r;
+    const char *q;
+    int len = 0;
+
+    for (q = p; *q; q++)
+    {
+        if (*q == '%' && q[1] >= '1' && q[1] <= '9')
+            len += caps[*++q - '0'].len;
+        else
+            len++;
+    }
+    r = lw_alloc(len + 1);
+    len = 0;
+    for (q = p; *q; q++)
+    {
+        if (*q == '%' && q[1] >= '1' && q[1] <= '9')
+        {
+            q++;
+            memcpy(r + len, caps[*q - '0'].s, caps[*q - '0'].len);
+            len += caps[*q - '0'].len;
+        }
+        else
+            r[len++] = *q;
+    }
+    r[len] = 0;
+    return r;
+}
+
+static int peephole_apply(struct peephole_code *code, struct peephole_rule *r)
+{
+    struct peephole_capture caps[10];
+    char *newlines[PEEPHOLE_MAXLINES];
+    int nmatch, nnew, i, j, changed = 0;
+
+    for (nmatch = 0; r -> match[nmatch]; nmatch++)
+        /* do nothing */ ;
+    for (nnew = 0; r -> replace[nnew]; nnew++)
+        /* do nothing */ ;
+
+    for (i = 0; i + nmatch <= code -> nlines; i++)
+    {
+        memset(caps, 0, sizeof(caps));
+        for (j = 0; j < nmatch; j++)
+        {
+            if (!peephole_matchtext(r -> match[j], code -> lines[i + j], caps))
+                break;
+        }
+        if (j < nmatch || !peephole_where(r -> where, caps))
+            continue;
+        for (j = 0; j < nnew; j++)
+            newlines[j] = peephole_subst(r -> replace[j], caps);
+        peephole_splice(code, i, nmatch, newlines, nnew);
+        changed++;
+        // the lines before may now match something
+        i = (i > PEEPHOLE_MAXLINES) ? i - PEEPHOLE_MAXLINES : -1;
+    }
+    return changed;
+}
+
+// return the target of a branch instruction or NULL if s is not a branch
+static const char *peephole_branchtarget(const char *s, int uncond)
+{
+    static const char *branches = "bra|brn|" PEEPHOLE_CONDBRANCHES;
+    const char *p, *b;
+    int l;
+
+    if (s[0] == 'l')
+        s++;
+    p = strchr(s, ' ');
+    if (!p)
+        return NULL;
+    l = p - s;
+    if (uncond)
+        return (l == 3 && strncmp(s, "bra", 3) == 0) ? p + 1 : NULL;
+    for (b = branches; *b; b += 4)
+    {
+        if (l == 3 && strncmp(s, b, 3) == 0)
+            return p + 1;
+        if (!b[3])
+            break;
+    }
+    return NULL;
+}
+
+// return the index of the first instruction after label name
+static int peephole_labeltarget(struct peephole_code *code, const char *name)
+{
+    int i, l;
+
+    l = strlen(name);
+    for (i = 0; i < code -> nlines; i++)
+    {
+        if (strncmp(code -> lines[i], name, l) == 0 && code -> lines[i][l] == ':' && code -> lines[i][l + 1] == 0)
+            break;
+    }
+    while (i < code -> nlines && peephole_islabel(code -> lines[i]))
+        i++;
+    return (i < code -> nlines) ? i : -1;
+}
+
+static int peephole_thread(struct peephole_code *code)
+{
+    const char *t, *u;
+    char *s;
+    int i, j, changed = 0;
+
+    for (i = 0; i < code -> nlines; i++)
+    {
+        t = peephole_branchtarget(code -> lines[i], 0);
+        if (!t)
+            continue;
+        j = peephole_labeltarget(code, t);
+        if (j < 0 || j == i)
+            continue;
+        u = peephole_branchtarget(code -> lines[j], 1);
+        if (!u || strcmp(t, u) == 0)
+            continue;
+        s = lw_alloc((t - code -> lines[i]) + strlen(u) + 1);
+        memcpy(s, code -> lines[i], t - code -> lines[i]);
+        strcpy(s + (t - code -> lines[i]), u);
+        lw_free(code -> lines[i]);
+        code -> lines[i] = s;
+        changed++;
+    }
+    return changed;
+}
+
+static int peephole_branchrts(struct peephole_code *code)
+{
+    const char *t;
+    int i, j, changed = 0;
+
+    for (i = 0; i < code -> nlines; i++)
+    {
+        t = peephole_branchtarget(code -> lines[i], 1);
+        if (!t)
+            continue;
+        j = peephole_labeltarget(code, t);
+        if (j < 0 || strcmp(code -> lines[j], "rts") != 0)
+            continue;
+        lw_free(code -> lines[i]);
+        code -> lines[i] = lw_strdup("rts");
+        changed++;
+    }
+    return changed;
+}
+
+// return nonzero if the symbol name appears in the operand of any instruction
+static int peephole_referenced(struct peephole_code *code, const char *name, int len)
+{
+    const char *p;
+    int i;
+
+    for (i = 0; i < code -> nlines; i++)
+    {
+        if (peephole_islabel(code -> lines[i]))
+            continue;
+        p = strchr(code -> lines[i], ' ');
+        while (p && (p = strstr(p, name)))
+        {
+            // only whole symbols count
+            if (strchr(" ,#[(+-*/", p[-1]) && (p[len] == 0 || !strchr("_.$@?", p[len]))
+                && !(p[len] >= '0' && p[len] <= '9') && !((p[len] | 0x20) >= 'a' && (p[len] | 0x20) <= 'z'))
+                return 1;
+            p++;
+        }
+    }
+    return 0;
+}
+
+static int peephole_deadlabel(struct peephole_code *code)
+{
+    char *name;
+    int i, l, changed = 0;
+
+    for (i = 0; i < code -> nlines; i++)
+    {
+        if (!peephole_islabel(code -> lines[i]))
+            continue;
+        l = strlen(code -> lines[i]) - 1;
+        name = lw_strndup(code -> lines[i], l);
+        if (!peephole_referenced(code, name, l))
+        {
+            peephole_splice(code, i, 1, NULL, 0);
+            i--;
+            changed++;
+        }
+        lw_free(name);
+    }
+    return changed;
+}
+
+/*
+Copy the generated code from in to out, applying the peephole rules.
+*/
+void peephole_optimize(FILE *in, FILE *out)
+{
+    struct peephole_code code = { NULL, 0, 0 };
+    struct peephole_rule *r;
+    int pass, changed, i;
+
+    peephole_read(&code, in);
+    for (pass = 0; pass < PEEPHOLE_MAXPASSES; pass++)
+    {
+        changed = 0;
+        for (r = peephole_rules; r -> name; r++)
+        {
+            if (r -> disabled)
+                continue;
+            if (r -> func)
+                changed += (r -> func)(&code);
+            else
+                changed += peephole_apply(&code, r);
+        }
+        if (!changed)
+            break;
+    }
+    peephole_write(&code, out);
+    for (i = 0; i < code.nlines; i++)
+        lw_free(code.lines[i]);
+    lw_free(code.lines);
+}
@@ -48,6 +48,7 @@ lw_stringlist_t macrolist;
 
 /* various flags */
 int trigraphs = 0;
+int line_gap = 8;
 char *output_file = NULL;
 FILE *output_fp = NULL;
 
@@ -59,6 +60,7 @@ static struct lw_cmdline_options options[] =
 	{ "sincludedir", 'S',	"PATH",		0,							"Add entry to the system include path" },
 	{ "define", 	'D',	"SYM[=VAL]",0, 							"Automatically define SYM to be VAL (or 1)"},
 	{ "trigraphs",	0x100,	NULL,		0,							"Enable interpretation of trigraphs" },
+	{ "line-gap",	0x101,	"LINES",	0,							"Emit a line marker instead of more than LINES blank lines (default 8)" },
 	{ 0 }
 };
 
@@ -76,6 +78,15 @@ static int parse_opts(int key, char *arg, void *state)
 		trigraphs = 1;
 		break;
 
+	case 0x101:
+		{
+			char *ep;
+			line_gap = strtol(arg, &ep, 10);
+			if (*arg == 0 || *ep || line_gap < 0)
+				do_error("Invalid line gap %s", arg);
+		}
+		break;
+
 	case 'I':
 		lw_stringlist_addstring(includedirs, arg);
 		break;
@@ -160,35 +171,111 @@ int main(int argc, char **argv)
 	exit(retval);
 }
 
-static void print_line_marker(FILE *fp, int line, const char *fn, int flag)
+/*
+Output is collected in a large buffer and written in big blocks rather than
+going through stdio a token at a time. out_bol tracks whether the output is
+at the start of a line so line markers can always begin on a fresh line.
+*/
+#define OUTBUF_SIZE 65536
+static char outbuf[OUTBUF_SIZE];
+static int outbuf_len = 0;
+static int out_bol = 1;
+
+static void out_flush(void)
 {
-	fprintf(fp, "\n# %d \"", line);
-	while (*fn)
+	if (outbuf_len > 0 && fwrite(outbuf, 1, outbuf_len, output_fp) != outbuf_len)
+		do_error("Failed writing output: %s", strerror(errno));
+	outbuf_len = 0;
+}
+
+static void out_write(const char *s, int len)
+{
+	if (len <= 0)
+		return;
+	if (outbuf_len + len > OUTBUF_SIZE)
 	{
-		if (*fn < 32 || *fn == 34 || *fn > 126)
+		out_flush();
+		// too big to be worth buffering; send it straight out
+		if (len > OUTBUF_SIZE)
 		{
-			fprintf(fp, "\\%03o", *fn);
+			if (fwrite(s, 1, len, output_fp) != len)
+				do_error("Failed writing output: %s", strerror(errno));
+			out_bol = (s[len - 1] == '\n');
+			return;
+		}
+	}
+	memcpy(outbuf + outbuf_len, s, len);
+	outbuf_len += len;
+	out_bol = (s[len - 1] == '\n');
+}
+
+static void out_char(int c)
+{
+	if (outbuf_len == OUTBUF_SIZE)
+		out_flush();
+	outbuf[outbuf_len++] = c;
+	out_bol = (c == '\n');
+}
+
+static void out_newlines(int n)
+{
+	int l;
+	
+	while (n > 0)
+	{
+		if (outbuf_len == OUTBUF_SIZE)
+			out_flush();
+		l = OUTBUF_SIZE - outbuf_len;
+		if (l > n)
+			l = n;
+		memset(outbuf + outbuf_len, '\n', l);
+		outbuf_len += l;
+		n -= l;
+		out_bol = 1;
+	}
+}
+
+/* a flag of 0 means no flag; the marker always ends its own line */
+static void print_line_marker(int line, const char *fn, int flag)
+{
+	char buf[32];
+	
+	if (!out_bol)
+		out_char('\n');
+	out_write(buf, sprintf(buf, "# %d \"", line));
+	for (; *fn; fn++)
+	{
+		unsigned char c = *fn;
+		if (c < 32 || c == 34 || c == 92 || c > 126)
+		{
+			out_write(buf, sprintf(buf, "\\%03o", c));
 		}
 		else
 		{
-			fprintf(fp, "%c", *fn);
+			out_char(c);
 		}
-		fn++;
 	}
-	fprintf(fp, "\" %d", flag);
+	if (flag)
+		out_write(buf, sprintf(buf, "\" %d\n", flag));
+	else
+		out_write("\"\n", 2);
 }
 
 int process_file(const char *fn)
 {
 	struct preproc_info *pp;
 	struct token *tok = NULL;
+	struct token *ws = NULL;
 	int last_line = 0;
-	char *last_fn = NULL;
+	int eol = 0;
+	const char *last_fn = NULL;
+	const char *ts;
 	char *tstr;
 		
 	pp = preproc_init(fn);
 	if (!pp)
 		return -1;
+	pp -> trigraphs = trigraphs;
 
 	/* set up the include paths */
 	lw_stringlist_reset(includedirs);
@@ -210,40 +297,84 @@ int process_file(const char *fn)
 		preproc_add_macro(pp, tstr);
 	}
 
-	print_line_marker(output_fp, 1, fn, 1);
-	last_fn = lw_strdup(fn);	
+	print_line_marker(1, fn, 1);
+	last_line = 1;
+	// file names are pooled by the preprocessor so a pointer compare will do
+	last_fn = pp -> fn;
 	for (;;)
 	{
 		tok = preproc_next(pp);
 		if (tok -> ttype == TOK_EOF)
 			break;
-		if (strcmp(tok -> fn, last_fn) != 0)
+		/*
+		Line ends are held back rather than written as they come: blank
+		lines and lines skipped by a conditional each arrive as a bare
+		TOK_EOL, so only the next real token knows how far the output has
+		to move and whether that is far enough to want a line marker.
+		Whitespace that starts a line is held too so a line with nothing
+		but blanks on it counts as blank.
+		*/
+		if (tok -> ttype == TOK_EOL)
+		{
+			eol = 1;
+			if (ws)
+				token_free(ws);
+			ws = NULL;
+			token_free(tok);
+			continue;
+		}
+		if (tok -> ttype == TOK_WSPACE && (eol || tok -> fn != last_fn || tok -> lineno > last_line))
+		{
+			if (ws)
+				token_free(ws);
+			ws = tok;
+			continue;
+		}
+		if (tok -> fn != last_fn)
 		{
-			int lt = 1;
-			if (tok -> lineno != 1)
+			last_fn = tok -> fn;
+			last_line = tok -> lineno;
+			print_line_marker(last_line, last_fn, (last_line == 1) ? 1 : 2);
+		}
+		else if (tok -> lineno > last_line)
+		{
+			if (tok -> lineno - last_line > line_gap)
+			{
+				print_line_marker(tok -> lineno, last_fn, 0);
+			}
+			else
 			{
-				lt = 2;
+				out_newlines(tok -> lineno - last_line);
 			}
-			lw_free(last_fn);
-			last_fn = lw_strdup(tok -> fn);
 			last_line = tok -> lineno;
-			print_line_marker(output_fp, last_line, last_fn, lt);
 		}
-		else
+		else if (eol)
 		{
-			while (tok -> lineno > last_line)
+			// a #line moved us backwards (or nowhere); say where we are
+			last_line = tok -> lineno;
+			print_line_marker(last_line, last_fn, 0);
+		}
+		eol = 0;
+		if (ws)
+		{
+			if (ws -> fn == tok -> fn && ws -> lineno == tok -> lineno)
 			{
-				fprintf(output_fp, "\n");
-				last_line++;
+				ts = token_text(ws);
+				out_write(ts, strlen(ts));
 			}
+			token_free(ws);
+			ws = NULL;
 		}
-		token_print(tok, output_fp);
-		if (tok -> ttype == TOK_EOL)
-			last_line++;
+		ts = token_text(tok);
+		out_write(ts, strlen(ts));
 		token_free(tok);
 	}
 	token_free(tok);
-	lw_free(last_fn);
+	if (ws)
+		token_free(ws);
+	if (!out_bol)
+		out_char('\n');
+	out_flush();
 //	symtab_dump(pp);
 	preproc_finish(pp);
 	return 0;
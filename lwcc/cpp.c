@@ -25,13 +25,19 @@ this program. If not, see <http://www.gnu.org/licenses/>.
 #include <string.h>
 
 #include <lw_alloc.h>
+#include <lw_strbuf.h>
 #include <lw_string.h>
 #include <lw_stringlist.h>
 #include <lw_strpool.h>
 #include "cpp.h"
+#include "symbol.h"
 
 
 struct token *preproc_lex_next_token(struct preproc_info *);
+extern int preproc_lex_open(struct preproc_info *, FILE *);
+extern void preproc_lex_close(struct preproc_info *);
+extern void preproc_include_init(struct preproc_info *);
+extern void preproc_include_finish(struct preproc_info *);
 
 struct preproc_info *preproc_init(const char *fn)
 {
@@ -52,8 +58,22 @@ struct preproc_info *preproc_init(const char *fn)
 	pp = lw_alloc(sizeof(struct preproc_info));
 	memset(pp, 0, sizeof(struct preproc_info));
 	pp -> strpool = lw_strpool_create();
+	pp -> sh = symtab_create();
+	pp -> lexbuf = lw_strbuf_new();
+	preproc_include_init(pp);
 	pp -> fn = lw_strpool_strdup(pp -> strpool, fn);
-	pp -> fp = fp;
+	if (preproc_lex_open(pp, fp))
+	{
+		fclose(fp);
+		preproc_lex_close(pp);
+		symtab_destroy(pp -> sh);
+		lw_free(lw_strbuf_end(pp -> lexbuf));
+		preproc_include_finish(pp);
+		lw_strpool_free(pp -> strpool);
+		lw_free(pp);
+		return NULL;
+	}
+	fclose(fp);
 	pp -> ra = CPP_NOUNG;
 	pp -> unget = CPP_NOUNG;
 	pp -> ppeolseen = 1;
@@ -128,7 +148,7 @@ void preproc_unget_token(struct preproc_info *pp, struct token *t)
 
 void preproc_finish(struct preproc_info *pp)
 {
-	fclose(pp -> fp);
+	preproc_lex_close(pp);
 	lw_stringlist_destroy(pp -> inclist);
 	lw_stringlist_destroy(pp -> quotelist);
 	if (pp -> curtok)
@@ -138,8 +158,12 @@ void preproc_finish(struct preproc_info *pp)
 		preproc_next_token(pp);
 		token_free(pp -> curtok);
 	}
+	symtab_destroy(pp -> sh);
+	lw_free(lw_strbuf_end(pp -> lexbuf));
+	preproc_include_finish(pp);
 	lw_strpool_free(pp -> strpool);
 	lw_free(pp);
+	token_arena_release();
 }
 
 void preproc_register_error_callback(struct preproc_info *pp, void (*cb)(const char *))
@@ -166,9 +190,13 @@ static void preproc_throw_message(struct preproc_info *pp, void (*cb)(const char
 {
 	int s, s2;
 	char *b;
+	va_list args2;
 	
+	// the arguments are walked twice so the first pass needs its own copy
+	va_copy(args2, args);
 	s2 = snprintf(NULL, 0, "(%s:%d:%d) ", pp -> fn, pp -> lineno, pp -> column);
-	s = vsnprintf(NULL, 0, m, args);
+	s = vsnprintf(NULL, 0, m, args2);
+	va_end(args2);
 	b = lw_alloc(s + s2 + 1);
 	snprintf(b, s2 + 1, "(%s:%d:%d) ", pp -> fn, pp -> lineno, pp -> column);
 	vsnprintf(b + s2, s + 1, m, args);
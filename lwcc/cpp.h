@@ -23,6 +23,7 @@ this program. If not, see <http://www.gnu.org/licenses/>.
 #define cpp_h_seen___
 
 #include <stdio.h>
+#include <sys/types.h>
 
 #include <lw_stringlist.h>
 
@@ -37,10 +38,18 @@ struct expand_e
 	struct symtab_e *s;		// symbol table entry of the expanding symbol
 };
 
+struct preproc_inccache;
+
 struct preproc_info
 {
 	const char *fn;
-	FILE *fp;
+	const char *incfn;		// the path the current file was opened as
+	dev_t incdev;			// device and inode of the current include file
+	ino_t incino;
+	unsigned char *inbuf;	// the entire contents of the current input file
+	size_t inbuflen;		// the number of bytes in inbuf
+	size_t inbufpos;		// offset of the next byte to read from inbuf
+	size_t inbufplain;		// bytes before this offset need no special handling
 	struct token *tokqueue;
 	struct token *curtok;
 	void (*errorcb)(const char *);
@@ -62,7 +71,9 @@ struct preproc_info
 	int found_level;		// nonzero if we're in a true conditional
 	int else_level;			// for counting #else directives
 	int else_skip_level;	// ditto
-	struct symtab_e *sh;	// the preprocessor's symbol table
+	int guardstate;			// progress matching the include guard idiom in this file
+	const char *guardname;	// the include guard macro, if guardstate says there is one
+	struct symtab *sh;		// the preprocessor's symbol table
 	struct token *sourcelist;	// for expanding a list of tokens
 	struct expand_e *expand_list;	// record of which macros are currently being expanded
 	char *lexstr;			// for lexing a string (token pasting)
@@ -70,6 +81,8 @@ struct preproc_info
 	struct preproc_info *n;	// next in file stack
 	struct preproc_info *filestack;	// stack of saved files during include
 	struct lw_strpool *strpool;
+	struct lw_strbuf *lexbuf;	// reusable buffer for the text of the current token
+	struct preproc_inccache *inccache;	// include path lookups and guarded files
 	lw_stringlist_t quotelist;
 	lw_stringlist_t inclist;
 };
@@ -35,6 +35,13 @@ this program. If not, see <http://www.gnu.org/licenses/>.
 
 #include <version.h>
 
+#include "cpp.h"
+#include "tree.h"
+
+extern node_t *parse_program(struct preproc_info *pp);
+extern void optimize_tree(node_t *n);
+extern void generate_program(node_t *n, FILE *of);
+
 #define VERSTRING "lwcc from " PACKAGE_STRING
 #define S(x) S2(x)
 #define S2(x) #x
@@ -64,6 +71,16 @@ const char *temp_directory = NULL;
 static volatile sig_atomic_t sigterm_received = 0;
 static volatile sig_atomic_t child_pid = 0;
 
+/* with -j, this many input files may be worked on at once; the process ids
+   of the running jobs are kept so SIGTERM can be passed along to them */
+#define MAX_JOBS 64
+static int max_jobs = 1;
+static volatile sig_atomic_t job_pids[MAX_JOBS];
+
+/* in a job process, temporary files and linker inputs are reported to the
+   parent through this file since the parent's lists can't be updated */
+static FILE *job_report = NULL;
+
 /* path specified with --sysroot */
 const char *sysroot = "";
 /* path specified with -isysroot */
@@ -78,6 +95,7 @@ int nostartfiles = 0;			// set if -nostartfiles is specified
 int nostdlib = 0;				// set if -nostdlib is specified
 int verbose_mode = 0;			// set to number of --verbose arguments
 int save_temps = 0;				// set if -save-temps is specified
+int no_integrated = 0;			// set if -no-integrated-cpp is specified
 int debug_mode = 0;				// set if -g specified
 int pic_mode = 0;				// set to 1 if -fpic, 2 if -fPIC; last one specified wins
 const char *output_file;		// set to the value of the -o option (output file)
@@ -114,9 +132,16 @@ static void parse_command_line(int, char **);
    might currently be running */
 static void exit_on_signal(int sig)
 {
+	int i;
+	
 	sigterm_received = 1;
 	if (child_pid)
 		kill(child_pid, SIGTERM);
+	for (i = 0; i < MAX_JOBS; i++)
+	{
+		if (job_pids[i])
+			kill(job_pids[i], SIGTERM);
+	}
 }
 
 /* utility function to carp about an error condition and bail */
@@ -220,7 +245,7 @@ static char *find_file(const char *fn, lw_stringlist_t p, int mode)
 	{
 		lp = strlen(s);
 		need_slash = 0;
-		if (lp && s[lp - 1] == '/')
+		if (lp && s[lp - 1] != '/')
 			need_slash = 1;
 		f = lw_alloc(lp + lf + need_slash + 1);
 		memcpy(f, s, lp);
@@ -289,8 +314,6 @@ static int execute_program(lw_stringlist_t args)
 		/* failure to make child process */
 		do_error("Failed to execute program %s: %s", argv[0], strerror(errno));
 	}
-	/* clean up argv */
-	lw_free(argv);
 	
 	/* parent process - wait for child to exit */
 	while (waitpid(child_pid, &result, 0) == -1 && errno == EINTR)
@@ -302,10 +325,44 @@ static int execute_program(lw_stringlist_t args)
 		/* carp about non-zero return status */
 		do_error("%s terminated with status %d", argv[0], result);
 	}
+	/* clean up argv */
+	lw_free(argv);
 	/* return nonzero if signalled to exit */
 	return sigterm_received;
 }
 
+/* make the temporary directory and record its name in temp_directory */
+static void make_temp_directory(void)
+{
+	const char *dirtempl;
+	char *path;
+	size_t dirtempl_len;
+	int need_slash;
+	
+	/* look for a TMPFIR environment variable and use that if present
+	   but use /tmp as a fallback */
+	dirtempl = getenv("TMPDIR");
+	if (dirtempl == NULL)
+		dirtempl = "/tmp";
+	dirtempl_len = strlen(dirtempl);
+	/* work out if we need to add a slash on the end of the directory */
+	if (dirtempl_len && dirtempl[dirtempl_len - 1] == '/')
+		need_slash = 0;
+	else
+		need_slash = 1;
+	/* make a string of the form <tempdir>/lwcc-XXXXXX */
+	path = lw_alloc(dirtempl_len + need_slash + 11 + 1);
+	memcpy(path, dirtempl, dirtempl_len);
+	if (need_slash)
+		path[dirtempl_len] = '/';
+	memcpy(path + dirtempl_len + need_slash, "lwcc-XXXXXX", 12);
+	/* now make a temporary directory */
+	if (mkdtemp(path) == NULL)
+		do_error("mkdtemp failed: %s", strerror(errno));
+	/* record the temporary directory name */
+	temp_directory = path;
+}
+
 /*
 construct an output file name as follows:
 
@@ -357,36 +414,7 @@ static char *output_name(const char *f, const char *nsuffix, int last)
 
 	/* finally, use a temporary file */
 	if (temp_directory == NULL)
-	{
-		/* if we haven't already made a temporary directory, do so */
-		const char *dirtempl;
-		char *path;
-		size_t dirtempl_len;
-		int need_slash;
-		
-		/* look for a TMPFIR environment variable and use that if present
-		   but use /tmp as a fallback */
-		dirtempl = getenv("TMPDIR");
-		if (dirtempl == NULL)
-			dirtempl = "/tmp";
-		dirtempl_len = strlen(dirtempl);
-		/* work out if we need to add a slash on the end of the directory */
-		if (dirtempl_len && dirtempl[dirtempl_len - 1] == '/')
-			need_slash = 0;
-		else
-			need_slash = 1;
-		/* make a string of the form <tempdir>/lwcc-XXXXXX */
-		path = lw_alloc(dirtempl_len + need_slash + 11 + 1);
-		memcpy(path, dirtempl, dirtempl_len);
-		if (need_slash)
-			path[dirtempl_len] = '/';
-		memcpy(path + dirtempl_len + need_slash, "lwcc-XXXXXX", 12);
-		/* now make a temporary directory */
-		if (mkdtemp(path) == NULL)
-			do_error("mkdtemp failed: %s", strerror(errno));
-		/* record the temporary directory name */
-		temp_directory = path;
-	}
+		make_temp_directory();
 	/* now create a file name in the temporary directory. The strategy here
 	   uses a counter that is passed along and is guaranteed to be unique for
 	   every file requested. */
@@ -403,6 +431,8 @@ static char *output_name(const char *f, const char *nsuffix, int last)
 	
 	/* record the temporary file name for later */
 	lw_stringlist_addstring(tempfiles, name);
+	if (job_report)
+		fprintf(job_report, "T%s\n", name);
 	return name;
 }
 
@@ -585,6 +615,97 @@ static int preprocess_file(const char *file, char *input, char **output, const c
 	return retval;
 }
 
+/*
+Return nonzero if a C file can be preprocessed and compiled within the
+driver itself. That needs the preprocessor arguments to be ones the driver
+understands and rules out -save-temps and -no-integrated-cpp, which want
+the phases run as separate programs.
+*/
+static int can_integrate(void)
+{
+	char *s;
+	
+	if (save_temps || no_integrated)
+		return 0;
+	if (lw_stringlist_nstrings(includes) > 0)
+		return 0;
+	lw_stringlist_reset(preproc_args);
+	for (s = lw_stringlist_current(preproc_args); s; s = lw_stringlist_next(preproc_args))
+	{
+		if (strncmp(s, "-D", 2) != 0 && strcmp(s, "-trigraphs") != 0)
+			return 0;
+	}
+	return 1;
+}
+
+/* preprocess and compile a C file within the driver. Tokens go straight
+   from the preprocessor to the parser so there is no .i file and neither
+   lwcc-cpp nor lwcc-cc gets started. */
+static int compile_integrated(const char *file, char *input, char **output, const char *suffix)
+{
+	struct preproc_info *pp;
+	node_t *program_tree;
+	FILE *fp;
+	char *out;
+	char *s;
+	
+	out = output_name(file, suffix, stop_after == PHASE_COMPILE);
+	if (verbose_mode)
+		printf("Compiling %s to %s\n", input, out);
+	if (sigterm_received)
+	{
+		lw_free(out);
+		return 1;
+	}
+	
+	pp = preproc_init(input);
+	if (!pp)
+		do_error("Cannot open %s: %s", input, strerror(errno));
+	
+	/* set up the same include paths and macros lwcc-cpp would get */
+	lw_stringlist_reset(include_dirs);
+	for (s = lw_stringlist_current(include_dirs); s; s = lw_stringlist_next(include_dirs))
+		preproc_add_include(pp, s, 0);
+	lw_stringlist_reset(user_sysincdirs);
+	for (s = lw_stringlist_current(user_sysincdirs); s; s = lw_stringlist_next(user_sysincdirs))
+		preproc_add_include(pp, s, 1);
+	if (!nostdinc)
+	{
+		lw_stringlist_reset(priv_sysincdirs);
+		for (s = lw_stringlist_current(priv_sysincdirs); s; s = lw_stringlist_next(priv_sysincdirs))
+			preproc_add_include(pp, s, 1);
+		lw_stringlist_reset(sysincdirs);
+		for (s = lw_stringlist_current(sysincdirs); s; s = lw_stringlist_next(sysincdirs))
+			preproc_add_include(pp, s, 1);
+	}
+	lw_stringlist_reset(preproc_args);
+	for (s = lw_stringlist_current(preproc_args); s; s = lw_stringlist_next(preproc_args))
+	{
+		if (strcmp(s, "-trigraphs") == 0)
+			pp -> trigraphs = 1;
+		else
+			preproc_add_macro(pp, s + 2);
+	}
+	
+	program_tree = node_create(NODE_PROGRAM);
+	node_addchild(program_tree, parse_program(pp));
+	preproc_finish(pp);
+	optimize_tree(program_tree);
+	
+	fp = fopen(out, "wb");
+	if (!fp)
+		do_error("Failed to create output file %s: %s", out, strerror(errno));
+	generate_program(program_tree, fp);
+	if (fclose(fp) != 0)
+		do_error("Failed writing %s: %s", out, strerror(errno));
+	node_destroy(program_tree);
+
+	if (*output == input)
+		lw_free(input);
+	*output = out;
+	return sigterm_received;
+}
+
 /*
 handle an input file through the various stages of compilation. If any
 stage decides to handle an input file, that fact is recorded. If control
@@ -597,7 +718,7 @@ static int handle_input_file(const char *f)
 {
 	const char *suffix;
 	char *src;
-	int handled, retval;
+	int handled = 0, retval = 0;
 	
 	/* note: this needs to handle -x but for now, assume c for stdin */	
 	if (strcmp(f, "-") == 0)
@@ -617,8 +738,17 @@ static int handle_input_file(const char *f)
 	/* make a copy of the file */
 	src = lw_strdup(f);
 	
+	/* preprocess and compile in one go if nothing needs the .i file */
+	if (strcmp(suffix, ".c") == 0 && stop_after >= PHASE_COMPILE && can_integrate())
+	{
+		suffix = ".s";
+		retval = compile_integrated(f, src, &src, suffix);
+		if (retval)
+			goto done;
+		handled = 1;
+	}
 	/* preprocess if appropriate */
-	if (strcmp(suffix, ".c") == 0)
+	else if (strcmp(suffix, ".c") == 0)
 	{
 		/* preprocessed c input source goes to .i */
 		suffix = ".i";
@@ -674,6 +804,8 @@ static int handle_input_file(const char *f)
 	
 	/* add the final file name to the linker args */
 	lw_stringlist_addstring(linker_args, src);
+	if (job_report)
+		fprintf(job_report, "L%s\n", src);
 done:
 	if (!handled && !retval)
 	{
@@ -693,6 +825,173 @@ done:
 	return retval;
 }
 
+/*
+Parallel handling of input files for -j. Each input file gets its own job
+process which runs handle_input_file() for it. Whatever a job writes to
+stdout or stderr, including the output of the programs it runs, goes to
+temporary files. The parent passes that along in the order the files were
+given so the diagnostics come out the same no matter which job finishes
+first. Jobs also report the temporary files they made and the file to hand
+to the linker so the parent can clean up and link as usual.
+
+No new jobs are started once one fails. Output is passed along up to and
+including the first failed file in command line order; anything from later
+files is dropped.
+*/
+struct job
+{
+	char *file;					// input file being handled
+	pid_t pid;					// job process, 0 once it has been reaped
+	int slot;					// entry in job_pids
+	int status;					// exit status of the job
+	int done;					// set once the job has finished
+	FILE *out;					// collected stdout
+	FILE *err;					// collected stderr
+	FILE *report;				// temporary files and linker inputs
+};
+
+/* each job gets its own range of temporary file numbers; this is more than
+   the number of phases an input file can go through */
+#define JOB_FILE_COUNTER_STRIDE 8
+
+static void copy_stream(FILE *from, FILE *to)
+{
+	char buf[4096];
+	size_t n;
+	
+	rewind(from);
+	while ((n = fread(buf, 1, sizeof(buf), from)) > 0)
+		fwrite(buf, 1, n, to);
+	fflush(to);
+}
+
+static void start_job(struct job *j)
+{
+	int i;
+	
+	for (j -> slot = 0; job_pids[j -> slot]; j -> slot++)
+		/* do nothing */ ;
+	j -> out = tmpfile();
+	j -> err = tmpfile();
+	j -> report = tmpfile();
+	if (!j -> out || !j -> err || !j -> report)
+		do_error("Failed to create temporary file: %s", strerror(errno));
+	j -> done = 0;
+	j -> status = 0;
+	
+	/* make sure nothing buffered gets written twice */
+	fflush(NULL);
+	j -> pid = fork();
+	if (j -> pid == 0)
+	{
+		/* job process */
+		for (i = 0; i < MAX_JOBS; i++)
+			job_pids[i] = 0;
+		dup2(fileno(j -> out), STDOUT_FILENO);
+		dup2(fileno(j -> err), STDERR_FILENO);
+		job_report = j -> report;
+		exit(handle_input_file(j -> file) ? 1 : 0);
+	}
+	else if (j -> pid == -1)
+	{
+		do_error("Failed to start job for %s: %s", j -> file, strerror(errno));
+	}
+	job_pids[j -> slot] = j -> pid;
+	file_counter += JOB_FILE_COUNTER_STRIDE;
+}
+
+/* collect what a finished job did; its output and linker input are only
+   used if keep is set but its temporary files are always recorded */
+static void finish_job(struct job *j, int keep)
+{
+	char buf[1024];
+	size_t l;
+	
+	if (keep)
+	{
+		copy_stream(j -> out, stdout);
+		copy_stream(j -> err, stderr);
+	}
+	rewind(j -> report);
+	while (fgets(buf, sizeof(buf), j -> report))
+	{
+		l = strlen(buf);
+		if (l && buf[l - 1] == '\n')
+			buf[--l] = '\0';
+		if (buf[0] == 'T')
+			lw_stringlist_addstring(tempfiles, buf + 1);
+		else if (buf[0] == 'L' && keep)
+			lw_stringlist_addstring(linker_args, buf + 1);
+	}
+	fclose(j -> out);
+	fclose(j -> err);
+	fclose(j -> report);
+}
+
+static int handle_input_files_parallel(void)
+{
+	struct job *jobs;
+	int njobs, started, reported, running, failed, keep, i, status;
+	pid_t pid;
+	char *s;
+	
+	njobs = lw_stringlist_nstrings(input_files);
+	jobs = lw_alloc(sizeof(struct job) * njobs);
+	lw_stringlist_reset(input_files);
+	for (i = 0, s = lw_stringlist_current(input_files); s; s = lw_stringlist_next(input_files))
+		jobs[i++].file = s;
+	
+	/* the jobs have to share the temporary directory so make it now */
+	if (!save_temps && temp_directory == NULL)
+		make_temp_directory();
+	
+	started = reported = running = failed = 0;
+	keep = 1;
+	for (;;)
+	{
+		while (started < njobs && running < max_jobs && !failed && !sigterm_received)
+		{
+			start_job(&jobs[started++]);
+			running++;
+		}
+		if (running == 0)
+			break;
+		
+		pid = waitpid(-1, &status, 0);
+		if (pid == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			do_error("waitpid failed: %s", strerror(errno));
+		}
+		for (i = 0; i < started; i++)
+		{
+			if (jobs[i].pid == pid)
+				break;
+		}
+		if (i == started)
+			continue;
+		job_pids[jobs[i].slot] = 0;
+		jobs[i].pid = 0;
+		jobs[i].done = 1;
+		jobs[i].status = (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : 1;
+		running--;
+		if (jobs[i].status)
+			failed = 1;
+		
+		/* pass along whatever has finished in command line order */
+		for (; reported < started && jobs[reported].done; reported++)
+		{
+			finish_job(&jobs[reported], keep);
+			if (jobs[reported].status)
+				keep = 0;
+		}
+	}
+	
+	lw_free(jobs);
+	return failed || sigterm_received;
+}
+
 /*
 This actually runs the linker. Along the way, all the files the linker
 is supposed to handle will have been added to linker_args.
@@ -806,11 +1105,18 @@ int main(int argc, char **argv)
 	signal(SIGTERM, exit_on_signal);
 	
 	/* handle input files */
-	lw_stringlist_reset(input_files);
-	for (ap = lw_stringlist_current(input_files); ap; ap = lw_stringlist_next(input_files))
+	if (max_jobs > 1 && lw_stringlist_nstrings(input_files) > 1)
 	{
-		if (handle_input_file(ap))
-			retval = 1;
+		retval = handle_input_files_parallel();
+	}
+	else
+	{
+		lw_stringlist_reset(input_files);
+		for (ap = lw_stringlist_current(input_files); ap; ap = lw_stringlist_next(input_files))
+		{
+			if (handle_input_file(ap))
+				retval = 1;
+		}
 	}
 
 	if (!retval && stop_after >= PHASE_LINK)
@@ -828,7 +1134,8 @@ int main(int argc, char **argv)
 		lw_stringlist_reset(tempfiles);
 		for (ap = lw_stringlist_current(tempfiles); ap; ap = lw_stringlist_next(tempfiles))
 		{
-			if (unlink(ap) == -1)
+			/* a phase that failed may not have made its output file */
+			if (unlink(ap) == -1 && errno != ENOENT)
 			{
 				do_warning("Removal of %s failed: %s", ap, strerror(errno));
 			}
@@ -873,6 +1180,7 @@ struct option_e
 enum CMD_MISC {
 	CMD_MISC_VERSION,
 	CMD_MISC_OPTIMIZE,
+	CMD_MISC_JOBS,
 };
 
 enum OPT_ARG {
@@ -965,6 +1273,15 @@ static int cmdline_misc(char *opt, char *optarg, int optcode, void *optptr)
 		}
 		return -1;
 
+	case CMD_MISC_JOBS:
+		{
+			char *ep;
+			max_jobs = strtol(optarg, &ep, 10);
+			if (*ep || max_jobs < 1 || max_jobs > MAX_JOBS)
+				do_error("-j must be between 1 and %d", MAX_JOBS);
+		}
+		return 0;
+
 	default:
 		return -1;
 	}
@@ -999,7 +1316,9 @@ struct option_e optionlist[] =
 	{ "-include",			OPT_ARG_SEP,	1,	0,					&includes,		cmdline_optarglist },
 	{ "-isysroot",			OPT_ARG_SEP,	1,	0,					&isysroot,		cmdline_set_string },
 	{ "-isystem",			OPT_ARG_SEP,	1,	0,					&user_sysincdirs, cmdline_optarglist },
+	{ "-j",					OPT_ARG_SEP,	0,	CMD_MISC_JOBS,		NULL,			cmdline_misc },
 	{ "-M",					OPT_ARG_OPT,	1,	0,					&preproc_args,	cmdline_arglist },
+	{ "-no-integrated-cpp",	OPT_ARG_OPT,	1,	1,					&no_integrated,	cmdline_set_int },
 	{ "-nostartfiles",		OPT_ARG_OPT,	1,	1,					&nostartfiles,	cmdline_set_int },
 	{ "-nostdinc",			OPT_ARG_OPT,	1,	1,					&nostdinc,		cmdline_set_int },
 	{ "-nostdlib",			OPT_ARG_OPT,	1,	1,					&nostdlib,		cmdline_set_int },
@@ -28,6 +28,60 @@ this program. If not, see <http://www.gnu.org/licenses/>.
 #include "cpp.h"
 #include "token.h"
 
+extern void preproc_include_done(struct preproc_info *);
+
+/* Read the entire contents of fp into the input buffer of pp. The caller
+   remains responsible for closing fp. Returns nonzero on a read error. */
+int preproc_lex_open(struct preproc_info *pp, FILE *fp)
+{
+	size_t bufsize = 16384;
+	size_t n;
+	long l;
+	
+	if (fseek(fp, 0, SEEK_END) == 0)
+	{
+		l = ftell(fp);
+		if (l > 0)
+			bufsize = l + 1;
+		rewind(fp);
+	}
+	
+	pp -> inbuf = lw_alloc(bufsize);
+	pp -> inbuflen = 0;
+	pp -> inbufpos = 0;
+	pp -> inbufplain = 0;
+	for (;;)
+	{
+		if (pp -> inbuflen == bufsize)
+		{
+			bufsize *= 2;
+			pp -> inbuf = lw_realloc(pp -> inbuf, bufsize);
+		}
+		n = fread(pp -> inbuf + pp -> inbuflen, 1, bufsize - pp -> inbuflen, fp);
+		if (n == 0)
+			break;
+		pp -> inbuflen += n;
+	}
+	return ferror(fp);
+}
+
+/* release the input buffers of the current file */
+void preproc_lex_close(struct preproc_info *pp)
+{
+	lw_free(pp -> inbuf);
+	lw_free(pp -> ungetbuf);
+	pp -> inbuf = NULL;
+	pp -> inbuflen = 0;
+	pp -> inbufpos = 0;
+	pp -> inbufplain = 0;
+	pp -> ungetbuf = NULL;
+	pp -> ungetbufl = 0;
+	pp -> ungetbufs = 0;
+}
+
+// fetch the next byte from the input buffer, or EOF
+#define fetch_byte_raw(pp)	((pp) -> inbufpos < (pp) -> inbuflen ? (pp) -> inbuf[(pp) -> inbufpos++] : EOF)
+
 /* fetch a raw input byte from the current file. Will return CPP_EOF if
    EOF is encountered and CPP_EOL if an end of line sequence is encountered.
    End of line is defined as either CR, CRLF, LF, or LFCR. CPP_EOL is
@@ -47,20 +101,20 @@ static int fetch_byte_ll(struct preproc_info *pp)
 		pp -> lineno++;
 		pp -> column = 0;
 	}
-	c = getc(pp -> fp);
+	c = fetch_byte_raw(pp);
 	pp -> column++;
 	if (pp -> eolstate == 1)
 	{
 		// just saw CR, munch LF
 		if (c == 10)
-			c = getc(pp -> fp);
+			c = fetch_byte_raw(pp);
 		pp -> eolstate = 0;
 	}
 	else if (pp -> eolstate == 2)
 	{
 		// just saw LF, much CR
 		if (c == 13)
-			c = getc(pp -> fp);
+			c = fetch_byte_raw(pp);
 		pp -> eolstate = 0;
 	}
 	
@@ -212,11 +266,37 @@ void preproc_lex_unfetch_byte(struct preproc_info *pp, int c)
 	pp -> ungetbuf[pp -> ungetbufl++] = c;
 }
 
-/* This function retrieves a byte from the input stream. It performs
-   backslash-newline splicing on the returned bytes. Any character
-   retrieved from the unfetch buffer is presumed to have already passed
-   the backslash-newline filter. */
-static int fetch_byte(struct preproc_info *pp)
+/* Find the end of the run of bytes starting at the current input position
+   that can be returned exactly as they are: anything other than CR, LF,
+   a backslash (which may start a line splice), or, if trigraphs are
+   enabled, a question mark. The inner loop has no branches so the
+   compiler can vectorize it. */
+static void fetch_scan(struct preproc_info *pp)
+{
+	unsigned char *p = pp -> inbuf + pp -> inbufpos;
+	unsigned char *e = pp -> inbuf + pp -> inbuflen;
+	int q = pp -> trigraphs ? '?' : 10;
+	int m;
+	int i;
+	
+	while (e - p >= 16)
+	{
+		m = 0;
+		for (i = 0; i < 16; i++)
+			m |= (p[i] == 10) | (p[i] == 13) | (p[i] == '\\') | (p[i] == q);
+		if (m)
+			break;
+		p += 16;
+	}
+	while (p < e && *p != 10 && *p != 13 && *p != '\\' && *p != q)
+		p++;
+	pp -> inbufplain = p - pp -> inbuf;
+}
+
+/* This function handles everything fetch_byte() below does not: token
+   pasting strings, the unfetch buffer, and bytes that need to go through
+   the trigraph, end of line, and line splicing layers. */
+static int fetch_byte_slow(struct preproc_info *pp)
 {
 	int c;
 
@@ -231,14 +311,18 @@ static int fetch_byte(struct preproc_info *pp)
 	if (pp -> ungetbufl > 0)
 	{
 		pp -> ungetbufl--;
-		c = pp -> ungetbuf[pp -> ungetbufl];
-		if (pp -> ungetbufl == 0)
+		return pp -> ungetbuf[pp -> ungetbufl];
+	}
+
+	// start a new run of plain bytes if no lower layer has anything pending
+	if (pp -> unget == CPP_NOUNG && pp -> ra == CPP_NOUNG && pp -> qseen == 0 && pp -> eolstate == 0)
+	{
+		fetch_scan(pp);
+		if (pp -> inbufpos < pp -> inbufplain)
 		{
-			lw_free(pp -> ungetbuf);
-			pp -> ungetbuf = NULL;
-			pp -> ungetbufs = 0;
+			pp -> column++;
+			return pp -> inbuf[pp -> inbufpos++];
 		}
-		return c;
 	}
 	
 again:
@@ -263,7 +347,41 @@ again:
 	return c;
 }
 
+/* This function retrieves a byte from the input stream. It performs
+   backslash-newline splicing on the returned bytes. Any character
+   retrieved from the unfetch buffer is presumed to have already passed
+   the backslash-newline filter.
+
+   Bytes inside a run found by fetch_scan() are returned directly; a run
+   is only started when none of the lower layers has anything pending so
+   skipping them cannot change the result. */
+static inline int fetch_byte(struct preproc_info *pp)
+{
+	if (pp -> inbufpos < pp -> inbufplain && pp -> ungetbufl == 0 && !(pp -> lexstr))
+	{
+		pp -> column++;
+		return pp -> inbuf[pp -> inbufpos++];
+	}
+	return fetch_byte_slow(pp);
+}
+
+
 
+/* Token text is collected in a buffer that belongs to the preprocessor and
+   is reused for every token; token_create() interns a copy. The buffer
+   is allocated separately so the state copies made around #include all
+   share it. */
+static struct lw_strbuf *lex_strbuf(struct preproc_info *pp)
+{
+	pp -> lexbuf -> bo = 0;
+	return pp -> lexbuf;
+}
+
+static char *lex_strbuf_end(struct lw_strbuf *strbuf)
+{
+	lw_strbuf_add(strbuf, 0);
+	return strbuf -> str;
+}
 
 /*
 Lex a token off the current input file.
@@ -357,6 +475,7 @@ struct token *preproc_lex_next_token(struct preproc_info *pp)
 	int sline = pp -> lineno;
 	int scol = pp -> column;
 	char *strval = NULL;
+	char chbuf[2];
 	int ttype = TOK_NONE;
 	int c, c2;
 	int cl;
@@ -389,10 +508,12 @@ fileagain:
 			{
 				preproc_throw_error(pp, "Unbalanced conditionals in include file");
 			}
-			fclose(pp -> fp);
+			preproc_include_done(pp);
+			preproc_lex_close(pp);
 			fs = pp -> filestack;
 			*pp = *fs;
 			pp -> filestack = fs -> n;
+			lw_free(fs);
 			goto fileagain;
 		}
 		else
@@ -616,7 +737,7 @@ fileagain:
 		/* character constant - turns into a  uint */
 chrlit:
 		cl = 0;
-		strbuf = lw_strbuf_new();
+		strbuf = lex_strbuf(pp);
 		for (;;)
 		{
 			c = preproc_lex_fetch_byte(pp);
@@ -632,7 +753,7 @@ chrlit:
 					if (!pp -> lexstr)
 						preproc_throw_error(pp, "Invalid character constant");
 					ttype = TOK_ERROR;
-					strval = lw_strbuf_end(strbuf);
+					strval = lex_strbuf_end(strbuf);
 					goto out;
 				}
 				cl++;
@@ -641,7 +762,7 @@ chrlit:
 			}
 			lw_strbuf_add(strbuf, c);
 		}
-		strval = lw_strbuf_end(strbuf);
+		strval = lex_strbuf_end(strbuf);
 		if (cl == 0)
 		{
 			ttype = TOK_ERROR;
@@ -655,7 +776,7 @@ chrlit:
 	case '"':
 strlit:
 		/* string literal */
-		strbuf = lw_strbuf_new();
+		strbuf = lex_strbuf(pp);
 		lw_strbuf_add(strbuf, '"');
 		for (;;)
 		{
@@ -663,7 +784,7 @@ strlit:
 			if (c == CPP_EOF || c == CPP_EOL)
 			{
 				ttype = TOK_ERROR;
-				strval = lw_strbuf_end(strbuf);
+				strval = lex_strbuf_end(strbuf);
 				if (!pp -> lexstr)
 					preproc_throw_error(pp, "Invalid string constant");
 				goto out;
@@ -679,7 +800,7 @@ strlit:
 					ttype = TOK_ERROR;
 					if (!pp -> lexstr)
 						preproc_throw_error(pp, "Invalid string constant");
-					strval = lw_strbuf_end(strbuf);
+					strval = lex_strbuf_end(strbuf);
 					goto out;
 				}
 				cl++;
@@ -689,7 +810,7 @@ strlit:
 			lw_strbuf_add(strbuf, c);
 		}
 		lw_strbuf_add(strbuf, '"');
-		strval = lw_strbuf_end(strbuf);
+		strval = lex_strbuf_end(strbuf);
 		ttype = TOK_STR_LIT;
 		goto out;
 
@@ -718,7 +839,7 @@ strlit:
 	case 'S': case 'T': case 'U': case 'V': case 'W': case 'X':
 	case 'Y': case 'Z':
 		/* we have an identifier here */
-		strbuf = lw_strbuf_new();
+		strbuf = lex_strbuf(pp);
 		lw_strbuf_add(strbuf, c);
 		for (;;)
 		{
@@ -731,7 +852,7 @@ strlit:
 			else
 			{
 				lw_strbuf_add(strbuf, 0);
-				strval = lw_strbuf_end(strbuf);
+				strval = lex_strbuf_end(strbuf);
 				break;
 			}
 		}
@@ -743,7 +864,7 @@ strlit:
 		c = preproc_lex_fetch_byte(pp);
 		if (c >= '0' && c <= '9')
 		{
-			strbuf = lw_strbuf_new();
+			strbuf = lex_strbuf(pp);
 			lw_strbuf_add(strbuf, '.');
 			goto numlit;
 		}
@@ -763,7 +884,7 @@ strlit:
 
 	case '0': case '1': case '2': case '3': case '4':
 	case '5': case '6': case '7': case '8': case '9':
-		strbuf = lw_strbuf_new();
+		strbuf = lex_strbuf(pp);
 numlit:
 		ttype = TOK_NUMBER;
 		lw_strbuf_add(strbuf, c);
@@ -784,19 +905,18 @@ numlit:
 				preproc_lex_unfetch_byte(pp, c);
 			}
 		}
-		strval = lw_strbuf_end(strbuf);
+		strval = lex_strbuf_end(strbuf);
 		preproc_lex_unfetch_byte(pp, c);
 		goto out;
 		
 	default:
 		ttype = TOK_CHAR;
-		strval = lw_alloc(2);
-		strval[0] = c;
-		strval[1] = 0;
+		chbuf[0] = c;
+		chbuf[1] = 0;
+		strval = chbuf;
 		break;
 	}
 out:	
 	t = token_create(ttype, strval, sline, scol, pp -> fn);
-	lw_free(strval);
 	return t;
 }
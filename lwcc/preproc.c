@@ -22,6 +22,7 @@ this program. If not, see <http://www.gnu.org/licenses/>.
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -34,14 +35,21 @@ this program. If not, see <http://www.gnu.org/licenses/>.
 #include "symbol.h"
 #include "token.h"
 
-static int expand_macro(struct preproc_info *, char *);
+// how far the current file has matched #ifndef X ... #endif
+#define GUARD_START		0	// nothing but white space seen yet
+#define GUARD_OPEN		1	// inside the #ifndef that may be the guard
+#define GUARD_CLOSED	2	// the #endif matching it has been seen
+#define GUARD_NONE		-1	// the file is not guarded
+
+static int expand_macro(struct preproc_info *, const char *);
 static void process_directive(struct preproc_info *);
 static long eval_expr(struct preproc_info *);
 extern struct token *preproc_lex_next_token(struct preproc_info *);
 static long preproc_numval(struct preproc_info *, struct token *);
-static int eval_escape(char **);
+static int eval_escape(const char **);
 extern int preproc_lex_fetch_byte(struct preproc_info *);
 extern void preproc_lex_unfetch_byte(struct preproc_info *, int);
+extern int preproc_lex_open(struct preproc_info *, FILE *);
 
 
 struct token *preproc_next_processed_token(struct preproc_info *pp)
@@ -68,6 +76,10 @@ again:
 	if (pp -> skip_level)
 		goto again;
 
+	// real text outside the include guard means the file isn't guarded
+	if (ct -> ttype != TOK_WSPACE && (pp -> guardstate == GUARD_START || pp -> guardstate == GUARD_CLOSED))
+		pp -> guardstate = GUARD_NONE;
+
 	if (ct -> ttype != TOK_WSPACE)
 		pp -> ppeolseen = 0;
 	
@@ -180,6 +192,11 @@ static void dir_ifndef(struct preproc_info *pp)
 		skip_eol(pp);
 	}
 	
+	if (pp -> guardstate == GUARD_START)
+	{
+		pp -> guardstate = GUARD_OPEN;
+		pp -> guardname = ct -> strval;
+	}
 	if (symtab_find(pp, ct -> strval) != NULL)
 	{
 		pp -> skip_level++;
@@ -201,6 +218,8 @@ static void dir_if(struct preproc_info *pp)
 
 static void dir_elif(struct preproc_info *pp)
 {
+	if (pp -> guardstate == GUARD_OPEN && pp -> skip_level + pp -> found_level == 1)
+		pp -> guardstate = GUARD_NONE;
 	if (pp -> skip_level == 0)
 		pp -> else_skip_level = pp -> found_level;
 	if (pp -> skip_level)
@@ -225,6 +244,8 @@ static void dir_elif(struct preproc_info *pp)
 
 static void dir_else(struct preproc_info *pp)
 {
+	if (pp -> guardstate == GUARD_OPEN && pp -> skip_level + pp -> found_level == 1)
+		pp -> guardstate = GUARD_NONE;
 	if (pp -> skip_level)
 	{
 		if (pp -> else_skip_level > pp -> found_level)
@@ -262,6 +283,8 @@ static void dir_endif(struct preproc_info *pp)
 	if (pp -> skip_level == 0)
 		pp -> else_skip_level = 0;
 	pp -> else_level = 0;
+	if (pp -> guardstate == GUARD_OPEN && pp -> skip_level + pp -> found_level == 0)
+		pp -> guardstate = GUARD_CLOSED;
 	check_eol(pp);
 }
 
@@ -477,19 +500,172 @@ static void dir_warning(struct preproc_info *pp)
 	lw_free(s);
 }
 
-static char *preproc_file_exists_in_dir(char *dir, char *fn)
+/*
+Include file bookkeeping. Every (directory, name) probe made while
+searching for an include file is cached for the life of the preprocessor,
+including failures, so each directory is only checked once per name.
+Files that turn out to be wrapped entirely in an include guard, or that
+say #pragma once, are remembered by device and inode rather than by path,
+so "x.h", "./x.h" and a link to it are all the same file; later includes
+of them are skipped after a stat() without opening the file at all.
+
+The cache hangs off the preprocessor state through a pointer that never
+changes, so the state copies made around #include all share it.
+*/
+
+#define PREPROC_INCHASH	256
+
+struct preproc_incpath
+{
+	char *dir;
+	char *name;
+	char *path;						// the file found, NULL if it isn't there
+	unsigned int hash;
+	struct preproc_incpath *next;
+};
+
+struct preproc_incfile
+{
+	dev_t dev;
+	ino_t ino;
+	char *guard;					// guard macro, NULL if none
+	int once;						// nonzero if #pragma once was seen
+	struct preproc_incfile *next;
+};
+
+struct preproc_inccache
+{
+	struct preproc_incpath *paths[PREPROC_INCHASH];
+	struct preproc_incfile *files[PREPROC_INCHASH];
+};
+
+static unsigned int preproc_inchash(unsigned int h, const char *s)
+{
+	while (*s)
+		h = h * 33 + (unsigned char)*s++;
+	return h;
+}
+
+void preproc_include_init(struct preproc_info *pp)
+{
+	int i;
+	
+	pp -> inccache = lw_alloc(sizeof(struct preproc_inccache));
+	for (i = 0; i < PREPROC_INCHASH; i++)
+	{
+		pp -> inccache -> paths[i] = NULL;
+		pp -> inccache -> files[i] = NULL;
+	}
+}
+
+void preproc_include_finish(struct preproc_info *pp)
+{
+	struct preproc_incpath *ip;
+	struct preproc_incfile *f;
+	int i;
+	
+	for (i = 0; i < PREPROC_INCHASH; i++)
+	{
+		while ((ip = pp -> inccache -> paths[i]))
+		{
+			pp -> inccache -> paths[i] = ip -> next;
+			lw_free(ip -> dir);
+			lw_free(ip -> name);
+			lw_free(ip -> path);
+			lw_free(ip);
+		}
+		while ((f = pp -> inccache -> files[i]))
+		{
+			pp -> inccache -> files[i] = f -> next;
+			lw_free(f -> guard);
+			lw_free(f);
+		}
+	}
+	lw_free(pp -> inccache);
+	pp -> inccache = NULL;
+}
+
+/* find the record for an included file, creating it if create is set */
+static struct preproc_incfile *preproc_incfile(struct preproc_info *pp, dev_t dev, ino_t ino, int create)
+{
+	struct preproc_incfile *f;
+	unsigned int h;
+	
+	h = (unsigned int)dev * 33 + (unsigned int)ino;
+	for (f = pp -> inccache -> files[h % PREPROC_INCHASH]; f; f = f -> next)
+	{
+		if (f -> dev == dev && f -> ino == ino)
+			return f;
+	}
+	if (!create)
+		return NULL;
+	f = lw_alloc(sizeof(struct preproc_incfile));
+	f -> dev = dev;
+	f -> ino = ino;
+	f -> guard = NULL;
+	f -> once = 0;
+	f -> next = pp -> inccache -> files[h % PREPROC_INCHASH];
+	pp -> inccache -> files[h % PREPROC_INCHASH] = f;
+	return f;
+}
+
+/* Called when the end of an include file is reached. If the whole file
+   was a single #ifndef X ... #endif block, remember X. */
+void preproc_include_done(struct preproc_info *pp)
+{
+	struct preproc_incfile *f;
+	
+	if (pp -> guardstate != GUARD_CLOSED || !(pp -> incfn))
+		return;
+	f = preproc_incfile(pp, pp -> incdev, pp -> incino, 1);
+	if (!(f -> guard))
+		f -> guard = lw_strdup(pp -> guardname);
+}
+
+/* return nonzero if including the file st describes again would have no effect */
+static int preproc_include_skip(struct preproc_info *pp, struct stat *st)
+{
+	struct preproc_incfile *f;
+	
+	f = preproc_incfile(pp, st -> st_dev, st -> st_ino, 0);
+	if (!f)
+		return 0;
+	if (f -> once)
+		return 1;
+	return f -> guard && symtab_find(pp, f -> guard);
+}
+
+static char *preproc_file_exists_in_dir(struct preproc_info *pp, char *dir, char *fn)
 {
+	struct preproc_incpath *ip;
+	unsigned int h;
 	int l;
 	char *f;
 	
+	h = preproc_inchash(preproc_inchash(5381, dir) * 33, fn);
+	for (ip = pp -> inccache -> paths[h % PREPROC_INCHASH]; ip; ip = ip -> next)
+	{
+		if (ip -> hash == h && strcmp(ip -> dir, dir) == 0 && strcmp(ip -> name, fn) == 0)
+			return ip -> path ? lw_strdup(ip -> path) : NULL;
+	}
+	
 	l = snprintf(NULL, 0, "%s/%s", dir, fn);
 	f = lw_alloc(l + 1);
 	snprintf(f, l + 1, "%s/%s", dir, fn);
 	
-	if (access(f, R_OK) == 0)
-		return f;
-	lw_free(f);
-	return NULL;
+	if (access(f, R_OK) != 0)
+	{
+		lw_free(f);
+		f = NULL;
+	}
+	ip = lw_alloc(sizeof(struct preproc_incpath));
+	ip -> dir = lw_strdup(dir);
+	ip -> name = lw_strdup(fn);
+	ip -> path = f;
+	ip -> hash = h;
+	ip -> next = pp -> inccache -> paths[h % PREPROC_INCHASH];
+	pp -> inccache -> paths[h % PREPROC_INCHASH] = ip;
+	return f ? lw_strdup(f) : NULL;
 }
 
 static char *preproc_find_file(struct preproc_info *pp, char *fn, int sys)
@@ -505,7 +681,7 @@ static char *preproc_find_file(struct preproc_info *pp, char *fn, int sys)
 	if (!sys)
 	{
 		/* look in the directory with the current file */
-		tstr = strchr(pp -> fn, '/');
+		tstr = strrchr(pp -> fn, '/');
 		if (!tstr)
 			pref = lw_strdup(".");
 		else
@@ -514,7 +690,7 @@ static char *preproc_find_file(struct preproc_info *pp, char *fn, int sys)
 			memcpy(pref, pp -> fn, tstr - pp -> fn);
 			pref[tstr - pp -> fn] = 0;
 		}
-		rfn = preproc_file_exists_in_dir(pref, fn);
+		rfn = preproc_file_exists_in_dir(pp, pref, fn);
 		lw_free(pref);
 		if (rfn)
 			return rfn;
@@ -523,7 +699,7 @@ static char *preproc_find_file(struct preproc_info *pp, char *fn, int sys)
 		lw_stringlist_reset(pp -> quotelist);
 		for (pref = lw_stringlist_current(pp -> quotelist); pref; pref = lw_stringlist_next(pp -> quotelist))
 		{
-			rfn = preproc_file_exists_in_dir(pref, fn);
+			rfn = preproc_file_exists_in_dir(pp, pref, fn);
 			if (rfn)
 				return rfn;
 		}
@@ -533,7 +709,7 @@ static char *preproc_find_file(struct preproc_info *pp, char *fn, int sys)
 	lw_stringlist_reset(pp -> inclist);
 	for (pref = lw_stringlist_current(pp -> inclist); pref; pref = lw_stringlist_next(pp -> inclist))
 	{
-		rfn = preproc_file_exists_in_dir(pref, fn);
+		rfn = preproc_file_exists_in_dir(pp, pref, fn);
 		if (rfn)
 			return rfn;
 	}
@@ -548,9 +724,11 @@ static void dir_include(struct preproc_info *pp)
 	struct token *ct;
 	int sys = 0;
 	char *fn;
+	char *rfn;
 	struct lw_strbuf *strbuf;
 	int i;
 	struct preproc_info *fs;
+	struct stat st;
 	
 	ct = preproc_next_token_nws(pp);
 	if (ct -> ttype == TOK_STR_LIT)
@@ -639,14 +817,25 @@ usrinc:
 		}
 	}
 doinc:
-	fn = preproc_find_file(pp, fn, sys);
-	if (!fn)
-		goto badfile;
-	fp = fopen(fn, "rb");
-	if (!fp)
+	rfn = preproc_find_file(pp, fn, sys);
+	if (!rfn)
+	{
+		preproc_throw_error(pp, "Cannot open #include file %s - this is fatal", fn);
+		exit(1);
+	}
+	lw_free(fn);
+	fn = rfn;
+	
+	/* a guarded file whose guard is defined would contribute nothing */
+	if (stat(fn, &st) == 0 && preproc_include_skip(pp, &st))
 	{
 		lw_free(fn);
-badfile:
+		return;
+	}
+	
+	fp = fopen(fn, "rb");
+	if (!fp || fstat(fileno(fp), &st) != 0)
+	{
 		preproc_throw_error(pp, "Cannot open #include file %s - this is fatal", fn);
 		exit(1);
 	}
@@ -658,8 +847,10 @@ badfile:
 	pp -> curtok = NULL;
 	pp -> filestack = fs;
 	pp -> fn = lw_strpool_strdup(pp -> strpool, fn);
+	pp -> incfn = pp -> fn;
+	pp -> incdev = st.st_dev;
+	pp -> incino = st.st_ino;
 	lw_free(fn);
-	pp -> fp = fp;
 	pp -> ra = CPP_NOUNG;
 	pp -> ppeolseen = 1;
 	pp -> eolstate = 0;
@@ -669,14 +860,19 @@ badfile:
 	pp -> ungetbufl = 0;
 	pp -> ungetbufs = 0;
 	pp -> ungetbuf = NULL;
-	pp -> unget = 0;
+	pp -> unget = CPP_NOUNG;
 	pp -> eolseen = 0;
 	pp -> nlseen = 0;
 	pp -> skip_level = 0;
 	pp -> found_level = 0;
 	pp -> else_level = 0;
 	pp -> else_skip_level = 0;
+	pp -> guardstate = GUARD_START;
+	pp -> guardname = NULL;
 	pp -> tokqueue = NULL;	
+	if (preproc_lex_open(pp, fp))
+		preproc_throw_error(pp, "Error reading #include file");
+	fclose(fp);
 	// now get on with processing
 }
 
@@ -726,18 +922,29 @@ static void dir_line(struct preproc_info *pp)
 		lw_free(estr);
 		return;
 	}
-	pp -> fn = estr;
+	pp -> fn = lw_strpool_strdup(pp -> strpool, estr);
+	lw_free(estr);
 	pp -> lineno = lineno;
 }
 
 static void dir_pragma(struct preproc_info *pp)
 {
+	struct token *ct;
+	
 	if (pp -> skip_level)
 	{
 		skip_eol(pp);
 		return;
 	}
 	
+	ct = preproc_next_token_nws(pp);
+	if (ct -> ttype == TOK_IDENT && strcmp(ct -> strval, "once") == 0)
+	{
+		if (pp -> incfn)
+			preproc_incfile(pp, pp -> incdev, pp -> incino, 1) -> once = 1;
+		check_eol(pp);
+		return;
+	}
 	preproc_throw_warning(pp, "Unsupported #pragma");
 	skip_eol(pp);
 }
@@ -774,10 +981,15 @@ static void process_directive(struct preproc_info *pp)
 	if (ct -> ttype == TOK_EOL)
 		return;
 	
+	// only an #ifndef may open an include guard, and nothing may follow it
+	if (pp -> guardstate == GUARD_CLOSED || (pp -> guardstate == GUARD_START && !(ct -> ttype == TOK_IDENT && strcmp(ct -> strval, "ifndef") == 0)))
+		pp -> guardstate = GUARD_NONE;
+	
 	if (ct -> ttype == TOK_NUMBER)
 	{
 		// this is probably a file marker from a previous run of the preprocessor
-		char *fn;
+		const char *fn;
+		char *nfn;
 		struct lw_strbuf *sb;
 		
 		i = preproc_numval(pp, ct);
@@ -797,9 +1009,9 @@ static void process_directive(struct preproc_info *pp)
 				lw_strbuf_add(sb, *fn++);
 			}
 		}
-		fn = lw_strbuf_end(sb);
-		pp -> fn = lw_strpool_strdup(pp -> strpool, fn);
-		lw_free(fn);
+		nfn = lw_strbuf_end(sb);
+		pp -> fn = lw_strpool_strdup(pp -> strpool, nfn);
+		lw_free(nfn);
 		skip_eol(pp);
 		return;
 	}
@@ -1060,7 +1272,7 @@ static long eval_expr(struct preproc_info *pp)
 	return rv;
 }
 
-static int eval_escape(char **t)
+static int eval_escape(const char **t)
 {
 	int c;
 	int c2;
@@ -1126,7 +1338,7 @@ long preproc_numval(struct preproc_info *pp, struct token *t)
 {
 	unsigned long long rv = 0;
 	unsigned long long rv2 = 0;
-	char *tstr = t -> strval;
+	const char *tstr = t -> strval;
 	int radix = 10;
 	int c;
 	int ovf = 0;
@@ -1226,6 +1438,7 @@ static char *stringify(struct token_list *tli)
 				if (tl -> strval[ws] == '"' || tl -> strval[ws] == '\\')
 					lw_strbuf_add(s, '\\');
 			}
+			lw_strbuf_add(s, tl -> strval[ws]);
 		}
 		ws = 0;
 	}
@@ -1234,19 +1447,19 @@ static char *stringify(struct token_list *tli)
 	return lw_strbuf_end(s);
 }
 
-static int macro_arg(struct symtab_e *s, char *str)
+static int macro_arg(struct symtab_e *s, const char *str)
 {
 	int i;
+
+	// object-like macros have no arguments
+	if (s -> nargs < 0)
+		return -1;
 	if (strcmp(str, "__VA_ARGS__") == 0)
-		i = s -> nargs;
-	else
-		for (i = 0; i < s -> nargs; i++)
-			if (strcmp(s -> params[i], str) == 0)
-				break;
-	if (i == s -> nargs)
-		if (s -> vargs == 0)
-			return -1;
-	return i;
+		return s -> vargs ? s -> nargs : -1;
+	for (i = 0; i < s -> nargs; i++)
+		if (strcmp(s -> params[i], str) == 0)
+			return i;
+	return -1;
 }
 
 /* return list to tokens as a result of ## expansion */
@@ -1343,6 +1556,7 @@ static struct token_list *paste_tokens(struct preproc_info *pp, struct symtab_e
 		token_list_remove(right -> head);
 		token_list_append(left, token_dup(ttok));
 	}
+	token_free(ttok);
 	lw_free(tstr);
 	pp -> lexstr = NULL;
 	pp -> lexstrloc = 0;
@@ -1354,10 +1568,10 @@ static struct token_list *paste_tokens(struct preproc_info *pp, struct symtab_e
 	return left;
 }
 
-static int expand_macro(struct preproc_info *pp, char *mname)
+static int expand_macro(struct preproc_info *pp, const char *mname)
 {
 	struct symtab_e *s;
-	struct token *t, *t2, *t3;
+	struct token *ct, *t, *t2, *t3;
 	int nargs = 0;
 	struct expand_e *e;
 	struct token_list **exparglist = NULL;
@@ -1449,6 +1663,11 @@ static int expand_macro(struct preproc_info *pp, char *mname)
 		goto expandmacro;
 	}
 	
+	// the macro name is the current token and fetching the next one would
+	// free it; hold on to it in case this isn't an invocation after all
+	ct = pp -> curtok;
+	pp -> curtok = NULL;
+
 	// look for opening paren after optional whitespace
 	t2 = NULL;
 	t = NULL;
@@ -1457,31 +1676,42 @@ static int expand_macro(struct preproc_info *pp, char *mname)
 		t = preproc_next_token(pp);
 		if (t -> ttype != TOK_WSPACE && t -> ttype != TOK_EOL)
 			break;
+		// keep the skipped token; it goes back if there is no '('
+		pp -> curtok = NULL;
 		t -> next = t2;
-		t2 = t2;
+		t2 = t;
 	}
 	if (t -> ttype != TOK_OPAREN)
 	{
 		// not a function-like invocation
+		pp -> curtok = NULL;
+		preproc_unget_token(pp, t);
 		while (t2)
 		{
 			t = t2 -> next;
 			preproc_unget_token(pp, t2);
 			t2 = t;
 		}
+		pp -> curtok = ct;
 		return 0;
 	}
+	while (t2)
+	{
+		t = t2 -> next;
+		token_free(t2);
+		t2 = t;
+	}
+	token_free(ct);
 	
 	// parse parameters here
 	t = preproc_next_token_nws(pp);
 	nargs = 1;
 	arglist = lw_alloc(sizeof(struct token_list *));
 	arglist[0] = token_list_create();
-	t2 = NULL;
+	pcount = 0;
 	
-	while (t -> ttype != TOK_CPAREN)
+	for (; t -> ttype != TOK_CPAREN || pcount > 0; t = preproc_next_token(pp))
 	{
-		pcount = 0;
 		if (t -> ttype == TOK_EOF)
 		{
 			preproc_throw_error(pp, "Unexpected EOF in macro call");
@@ -1491,16 +1721,16 @@ static int expand_macro(struct preproc_info *pp, char *mname)
 			continue;
 		if (t -> ttype == TOK_OPAREN)
 			pcount++;
-		else if (t -> ttype == TOK_CPAREN && pcount)
+		else if (t -> ttype == TOK_CPAREN)
 			pcount--;
 		if (t -> ttype == TOK_COMMA && pcount == 0)
 		{
-			if (!(s -> vargs) || (nargs > s -> nargs))
+			// extra arguments to a variadic macro all go in __VA_ARGS__
+			if (!(s -> vargs) || (nargs <= s -> nargs))
 			{
 				nargs++;
 				arglist = lw_realloc(arglist, sizeof(struct token_list *) * nargs);
 				arglist[nargs - 1] = token_list_create();
-				t2 = NULL;
 				continue;
 			}
 		}
@@ -1530,7 +1760,15 @@ static int expand_macro(struct preproc_info *pp, char *mname)
 		// NOTE: do nothing if empty argument
 		if (arglist[i] == NULL || arglist[i] -> head == NULL)
 			continue;
-		pp -> sourcelist = arglist[i]->head;
+		// expand a copy; the raw argument is still needed for # and ##
+		t2 = NULL;
+		for (t = arglist[i] -> tail; t; t = t -> prev)
+		{
+			t3 = token_dup(t);
+			t3 -> next = t2;
+			t2 = t3;
+		}
+		pp -> sourcelist = t2;
 		for (;;)
 		{
 			t = preproc_next_processed_token(pp);
@@ -1606,7 +1844,7 @@ expandmacro:
 			{
 				token_list_insert(expand_list, t2, token_dup(t));
 			}
-			t = t3 -> prev;
+			t = t3 ? t3 -> prev : expand_list -> tail;
 			token_list_destroy(rtl);
 		}
 	}
@@ -1626,7 +1864,9 @@ expandmacro:
 					token_list_insert(expand_list, t, token_dup(t2));
 				token_list_remove(t);
 				t = t3;
-				goto again;
+				if (t)
+					goto again;
+				break;
 			}
 		}
 	}
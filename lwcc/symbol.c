@@ -28,6 +28,8 @@ this program. If not, see <http://www.gnu.org/licenses/>.
 #include "symbol.h"
 #include "token.h"
 
+#define SYMTAB_INITSIZE	256
+
 void symbol_free(struct symtab_e *s)
 {
 	int i;
@@ -38,15 +40,83 @@ void symbol_free(struct symtab_e *s)
 		lw_free(s -> params[i]);
 	lw_free(s -> params);
 	token_list_destroy(s -> tl);
+	lw_free(s);
+}
+
+static unsigned int symtab_hash(const char *name)
+{
+	unsigned int h = 5381;
+	
+	while (*name)
+		h = h * 33 + (unsigned char)*name++;
+	return h;
+}
+
+struct symtab *symtab_create(void)
+{
+	struct symtab *st;
+	int i;
+	
+	st = lw_alloc(sizeof(struct symtab));
+	st -> nbuckets = SYMTAB_INITSIZE;
+	st -> nsyms = 0;
+	st -> buckets = lw_alloc(sizeof(struct symtab_e *) * st -> nbuckets);
+	for (i = 0; i < st -> nbuckets; i++)
+		st -> buckets[i] = NULL;
+	return st;
+}
+
+void symtab_destroy(struct symtab *st)
+{
+	struct symtab_e *s, *n;
+	int i;
+	
+	for (i = 0; i < st -> nbuckets; i++)
+	{
+		for (s = st -> buckets[i]; s; s = n)
+		{
+			n = s -> next;
+			symbol_free(s);
+		}
+	}
+	lw_free(st -> buckets);
+	lw_free(st);
 }
 
-struct symtab_e *symtab_find(struct preproc_info *pp, char *name)
+/* double the number of hash chains; called once the table averages more
+   than one symbol per chain so lookups stay constant time */
+static void symtab_grow(struct symtab *st)
+{
+	struct symtab_e **nb, *s, *n;
+	int ns = st -> nbuckets * 2;
+	int i;
+	
+	nb = lw_alloc(sizeof(struct symtab_e *) * ns);
+	for (i = 0; i < ns; i++)
+		nb[i] = NULL;
+	for (i = 0; i < st -> nbuckets; i++)
+	{
+		for (s = st -> buckets[i]; s; s = n)
+		{
+			n = s -> next;
+			s -> next = nb[s -> hash & (ns - 1)];
+			nb[s -> hash & (ns - 1)] = s;
+		}
+	}
+	lw_free(st -> buckets);
+	st -> buckets = nb;
+	st -> nbuckets = ns;
+}
+
+struct symtab_e *symtab_find(struct preproc_info *pp, const char *name)
 {
 	struct symtab_e *s;
+	unsigned int h;
 	
-	for (s = pp -> sh; s; s = s -> next)
+	h = symtab_hash(name);
+	for (s = pp -> sh -> buckets[h & (pp -> sh -> nbuckets - 1)]; s; s = s -> next)
 	{
-		if (strcmp(s -> name, name) == 0)
+		if (s -> hash == h && strcmp(s -> name, name) == 0)
 		{
 			return s;
 		}
@@ -54,20 +124,22 @@ struct symtab_e *symtab_find(struct preproc_info *pp, char *name)
 	return NULL;
 }
 
-void symtab_undef(struct preproc_info *pp, char *name)
+void symtab_undef(struct preproc_info *pp, const char *name)
 {
 	struct symtab_e *s, **p;
+	unsigned int h;
 	
-	p = &(pp -> sh);
-	for (s = pp -> sh; s; s = s -> next)
+	h = symtab_hash(name);
+	for (p = &(pp -> sh -> buckets[h & (pp -> sh -> nbuckets - 1)]); *p; p = &((*p) -> next))
 	{
-		if (strcmp(s -> name, name) == 0)
+		s = *p;
+		if (s -> hash == h && strcmp(s -> name, name) == 0)
 		{
-			(*p) -> next = s -> next;
+			*p = s -> next;
 			symbol_free(s);
+			pp -> sh -> nsyms--;
 			return;
 		}
-		p = &((*p) -> next);
 	}
 }
 
@@ -88,44 +160,51 @@ void symtab_define(struct preproc_info *pp, char *name, struct token_list *def,
 			s -> params[i] = lw_strdup(params[i]);
 	}
 	s -> vargs = vargs;
-	s -> next = pp -> sh;
-	pp -> sh = s;
+	s -> hash = symtab_hash(name);
+	if (pp -> sh -> nsyms >= pp -> sh -> nbuckets)
+		symtab_grow(pp -> sh);
+	s -> next = pp -> sh -> buckets[s -> hash & (pp -> sh -> nbuckets - 1)];
+	pp -> sh -> buckets[s -> hash & (pp -> sh -> nbuckets - 1)] = s;
+	pp -> sh -> nsyms++;
 }
 
 void symtab_dump(struct preproc_info *pp)
 {
 	struct symtab_e *s;
 	struct token *t;
-	int i;
+	int i, b;
 		
-	for (s = pp -> sh; s; s = s -> next)
+	for (b = 0; b < pp -> sh -> nbuckets; b++)
 	{
-		printf("%s", s -> name);
-		if (s -> nargs >= 0)
+		for (s = pp -> sh -> buckets[b]; s; s = s -> next)
 		{
-			printf("(");
-			for (i = 0; i < s -> nargs; i++)
+			printf("%s", s -> name);
+			if (s -> nargs >= 0)
 			{
-				if (i)
-					printf(",");
-				printf("%s", s -> params[i]);
+				printf("(");
+				for (i = 0; i < s -> nargs; i++)
+				{
+					if (i)
+						printf(",");
+					printf("%s", s -> params[i]);
+				}
+				if (s -> vargs)
+				{
+					if (s -> nargs)
+						printf(",");
+					printf("...");
+				}
+				printf(")");
 			}
-			if (s -> vargs)
-			{
-				if (s -> nargs)
-					printf(",");
-				printf("...");
-			}
-			printf(")");
-		}
-		printf(" => ");
-		if (s -> tl)
-		{
-			for (t = s -> tl -> head; t; t = t -> next)
+			printf(" => ");
+			if (s -> tl)
 			{
-				token_print(t, stdout);
+				for (t = s -> tl -> head; t; t = t -> next)
+				{
+					token_print(t, stdout);
+				}
 			}
+			printf("\n");
 		}
-		printf("\n");
 	}
 }
@@ -32,11 +32,21 @@ struct symtab_e
 	int nargs;				// number named of arguments - -1 for object like macro
 	int vargs;				// set if macro has varargs style
 	char **params;			// the names of the parameters
-	struct symtab_e *next;	// next entry in list
+	unsigned int hash;		// hash of the name
+	struct symtab_e *next;	// next entry in the hash chain
 };
 
-struct symtab_e *symtab_find(struct preproc_info *, char *);
-void symtab_undef(struct preproc_info *, char *);
+struct symtab
+{
+	struct symtab_e **buckets;	// hash chains
+	int nbuckets;			// number of hash chains; always a power of two
+	int nsyms;				// number of symbols defined
+};
+
+struct symtab *symtab_create(void);
+void symtab_destroy(struct symtab *);
+struct symtab_e *symtab_find(struct preproc_info *, const char *);
+void symtab_undef(struct preproc_info *, const char *);
 void symtab_define(struct preproc_info *, char *, struct token_list *, int, char **, int);
 
 #endif // symbol_h_seen___
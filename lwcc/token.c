@@ -19,23 +19,193 @@ You should have received a copy of the GNU General Public License along with
 this program. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <lw_alloc.h>
 #include <lw_string.h>
 
 #include "token.h"
 
-struct token *token_create(int ttype, char *strval, int row, int col, const char *fn)
+/*
+Tokens and their strings are allocated from an arena that lives for one
+translation unit. Tokens come from large blocks and token_free() only
+puts them on a free list for reuse, so the number of blocks is bounded by
+the peak number of live tokens. Token strings are interned: every token
+with the same spelling points at the same immutable copy, so duplicating
+a token never copies its string. Everything is released in one go by
+token_arena_release() when the preprocessor finishes.
+*/
+
+#define TOKEN_BLOCKSIZE		1024	// tokens per arena block
+#define TOKEN_STRBLOCKSIZE	65536	// bytes per interned string block
+#define TOKEN_INTERNSIZE	4096	// initial number of intern hash chains
+
+struct token_block
+{
+	struct token_block *next;
+	struct token tokens[TOKEN_BLOCKSIZE];
+};
+
+struct token_strblock
+{
+	struct token_strblock *next;
+	int used;
+	int size;
+};
+
+struct token_istr
 {
+	struct token_istr *next;	// next in hash chain
+	unsigned int hash;
+	char str[1];				// the string itself, allocated to length
+};
+
+static struct token_block *token_blocks = NULL;
+static int token_blockused = TOKEN_BLOCKSIZE;
+static struct token *token_freelist = NULL;
+static struct token_strblock *token_strblocks = NULL;
+static struct token_istr **token_istrs = NULL;
+static int token_nistrs = 0;
+static int token_istrsize = 0;
+
+static struct token *token_alloc(void)
+{
+	struct token_block *b;
 	struct token *t;
 	
-	t = lw_alloc(sizeof(struct token));
+	if (token_freelist)
+	{
+		t = token_freelist;
+		token_freelist = t -> next;
+		return t;
+	}
+	if (token_blockused == TOKEN_BLOCKSIZE)
+	{
+		b = lw_alloc(sizeof(struct token_block));
+		b -> next = token_blocks;
+		token_blocks = b;
+		token_blockused = 0;
+	}
+	return &(token_blocks -> tokens[token_blockused++]);
+}
+
+/* carve space for an interned string entry out of the current string block */
+static struct token_istr *token_istr_alloc(int len)
+{
+	struct token_strblock *b;
+	int need;
+	int bs;
+	
+	// keep entries pointer aligned
+	need = offsetof(struct token_istr, str) + len + 1;
+	need = (need + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	b = token_strblocks;
+	if (!b || b -> size - b -> used < need)
+	{
+		bs = TOKEN_STRBLOCKSIZE;
+		if (need > bs - (int)sizeof(struct token_strblock))
+			bs = need + sizeof(struct token_strblock);
+		b = lw_alloc(bs);
+		b -> next = token_strblocks;
+		b -> size = bs;
+		b -> used = sizeof(struct token_strblock);
+		token_strblocks = b;
+	}
+	b -> used += need;
+	return (struct token_istr *)((char *)b + b -> used - need);
+}
+
+static void token_intern_grow(void)
+{
+	struct token_istr **nt, *e, *n;
+	int ns;
+	int i;
+	
+	ns = token_istrsize ? token_istrsize * 2 : TOKEN_INTERNSIZE;
+	nt = lw_alloc(sizeof(struct token_istr *) * ns);
+	for (i = 0; i < ns; i++)
+		nt[i] = NULL;
+	for (i = 0; i < token_istrsize; i++)
+	{
+		for (e = token_istrs[i]; e; e = n)
+		{
+			n = e -> next;
+			e -> next = nt[e -> hash & (ns - 1)];
+			nt[e -> hash & (ns - 1)] = e;
+		}
+	}
+	lw_free(token_istrs);
+	token_istrs = nt;
+	token_istrsize = ns;
+}
+
+const char *token_intern(const char *str)
+{
+	struct token_istr *e;
+	unsigned int h = 5381;
+	int len;
+	
+	for (len = 0; str[len]; len++)
+		h = h * 33 + (unsigned char)str[len];
+	
+	if (token_istrs)
+	{
+		for (e = token_istrs[h & (token_istrsize - 1)]; e; e = e -> next)
+		{
+			if (e -> hash == h && strcmp(e -> str, str) == 0)
+				return e -> str;
+		}
+	}
+	if (token_nistrs >= token_istrsize)
+		token_intern_grow();
+	e = token_istr_alloc(len);
+	e -> hash = h;
+	memcpy(e -> str, str, len + 1);
+	e -> next = token_istrs[h & (token_istrsize - 1)];
+	token_istrs[h & (token_istrsize - 1)] = e;
+	token_nistrs++;
+	return e -> str;
+}
+
+void token_arena_release(void)
+{
+	struct token_block *b;
+	struct token_strblock *sb;
+	
+	while (token_blocks)
+	{
+		b = token_blocks;
+		token_blocks = b -> next;
+		lw_free(b);
+	}
+	while (token_strblocks)
+	{
+		sb = token_strblocks;
+		token_strblocks = sb -> next;
+		lw_free(sb);
+	}
+	lw_free(token_istrs);
+	token_istrs = NULL;
+	token_istrsize = 0;
+	token_nistrs = 0;
+	token_blockused = TOKEN_BLOCKSIZE;
+	token_freelist = NULL;
+}
+
+static const char *token_spelling(int);
+
+struct token *token_create(int ttype, const char *strval, int row, int col, const char *fn)
+{
+	struct token *t;
+	
+	t = token_alloc();
 	t -> ttype = ttype;
 	if (strval)
-		t -> strval = lw_strdup(strval);
+		t -> strval = token_intern(strval);
 	else
-		t -> strval = NULL;
+		t -> strval = token_spelling(ttype);
 	t -> lineno = row;
 	t -> column = col;
 	t -> fn = fn;
@@ -47,25 +217,23 @@ struct token *token_create(int ttype, char *strval, int row, int col, const char
 
 void token_free(struct token *t)
 {
-	lw_free(t -> strval);
-	lw_free(t);
+	t -> next = token_freelist;
+	token_freelist = t;
 }
 
 struct token *token_dup(struct token *t)
 {
 	struct token *t2;
 	
-	t2 = lw_alloc(sizeof(struct token));
+	t2 = token_alloc();
 	t2 -> ttype = t -> ttype;
 	t2 -> lineno = t -> lineno;
 	t2 -> column = t -> column;
+	t2 -> fn = t -> fn;
 	t2 -> list = NULL;
 	t2 -> next = NULL;
 	t2 -> prev = NULL;
-	if (t -> strval)
-		t2 -> strval = lw_strdup(t -> strval);
-	else
-		t2 -> strval = NULL;
+	t2 -> strval = t -> strval;
 	return t2;
 }
 
@@ -124,19 +292,47 @@ static struct { int ttype; char *tstr; } tok_strs[] =
 	{ TOK_NONE, "" }
 };
 
-void token_print(struct token *t, FILE *f)
+/* Punctuators carry their fixed spelling as their string value so code
+   that pastes or stringifies tokens can treat every token alike. White
+   space and end of line tokens have no string value. */
+static const char *token_spelling(int ttype)
 {
+	static const char *spellings[TOK_MAX];
+	static int init = 0;
 	int i;
-	for (i = 0; tok_strs[i].ttype != TOK_NONE; i++)
+	
+	if (!init)
 	{
-		if (tok_strs[i].ttype == t -> ttype)
+		for (i = 0; tok_strs[i].ttype != TOK_NONE; i++)
 		{
-			fprintf(f, "%s", tok_strs[i].tstr);
-			break;
+			if (tok_strs[i].ttype != TOK_WSPACE && tok_strs[i].ttype != TOK_EOL)
+				spellings[tok_strs[i].ttype] = tok_strs[i].tstr;
 		}
+		init = 1;
 	}
+	if (ttype < 0 || ttype >= TOK_MAX)
+		return NULL;
+	return spellings[ttype];
+}
+
+/* return the text of a token as it would appear in the source */
+const char *token_text(struct token *t)
+{
+	int i;
+	
 	if (t -> strval)
-		fprintf(f, "%s", t -> strval);
+		return t -> strval;
+	for (i = 0; tok_strs[i].ttype != TOK_NONE; i++)
+	{
+		if (tok_strs[i].ttype == t -> ttype)
+			return tok_strs[i].tstr;
+	}
+	return "";
+}
+
+void token_print(struct token *t, FILE *f)
+{
+	fputs(token_text(t), f);
 }
 
 /* token list management */
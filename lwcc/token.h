@@ -95,7 +95,7 @@ enum
 struct token
 {
 	int ttype;				// token type
-	char *strval;			// the token value if relevant
+	const char *strval;		// the token value if relevant; interned, never modify
 	struct token *prev;		// previous token in a list
 	struct token *next;		// next token in a list
 	struct token_list *list;// pointer to head of list descriptor this token is on
@@ -111,8 +111,12 @@ struct token_list
 };
 
 extern void token_free(struct token *);
-extern struct token *token_create(int, char *strval, int, int, const char *);
+extern struct token *token_create(int, const char *strval, int, int, const char *);
 extern struct token *token_dup(struct token *);
+/* return the shared copy of a string; valid until token_arena_release() */
+extern const char *token_intern(const char *);
+/* free all tokens and interned strings at the end of a translation unit */
+extern void token_arena_release(void);
 /* add a token to the end of a list */
 extern void token_list_append(struct token_list *, struct token *);
 /* add a token to the start of a list */
@@ -128,5 +132,6 @@ extern struct token_list *token_list_create(void);
 extern void token_list_destroy(struct token_list *);
 
 extern void token_print(struct token *, FILE *);
+extern const char *token_text(struct token *);
 
 #endif // token_h_seen___
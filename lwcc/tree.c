@@ -234,12 +234,10 @@ void node_removechild(node_t *node, node_t *nn)
 	if (!node)
 		node = nn -> parent;
 	
-	pp = &(node -> children);
-	for (np = node -> children; np; np = np -> next_child)
+	for (pp = &(node -> children); (np = *pp); pp = &(np -> next_child))
 	{
-		if (np -> next_child == nn)
+		if (np == nn)
 			break;
-		pp = &((*pp) -> next_child);
 	}
 	if (!np)
 		return;
@@ -249,6 +247,22 @@ void node_removechild(node_t *node, node_t *nn)
 	nn -> next_child = NULL;
 }
 
+/* make a deep copy of a node and its children */
+node_t *node_dup(node_t *node)
+{
+	node_t *r, *nn;
+	
+	r = lw_alloc(sizeof(node_t));
+	memset(r, 0, sizeof(node_t));
+	r -> type = node -> type;
+	if (node -> strval)
+		r -> strval = lw_strdup(node -> strval);
+	memcpy(r -> ival, node -> ival, sizeof(r -> ival));
+	for (nn = node -> children; nn; nn = nn -> next_child)
+		node_addchild(r, node_dup(nn));
+	return r;
+}
+
 void node_removechild_destroy(node_t *node, node_t *nn)
 {
 	node_removechild(node, nn);
@@ -109,5 +109,6 @@ extern void node_addchild(node_t *, node_t *);
 extern void node_removechild(node_t *, node_t *);
 extern void node_display(node_t *, FILE *);
 extern void node_removechild_destroy(node_t *, node_t *);
+extern node_t *node_dup(node_t *);
 
 #endif // tree_h_seen___
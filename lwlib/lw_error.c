@@ -25,7 +25,7 @@ this program. If not, see <http://www.gnu.org/licenses/>.
 #include <stdlib.h>
 #include <stdarg.h>
 
-static void (*lw_error_func)(const char *fmt, ...) = NULL;
+static void (*lw_error_func)(const char *fmt, va_list args) = NULL;
 
 void lw_error(const char *fmt, ...)
 {
@@ -39,7 +39,7 @@ void lw_error(const char *fmt, ...)
 	exit(1);
 }
 
-void lw_error_setfunc(void (*f)(const char *fmt, ...))
+void lw_error_setfunc(void (*f)(const char *fmt, va_list args))
 {
 	lw_error_func = f;
 }
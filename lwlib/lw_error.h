@@ -22,7 +22,14 @@ this program. If not, see <http://www.gnu.org/licenses/>.
 #ifndef ___lw_error_h_seen___
 #define ___lw_error_h_seen___
 
+#include <stdarg.h>
+
+/*
+lw_error() reports a fatal error and exits. A function registered with
+lw_error_setfunc() receives the message instead of stderr; it may longjmp()
+out to recover, otherwise the program exits when it returns.
+*/
 void lw_error(const char *fmt, ...);
-void lw_error_setfunc(void (*f)(const char *fmt, ...));
+void lw_error_setfunc(void (*f)(const char *fmt, va_list args));
 
 #endif /* ___lw_error_h_seen___ */
@@ -21,6 +21,7 @@ this program. If not, see <http://www.gnu.org/licenses/>.
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
 
@@ -29,33 +30,111 @@ this program. If not, see <http://www.gnu.org/licenses/>.
 #include "lw_error.h"
 #include "lw_string.h"
 
-static lw_expr_fn_t *evaluate_special = NULL;
-static lw_expr_fn2_t *evaluate_var = NULL;
-static lw_expr_fn3_t *parse_term = NULL;
+/*
+Everything the parser and simplifier need besides the expression itself
+lives in a context so independent users (several assemblies in one
+process, or on different threads) don't trip over each other. The older
+API without a context argument operates on a default context.
+*/
+struct lw_expr_ctx_priv
+{
+	lw_expr_fn_t *evaluate_special;		// special term handler
+	lw_expr_fn2_t *evaluate_var;		// variable lookup handler
+	lw_expr_fn3_t *parse_term;			// term parser
+	void (*divzero)(void *priv);		// division by zero handler
+	int width;							// expression width (8 for 8 bit complement)
+	int parse_compact;					// set if whitespace ends an expression
+
+	/* Q&D to break out of infinite recursion */
+	int level;
+	int bailing;
+
+	/* statistics counters */
+	unsigned long simplify_calls;
+	unsigned long simplify_iterations;
+
+	/* buffer for lw_expr_print_ctx() */
+	char *printbuf;
+	int printbufsize;
+};
+
+static struct lw_expr_ctx_priv default_ctx;
+
+lw_expr_ctx_t lw_expr_ctx_create(void)
+{
+	lw_expr_ctx_t ctx;
+	
+	ctx = lw_alloc(sizeof(struct lw_expr_ctx_priv));
+	memset(ctx, 0, sizeof(struct lw_expr_ctx_priv));
+	return ctx;
+}
+
+void lw_expr_ctx_destroy(lw_expr_ctx_t ctx)
+{
+	if (ctx && ctx != &default_ctx)
+	{
+		lw_free(ctx -> printbuf);
+		lw_free(ctx);
+	}
+}
+
+lw_expr_ctx_t lw_expr_ctx_default(void)
+{
+	return &default_ctx;
+}
+
+void lw_expr_ctx_setwidth(lw_expr_ctx_t ctx, int w)
+{
+	ctx -> width = w;
+}
+
+void lw_expr_ctx_setdivzero(lw_expr_ctx_t ctx, void (*fn)(void *priv))
+{
+	ctx -> divzero = fn;
+}
+
+void lw_expr_ctx_set_term_parser(lw_expr_ctx_t ctx, lw_expr_fn3_t *fn)
+{
+	ctx -> parse_term = fn;
+}
 
-/* Q&D to break out of infinite recursion */
-static int level = 0;
-static int bailing = 0;
-static int parse_compact = 0;
+void lw_expr_ctx_set_special_handler(lw_expr_ctx_t ctx, lw_expr_fn_t *fn)
+{
+	ctx -> evaluate_special = fn;
+}
 
-static void (*divzero)(void *priv) = NULL;
+void lw_expr_ctx_set_var_handler(lw_expr_ctx_t ctx, lw_expr_fn2_t *fn)
+{
+	ctx -> evaluate_var = fn;
+}
 
-static int expr_width = 0;
+void lw_expr_ctx_getstats(lw_expr_ctx_t ctx, unsigned long *calls, unsigned long *iterations)
+{
+	if (calls)
+		*calls = ctx -> simplify_calls;
+	if (iterations)
+		*iterations = ctx -> simplify_iterations;
+}
 
 void lw_expr_setwidth(int w)
 {
-	expr_width = w;
+	lw_expr_ctx_setwidth(&default_ctx, w);
 }
 
 void lw_expr_setdivzero(void (*fn)(void *priv))
 {
-	divzero = fn;
+	lw_expr_ctx_setdivzero(&default_ctx, fn);
 }
 
-static void lw_expr_divzero(void *priv)
+void lw_expr_getstats(unsigned long *calls, unsigned long *iterations)
 {
-	if (divzero)
-		(*divzero)(priv);
+	lw_expr_ctx_getstats(&default_ctx, calls, iterations);
+}
+
+static void lw_expr_divzero(lw_expr_ctx_t ctx, void *priv)
+{
+	if (ctx -> divzero)
+		(*(ctx -> divzero))(priv);
 	else
 		fprintf(stderr, "Divide by zero in lw_expr!\n");
 }
@@ -97,17 +176,17 @@ int lw_expr_specint(lw_expr_t e)
 
 void lw_expr_set_term_parser(lw_expr_fn3_t *fn)
 {
-	parse_term = fn;
+	lw_expr_ctx_set_term_parser(&default_ctx, fn);
 }
 
 void lw_expr_set_special_handler(lw_expr_fn_t *fn)
 {
-	evaluate_special = fn;
+	lw_expr_ctx_set_special_handler(&default_ctx, fn);
 }
 
 void lw_expr_set_var_handler(lw_expr_fn2_t *fn)
 {
-	evaluate_var = fn;
+	lw_expr_ctx_set_var_handler(&default_ctx, fn);
 }
 
 lw_expr_t lw_expr_create(void)
@@ -115,67 +194,138 @@ lw_expr_t lw_expr_create(void)
 	lw_expr_t r;
 	
 	r = lw_alloc(sizeof(struct lw_expr_priv));
-	r -> operands = NULL;
+	r -> noperands = 0;
+	r -> maxoperands = LW_EXPR_INLINE_OPERANDS;
+	r -> operands = r -> inlineops;
 	r -> value2 = NULL;
 	r -> type = lw_expr_type_int;
 	r -> value = 0;
 	return r;
 }
 
+/* destroy all of E's operands but keep the space for them */
+static void lw_expr_clearoperands(lw_expr_t E)
+{
+	int i;
+	
+	for (i = 0; i < E -> noperands; i++)
+		lw_expr_destroy(E -> operands[i]);
+	E -> noperands = 0;
+}
+
 void lw_expr_destroy(lw_expr_t E)
 {
-	struct lw_expr_opers *o;
 	if (!E)
 		return;
-	while (E -> operands)
+	lw_expr_clearoperands(E);
+	if (E -> operands != E -> inlineops)
+		lw_free(E -> operands);
+	if (E -> type == lw_expr_type_var)
+		lw_free(E -> value2);
+	lw_free(E);
+}
+
+/* add O to the end of E's operands; E takes over O without copying it */
+static void lw_expr_attach(lw_expr_t E, lw_expr_t O)
+{
+	if (E -> noperands == E -> maxoperands)
 	{
-		o = E -> operands;
-		E -> operands = o -> next;
-		lw_expr_destroy(o -> p);
-		lw_free(o);
+		E -> maxoperands *= 2;
+		if (E -> operands == E -> inlineops)
+		{
+			E -> operands = lw_alloc(E -> maxoperands * sizeof(lw_expr_t));
+			memcpy(E -> operands, E -> inlineops, E -> noperands * sizeof(lw_expr_t));
+		}
+		else
+			E -> operands = lw_realloc(E -> operands, E -> maxoperands * sizeof(lw_expr_t));
 	}
+	E -> operands[E -> noperands++] = O;
+}
+
+/* add O to the start of E's operands without copying it */
+static void lw_expr_prepend(lw_expr_t E, lw_expr_t O)
+{
+	lw_expr_attach(E, O);
+	memmove(E -> operands + 1, E -> operands, (E -> noperands - 1) * sizeof(lw_expr_t));
+	E -> operands[0] = O;
+}
+
+/* remove operand n from E and return it */
+static lw_expr_t lw_expr_detach(lw_expr_t E, int n)
+{
+	lw_expr_t r;
+	
+	r = E -> operands[n];
+	E -> noperands--;
+	memmove(E -> operands + n, E -> operands + n + 1, (E -> noperands - n) * sizeof(lw_expr_t));
+	return r;
+}
+
+/*
+Replace the contents of E with those of T and free T. E's old operands are
+destroyed; T's operands are moved rather than copied.
+*/
+static void lw_expr_replace(lw_expr_t E, lw_expr_t T)
+{
+	lw_expr_clearoperands(E);
+	if (E -> operands != E -> inlineops)
+		lw_free(E -> operands);
 	if (E -> type == lw_expr_type_var)
 		lw_free(E -> value2);
-	lw_free(E);
+	
+	E -> type = T -> type;
+	E -> value = T -> value;
+	E -> value2 = T -> value2;
+	E -> noperands = T -> noperands;
+	E -> maxoperands = T -> maxoperands;
+	if (T -> operands == T -> inlineops)
+	{
+		memcpy(E -> inlineops, T -> inlineops, sizeof(E -> inlineops));
+		E -> operands = E -> inlineops;
+	}
+	else
+		E -> operands = T -> operands;
+	lw_free(T);
+}
+
+/* make an operator term that takes over its operands; T2 is NULL for unary operators */
+static lw_expr_t lw_expr_mkoper(int oper, lw_expr_t T1, lw_expr_t T2)
+{
+	lw_expr_t r;
+	
+	r = lw_expr_create();
+	r -> type = lw_expr_type_oper;
+	r -> value = oper;
+	lw_expr_attach(r, T1);
+	if (T2)
+		lw_expr_attach(r, T2);
+	return r;
 }
 
 /* actually duplicates the entire expression */
-void lw_expr_add_operand(lw_expr_t E, lw_expr_t O);
 lw_expr_t lw_expr_copy(lw_expr_t E)
 {
 	lw_expr_t r;
-	struct lw_expr_opers *o;
+	int i;
 	
 	if (!E)
 		return NULL;
-	r = lw_alloc(sizeof(struct lw_expr_priv));
-	*r = *E;
-	r -> operands = NULL;
+	r = lw_expr_create();
+	r -> type = E -> type;
+	r -> value = E -> value;
+	r -> value2 = E -> value2;
 	
 	if (E -> type == lw_expr_type_var)
 		r -> value2 = lw_strdup(E -> value2);
-	for (o = E -> operands; o; o = o -> next)
-	{
-		lw_expr_add_operand(r, o -> p);
-	}
+	for (i = 0; i < E -> noperands; i++)
+		lw_expr_attach(r, lw_expr_copy(E -> operands[i]));
 	
 	return r;
 }
 
 void lw_expr_add_operand(lw_expr_t E, lw_expr_t O)
 {
-	struct lw_expr_opers *o, *t;
-	
-	o = lw_alloc(sizeof(struct lw_expr_opers));
-	o -> p = lw_expr_copy(O);
-	o -> next = NULL;
-	for (t = E -> operands; t && t -> next; t = t -> next)
-		/* do nothing */ ;
-	
-	if (t)
-		t -> next = o;
-	else
-		E -> operands = o;
+	lw_expr_attach(E, lw_expr_copy(O));
 }
 
 lw_expr_t lw_expr_build_aux(int exprtype, va_list args)
@@ -245,7 +395,6 @@ lw_expr_t lw_expr_build(int exprtype, ...)
 
 void lw_expr_print_aux(lw_expr_t E, char **obuf, int *buflen, int *bufloc)
 {
-	struct lw_expr_opers *o;
 	int c = 0;
 	char buf[256];
 
@@ -254,10 +403,9 @@ void lw_expr_print_aux(lw_expr_t E, char **obuf, int *buflen, int *bufloc)
 		strcpy(buf, "(NULL)");
 		return;
 	}
-	for (o = E -> operands; o; o = o -> next)
+	for (c = 0; c < E -> noperands; c++)
 	{
-		c++;
-		lw_expr_print_aux(o -> p, obuf, buflen, bufloc);
+		lw_expr_print_aux(E -> operands[c], obuf, buflen, bufloc);
 	}
 	
 	switch (E -> type)
@@ -357,16 +505,22 @@ void lw_expr_print_aux(lw_expr_t E, char **obuf, int *buflen, int *bufloc)
 	*bufloc += c;
 }
 
-char *lw_expr_print(lw_expr_t E)
+/*
+The returned string belongs to the context and is overwritten by the next
+print through the same context.
+*/
+char *lw_expr_print_ctx(lw_expr_ctx_t ctx, lw_expr_t E)
 {
-	static char *obuf = NULL;
-	static int obufsize = 0;
-
 	int obufloc = 0;
 
-	lw_expr_print_aux(E, &obuf, &obufsize, &obufloc);
+	lw_expr_print_aux(E, &(ctx -> printbuf), &(ctx -> printbufsize), &obufloc);
+
+	return ctx -> printbuf;
+}
 
-	return obuf;
+char *lw_expr_print(lw_expr_t E)
+{
+	return lw_expr_print_ctx(&default_ctx, E);
 }
 
 /*
@@ -377,7 +531,7 @@ zero if expressions are not the same
 */
 int lw_expr_compare(lw_expr_t E1, lw_expr_t E2)
 {
-	struct lw_expr_opers *o1, *o2;
+	int i;
 
 	if (E1 == E2)
 		return 1;
@@ -404,11 +558,11 @@ int lw_expr_compare(lw_expr_t E1, lw_expr_t E2)
 			return 0;
 	}
 	
-	for (o1 = E1 -> operands, o2 = E2 -> operands; o1 && o2; o1 = o1 -> next, o2 = o2 -> next)
-		if (lw_expr_compare(o1 -> p, o2 -> p) == 0)
+	if (E1 -> noperands != E2 -> noperands)
+		return 0;
+	for (i = 0; i < E1 -> noperands; i++)
+		if (lw_expr_compare(E1 -> operands[i], E2 -> operands[i]) == 0)
 			return 0;
-	if (o1 || o2)
-		return 0;	
 
 	return 1;
 }
@@ -424,112 +578,218 @@ int lw_expr_isoper(lw_expr_t E, int oper)
 
 void lw_expr_simplify_sortconstfirst(lw_expr_t E)
 {
-	struct lw_expr_opers *o;
+	lw_expr_t t;
+	int i;
 
 	if (E -> type != lw_expr_type_oper)
 		return;
 	if (E -> value != lw_expr_oper_times && E -> value != lw_expr_oper_plus)
 		return;
 
-	for (o = E -> operands; o; o = o -> next)
+	for (i = 0; i < E -> noperands; i++)
 	{
-		if (o -> p -> type == lw_expr_type_oper && (o -> p -> value == lw_expr_oper_times || o -> p -> value == lw_expr_oper_plus))
-			lw_expr_simplify_sortconstfirst(o -> p);
+		t = E -> operands[i];
+		if (t -> type == lw_expr_type_oper && (t -> value == lw_expr_oper_times || t -> value == lw_expr_oper_plus))
+			lw_expr_simplify_sortconstfirst(t);
 	}
 	
-	for (o = E -> operands; o; o = o -> next)
+	for (i = 1; i < E -> noperands; i++)
 	{
-		if (o -> p -> type == lw_expr_type_int && o != E -> operands)
-		{
-			struct lw_expr_opers *o2;
-			for (o2 = E -> operands; o2 -> next != o; o2 = o2 -> next)
-				/* do nothing */ ;
-			o2 -> next = o -> next;
-			o -> next = E -> operands;
-			E -> operands = o;
-			o = o2;
-		}
+		if (E -> operands[i] -> type == lw_expr_type_int)
+			lw_expr_prepend(E, lw_expr_detach(E, i));
 	}
 }
 
-void lw_expr_sortoperandlist(struct lw_expr_opers **o)
+/*
+Put two terms in a canonical order: by type, then value, then name, then
+operands. Specials of the same type are ordered by their pointers, which
+is only consistent within one run; that is fine for grouping terms but
+the order must never be allowed to show in the result.
+*/
+static int lw_expr_order(lw_expr_t E1, lw_expr_t E2)
 {
-//	fprintf(stderr, "lw_expr_sortoperandlist() not yet implemented\n");
+	int i, r;
+	
+	if (E1 -> type != E2 -> type)
+		return E1 -> type < E2 -> type ? -1 : 1;
+	if (E1 -> value != E2 -> value)
+		return E1 -> value < E2 -> value ? -1 : 1;
+	if (E1 -> type == lw_expr_type_var)
+		return strcmp(E1 -> value2, E2 -> value2);
+	if (E1 -> type == lw_expr_type_special)
+	{
+		if (E1 -> value2 == E2 -> value2)
+			return 0;
+		return (char *)(E1 -> value2) < (char *)(E2 -> value2) ? -1 : 1;
+	}
+	if (E1 -> noperands != E2 -> noperands)
+		return E1 -> noperands < E2 -> noperands ? -1 : 1;
+	for (i = 0; i < E1 -> noperands; i++)
+	{
+		r = lw_expr_order(E1 -> operands[i], E2 -> operands[i]);
+		if (r)
+			return r;
+	}
+	return 0;
 }
 
-// return 1 if the operand lists match, 0 if not
-// may re-order the argument lists
-int lw_expr_simplify_compareoperandlist(struct lw_expr_opers **ol1, struct lw_expr_opers **ol2)
+static int lw_expr_order_qsort(const void *a, const void *b)
 {
-	struct lw_expr_opers *o1, *o2;
-	
-	lw_expr_sortoperandlist(ol1);
-	lw_expr_sortoperandlist(ol2);
+	return lw_expr_order(*(lw_expr_t *)a, *(lw_expr_t *)b);
+}
+
+/* sort an array of operands into canonical order */
+void lw_expr_sortoperandlist(lw_expr_t *ops, int n)
+{
+	if (n > 1)
+		qsort(ops, n, sizeof(lw_expr_t), lw_expr_order_qsort);
+}
+
+/*
+A term of a sum for like term collection: the term is coef times the
+product of the key operands. keysorted is the key in canonical order so
+a*b and b*a are recognized as the same.
+*/
+struct lw_expr_liketerm
+{
+	int index;					// position in the sum
+	int coef;
+	int nkey;
+	lw_expr_t *key;
+	lw_expr_t *keysorted;
+};
+
+static int lw_expr_liketerm_qsort(const void *a, const void *b)
+{
+	const struct lw_expr_liketerm *t1 = a, *t2 = b;
+	int i, r;
 	
-	for (o1 = *ol1, o2 = *ol2; o1 &&  o2; o1 = o1 -> next, o2 = o2 -> next)
+	if (t1 -> nkey != t2 -> nkey)
+		return t1 -> nkey < t2 -> nkey ? -1 : 1;
+	for (i = 0; i < t1 -> nkey; i++)
 	{
-		if (!lw_expr_compare(o1 -> p, o2 -> p))
-			return 0;
+		r = lw_expr_order(t1 -> keysorted[i], t2 -> keysorted[i]);
+		if (r)
+			return r;
 	}
-	if (o1 || o2)
+	// keep like terms in their original order
+	return t1 -> index - t2 -> index;
+}
+
+static int lw_expr_liketerm_same(struct lw_expr_liketerm *t1, struct lw_expr_liketerm *t2)
+{
+	int i;
+	
+	if (t1 -> nkey != t2 -> nkey)
 		return 0;
+	for (i = 0; i < t1 -> nkey; i++)
+		if (!lw_expr_compare(t1 -> keysorted[i], t2 -> keysorted[i]))
+			return 0;
 	return 1;
 }
 
-int lw_expr_simplify_isliketerm(lw_expr_t e1, lw_expr_t e2)
+/*
+Collect like terms in the sum E: 2*a + b + a*3 becomes 5*a + b. The
+combined term takes the place of the first of them. Sorting the terms
+brings like terms together so this is O(n log n) rather than comparing
+every pair. Returns nonzero if anything was combined.
+*/
+static int lw_expr_simplify_liketerms(lw_expr_t E)
 {
-	// first term is a "times"
-	if (e1 -> type == lw_expr_type_oper && e1 -> value == lw_expr_oper_times)
+	struct lw_expr_liketerm *terms;
+	lw_expr_t *keys, t, e1;
+	int i, j, k, n, nkeys, coef, merged = 0;
+	
+	if (E -> noperands < 2)
+		return 0;
+	
+	terms = lw_alloc(E -> noperands * sizeof(struct lw_expr_liketerm));
+	for (i = 0, n = 0, nkeys = 0; i < E -> noperands; i++)
 	{
-		// second term is a "times"
-		if (e2 -> type == lw_expr_type_oper && e2 -> value == lw_expr_oper_times)
+		t = E -> operands[i];
+		// skip constants
+		if (t -> type == lw_expr_type_int)
+			continue;
+		terms[n].index = i;
+		terms[n].coef = 1;
+		if (t -> type == lw_expr_type_oper && t -> value == lw_expr_oper_times)
 		{
-			// both times - easy check
-			struct lw_expr_opers *o1, *o2;
-			for (o1 = e1 -> operands; o1; o1 = o1 -> next)
-				if (o1 -> p -> type != lw_expr_type_int)
-					break;
-			
-			for (o2 = e2 -> operands; o2; o2 = o2 -> next)
-				if (o2 -> p -> type != lw_expr_type_int)
-					break;
-			
-			if (lw_expr_simplify_compareoperandlist(&o1, &o2))
-				return 1;
-			return 0;
+			terms[n].key = t -> operands;
+			terms[n].nkey = t -> noperands;
+			if (t -> operands[0] -> type == lw_expr_type_int)
+			{
+				terms[n].coef = t -> operands[0] -> value;
+				terms[n].key++;
+				terms[n].nkey--;
+			}
 		}
-		
-		// not a times - have to assume it's the operand list
-		// with a "1 *" in front if it
-		if (!e1 -> operands -> next)
-			return 0;
-		if (e1 -> operands -> next -> next)
-			return 0;
-		if (!lw_expr_compare(e1 -> operands -> next -> p, e2))
-			return 0;
-		return 1;
+		else
+		{
+			terms[n].key = E -> operands + i;
+			terms[n].nkey = 1;
+		}
+		nkeys += terms[n].nkey;
+		n++;
 	}
 	
-	// e1 is not a times
-	if (e2 -> type == lw_expr_type_oper && e2 -> value == lw_expr_oper_times)
+	keys = lw_alloc((nkeys ? nkeys : 1) * sizeof(lw_expr_t));
+	for (i = 0, k = 0; i < n; i++)
 	{
-		// e2 is a times
-		if (e2 -> operands -> next -> next)
-			return 0;
-		if (!lw_expr_compare(e1, e2 -> operands -> next -> p))
-			return 0;
-		return 1;
+		terms[i].keysorted = keys + k;
+		memcpy(keys + k, terms[i].key, terms[i].nkey * sizeof(lw_expr_t));
+		lw_expr_sortoperandlist(keys + k, terms[i].nkey);
+		k += terms[i].nkey;
 	}
+	qsort(terms, n, sizeof(struct lw_expr_liketerm), lw_expr_liketerm_qsort);
 	
-	// neither are times
-	if (!lw_expr_compare(e1, e2))
-		return 0;
-	return 1;
+	for (i = 0; i < n; i = j)
+	{
+		coef = terms[i].coef;
+		for (j = i + 1; j < n && lw_expr_liketerm_same(terms + i, terms + j); j++)
+			coef += terms[j].coef;
+		if (j == i + 1)
+			continue;
+		
+		// we have like terms here; the first one gets the total
+		if (coef == 0)
+			e1 = lw_expr_build(lw_expr_type_int, 0);
+		else if (coef == 1 && terms[i].nkey == 1)
+			e1 = lw_expr_copy(terms[i].key[0]);
+		else
+		{
+			e1 = lw_expr_create();
+			e1 -> type = lw_expr_type_oper;
+			e1 -> value = lw_expr_oper_times;
+			if (coef != 1)
+				lw_expr_attach(e1, lw_expr_build(lw_expr_type_int, coef));
+			for (k = 0; k < terms[i].nkey; k++)
+				lw_expr_add_operand(e1, terms[i].key[k]);
+		}
+		for (k = j - 1; k > i; k--)
+		{
+			lw_expr_destroy(E -> operands[terms[k].index]);
+			E -> operands[terms[k].index] = NULL;
+		}
+		lw_expr_destroy(E -> operands[terms[i].index]);
+		E -> operands[terms[i].index] = e1;
+		merged = 1;
+	}
+	lw_free(keys);
+	lw_free(terms);
+	
+	if (merged)
+	{
+		for (i = 0, j = 0; i < E -> noperands; i++)
+			if (E -> operands[i])
+				E -> operands[j++] = E -> operands[i];
+		E -> noperands = j;
+	}
+	return merged;
 }
 
 int lw_expr_contains(lw_expr_t E, lw_expr_t E1)
 {
-	struct lw_expr_opers *o;
+	int i;
 	
 	// NULL expr contains nothing :)
 	if (!E)
@@ -541,106 +801,145 @@ int lw_expr_contains(lw_expr_t E, lw_expr_t E1)
 	if (lw_expr_compare(E, E1))
 		return 1;
 	
-	for (o = E -> operands; o; o = o -> next)
+	for (i = 0; i < E -> noperands; i++)
 	{
-		if (lw_expr_contains(o -> p, E1))
+		if (lw_expr_contains(E -> operands[i], E1))
 			return 1;
 	}
 	return 0;
 }
 
-void lw_expr_simplify_l(lw_expr_t E, void *priv);
+/*
+Work out the value of an operator applied to integers. Unary operators
+ignore v2. The caller is responsible for not dividing by zero.
+*/
+static int lw_expr_evaloper(int oper, int v1, int v2)
+{
+	switch (oper)
+	{
+	case lw_expr_oper_neg:
+		return -v1;
+
+	case lw_expr_oper_com:
+		return ~v1;
+	
+	case lw_expr_oper_com8:
+		return ~v1 & 0xff;
+	
+	case lw_expr_oper_plus:
+		return v1 + v2;
+
+	case lw_expr_oper_minus:
+		return v1 - v2;
+
+	case lw_expr_oper_times:
+		return v1 * v2;
+
+	case lw_expr_oper_divide:
+	case lw_expr_oper_intdiv:
+		return v1 / v2;
+	
+	case lw_expr_oper_mod:
+		return v1 % v2;
+	
+	case lw_expr_oper_bwand:
+		return v1 & v2;
+
+	case lw_expr_oper_bwor:
+		return v1 | v2;
+
+	case lw_expr_oper_bwxor:
+		return v1 ^ v2;
+
+	case lw_expr_oper_and:
+		return v1 && v2;
+
+	case lw_expr_oper_or:
+		return v1 || v2;
+	}
+	return -42424242;
+}
+
+static void lw_expr_simplify_l(lw_expr_ctx_t ctx, lw_expr_t E, void *priv);
+
+/*
+Move the operands of nested operations of the same kind as E up into E in
+place of the nested operation, so a+(b+c) becomes a+b+c.
+*/
+static void lw_expr_simplify_flatten(lw_expr_t E)
+{
+	lw_expr_t t;
+	int i, j;
+
+	for (i = 0; i < E -> noperands; i++)
+	{
+		t = E -> operands[i];
+		if (t -> type != lw_expr_type_oper || t -> value != E -> value)
+			continue;
+		// replace the nested operation with its own operands; they are
+		// looked at again in case they need flattening too
+		lw_expr_detach(E, i);
+		for (j = 0; j < t -> noperands; j++)
+		{
+			lw_expr_attach(E, t -> operands[j]);
+			memmove(E -> operands + i + j + 1, E -> operands + i + j, (E -> noperands - i - j - 1) * sizeof(lw_expr_t));
+			E -> operands[i + j] = t -> operands[j];
+		}
+		t -> noperands = 0;
+		lw_expr_destroy(t);
+		i--;
+	}
+}
 
-void lw_expr_simplify_go(lw_expr_t E, void *priv)
+static void lw_expr_simplify_go(lw_expr_ctx_t ctx, lw_expr_t E, void *priv)
 {
-	struct lw_expr_opers *o;
+	int i, j;
 
 	// replace subtraction with O1 + -1(O2)...
 	// needed for like term collection
 	if (E -> type == lw_expr_type_oper && E -> value == lw_expr_oper_minus)
 	{
-		for (o = E -> operands -> next; o; o = o -> next)
-		{
-			lw_expr_t e1, e2;
-			
-			e2 = lw_expr_build(lw_expr_type_int, -1);
-			e1 = lw_expr_build(lw_expr_type_oper, lw_expr_oper_times, e2, o -> p);
-			lw_expr_destroy(o -> p);
-			lw_expr_destroy(e2);
-			o -> p = e1;
-		}
+		for (i = 1; i < E -> noperands; i++)
+			E -> operands[i] = lw_expr_mkoper(lw_expr_oper_times, lw_expr_build(lw_expr_type_int, -1), E -> operands[i]);
 		E -> value = lw_expr_oper_plus;
 	}
 
 	// turn "NEG" into -1(O) - needed for like term collection
 	if (E -> type == lw_expr_type_oper && E -> value == lw_expr_oper_neg)
 	{
-		lw_expr_t e1;
-		
 		E -> value = lw_expr_oper_times;
-		e1 = lw_expr_build(lw_expr_type_int, -1);
-		lw_expr_add_operand(E, e1);
-		lw_expr_destroy(e1);
+		lw_expr_attach(E, lw_expr_build(lw_expr_type_int, -1));
 	}
 	
 again:
 	// try to resolve non-constant terms to constants here
-	if (E -> type == lw_expr_type_special && evaluate_special)
+	if (E -> type == lw_expr_type_special && ctx -> evaluate_special)
 	{
 		lw_expr_t te;
 		
-		te = evaluate_special(E -> value, E -> value2, priv);
+		te = ctx -> evaluate_special(E -> value, E -> value2, priv);
 		if (lw_expr_contains(te, E))
 			lw_expr_destroy(te);
 		else if (te)
 		{
-			for (o = E -> operands; o; o = o -> next)
-				lw_expr_destroy(o -> p);
-			if (E -> type == lw_expr_type_var)
-				lw_free(E -> value2);
-			*E = *te;
-			E -> operands = NULL;
-	
-			if (te -> type == lw_expr_type_var)
-				E -> value2 = lw_strdup(te -> value2);
-			for (o = te -> operands; o; o = o -> next)
-			{
-				lw_expr_t xxx;
-				xxx = lw_expr_copy(o -> p);
-				lw_expr_add_operand(E, xxx);
-				lw_expr_destroy(xxx);
-			}
-			lw_expr_destroy(te);
+			lw_expr_replace(E, te);
 			goto again;
 		}
 		return;
 	}
 
-	if (E -> type == lw_expr_type_var && evaluate_var)
+	if (E -> type == lw_expr_type_var && ctx -> evaluate_var)
 	{
 		lw_expr_t te;
 		
-		te = evaluate_var(E -> value2, priv);
+		te = ctx -> evaluate_var(E -> value2, priv);
 		if (!te)
 			return;
 		if (lw_expr_contains(te, E))
 			lw_expr_destroy(te);
 		else if (te)
 		{
-			for (o = E -> operands; o; o = o -> next)
-				lw_expr_destroy(o -> p);
-			if (E -> type == lw_expr_type_var)
-				lw_free(E -> value2);
-			*E = *te;
-			E -> operands = NULL;
-	
-			if (te -> type == lw_expr_type_var)
-				E -> value2 = lw_strdup(te -> value2);
-			for (o = te -> operands; o; o = o -> next)
-			{
-				lw_expr_add_operand(E, lw_expr_copy(o -> p));
-			}
-			lw_expr_destroy(te);
+			lw_expr_replace(E, te);
 			goto again;
 		}
 		return;
@@ -650,238 +949,98 @@ again:
 	if (E -> type != lw_expr_type_oper)
 		return;
 
-	// merge plus operations
-	if (E -> value == lw_expr_oper_plus)
-	{
-	tryagainplus:
-		for (o = E -> operands; o; o = o -> next)
-		{
-			if (o -> p -> type == lw_expr_type_oper && o -> p -> value == lw_expr_oper_plus)
-			{
-				struct lw_expr_opers *o2;
-				// we have a + operation - bring operands up
-				
-				for (o2 = E -> operands; o2 && o2 -> next != o; o2 = o2 -> next)
-					/* do nothing */ ;
-				if (o2)
-					o2 -> next = o -> p -> operands;
-				else
-					E -> operands = o -> p -> operands;
-				for (o2 = o -> p -> operands; o2 -> next; o2 = o2 -> next)
-					/* do nothing */ ;
-				o2 -> next = o -> next;
-				o -> p -> operands = NULL;
-				lw_expr_destroy(o -> p);
-				lw_free(o);
-				goto tryagainplus;
-			}
-		}
-	}
-	
-	// merge times operations
-	if (E -> value == lw_expr_oper_times)
-	{
-	tryagaintimes:
-		for (o = E -> operands; o; o = o -> next)
-		{
-			if (o -> p -> type == lw_expr_type_oper && o -> p -> value == lw_expr_oper_times)
-			{
-				struct lw_expr_opers *o2;
-				// we have a + operation - bring operands up
-				
-				for (o2 = E -> operands; o2 && o2 -> next != o; o2 = o2 -> next)
-					/* do nothing */ ;
-				if (o2)
-					o2 -> next = o -> p -> operands;
-				else
-					E -> operands = o -> p -> operands;
-				for (o2 = o -> p -> operands; o2 -> next; o2 = o2 -> next)
-					/* do nothing */ ;
-				o2 -> next = o -> next;
-				o -> p -> operands = NULL;
-				lw_expr_destroy(o -> p);
-				lw_free(o);
-				goto tryagaintimes;
-			}
-		}
-	}
+	// merge plus operations and times operations
+	if (E -> value == lw_expr_oper_plus || E -> value == lw_expr_oper_times)
+		lw_expr_simplify_flatten(E);
 	
 	// simplify operands
-	for (o = E -> operands; o; o = o -> next)
-		if (o -> p -> type != lw_expr_type_int)
-			lw_expr_simplify_l(o -> p, priv);
+	for (i = 0; i < E -> noperands; i++)
+		if (E -> operands[i] -> type != lw_expr_type_int)
+			lw_expr_simplify_l(ctx, E -> operands[i], priv);
 
-	for (o = E -> operands; o; o = o -> next)
+	for (i = 0; i < E -> noperands; i++)
 	{
-		if (o -> p -> type != lw_expr_type_int)
+		if (E -> operands[i] -> type != lw_expr_type_int)
 			break;
 	}
 
-	if (!o)
+	if (i == E -> noperands)
 	{
 		// we can do the operation here!
-		int tr = -42424242;
+		int tr;
 		
 		switch (E -> value)
 		{
-		case lw_expr_oper_neg:
-			tr = -(E -> operands -> p -> value);
-			break;
-
-		case lw_expr_oper_com:
-			tr = ~(E -> operands -> p -> value);
-			break;
-		
-		case lw_expr_oper_com8:
-			tr = ~(E -> operands -> p -> value) & 0xff;
-			break;
-		
 		case lw_expr_oper_plus:
-			tr = E -> operands -> p -> value;
-			for (o = E -> operands -> next; o; o = o -> next)
-				tr += o -> p -> value;
-			break;
-
 		case lw_expr_oper_minus:
-			tr = E -> operands -> p -> value;
-			for (o = E -> operands -> next; o; o = o -> next)
-				tr -= o -> p -> value;
+		case lw_expr_oper_times:
+			tr = E -> operands[0] -> value;
+			for (i = 1; i < E -> noperands; i++)
+				tr = lw_expr_evaloper(E -> value, tr, E -> operands[i] -> value);
 			break;
 
-		case lw_expr_oper_times:
-			tr = E -> operands -> p -> value;
-			for (o = E -> operands -> next; o; o = o -> next)
-				tr *= o -> p -> value;
+		case lw_expr_oper_neg:
+		case lw_expr_oper_com:
+		case lw_expr_oper_com8:
+			tr = lw_expr_evaloper(E -> value, E -> operands[0] -> value, 0);
 			break;
 
 		case lw_expr_oper_divide:
-			if (E -> operands -> next -> p -> value == 0)
-			{
-				tr = 0;
-				lw_expr_divzero(priv);
-				break;
-			}
-			tr = E -> operands -> p -> value / E -> operands -> next -> p -> value;
-			break;
-		
 		case lw_expr_oper_mod:
-			if (E -> operands -> next -> p -> value == 0)
-			{
-				tr = 0;
-				lw_expr_divzero(priv);
-				break;
-			}
-			tr = E -> operands -> p -> value % E -> operands -> next -> p -> value;
-			break;
-		
 		case lw_expr_oper_intdiv:
-			if (E -> operands -> next -> p -> value == 0)
+			if (E -> operands[1] -> value == 0)
 			{
 				tr = 0;
-				lw_expr_divzero(priv);
+				lw_expr_divzero(ctx, priv);
 				break;
 			}
-			tr = E -> operands -> p -> value / E -> operands -> next -> p -> value;
-			break;
-
-		case lw_expr_oper_bwand:
-			tr = E -> operands -> p -> value & E -> operands -> next -> p -> value;
-			break;
-
-		case lw_expr_oper_bwor:
-			tr = E -> operands -> p -> value | E -> operands -> next -> p -> value;
-			break;
-
-		case lw_expr_oper_bwxor:
-			tr = E -> operands -> p -> value ^ E -> operands -> next -> p -> value;
-			break;
-
-		case lw_expr_oper_and:
-			tr = E -> operands -> p -> value && E -> operands -> next -> p -> value;
-			break;
-
-		case lw_expr_oper_or:
-			tr = E -> operands -> p -> value || E -> operands -> next -> p -> value;
+			/* fall through */
+		default:
+			tr = lw_expr_evaloper(E -> value, E -> operands[0] -> value, E -> operands[1] -> value);
 			break;
-		
 		}
 		
-		while (E -> operands)
-		{
-			o = E -> operands;
-			E -> operands = o -> next;
-			lw_expr_destroy(o -> p);
-			lw_free(o);
-		}
+		lw_expr_clearoperands(E);
 		E -> type = lw_expr_type_int;
 		E -> value = tr;
 		return;
 	}
 
-	if (E -> value == lw_expr_oper_plus)
+	// gather the constants of a sum or product into one, at the end
+	if (E -> value == lw_expr_oper_plus || E -> value == lw_expr_oper_times)
 	{
-		lw_expr_t e1;
-		int cval = 0;
-		
-		e1 = lw_expr_create();
-		e1 -> operands = E -> operands;
-		E -> operands = 0;
+		int cval;
 		
-		for (o = e1 -> operands; o; o = o -> next)
+		cval = (E -> value == lw_expr_oper_plus) ? 0 : 1;
+		for (i = 0, j = 0; i < E -> noperands; i++)
 		{
-			if (o -> p -> type == lw_expr_type_int)
-				cval += o -> p -> value;
+			if (E -> operands[i] -> type == lw_expr_type_int)
+			{
+				cval = lw_expr_evaloper(E -> value, cval, E -> operands[i] -> value);
+				lw_expr_destroy(E -> operands[i]);
+			}
 			else
-				lw_expr_add_operand(E, o -> p);
-		}
-		lw_expr_destroy(e1);
-		if (cval)
-		{
-			e1 = lw_expr_build(lw_expr_type_int, cval);
-			lw_expr_add_operand(E, e1);
-			lw_expr_destroy(e1);
+				E -> operands[j++] = E -> operands[i];
 		}
+		E -> noperands = j;
+		if (cval != ((E -> value == lw_expr_oper_plus) ? 0 : 1))
+			lw_expr_attach(E, lw_expr_build(lw_expr_type_int, cval));
 	}
 
 	if (E -> value == lw_expr_oper_times)
 	{
-		lw_expr_t e1;
-		int cval = 1;
-		
-		e1 = lw_expr_create();
-		e1 -> operands = E -> operands;
-		E -> operands = 0;
-		
-		for (o = e1 -> operands; o; o = o -> next)
+		// a product of one thing is just that thing
+		if (E -> noperands == 1)
 		{
-			if (o -> p -> type == lw_expr_type_int)
-				cval *= o -> p -> value;
-			else
-				lw_expr_add_operand(E, o -> p);
-		}
-		lw_expr_destroy(e1);
-		if (cval != 1)
-		{
-			e1 = lw_expr_build(lw_expr_type_int, cval);
-			lw_expr_add_operand(E, e1);
-			lw_expr_destroy(e1);
+			lw_expr_replace(E, lw_expr_detach(E, 0));
+			return;
 		}
-	}
-
-	if (E -> value == lw_expr_oper_times)
-	{
-		for (o = E -> operands; o; o = o -> next)
+		for (i = 0; i < E -> noperands; i++)
 		{
-			if (o -> p -> type == lw_expr_type_int && o -> p -> value == 0)
+			if (E -> operands[i] -> type == lw_expr_type_int && E -> operands[i] -> value == 0)
 			{
 				// one operand of times is 0, replace operation with 0
-				while (E -> operands)
-				{
-					o = E -> operands;
-					E -> operands = o -> next;
-					lw_expr_destroy(o -> p);
-					lw_free(o);
-				}
+				lw_expr_clearoperands(E);
 				E -> type = lw_expr_type_int;
 				E -> value = 0;
 				return;
@@ -895,246 +1054,120 @@ again:
 	
 	// look for like terms and collect them together
 	if (E -> value == lw_expr_oper_plus)
-	{
-		struct lw_expr_opers *o2;
-		for (o = E -> operands; o; o = o -> next)
-		{
-			// skip constants
-			if (o -> p -> type == lw_expr_type_int)
-				continue;
-			
-			// we have a term to match
-			// (o -> p) is first term
-			for (o2 = o -> next; o2; o2 = o2 -> next)
-			{
-				lw_expr_t e1, e2;
-				
-				if (o2 -> p -> type == lw_expr_type_int)
-					continue;
-
-				if (lw_expr_simplify_isliketerm(o -> p, o2 -> p))
-				{
-					int coef, coef2;
-					
-					// we have a like term here
-					// do something about it
-					if (o -> p -> type == lw_expr_type_oper && o -> p -> value == lw_expr_oper_times)
-					{
-						if (o -> p -> operands -> p -> type == lw_expr_type_int)
-							coef = o -> p -> operands -> p -> value;
-						else
-							coef = 1;
-					}
-					else
-						coef = 1;
-					if (o2 -> p -> type == lw_expr_type_oper && o2 -> p -> value == lw_expr_oper_times)
-					{
-						if (o2 -> p -> operands -> p -> type == lw_expr_type_int)
-							coef2 = o2 -> p -> operands -> p -> value;
-						else
-							coef2 = 1;
-					}
-					else
-						coef2 = 1;
-					coef += coef2;
-					e1 = lw_expr_create();
-					e1 -> type = lw_expr_type_oper;
-					e1 -> value = lw_expr_oper_times;
-					if (coef != 1)
-					{
-						e2 = lw_expr_build(lw_expr_type_int, coef);
-						lw_expr_add_operand(e1, e2);
-						lw_expr_destroy(e2);
-					}
-					lw_expr_destroy(o -> p);
-					o -> p = e1;
-					if (o2 -> p -> type == lw_expr_type_oper)
-					{
-						for (o = o2 -> p -> operands; o; o = o -> next)
-						{
-							if (o -> p -> type == lw_expr_type_int)
-								continue;
-							lw_expr_add_operand(e1, o -> p);
-						}
-					}
-					else
-					{
-						lw_expr_add_operand(e1, o2 -> p);
-					}
-					lw_expr_destroy(o2 -> p);
-					o2 -> p = lw_expr_build(lw_expr_type_int, 0);
-					goto again;
-				}
-			}
-		}
-	}
-
+		lw_expr_simplify_liketerms(E);
 
 	if (E -> value == lw_expr_oper_plus)
 	{
-		int c = 0, t = 0;
-		for (o = E -> operands; o; o = o -> next)
+		int c = 0;
+		
+		for (i = 0; i < E -> noperands; i++)
 		{
-			t++;
-			if (!(o -> p -> type == lw_expr_type_int && o -> p -> value == 0))
+			if (!(E -> operands[i] -> type == lw_expr_type_int && E -> operands[i] -> value == 0))
 			{
 				c++;
+				j = i;
 			}
 		}
 		if (c == 1)
 		{
-			lw_expr_t r = NULL;
 			// find the value and "move it up"
-			while (E -> operands)
-			{
-				o = E -> operands;
-				if (o -> p -> type != lw_expr_type_int || o -> p -> value != 0)
-				{
-					r = lw_expr_copy(o -> p);
-				}
-				E -> operands = o -> next;
-				lw_expr_destroy(o -> p);
-				lw_free(o);
-			}
-			*E = *r;
-			lw_free(r);
+			lw_expr_replace(E, lw_expr_detach(E, j));
 			return;
 		}
 		else if (c == 0)
 		{
 			// replace with 0
-			while (E -> operands)
-			{
-				o = E -> operands;
-				E -> operands = o -> next;
-				lw_expr_destroy(o -> p);
-				lw_free(o);
-			}
+			lw_expr_clearoperands(E);
 			E -> type = lw_expr_type_int;
 			E -> value = 0;
 			return;
 		}
-		else if (c != t)
+		else if (c != E -> noperands)
 		{
 			// collapse out zero terms
-			struct lw_expr_opers *o2;
-			
-			for (o = E -> operands; o; o = o -> next)
+			for (i = 0, j = 0; i < E -> noperands; i++)
 			{
-				if (o -> p -> type == lw_expr_type_int && o -> p -> value == 0)
-				{
-					if (o == E -> operands)
-					{
-						E -> operands = o -> next;
-						lw_expr_destroy(o -> p);
-						lw_free(o);
-						o = E -> operands;
-					}
-					else
-					{
-						for (o2 = E -> operands; o2 -> next == o; o2 = o2 -> next)
-							/* do nothing */ ;
-						o2 -> next = o -> next;
-						lw_expr_destroy(o -> p);
-						lw_free(o);
-						o = o2;
-					}
-				}
+				if (E -> operands[i] -> type == lw_expr_type_int && E -> operands[i] -> value == 0)
+					lw_expr_destroy(E -> operands[i]);
+				else
+					E -> operands[j++] = E -> operands[i];
 			}
+			E -> noperands = j;
 		}
 		return;
 	}
 	
 	/* handle <int> times <plus> - expand the terms - only with exactly two operands */
-	if (E -> value == lw_expr_oper_times)
+	if (E -> value == lw_expr_oper_times && E -> noperands == 2)
 	{
-		lw_expr_t t1;
-		lw_expr_t E2;
-		lw_expr_t E3;
-		if (E -> operands && E -> operands -> next && !(E -> operands -> next -> next))
+		lw_expr_t E2, E3;
+		
+		/* <int> TIMES <other> or <other> TIMES <int> */
+		if (E -> operands[0] -> type == lw_expr_type_int)
 		{
-			if (E -> operands -> p -> type  == lw_expr_type_int)
-			{
-				/* <int> TIMES <other> */
-				E2 = E -> operands -> next -> p;
-				E3 = E -> operands -> p;
-				if (E2 -> type == lw_expr_type_oper && E2 -> value == lw_expr_oper_plus)
-				{
-					lw_free(E -> operands -> next);
-					lw_free(E -> operands);
-					E -> operands = NULL;
-					E -> value = lw_expr_oper_plus;
-					
-					for (o = E2 -> operands; o; o = o -> next)
-					{
-						t1 = lw_expr_build(lw_expr_type_oper, lw_expr_oper_times, E3, o -> p);
-						lw_expr_add_operand(E, t1);
-						lw_expr_destroy(t1);
-					}
-					
-					lw_expr_destroy(E2);
-					lw_expr_destroy(E3);
-				}
-			}
-			else if (E -> operands -> next -> p -> type == lw_expr_type_int)
-			{
-				/* <other> TIMES <int> */
-				E2 = E -> operands -> p;
-				E3 = E -> operands -> next -> p;
-				if (E2 -> type == lw_expr_type_oper && E2 -> value == lw_expr_oper_plus)
-				{
-					lw_free(E -> operands -> next);
-					lw_free(E -> operands);
-					E -> operands = NULL;
-					E -> value = lw_expr_oper_plus;
-					
-					for (o = E2 -> operands; o; o = o -> next)
-					{
-						t1 = lw_expr_build(lw_expr_type_oper, lw_expr_oper_times, E3, o -> p);
-						lw_expr_add_operand(E, t1);
-					}
-					
-					lw_expr_destroy(E2);
-					lw_expr_destroy(E3);
-				}
-			}
+			E2 = E -> operands[1];
+			E3 = E -> operands[0];
+		}
+		else
+		{
+			E2 = E -> operands[0];
+			E3 = E -> operands[1];
+		}
+		if (E3 -> type == lw_expr_type_int && E2 -> type == lw_expr_type_oper && E2 -> value == lw_expr_oper_plus)
+		{
+			E -> noperands = 0;
+			E -> value = lw_expr_oper_plus;
+			
+			for (i = 0; i < E2 -> noperands; i++)
+				lw_expr_attach(E, lw_expr_mkoper(lw_expr_oper_times, lw_expr_copy(E3), E2 -> operands[i]));
+			
+			E2 -> noperands = 0;
+			lw_expr_destroy(E2);
+			lw_expr_destroy(E3);
 		}
 	}
 }
 
-void lw_expr_simplify_l(lw_expr_t E, void *priv)
+static void lw_expr_simplify_l(lw_expr_ctx_t ctx, lw_expr_t E, void *priv)
 {
 	lw_expr_t te;
 	int c;
 	
-	(level)++;
+	(ctx -> level)++;
 	// bail out if the level gets too deep
-	if (level >= 500 || bailing)
+	if (ctx -> level >= 500 || ctx -> bailing)
 	{
-		bailing = 1;
-		level--;
-		if (level == 0)
-			bailing = 0;
+		ctx -> bailing = 1;
+		ctx -> level--;
+		if (ctx -> level == 0)
+			ctx -> bailing = 0;
 		return;
 	}
 	do
 	{
+		ctx -> simplify_iterations++;
 		te = lw_expr_copy(E);
-		lw_expr_simplify_go(E, priv);
+		lw_expr_simplify_go(ctx, E, priv);
 		c = 0;
 		if (lw_expr_compare(te, E) == 0)
 			c = 1;
 		lw_expr_destroy(te);
 	}
 	while (c);
-	(level)--;
+	(ctx -> level)--;
 }
 
-void lw_expr_simplify(lw_expr_t E, void *priv)
+void lw_expr_simplify_ctx(lw_expr_ctx_t ctx, lw_expr_t E, void *priv)
 {
+	ctx -> simplify_calls++;
 	if (E -> type == lw_expr_type_int)
 		return;
-	lw_expr_simplify_l(E, priv);
+	lw_expr_simplify_l(ctx, E, priv);
+}
+
+void lw_expr_simplify(lw_expr_t E, void *priv)
+{
+	lw_expr_simplify_ctx(&default_ctx, E, priv);
 }
 
 /*
@@ -1163,22 +1196,98 @@ error.
 
 */
 
-lw_expr_t lw_expr_parse_expr(char **p, void *priv, int prec);
+static lw_expr_t lw_expr_parse_expr(lw_expr_ctx_t ctx, char **p, void *priv, int prec);
+
+/* add the integer v to the sum E, keeping the constant as the first operand */
+static void lw_expr_parse_addconst(lw_expr_t E, int v)
+{
+	if (E -> operands[0] -> type == lw_expr_type_int)
+	{
+		E -> operands[0] -> value += v;
+		return;
+	}
+	lw_expr_prepend(E, lw_expr_build(lw_expr_type_int, v));
+}
+
+/* add T to the sum E; nested sums are flattened and constants merged */
+static void lw_expr_parse_addterm(lw_expr_t E, lw_expr_t T)
+{
+	int i;
+	
+	if (T -> type == lw_expr_type_int)
+	{
+		lw_expr_parse_addconst(E, T -> value);
+		lw_expr_destroy(T);
+		return;
+	}
+	if (T -> type == lw_expr_type_oper && T -> value == lw_expr_oper_plus)
+	{
+		for (i = 0; i < T -> noperands; i++)
+			lw_expr_parse_addterm(E, T -> operands[i]);
+		T -> noperands = 0;
+		lw_expr_destroy(T);
+		return;
+	}
+	lw_expr_attach(E, T);
+}
+
+/*
+Build an operator term from operands the parser owns (T2 is NULL for unary
+operators). Nothing is copied. Operators applied to integers are folded
+here, except for division by zero which is left for the simplifier to
+complain about. Sums are kept as one flat list with the constant first
+and subtracting a constant is turned into adding its negative, so the
+common "symbol plus offset" operand comes out as a single small term.
+*/
+static lw_expr_t lw_expr_parse_oper(int oper, lw_expr_t T1, lw_expr_t T2)
+{
+	lw_expr_t r;
+	
+	if (T1 -> type == lw_expr_type_int && (!T2 || T2 -> type == lw_expr_type_int))
+	{
+		if (!T2 || T2 -> value != 0 || (oper != lw_expr_oper_divide && oper != lw_expr_oper_mod && oper != lw_expr_oper_intdiv))
+		{
+			T1 -> value = lw_expr_evaloper(oper, T1 -> value, T2 ? T2 -> value : 0);
+			lw_expr_destroy(T2);
+			return T1;
+		}
+	}
+	
+	if (oper == lw_expr_oper_minus && T2 -> type == lw_expr_type_int)
+	{
+		T2 -> value = -(T2 -> value);
+		oper = lw_expr_oper_plus;
+	}
+	
+	if (oper == lw_expr_oper_plus)
+	{
+		if (T1 -> type == lw_expr_type_oper && T1 -> value == lw_expr_oper_plus)
+		{
+			lw_expr_parse_addterm(T1, T2);
+			return T1;
+		}
+		r = lw_expr_mkoper(lw_expr_oper_plus, T1, NULL);
+		lw_expr_parse_addterm(r, T2);
+		return r;
+	}
+	
+	return lw_expr_mkoper(oper, T1, T2);
+}
 
-static void lw_expr_parse_next_tok(char **p)
+static void lw_expr_parse_next_tok(lw_expr_ctx_t ctx, char **p)
 {
-	if (parse_compact)
+	if (ctx -> parse_compact)
 		return;
 	for (; **p && isspace(**p); (*p)++)
 		/* do nothing */ ;
 }
 
-lw_expr_t lw_expr_parse_term(char **p, void *priv)
+static lw_expr_t lw_expr_parse_term(lw_expr_ctx_t ctx, char **p, void *priv)
 {
-	lw_expr_t term, term2;
+	lw_expr_t term;
 	
 eval_next:
-	lw_expr_parse_next_tok(p);
+	lw_expr_parse_next_tok(ctx, p);
 
 	if (!**p || isspace(**p) || **p == ')' || **p == ']')
 		return NULL;
@@ -1186,8 +1295,8 @@ eval_next:
 	if (**p == '(')
 	{
 		(*p)++;
-		term = lw_expr_parse_expr(p, priv, 0);
-		lw_expr_parse_next_tok(p);
+		term = lw_expr_parse_expr(ctx, p, priv, 0);
+		lw_expr_parse_next_tok(ctx, p);
 		if (**p != ')')
 		{
 			lw_expr_destroy(term);
@@ -1208,36 +1317,31 @@ eval_next:
 	if (**p == '-')
 	{
 		(*p)++;
-		term = lw_expr_parse_expr(p, priv, 200);
+		term = lw_expr_parse_expr(ctx, p, priv, 200);
 		if (!term)
 			return NULL;
 		
-		term2 = lw_expr_build(lw_expr_type_oper, lw_expr_oper_neg, term);
-		lw_expr_destroy(term);
-		return term2;
+		return lw_expr_parse_oper(lw_expr_oper_neg, term, NULL);
 	}
 	
 	// unary ^ or ~ (complement, prec 200)
 	if (**p == '^' || **p == '~')
 	{
 		(*p)++;
-		term = lw_expr_parse_expr(p, priv, 200);
+		term = lw_expr_parse_expr(ctx, p, priv, 200);
 		if (!term)
 			return NULL;
 		
-		if (expr_width == 8)
-			term2 = lw_expr_build(lw_expr_type_oper, lw_expr_oper_com8, term);
-		else
-			term2 = lw_expr_build(lw_expr_type_oper, lw_expr_oper_com, term);
-		lw_expr_destroy(term);
-		return term2;
+		if (ctx -> width == 8)
+			return lw_expr_parse_oper(lw_expr_oper_com8, term, NULL);
+		return lw_expr_parse_oper(lw_expr_oper_com, term, NULL);
 	}
 	
 	// non-operator - pass to caller
-	return parse_term(p, priv);
+	return ctx -> parse_term(p, priv);
 }
 
-lw_expr_t lw_expr_parse_expr(char **p, void *priv, int prec)
+static lw_expr_t lw_expr_parse_expr(lw_expr_ctx_t ctx, char **p, void *priv, int prec)
 {
 	static const struct operinfo
 	{
@@ -1265,18 +1369,18 @@ lw_expr_t lw_expr_parse_expr(char **p, void *priv, int prec)
 	};
 	
 	int opern, i;
-	lw_expr_t term1, term2, term3;
+	lw_expr_t term1, term2;
 	
-	lw_expr_parse_next_tok(p);
+	lw_expr_parse_next_tok(ctx, p);
 	if (!**p || isspace(**p) || **p == ')' || **p == ',' || **p == ']' || **p == ';')
 		return NULL;
 
-	term1 = lw_expr_parse_term(p, priv);
+	term1 = lw_expr_parse_term(ctx, p, priv);
 	if (!term1)
 		return NULL;
 
 eval_next:
-	lw_expr_parse_next_tok(p);
+	lw_expr_parse_next_tok(ctx, p);
 	if (!**p || isspace(**p) || **p == ')' || **p == ',' || **p == ']' || **p == ';')
 		return term1;
 	
@@ -1313,7 +1417,7 @@ eval_next:
 	(*p) += i;
 	
 	// evaluate next expression(s) of higher precedence
-	term2 = lw_expr_parse_expr(p, priv, operators[opern].operprec);
+	term2 = lw_expr_parse_expr(ctx, p, priv, operators[opern].operprec);
 	if (!term2)
 	{
 		lw_expr_destroy(term1);
@@ -1321,38 +1425,43 @@ eval_next:
 	}
 	
 	// now create operator
-	term3 = lw_expr_build(lw_expr_type_oper, operators[opern].opernum, term1, term2);
-	lw_expr_destroy(term1);
-	lw_expr_destroy(term2);
-	
 	// the new "expression" is the next "left operand"
-	term1 = term3;
+	term1 = lw_expr_parse_oper(operators[opern].opernum, term1, term2);
 	
 	// continue evaluating
 	goto eval_next;
 }
 
+lw_expr_t lw_expr_parse_ctx(lw_expr_ctx_t ctx, char **p, void *priv)
+{
+	ctx -> parse_compact = 0;
+	return lw_expr_parse_expr(ctx, p, priv, 0);
+}
+
+lw_expr_t lw_expr_parse_compact_ctx(lw_expr_ctx_t ctx, char **p, void *priv)
+{
+	ctx -> parse_compact = 1;
+	return lw_expr_parse_expr(ctx, p, priv, 0);
+}
+
 lw_expr_t lw_expr_parse(char **p, void *priv)
 {
-	parse_compact = 0;
-	return lw_expr_parse_expr(p, priv, 0);
+	return lw_expr_parse_ctx(&default_ctx, p, priv);
 }
 
 lw_expr_t lw_expr_parse_compact(char **p, void *priv)
 {
-	parse_compact = 1;
-	return lw_expr_parse_expr(p, priv, 0);
+	return lw_expr_parse_compact_ctx(&default_ctx, p, priv);
 }
 	
 
 int lw_expr_testterms(lw_expr_t e, lw_expr_testfn_t *fn, void *priv)
 {
-	struct lw_expr_opers *o;
-	int r;
+	int i, r;
 	
-	for (o = e -> operands; o; o = o -> next)
+	for (i = 0; i < e -> noperands; i++)
 	{
-		r = lw_expr_testterms(o -> p, fn, priv);
+		r = lw_expr_testterms(e -> operands[i], fn, priv);
 		if (r)
 			return r;
 	}
@@ -1371,14 +1480,14 @@ void *lw_expr_specptr(lw_expr_t e)
 
 int lw_expr_operandcount(lw_expr_t e)
 {
-	int count = 0;
-	struct lw_expr_opers *o;
-	
 	if (e -> type != lw_expr_type_oper)
 		return 0;
-	
-	for (o = e -> operands; o; o = o -> next)
-		count++;
-	
-	return count;
+	return e -> noperands;
+}
+
+lw_expr_t lw_expr_operand(lw_expr_t e, int n)
+{
+	if (e -> type != lw_expr_type_oper || n < 0 || n >= e -> noperands)
+		return NULL;
+	return e -> operands[n];
 }
@@ -57,18 +57,19 @@ enum
 
 typedef struct lw_expr_priv * lw_expr_t;
 
-struct lw_expr_opers
-{
-	lw_expr_t p;
-	struct lw_expr_opers *next;
-};
+// number of operands kept in the term itself before a separate array is
+// allocated; almost every operator has one or two
+#define LW_EXPR_INLINE_OPERANDS	2
 
 struct lw_expr_priv
 {
 	int type;							// type of term
 	int value;							// integer value
 	void *value2;						// misc pointer value
-	struct lw_expr_opers *operands;		// ptr to list of operands (for operators)
+	int noperands;						// number of operands (for operators)
+	int maxoperands;					// room in operands[]
+	lw_expr_t *operands;				// operands; points to inlineops unless there are too many
+	lw_expr_t inlineops[LW_EXPR_INLINE_OPERANDS];
 };
 
 typedef lw_expr_t lw_expr_fn_t(int t, void *ptr, void *priv);
@@ -76,6 +77,24 @@ typedef lw_expr_t lw_expr_fn2_t(char *var, void *priv);
 typedef lw_expr_t lw_expr_fn3_t(char **p, void *priv);
 typedef int lw_expr_testfn_t(lw_expr_t e, void *priv);
 
+// parser/simplifier state: handlers, expression width, recursion guards;
+// the functions that don't take a context use a shared default one
+typedef struct lw_expr_ctx_priv * lw_expr_ctx_t;
+
+lw_expr_ctx_t lw_expr_ctx_create(void);
+void lw_expr_ctx_destroy(lw_expr_ctx_t ctx);
+lw_expr_ctx_t lw_expr_ctx_default(void);
+void lw_expr_ctx_set_special_handler(lw_expr_ctx_t ctx, lw_expr_fn_t *fn);
+void lw_expr_ctx_set_var_handler(lw_expr_ctx_t ctx, lw_expr_fn2_t *fn);
+void lw_expr_ctx_set_term_parser(lw_expr_ctx_t ctx, lw_expr_fn3_t *fn);
+void lw_expr_ctx_setdivzero(lw_expr_ctx_t ctx, void (*fn)(void *priv));
+void lw_expr_ctx_setwidth(lw_expr_ctx_t ctx, int w);
+void lw_expr_ctx_getstats(lw_expr_ctx_t ctx, unsigned long *calls, unsigned long *iterations);
+void lw_expr_simplify_ctx(lw_expr_ctx_t ctx, lw_expr_t E, void *priv);
+lw_expr_t lw_expr_parse_ctx(lw_expr_ctx_t ctx, char **p, void *priv);
+lw_expr_t lw_expr_parse_compact_ctx(lw_expr_ctx_t ctx, char **p, void *priv);
+char *lw_expr_print_ctx(lw_expr_ctx_t ctx, lw_expr_t E);
+
 lw_expr_t lwexpr_create(void);
 void lw_expr_destroy(lw_expr_t E);
 lw_expr_t lw_expr_copy(lw_expr_t E);
@@ -101,6 +120,9 @@ int lw_expr_type(lw_expr_t e);
 
 int lw_expr_operandcount(lw_expr_t e);
 
+// fetch operand n (counting from 0) of an operator, or NULL
+lw_expr_t lw_expr_operand(lw_expr_t e, int n);
+
 void lw_expr_setwidth(int w);
 
 // run a function on all terms in an expression; if the function
@@ -110,4 +132,8 @@ int lw_expr_testterms(lw_expr_t e, lw_expr_testfn_t *fn, void *priv);
 
 void lw_expr_setdivzero(void (*fn)(void *priv));
 
+// fetch the number of lw_expr_simplify() calls and the total number of
+// simplification iterations they took
+void lw_expr_getstats(unsigned long *calls, unsigned long *iterations);
+
 #endif /* ___lw_expr_h_seen___ */
@@ -0,0 +1,108 @@
+/*
+lwlib/lw_hex.c
+
+Copyright © 2026 William Astle
+
+This file is part of LWTOOLS.
+
+LWTOOLS is free software: you can redistribute it and/or modify it under the
+terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "lw_hex.h"
+
+static const char lw_hex_digits[16] = "0123456789ABCDEF";
+
+#define lw_hex_byte(p, b) do { (p)[0] = lw_hex_digits[((b) >> 4) & 0x0f]; (p)[1] = lw_hex_digits[(b) & 0x0f]; } while (0)
+
+int lw_hex_encode(char *buf, const unsigned char *data, int len, int *sum)
+{
+	int i;
+	int s = 0;
+	
+	for (i = 0; i < len; i++)
+	{
+		lw_hex_byte(buf + i * 2, data[i]);
+		s += data[i];
+	}
+	if (sum)
+		*sum += s;
+	return len * 2;
+}
+
+int lw_hex_srec(char *buf, int type, int addr, const unsigned char *data, int len)
+{
+	unsigned char hdr[3];
+	int sum = 0;
+	int l;
+	
+	if (len > 252)
+		len = 252;
+	buf[0] = 'S';
+	buf[1] = lw_hex_digits[type & 0x0f];
+	hdr[0] = len + 3;
+	hdr[1] = (addr >> 8) & 0xff;
+	hdr[2] = addr & 0xff;
+	l = 2 + lw_hex_encode(buf + 2, hdr, 3, &sum);
+	l += lw_hex_encode(buf + l, data, len, &sum);
+	sum = ~sum & 0xff;
+	lw_hex_byte(buf + l, sum);
+	buf[l + 2] = '\r';
+	buf[l + 3] = '\n';
+	return l + 4;
+}
+
+int lw_hex_ihex(char *buf, int type, int addr, const unsigned char *data, int len)
+{
+	unsigned char hdr[4];
+	int sum = 0;
+	int l;
+	
+	if (len > 255)
+		len = 255;
+	buf[0] = ':';
+	hdr[0] = len;
+	hdr[1] = (addr >> 8) & 0xff;
+	hdr[2] = addr & 0xff;
+	hdr[3] = type;
+	l = 1 + lw_hex_encode(buf + 1, hdr, 4, &sum);
+	l += lw_hex_encode(buf + l, data, len, &sum);
+	sum = (256 - sum) & 0xff;
+	lw_hex_byte(buf + l, sum);
+	buf[l + 2] = '\r';
+	buf[l + 3] = '\n';
+	return l + 4;
+}
+
+int lw_hex_line(char *buf, int addr, const unsigned char *data, int len)
+{
+	int i;
+	int l;
+	
+	if (len > 255)
+		len = 255;
+	buf[0] = '\r';
+	buf[1] = '\n';
+	lw_hex_byte(buf + 2, (addr >> 8) & 0xff);
+	lw_hex_byte(buf + 4, addr & 0xff);
+	buf[6] = ':';
+	l = 7;
+	for (i = 0; i < len; i++)
+	{
+		if (i > 0)
+			buf[l++] = ',';
+		lw_hex_byte(buf + l, data[i]);
+		l += 2;
+	}
+	return l;
+}
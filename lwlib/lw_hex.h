@@ -0,0 +1,48 @@
+/*
+lwlib/lw_hex.h
+
+Copyright © 2026 William Astle
+
+This file is part of LWTOOLS.
+
+LWTOOLS is free software: you can redistribute it and/or modify it under the
+terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <http://www.gnu.org/licenses/>.
+
+Encoders for the ASCII hex output formats (Motorola S records, Intel hex,
+and the simple "ADDR:XX,XX" format). Each encoder formats one complete
+record into a caller supplied buffer and returns the number of characters
+stored. No NUL terminator is added. Checksums are accumulated while the
+data bytes are converted.
+
+The buffer must have room for LW_HEX_RECMAX characters which allows for
+a record with up to 255 data bytes.
+*/
+
+#ifndef ___lw_hex_h_seen___
+#define ___lw_hex_h_seen___
+
+#define LW_HEX_RECMAX	1024
+
+// convert len bytes to hex digits; adds the byte values to *sum if not NULL
+extern int lw_hex_encode(char *buf, const unsigned char *data, int len, int *sum);
+
+// S<type> record with a 16 bit address, terminated with CR LF
+extern int lw_hex_srec(char *buf, int type, int addr, const unsigned char *data, int len);
+
+// Intel hex record of the specified type, terminated with CR LF
+extern int lw_hex_ihex(char *buf, int type, int addr, const unsigned char *data, int len);
+
+// CR LF, then "ADDR:XX,XX,..."
+extern int lw_hex_line(char *buf, int addr, const unsigned char *data, int len);
+
+#endif // ___lw_hex_h_seen___
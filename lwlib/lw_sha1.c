@@ -0,0 +1,162 @@
+/*
+lwlib/lw_sha1.c
+
+Copyright © 2026 William Astle
+
+This file is part of LWTOOLS.
+
+LWTOOLS is free software: you can redistribute it and/or modify it under the
+terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "lw_sha1.h"
+
+#define ROL(v, n)	((((v) << (n)) | ((v) >> (32 - (n)))) & 0xffffffff)
+
+static void lw_sha1_block(lw_sha1_t *c, const unsigned char *p)
+{
+	unsigned int w[80];
+	unsigned int a, b, cc, d, e, f, k, t;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (p[i * 4] << 24) | (p[i * 4 + 1] << 16) | (p[i * 4 + 2] << 8) | p[i * 4 + 3];
+	for (i = 16; i < 80; i++)
+		w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = c -> h[0];
+	b = c -> h[1];
+	cc = c -> h[2];
+	d = c -> h[3];
+	e = c -> h[4];
+	for (i = 0; i < 80; i++)
+	{
+		if (i < 20)
+		{
+			f = (b & cc) | (~b & d);
+			k = 0x5a827999;
+		}
+		else if (i < 40)
+		{
+			f = b ^ cc ^ d;
+			k = 0x6ed9eba1;
+		}
+		else if (i < 60)
+		{
+			f = (b & cc) | (b & d) | (cc & d);
+			k = 0x8f1bbcdc;
+		}
+		else
+		{
+			f = b ^ cc ^ d;
+			k = 0xca62c1d6;
+		}
+		t = (ROL(a, 5) + f + e + k + w[i]) & 0xffffffff;
+		e = d;
+		d = cc;
+		cc = ROL(b, 30);
+		b = a;
+		a = t;
+	}
+	c -> h[0] = (c -> h[0] + a) & 0xffffffff;
+	c -> h[1] = (c -> h[1] + b) & 0xffffffff;
+	c -> h[2] = (c -> h[2] + cc) & 0xffffffff;
+	c -> h[3] = (c -> h[3] + d) & 0xffffffff;
+	c -> h[4] = (c -> h[4] + e) & 0xffffffff;
+}
+
+void lw_sha1_init(lw_sha1_t *c)
+{
+	c -> h[0] = 0x67452301;
+	c -> h[1] = 0xefcdab89;
+	c -> h[2] = 0x98badcfe;
+	c -> h[3] = 0x10325476;
+	c -> h[4] = 0xc3d2e1f0;
+	c -> len = 0;
+	c -> blen = 0;
+}
+
+void lw_sha1_update(lw_sha1_t *c, const void *data, int len)
+{
+	const unsigned char *p = data;
+	int n;
+
+	c -> len += len;
+	if (c -> blen > 0)
+	{
+		n = 64 - c -> blen;
+		if (n > len)
+			n = len;
+		memcpy(c -> buf + c -> blen, p, n);
+		c -> blen += n;
+		p += n;
+		len -= n;
+		if (c -> blen < 64)
+			return;
+		lw_sha1_block(c, c -> buf);
+		c -> blen = 0;
+	}
+	for (; len >= 64; p += 64, len -= 64)
+		lw_sha1_block(c, p);
+	memcpy(c -> buf, p, len);
+	c -> blen = len;
+}
+
+void lw_sha1_final(lw_sha1_t *c, unsigned char *digest)
+{
+	unsigned long long bits = c -> len * 8;
+	int i;
+
+	c -> buf[c -> blen++] = 0x80;
+	if (c -> blen > 56)
+	{
+		memset(c -> buf + c -> blen, 0, 64 - c -> blen);
+		lw_sha1_block(c, c -> buf);
+		c -> blen = 0;
+	}
+	memset(c -> buf + c -> blen, 0, 56 - c -> blen);
+	for (i = 0; i < 8; i++)
+		c -> buf[56 + i] = (bits >> (56 - i * 8)) & 0xff;
+	lw_sha1_block(c, c -> buf);
+
+	for (i = 0; i < 5; i++)
+	{
+		digest[i * 4] = (c -> h[i] >> 24) & 0xff;
+		digest[i * 4 + 1] = (c -> h[i] >> 16) & 0xff;
+		digest[i * 4 + 2] = (c -> h[i] >> 8) & 0xff;
+		digest[i * 4 + 3] = c -> h[i] & 0xff;
+	}
+}
+
+void lw_sha1_finalhex(lw_sha1_t *c, char *hex)
+{
+	unsigned char d[LW_SHA1_SIZE];
+	int i;
+
+	lw_sha1_final(c, d);
+	for (i = 0; i < LW_SHA1_SIZE; i++)
+		sprintf(hex + i * 2, "%02x", d[i]);
+}
+
+int lw_sha1_file(lw_sha1_t *c, FILE *fp)
+{
+	unsigned char buf[16384];
+	size_t n;
+
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		lw_sha1_update(c, buf, n);
+	return ferror(fp) ? -1 : 0;
+}
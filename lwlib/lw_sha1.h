@@ -0,0 +1,51 @@
+/*
+lwlib/lw_sha1.h
+
+Copyright © 2026 William Astle
+
+This file is part of LWTOOLS.
+
+LWTOOLS is free software: you can redistribute it and/or modify it under the
+terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <http://www.gnu.org/licenses/>.
+
+SHA-1 message digest (FIPS 180-1). This is used to tell whether file
+contents or option sets are the same as before, not for security.
+*/
+
+#ifndef ___lw_sha1_h_seen___
+#define ___lw_sha1_h_seen___
+
+#include <stdio.h>
+
+#define LW_SHA1_SIZE	20
+#define LW_SHA1_HEXSIZE	41		// hex digest plus NUL
+
+typedef struct
+{
+	unsigned int h[5];
+	unsigned long long len;		// message length in bytes
+	unsigned char buf[64];		// partial block
+	int blen;
+} lw_sha1_t;
+
+extern void lw_sha1_init(lw_sha1_t *c);
+extern void lw_sha1_update(lw_sha1_t *c, const void *data, int len);
+extern void lw_sha1_final(lw_sha1_t *c, unsigned char *digest);
+
+// finish and format the digest as 40 lower case hex digits
+extern void lw_sha1_finalhex(lw_sha1_t *c, char *hex);
+
+// add the contents of an open file; returns nonzero on a read error
+extern int lw_sha1_file(lw_sha1_t *c, FILE *fp);
+
+#endif /* ___lw_sha1_h_seen___ */
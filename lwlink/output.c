@@ -25,6 +25,8 @@ Actually output the binary
 #include <stdlib.h>
 #include <string.h>
 
+#include <lw_hex.h>
+
 #include "lwlink.h"
 
 // this prevents warnings about not using the return value of fwrite()
@@ -174,12 +176,10 @@ void do_output_srec(FILE *of)
 	int remainingcodebytes;
 	
 	int codeaddr;
-	int i;
 	int recaddr = 0;
 	int recdlen = 0;
-	int recsum;
-	int reccnt = -1;
 	unsigned char* sectcode;
+	char rec[LW_HEX_RECMAX];
 	// no header yet; unnecessary
 
 	for (sn = 0; sn < nsects; sn++)				// check all sections
@@ -196,27 +196,14 @@ void do_output_srec(FILE *of)
 		while (remainingcodebytes) 
 		{
 			recdlen = (SRECLEN>remainingcodebytes)?remainingcodebytes:SRECLEN;
-			recsum = recdlen + 3;
 			codeaddr = recaddr - sectlist[sn].ptr -> loadaddress;			
-			fprintf(of, "S1%02X%04X", recdlen + 3, recaddr & 0xffff);
-			for (i = 0; i < recdlen; i++)
-			{
-				fprintf(of, "%02X", sectcode[codeaddr+i]);
-				recsum += sectcode[codeaddr+i];
-			}
-			recsum += (recaddr >> 8) & 0xFF;
-			recsum += recaddr & 0xFF;
-			fprintf(of, "%02X\r\n", (unsigned char)(~recsum));
-			reccnt += 1;
+			writebytes(rec, lw_hex_srec(rec, 1, recaddr, sectcode + codeaddr, recdlen), 1, of);
 			remainingcodebytes -= recdlen;
 			recaddr += recdlen;
 		}
 	}
 	// S9 record as a footer to inform about start addr
-	recsum = 3;
-	recsum += (linkscript.execaddr >> 8) & 0xFF;
-	recsum += linkscript.execaddr & 0xFF;
-	fprintf(of,"S903%04X%02X\r\n",linkscript.execaddr,(unsigned char)(~recsum));
+	writebytes(rec, lw_hex_srec(rec, 9, linkscript.execaddr, NULL, 0), 1, of);
 }
 
 void do_output_lwex0(FILE *of)
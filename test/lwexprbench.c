@@ -0,0 +1,1152 @@
+/*
+test/lwexprbench.c
+
+Copyright © 2026 William Astle
+
+This file is part of LWTOOLS.
+
+LWTOOLS is free software: you can redistribute it and/or modify it under the
+terms of the GNU General Public License as published by the Free Software
+Foundation, either version 3 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+more details.
+
+You should have received a copy of the GNU General Public License along with
+this program. If not, see <http://www.gnu.org/licenses/>.
+
+Microbenchmarks and a differential checker for the lw_expr parser and
+simplifier.
+
+With no mode option, times lw_expr_parse, lw_expr_copy, lw_expr_compare and
+lw_expr_simplify over generated expression shapes: long sums, many like
+terms, chains of nested specials, and variables resolved through the var
+callback.
+
+--record FILE writes a set of expressions and what the simplifier currently
+turns them into. --check FILE simplifies every expression in such a file
+again and reports any result that differs, so a faster simplifier can be
+checked against the one the file was made with. Results are compared in a
+canonical form (see canon_norm()) so a rewrite that only leaves like terms
+in a different order or nesting still matches the old file. Both modes, and --fuzz,
+also evaluate every expression before and after simplification with the
+unresolved symbols bound to several sets of values and complain if the
+two ever disagree.
+
+Everything is generated from a fixed seed with a private random number
+generator so the same expressions come out on every platform.
+*/
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if !defined(_WIN32)
+#include <sys/time.h>
+#endif
+
+#include <lw_alloc.h>
+#include <lw_expr.h>
+#include <lw_string.h>
+
+#define SPECIAL_TYPE	1
+#define MAXSPECIAL		4096
+#define NBINDINGS		3
+
+// special terms are identified by their address in here
+static char specials[MAXSPECIAL];
+
+static unsigned int rngstate = 1;
+static lw_expr_ctx_t ctx;
+static int divzeros;
+
+static double timer(void)
+{
+#if !defined(_WIN32)
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+#else
+	return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static unsigned int rnd(unsigned int n)
+{
+	// xorshift32; never let the state reach zero
+	rngstate ^= rngstate << 13;
+	rngstate ^= rngstate >> 17;
+	rngstate ^= rngstate << 5;
+	return n ? rngstate % n : rngstate;
+}
+
+/* growable output buffer for generated text and printed expressions */
+struct buf
+{
+	char *s;
+	int len;
+	int size;
+};
+
+static void buf_add(struct buf *b, const char *fmt, ...)
+{
+	va_list args;
+	int n;
+
+	for (;;)
+	{
+		va_start(args, fmt);
+		n = vsnprintf(b -> s + b -> len, b -> size - b -> len, fmt, args);
+		va_end(args);
+		if (n >= 0 && b -> len + n < b -> size)
+			break;
+		b -> size = b -> size * 2 + n + 64;
+		b -> s = lw_realloc(b -> s, b -> size);
+	}
+	b -> len += n;
+}
+
+static void buf_reset(struct buf *b)
+{
+	b -> len = 0;
+	if (b -> s)
+		b -> s[0] = '\0';
+}
+
+/*
+Symbol rules shared by the simplifier callbacks and the evaluator
+
+@0 is a constant; every sixteenth special is unresolved; the others are
+the previous special plus a small amount, like line addresses in lwasm.
+
+vN resolves to a constant when N is a multiple of 4 and to v(N-1) + N
+otherwise. wN resolves to an expression involving uN and @N. uN and any
+other names never resolve.
+*/
+static lw_expr_t resolve_special(int k)
+{
+	lw_expr_t e1, e2, r;
+
+	if (k == 0)
+		return lw_expr_build(lw_expr_type_int, 0x1000);
+	if (k % 16 == 15)
+		return NULL;
+	e1 = lw_expr_build(lw_expr_type_special, SPECIAL_TYPE, specials + k - 1);
+	e2 = lw_expr_build(lw_expr_type_int, k % 7 + 1);
+	r = lw_expr_build(lw_expr_type_oper, lw_expr_oper_plus, e1, e2);
+	lw_expr_destroy(e1);
+	lw_expr_destroy(e2);
+	return r;
+}
+
+static lw_expr_t resolve_var(const char *var)
+{
+	char name[32];
+	lw_expr_t e1, e2, e3, r;
+	int n;
+
+	if (var[0] != 'v' && var[0] != 'w')
+		return NULL;
+	if (!isdigit(var[1]))
+		return NULL;
+	n = atoi(var + 1);
+	if (var[0] == 'v')
+	{
+		if (n % 4 == 0)
+			return lw_expr_build(lw_expr_type_int, n * 3 + 1);
+		snprintf(name, sizeof(name), "v%d", n - 1);
+		e1 = lw_expr_build(lw_expr_type_var, name);
+		e2 = lw_expr_build(lw_expr_type_int, n);
+		r = lw_expr_build(lw_expr_type_oper, lw_expr_oper_plus, e1, e2);
+		lw_expr_destroy(e1);
+		lw_expr_destroy(e2);
+		return r;
+	}
+	snprintf(name, sizeof(name), "u%d", n);
+	e1 = lw_expr_build(lw_expr_type_var, name);
+	e2 = lw_expr_build(lw_expr_type_int, 2);
+	e3 = lw_expr_build(lw_expr_type_oper, lw_expr_oper_times, e1, e2);
+	lw_expr_destroy(e1);
+	lw_expr_destroy(e2);
+	e1 = lw_expr_build(lw_expr_type_special, SPECIAL_TYPE, specials + n % MAXSPECIAL);
+	r = lw_expr_build(lw_expr_type_oper, lw_expr_oper_minus, e3, e1);
+	lw_expr_destroy(e1);
+	lw_expr_destroy(e3);
+	return r;
+}
+
+static lw_expr_t evaluate_special(int t, void *ptr, void *priv)
+{
+	if (t != SPECIAL_TYPE)
+		return NULL;
+	return resolve_special((char *)ptr - specials);
+}
+
+static lw_expr_t evaluate_var(char *var, void *priv)
+{
+	return resolve_var(var);
+}
+
+static void divzero(void *priv)
+{
+	divzeros++;
+}
+
+/*
+Terms: decimal integers, @N for special N, and names made of letters,
+digits and underscores.
+*/
+static lw_expr_t parse_term(char **p, void *priv)
+{
+	char name[64];
+	int v, i;
+
+	if (isdigit(**p))
+	{
+		for (v = 0; isdigit(**p); (*p)++)
+			v = v * 10 + (**p - '0');
+		return lw_expr_build(lw_expr_type_int, v);
+	}
+	if (**p == '@')
+	{
+		(*p)++;
+		if (!isdigit(**p))
+			return NULL;
+		for (v = 0; isdigit(**p); (*p)++)
+			v = v * 10 + (**p - '0');
+		if (v >= MAXSPECIAL)
+			return NULL;
+		return lw_expr_build(lw_expr_type_special, SPECIAL_TYPE, specials + v);
+	}
+	if (isalpha(**p) || **p == '_')
+	{
+		for (i = 0; (isalnum(**p) || **p == '_') && i < sizeof(name) - 1; (*p)++)
+			name[i++] = **p;
+		name[i] = '\0';
+		return lw_expr_build(lw_expr_type_var, name);
+	}
+	return NULL;
+}
+
+static lw_expr_t parse(const char *s)
+{
+	char *p = (char *)s;
+	lw_expr_t e;
+
+	e = lw_expr_parse_ctx(ctx, &p, NULL);
+	if (e && *p)
+	{
+		lw_expr_destroy(e);
+		return NULL;
+	}
+	return e;
+}
+
+/*
+Print an expression in a form that doesn't depend on where anything is in
+memory (lw_expr_print() shows specials as pointers).
+*/
+static void print_expr(struct buf *b, lw_expr_t e)
+{
+	static const char *opers[] = { "?", "+", "-", "*", "/", "%", "\\", "&",
+		"|", "^", "&&", "||", "neg", "com", "com8" };
+	int i;
+
+	switch (lw_expr_type(e))
+	{
+	case lw_expr_type_int:
+		buf_add(b, "%d", lw_expr_intval(e));
+		break;
+
+	case lw_expr_type_var:
+		buf_add(b, "%s", (char *)(e -> value2));
+		break;
+
+	case lw_expr_type_special:
+		buf_add(b, "@%d", (int)((char *)lw_expr_specptr(e) - specials));
+		break;
+
+	case lw_expr_type_oper:
+		buf_add(b, "(%s", e -> value <= lw_expr_oper_com8 ? opers[e -> value] : "?");
+		for (i = 0; i < lw_expr_operandcount(e); i++)
+		{
+			buf_add(b, " ");
+			print_expr(b, lw_expr_operand(e, i));
+		}
+		buf_add(b, ")");
+		break;
+	}
+}
+
+/*
+Evaluate an expression with the unresolved symbols bound to values chosen
+by "binding". Arithmetic wraps like the simplifier's int arithmetic does on
+the usual two's complement machines. Sets *undef if the result is not
+defined (division by zero and the like).
+*/
+static unsigned int bind_value(const char *name, int k, int binding)
+{
+	unsigned int h = 2166136261u + binding * 16777619u;
+
+	if (name)
+	{
+		for (; *name; name++)
+			h = (h ^ (unsigned char)*name) * 16777619u;
+	}
+	else
+		h = (h ^ k) * 16777619u;
+	return (unsigned int)((int)(h % 201) - 100);
+}
+
+static unsigned int eval_expr(lw_expr_t e, int binding, int *undef)
+{
+	lw_expr_t te;
+	unsigned int r, v;
+	int i, n, a, d;
+
+	switch (lw_expr_type(e))
+	{
+	case lw_expr_type_int:
+		return (unsigned int)lw_expr_intval(e);
+
+	case lw_expr_type_var:
+		te = resolve_var(e -> value2);
+		if (!te)
+			return bind_value(e -> value2, 0, binding);
+		r = eval_expr(te, binding, undef);
+		lw_expr_destroy(te);
+		return r;
+
+	case lw_expr_type_special:
+		te = resolve_special((char *)lw_expr_specptr(e) - specials);
+		if (!te)
+			return bind_value(NULL, (char *)lw_expr_specptr(e) - specials, binding);
+		r = eval_expr(te, binding, undef);
+		lw_expr_destroy(te);
+		return r;
+	}
+
+	n = lw_expr_operandcount(e);
+	r = eval_expr(lw_expr_operand(e, 0), binding, undef);
+	switch (lw_expr_whichop(e))
+	{
+	case lw_expr_oper_neg:
+		return -r;
+
+	case lw_expr_oper_com:
+		return ~r;
+
+	case lw_expr_oper_com8:
+		return ~r & 0xff;
+
+	case lw_expr_oper_plus:
+		for (i = 1; i < n; i++)
+			r += eval_expr(lw_expr_operand(e, i), binding, undef);
+		return r;
+
+	case lw_expr_oper_minus:
+		for (i = 1; i < n; i++)
+			r -= eval_expr(lw_expr_operand(e, i), binding, undef);
+		return r;
+
+	case lw_expr_oper_times:
+		for (i = 1; i < n; i++)
+			r *= eval_expr(lw_expr_operand(e, i), binding, undef);
+		return r;
+	}
+
+	v = eval_expr(lw_expr_operand(e, 1), binding, undef);
+	a = (int)r;
+	d = (int)v;
+	switch (lw_expr_whichop(e))
+	{
+	case lw_expr_oper_divide:
+	case lw_expr_oper_intdiv:
+	case lw_expr_oper_mod:
+		if (d == 0 || (d == -1 && a == -2147483647 - 1))
+		{
+			*undef = 1;
+			return 0;
+		}
+		if (lw_expr_whichop(e) == lw_expr_oper_mod)
+			return (unsigned int)(a % d);
+		return (unsigned int)(a / d);
+
+	case lw_expr_oper_bwand:
+		return r & v;
+
+	case lw_expr_oper_bwor:
+		return r | v;
+
+	case lw_expr_oper_bwxor:
+		return r ^ v;
+
+	case lw_expr_oper_and:
+		return r && v;
+
+	case lw_expr_oper_or:
+		return r || v;
+	}
+	*undef = 1;
+	return 0;
+}
+
+/* expression generators; each appends one expression to b */
+
+// a0+1+a1+2+... as one long chain of additions
+static void gen_sum(struct buf *b, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (i & 1)
+			buf_add(b, "%s%d", i ? "+" : "", rnd(100));
+		else
+			buf_add(b, "%sa%d", i ? (rnd(3) ? "+" : "-") : "", rnd(n));
+	}
+}
+
+// a+(b+(c+...)) - as deep as the sum is long
+static void gen_nested(struct buf *b, int n)
+{
+	int i;
+
+	for (i = 0; i < n - 1; i++)
+		buf_add(b, "%c%d+(", 'a' + rnd(4), rnd(8));
+	buf_add(b, "%d", rnd(100));
+	for (i = 0; i < n - 1; i++)
+		buf_add(b, ")");
+}
+
+// 3*a-b+c*2+... over only a few distinct terms
+static void gen_like(struct buf *b, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (i)
+			buf_add(b, rnd(2) ? "+" : "-");
+		switch (rnd(4))
+		{
+		case 0:
+			buf_add(b, "%c", 'a' + rnd(4));
+			break;
+		case 1:
+			buf_add(b, "%d*%c", rnd(9) + 1, 'a' + rnd(4));
+			break;
+		case 2:
+			buf_add(b, "%c*%d", 'a' + rnd(4), rnd(9) + 1);
+			break;
+		default:
+			buf_add(b, "%c*%c", 'a' + rnd(2), 'c' + rnd(2));
+			break;
+		}
+	}
+}
+
+// specials that resolve through chains of other specials
+static void gen_special(struct buf *b, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		buf_add(b, "%s@%d", i ? (rnd(2) ? "+" : "-") : "", rnd(256));
+}
+
+// names resolved through the var callback
+static void gen_var(struct buf *b, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (i)
+			buf_add(b, rnd(2) ? "+" : "-");
+		switch (rnd(3))
+		{
+		case 0:
+			buf_add(b, "v%d", rnd(64));
+			break;
+		case 1:
+			buf_add(b, "w%d*%d", rnd(64), rnd(4) + 1);
+			break;
+		default:
+			buf_add(b, "u%d", rnd(8));
+			break;
+		}
+	}
+}
+
+// random expressions using every operator
+static void gen_random(struct buf *b, int depth)
+{
+	static const char *binops[] = { "+", "+", "+", "-", "-", "*", "*",
+		"&", "|", "!", "^", "&&", "||" };
+	static const char *divops[] = { "/", "%", "\\" };
+	int c;
+
+	if (depth == 0 || rnd(4) == 0)
+	{
+		switch (rnd(5))
+		{
+		case 0:
+			buf_add(b, "%d", rnd(20));
+			break;
+		case 1:
+			buf_add(b, "%c", 'a' + rnd(4));
+			break;
+		case 2:
+			buf_add(b, "@%d", rnd(40));
+			break;
+		case 3:
+			buf_add(b, "v%d", rnd(16));
+			break;
+		default:
+			buf_add(b, "%c%d", rnd(2) ? 'u' : 'w', rnd(4));
+			break;
+		}
+		return;
+	}
+
+	c = rnd(20);
+	if (c < 2)
+	{
+		buf_add(b, c ? "~(" : "-(");
+		gen_random(b, depth - 1);
+		buf_add(b, ")");
+		return;
+	}
+	buf_add(b, "(");
+	gen_random(b, depth - 1);
+	if (c < 4)
+	{
+		// only constant divisors so nothing divides by zero
+		buf_add(b, ")%s%d", divops[rnd(3)], rnd(9) + 1);
+		return;
+	}
+	buf_add(b, ")%s(", binops[rnd(sizeof(binops) / sizeof(binops[0]))]);
+	gen_random(b, depth - 1);
+	buf_add(b, ")");
+}
+
+static const struct shape
+{
+	const char *name;
+	void (*gen)(struct buf *, int);
+	int size;			// size passed to the generator for benchmarks
+	int checksize;		// size used for the recorded checks
+} shapes[] =
+{
+	{ "deep-sum",		gen_sum,		120,	40 },
+	{ "nested-sum",		gen_nested,		60,		20 },
+	{ "like-terms",		gen_like,		80,		24 },
+	{ "specials",		gen_special,	40,		12 },
+	{ "var-callback",	gen_var,		40,		12 },
+	{ "random",			gen_random,		6,		5 },
+	{ NULL }
+};
+
+/*
+Rewrite a printed result in a canonical form so results that mean the same
+polynomial compare equal whatever shape the simplifier left them in: sums
+and products are flattened, their constants folded and like terms
+combined, and the operands of commutative operators sorted. A rewrite of
+the simplifier that only leaves terms in a different order or nesting still
+matches a file recorded with the old one.
+*/
+struct cnode
+{
+	char op[8];					// operator, empty for a leaf
+	char *text;					// leaf text, or the canonical form
+	int nkids;
+	struct cnode **kids;
+};
+
+// every node made while comparing one pair, so they can all be freed
+struct carena
+{
+	struct cnode **nodes;
+	int n;
+};
+
+static struct cnode *cnode_new(struct carena *a, const char *op)
+{
+	struct cnode *n;
+
+	n = lw_alloc(sizeof(struct cnode));
+	strcpy(n -> op, op);
+	n -> text = NULL;
+	n -> nkids = 0;
+	n -> kids = NULL;
+	a -> nodes = lw_realloc(a -> nodes, (a -> n + 1) * sizeof(struct cnode *));
+	a -> nodes[a -> n++] = n;
+	return n;
+}
+
+static void cnode_add(struct cnode *n, struct cnode *k)
+{
+	n -> kids = lw_realloc(n -> kids, (n -> nkids + 1) * sizeof(struct cnode *));
+	n -> kids[n -> nkids++] = k;
+}
+
+static struct cnode *cnode_int(struct carena *a, unsigned int v)
+{
+	struct buf b = { NULL, 0, 0 };
+	struct cnode *n;
+
+	buf_add(&b, "%d", (int)v);
+	n = cnode_new(a, "");
+	n -> text = b.s;
+	return n;
+}
+
+static int cnode_isint(struct cnode *n, unsigned int *v)
+{
+	char *e;
+
+	if (n -> op[0] || !(isdigit((unsigned char)n -> text[0]) || n -> text[0] == '-'))
+		return 0;
+	*v = (unsigned int)strtol(n -> text, &e, 10);
+	return *e == '\0';
+}
+
+static int cnode_cmp(const void *a, const void *b)
+{
+	return strcmp((*(struct cnode * const *)a) -> text, (*(struct cnode * const *)b) -> text);
+}
+
+static struct cnode *canon_parse(struct carena *a, const char **p)
+{
+	struct cnode *n;
+	int l;
+
+	if (**p != '(')
+	{
+		for (l = 0; (*p)[l] && (*p)[l] != ' ' && (*p)[l] != ')'; l++)
+			;
+		n = cnode_new(a, "");
+		n -> text = lw_alloc(l + 1);
+		memcpy(n -> text, *p, l);
+		n -> text[l] = '\0';
+		*p += l;
+		return n;
+	}
+	n = cnode_new(a, "");
+	for ((*p)++, l = 0; **p && **p != ' ' && **p != ')'; (*p)++)
+	{
+		if (l < sizeof(n -> op) - 1)
+			n -> op[l++] = **p;
+	}
+	n -> op[l] = '\0';
+	while (**p == ' ')
+	{
+		(*p)++;
+		cnode_add(n, canon_parse(a, p));
+	}
+	if (**p == ')')
+		(*p)++;
+	return n;
+}
+
+static void canon_text(struct cnode *n, struct cnode **kids, int nkids)
+{
+	struct buf b = { NULL, 0, 0 };
+	int i;
+
+	buf_add(&b, "(%s", n -> op);
+	for (i = 0; i < nkids; i++)
+		buf_add(&b, " %s", kids[i] -> text);
+	buf_add(&b, ")");
+	n -> text = b.s;
+}
+
+static struct cnode *canon_norm(struct carena *a, struct cnode *n);
+
+/* a product: the constant first, then the other factors sorted */
+static struct cnode *canon_product(struct carena *a, struct cnode *n)
+{
+	struct cnode *r, *k;
+	unsigned int coef = 1, v;
+	int i, j;
+
+	r = cnode_new(a, "*");
+	for (i = 0; i < n -> nkids; i++)
+	{
+		k = canon_norm(a, n -> kids[i]);
+		if (!strcmp(k -> op, "*"))
+		{
+			for (j = 0; j < k -> nkids; j++)
+			{
+				if (cnode_isint(k -> kids[j], &v))
+					coef *= v;
+				else
+					cnode_add(r, k -> kids[j]);
+			}
+		}
+		else if (cnode_isint(k, &v))
+			coef *= v;
+		else
+			cnode_add(r, k);
+	}
+	if (coef == 0 || r -> nkids == 0)
+		return cnode_int(a, coef);
+	if (coef == 1 && r -> nkids == 1)
+		return r -> kids[0];
+	qsort(r -> kids, r -> nkids, sizeof(struct cnode *), cnode_cmp);
+	if (coef != 1)
+	{
+		cnode_add(r, NULL);
+		memmove(r -> kids + 1, r -> kids, (r -> nkids - 1) * sizeof(struct cnode *));
+		r -> kids[0] = cnode_int(a, coef);
+	}
+	canon_text(r, r -> kids, r -> nkids);
+	return r;
+}
+
+/* a sum: like terms combined, the constant first, then the terms sorted */
+static struct cnode *canon_sum(struct carena *a, struct cnode *n)
+{
+	struct cnode *r, *k, *t, **flat = NULL, **keys = NULL;
+	unsigned int con = 0, v, *coefs = NULL, c;
+	int i, j, nflat = 0, nterms = 0, nt, plus;
+
+	for (i = 0; i < n -> nkids; i++)
+	{
+		k = canon_norm(a, n -> kids[i]);
+		plus = !strcmp(k -> op, "+");
+		nt = plus ? k -> nkids : 1;
+		flat = lw_realloc(flat, (nflat + nt) * sizeof(struct cnode *));
+		for (j = 0; j < nt; j++)
+			flat[nflat++] = plus ? k -> kids[j] : k;
+	}
+	for (i = 0; i < nflat; i++)
+	{
+		t = flat[i];
+		if (cnode_isint(t, &v))
+		{
+			con += v;
+			continue;
+		}
+		// split off the coefficient; what's left identifies like terms
+		c = 1;
+		if (!strcmp(t -> op, "*") && cnode_isint(t -> kids[0], &c))
+		{
+			k = cnode_new(a, "*");
+			for (j = 1; j < t -> nkids; j++)
+				cnode_add(k, t -> kids[j]);
+			if (k -> nkids == 1)
+				k = k -> kids[0];
+			else
+				canon_text(k, k -> kids, k -> nkids);
+		}
+		else
+			k = t;
+		for (j = 0; j < nterms; j++)
+			if (!strcmp(keys[j] -> text, k -> text))
+				break;
+		if (j == nterms)
+		{
+			keys = lw_realloc(keys, (nterms + 1) * sizeof(struct cnode *));
+			coefs = lw_realloc(coefs, (nterms + 1) * sizeof(unsigned int));
+			keys[nterms] = k;
+			coefs[nterms++] = 0;
+		}
+		coefs[j] += c;
+	}
+
+	r = cnode_new(a, "+");
+	for (j = 0; j < nterms; j++)
+	{
+		if (coefs[j] == 0)
+			continue;
+		k = cnode_new(a, "*");
+		cnode_add(k, cnode_int(a, coefs[j]));
+		cnode_add(k, keys[j]);
+		cnode_add(r, canon_product(a, k));
+	}
+	lw_free(flat);
+	lw_free(keys);
+	lw_free(coefs);
+	if (r -> nkids == 0)
+		return cnode_int(a, con);
+	if (con == 0 && r -> nkids == 1)
+		return r -> kids[0];
+	qsort(r -> kids, r -> nkids, sizeof(struct cnode *), cnode_cmp);
+	if (con != 0)
+	{
+		cnode_add(r, NULL);
+		memmove(r -> kids + 1, r -> kids, (r -> nkids - 1) * sizeof(struct cnode *));
+		r -> kids[0] = cnode_int(a, con);
+	}
+	canon_text(r, r -> kids, r -> nkids);
+	return r;
+}
+
+static struct cnode *canon_norm(struct carena *a, struct cnode *n)
+{
+	struct cnode *r;
+	int i;
+
+	if (!n -> op[0])
+		return n;
+	if (!strcmp(n -> op, "+"))
+		return canon_sum(a, n);
+	if (!strcmp(n -> op, "*"))
+		return canon_product(a, n);
+	r = cnode_new(a, n -> op);
+	for (i = 0; i < n -> nkids; i++)
+		cnode_add(r, canon_norm(a, n -> kids[i]));
+	if (!strcmp(n -> op, "&") || !strcmp(n -> op, "|") || !strcmp(n -> op, "^"))
+		qsort(r -> kids, r -> nkids, sizeof(struct cnode *), cnode_cmp);
+	canon_text(r, r -> kids, r -> nkids);
+	return r;
+}
+
+static int canon_match(const char *s1, const char *s2)
+{
+	struct carena a = { NULL, 0 };
+	struct cnode *c1, *c2;
+	int i, r;
+
+	c1 = canon_norm(&a, canon_parse(&a, &s1));
+	c2 = canon_norm(&a, canon_parse(&a, &s2));
+	r = (*s1 == '\0' && *s2 == '\0' && !strcmp(c1 -> text, c2 -> text));
+	for (i = 0; i < a.n; i++)
+	{
+		lw_free(a.nodes[i] -> text);
+		lw_free(a.nodes[i] -> kids);
+		lw_free(a.nodes[i]);
+	}
+	lw_free(a.nodes);
+	return r;
+}
+
+/*
+Simplify one expression and compare against the expected result, if any;
+also compare the values before and after. Returns the number of problems
+found and puts the printed result in out.
+*/
+static int check_one(const char *src, const char *expect, struct buf *out, int lineno)
+{
+	lw_expr_t e, c;
+	struct buf pb = { NULL, 0, 0 };
+	unsigned int v1, v2;
+	int i, u1, u2, bad = 0;
+
+	buf_reset(out);
+	e = parse(src);
+	if (!e)
+	{
+		fprintf(stderr, "%d: cannot parse: %s\n", lineno, src);
+		return 1;
+	}
+
+	c = lw_expr_copy(e);
+	if (!lw_expr_compare(c, e))
+	{
+		fprintf(stderr, "%d: copy does not compare equal: %s\n", lineno, src);
+		bad++;
+	}
+	lw_expr_simplify_ctx(ctx, c, NULL);
+	print_expr(out, c);
+
+	if (expect && strcmp(expect, out -> s) && !canon_match(expect, out -> s))
+	{
+		fprintf(stderr, "%d: %s\n    expected: %s\n    got:      %s\n", lineno, src, expect, out -> s);
+		bad++;
+	}
+
+	for (i = 0; i < NBINDINGS; i++)
+	{
+		u1 = u2 = 0;
+		v1 = eval_expr(e, i, &u1);
+		v2 = eval_expr(c, i, &u2);
+		if (u1 || u2 || v1 == v2)
+			continue;
+		print_expr(&pb, e);
+		fprintf(stderr, "%d: value changed by simplifying (%d != %d): %s\n    before: %s\n    after:  %s\n",
+			lineno, (int)v1, (int)v2, src, pb.s, out -> s);
+		bad++;
+		break;
+	}
+	lw_free(pb.s);
+	lw_expr_destroy(e);
+	lw_expr_destroy(c);
+	return bad;
+}
+
+static int do_record(const char *fn, int count)
+{
+	FILE *fp;
+	struct buf src = { NULL, 0, 0 };
+	struct buf out = { NULL, 0, 0 };
+	int i, s, bad = 0, n = 0;
+
+	fp = fopen(fn, "w");
+	if (!fp)
+	{
+		perror(fn);
+		return 1;
+	}
+	fprintf(fp, "# lw_expr simplifier results, written by lwexprbench --record\n");
+	fprintf(fp, "# each line is an expression, a tab, and the simplified result\n");
+	for (s = 0; shapes[s].name; s++)
+	{
+		for (i = 0; i < count; i++)
+		{
+			buf_reset(&src);
+			shapes[s].gen(&src, shapes[s].checksize);
+			bad += check_one(src.s, NULL, &out, ++n);
+			fprintf(fp, "%s\t%s\n", src.s, out.s);
+		}
+	}
+	fclose(fp);
+	lw_free(src.s);
+	lw_free(out.s);
+	printf("%d expressions recorded\n", n);
+	return bad ? 1 : 0;
+}
+
+static int do_check(const char *fn)
+{
+	FILE *fp;
+	char *line = NULL, *tab;
+	int lsize = 0, len, c, lineno = 0, n = 0, bad = 0;
+	struct buf out = { NULL, 0, 0 };
+
+	fp = fopen(fn, "r");
+	if (!fp)
+	{
+		perror(fn);
+		return 1;
+	}
+	for (;;)
+	{
+		// lines can be longer than any fixed buffer
+		len = 0;
+		while ((c = fgetc(fp)) != EOF && c != '\n')
+		{
+			if (len + 1 >= lsize)
+			{
+				lsize += 4096;
+				line = lw_realloc(line, lsize);
+			}
+			line[len++] = c;
+		}
+		if (len == 0 && c == EOF)
+			break;
+		lineno++;
+		if (len == 0)
+			continue;
+		line[len] = '\0';
+		if (line[0] == '#')
+			continue;
+		tab = strchr(line, '\t');
+		if (!tab)
+		{
+			fprintf(stderr, "%s:%d: malformed line\n", fn, lineno);
+			bad++;
+			continue;
+		}
+		*tab++ = '\0';
+		n++;
+		if (check_one(line, tab, &out, lineno))
+			bad++;
+	}
+	fclose(fp);
+	lw_free(line);
+	lw_free(out.s);
+	printf("%d expressions checked, %d mismatched\n", n, bad);
+	return bad ? 1 : 0;
+}
+
+static int do_fuzz(int count)
+{
+	struct buf src = { NULL, 0, 0 };
+	struct buf out = { NULL, 0, 0 };
+	int i, bad = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		buf_reset(&src);
+		gen_random(&src, 2 + rnd(5));
+		if (check_one(src.s, NULL, &out, i + 1))
+			bad++;
+	}
+	lw_free(src.s);
+	lw_free(out.s);
+	printf("%d random expressions checked, %d failed\n", count, bad);
+	return bad ? 1 : 0;
+}
+
+static void report(const char *shape, const char *op, long count, double t)
+{
+	printf("%-14s %-9s %10ld %10.6fs %12.1f ns/op\n", shape, op, count, t, count ? t * 1e9 / count : 0.0);
+}
+
+static void bench_shape(const struct shape *sh, int scale, int repeat)
+{
+	int nexpr = 16, rounds = 5 * scale;
+	char **srcs;
+	lw_expr_t *exprs, *copies;
+	struct buf b = { NULL, 0, 0 };
+	double t0, best[4] = { 0, 0, 0, 0 };
+	int i, j, r, matched;
+
+	srcs = lw_alloc(nexpr * sizeof(char *));
+	exprs = lw_alloc(nexpr * sizeof(lw_expr_t));
+	copies = lw_alloc(nexpr * sizeof(lw_expr_t));
+	for (i = 0; i < nexpr; i++)
+	{
+		buf_reset(&b);
+		sh -> gen(&b, sh -> size);
+		srcs[i] = lw_strdup(b.s);
+		exprs[i] = parse(srcs[i]);
+		if (!exprs[i])
+		{
+			fprintf(stderr, "cannot parse generated expression: %s\n", srcs[i]);
+			exit(1);
+		}
+	}
+
+	for (r = 0; r < repeat; r++)
+	{
+		double t[4];
+
+		t0 = timer();
+		for (j = 0; j < rounds; j++)
+			for (i = 0; i < nexpr; i++)
+				lw_expr_destroy(parse(srcs[i]));
+		t[0] = timer() - t0;
+
+		t0 = timer();
+		for (j = 0; j < rounds; j++)
+			for (i = 0; i < nexpr; i++)
+				lw_expr_destroy(lw_expr_copy(exprs[i]));
+		t[1] = timer() - t0;
+
+		for (i = 0; i < nexpr; i++)
+			copies[i] = lw_expr_copy(exprs[i]);
+		matched = 0;
+		t0 = timer();
+		for (j = 0; j < rounds; j++)
+			for (i = 0; i < nexpr; i++)
+				matched += lw_expr_compare(exprs[i], copies[i]);
+		t[2] = timer() - t0;
+		if (matched != rounds * nexpr)
+		{
+			fprintf(stderr, "%s: copies do not compare equal\n", sh -> name);
+			exit(1);
+		}
+
+		// the simplifier works in place so it gets a fresh copy each time;
+		// making the copies is not counted
+		t[3] = 0;
+		for (j = 0; j < rounds; j++)
+		{
+			if (j)
+			{
+				for (i = 0; i < nexpr; i++)
+					copies[i] = lw_expr_copy(exprs[i]);
+			}
+			t0 = timer();
+			for (i = 0; i < nexpr; i++)
+				lw_expr_simplify_ctx(ctx, copies[i], NULL);
+			t[3] += timer() - t0;
+			for (i = 0; i < nexpr; i++)
+				lw_expr_destroy(copies[i]);
+		}
+
+		for (i = 0; i < 4; i++)
+			if (r == 0 || t[i] < best[i])
+				best[i] = t[i];
+	}
+
+	report(sh -> name, "parse", (long)rounds * nexpr, best[0]);
+	report(sh -> name, "copy", (long)rounds * nexpr, best[1]);
+	report(sh -> name, "compare", (long)rounds * nexpr, best[2]);
+	report(sh -> name, "simplify", (long)rounds * nexpr, best[3]);
+
+	for (i = 0; i < nexpr; i++)
+	{
+		lw_free(srcs[i]);
+		lw_expr_destroy(exprs[i]);
+	}
+	lw_free(srcs);
+	lw_free(exprs);
+	lw_free(copies);
+	lw_free(b.s);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [--scale=N] [--repeat=N] [--only=NAME] [--seed=N]\n", prog);
+	fprintf(stderr, "       %s --record=FILE [--count=N] [--seed=N]\n", prog);
+	fprintf(stderr, "       %s --check=FILE\n", prog);
+	fprintf(stderr, "       %s --fuzz=N [--seed=N]\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	const char *recordfile = NULL, *checkfile = NULL, *only = NULL;
+	int scale = 1, repeat = 3, count = 20, fuzz = 0, i, s;
+	unsigned int seed = 12345;
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strncmp(argv[i], "--scale=", 8))
+			scale = atoi(argv[i] + 8);
+		else if (!strncmp(argv[i], "--repeat=", 9))
+			repeat = atoi(argv[i] + 9);
+		else if (!strncmp(argv[i], "--only=", 7))
+			only = argv[i] + 7;
+		else if (!strncmp(argv[i], "--seed=", 7))
+			seed = strtoul(argv[i] + 7, NULL, 0);
+		else if (!strncmp(argv[i], "--count=", 8))
+			count = atoi(argv[i] + 8);
+		else if (!strncmp(argv[i], "--record=", 9))
+			recordfile = argv[i] + 9;
+		else if (!strncmp(argv[i], "--check=", 8))
+			checkfile = argv[i] + 8;
+		else if (!strncmp(argv[i], "--fuzz=", 7))
+			fuzz = atoi(argv[i] + 7);
+		else
+			usage(argv[0]);
+	}
+	if (scale < 1 || repeat < 1 || count < 1)
+		usage(argv[0]);
+	rngstate = seed ? seed : 1;
+
+	ctx = lw_expr_ctx_create();
+	lw_expr_ctx_set_term_parser(ctx, parse_term);
+	lw_expr_ctx_set_special_handler(ctx, evaluate_special);
+	lw_expr_ctx_set_var_handler(ctx, evaluate_var);
+	lw_expr_ctx_setdivzero(ctx, divzero);
+	lw_expr_ctx_setwidth(ctx, 16);
+
+	if (recordfile)
+		return do_record(recordfile, count);
+	if (checkfile)
+		return do_check(checkfile);
+	if (fuzz > 0)
+		return do_fuzz(fuzz);
+
+	for (s = 0; shapes[s].name; s++)
+	{
+		if (only && !strstr(shapes[s].name, only))
+			continue;
+		bench_shape(&shapes[s], scale, repeat);
+	}
+	lw_expr_ctx_destroy(ctx);
+	return 0;
+}
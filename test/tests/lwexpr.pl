@@ -0,0 +1,26 @@
+#!/usr/bin/env perl
+#
+# Check the lw_expr simplifier against the results recorded in
+# test/exprsimplify.ref, and check that simplifying a batch of random
+# expressions never changes their values. Both use test/lwexprbench, which
+# "make test" builds; the tests are skipped if it is missing.
+#
+# After a deliberate change to what the simplifier produces, record new
+# results with:
+#
+#     test/lwexprbench --record=test/exprsimplify.ref
+
+$prog = './test/lwexprbench';
+
+if (! -x $prog && ! -x "$prog.exe")
+{
+	print "lwexpr_recorded SKIP\n";
+	print "lwexpr_random SKIP\n";
+	exit 0;
+}
+
+$rc = system("$prog --check=test/exprsimplify.ref >/dev/null");
+print 'lwexpr_recorded ' . ($rc == 0 ? 'PASS' : 'FAIL') . "\n";
+
+$rc = system("$prog --fuzz=2000 --seed=1 >/dev/null");
+print 'lwexpr_random ' . ($rc == 0 ? 'PASS' : 'FAIL') . "\n";